@@ -0,0 +1,56 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "bench.hpp"
+#include "sys/string.hpp"
+
+#include <cstdlib>
+#include <iostream>
+
+namespace pf
+{
+  std::vector<Bench> *Bench::benchList = NULL;
+  void releaseBenchList(void) { if (Bench::benchList) delete Bench::benchList; }
+
+  Bench::Bench(Function fn, const char *name) : fn(fn), name(name) {
+    if (benchList == NULL) {
+      benchList = new std::vector<Bench>;
+      atexit(releaseBenchList);
+    }
+    benchList->push_back(*this);
+  }
+
+  Bench::Bench(void) : fn(NULL), name(NULL) {}
+
+  bool Bench::run(const char *name, int argc, const char **argv) {
+    if (name == NULL) return false;
+    if (benchList != NULL)
+      for (size_t i = 0; i < benchList->size(); ++i) {
+        const Bench &bench = (*benchList)[i];
+        if (bench.name == NULL || bench.fn == NULL) continue;
+        if (strequal(bench.name, name)) return (bench.fn)(argc, argv);
+      }
+    std::cerr << "unknown benchmark " << name << std::endl;
+    return false;
+  }
+
+  const char *Bench::getOption(int argc, const char **argv, const char *option) {
+    for (int i = 0; i + 1 < argc; ++i)
+      if (strequal(argv[i], option)) return argv[i + 1];
+    return NULL;
+  }
+} /* namespace pf */
+
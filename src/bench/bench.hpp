@@ -0,0 +1,53 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#ifndef __PF_BENCH_HPP__
+#define __PF_BENCH_HPP__
+
+#include <vector>
+
+namespace pf
+{
+  /*! Benchmarks are registered like the unit tests. They get the remaining
+   *  command line arguments and return false when they regress against the
+   *  baseline they may have been given
+   */
+  struct Bench
+  {
+    /*! A benchmark function to run */
+    typedef bool (*Function) (int argc, const char **argv);
+    /*! Empty benchmark */
+    Bench(void);
+    /*! Build a new benchmark and append it to the benchmark list */
+    Bench(Function fn, const char *name);
+    /*! Function to execute */
+    Function fn;
+    /*! Name of the benchmark */
+    const char *name;
+    /*! The benchmarks that are registered */
+    static std::vector<Bench> *benchList;
+    /*! Run the benchmark with the given name */
+    static bool run(const char *name, int argc, const char **argv);
+    /*! Value following "option" in the arguments (NULL if not there) */
+    static const char *getOption(int argc, const char **argv, const char *option);
+  };
+} /* namespace pf */
+
+/*! Register a new benchmark */
+#define BENCH_REGISTER(FN) static const pf::Bench __##FN##__(FN, #FN);
+
+#endif /* __PF_BENCH_HPP__ */
+
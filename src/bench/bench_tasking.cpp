@@ -0,0 +1,380 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "bench/bench.hpp"
+#include "sys/tasking.hpp"
+#include "sys/sysinfo.hpp"
+#include "sys/platform.hpp"
+#include "sys/vector.hpp"
+#include "sys/string.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+/*! Scalability of the tasking system. Each workload runs with 1 to N threads
+ *  (main thread included) with some warmup and repetitions. For each workload
+ *  and thread number, we report the throughput (tasks or task set elements
+ *  per second), the speedup against one thread, the steal ratio (stolen tasks
+ *  over run tasks) and the number of times the threads went to sleep. Options:
+ *  --threads N     maximum number of threads (default: hardware threads)
+ *  --reps R        timed repetitions, the median is kept (default: 5)
+ *  --warmup W      untimed repetitions (default: 1)
+ *  --workload NAME only run this workload
+ *  --csv FILE      output the results as CSV
+ *  --json FILE     output the results as JSON
+ *  --baseline FILE compare the throughputs with the CSV of a previous run
+ *  --tolerance T   throughput loss allowed against the baseline (default: 0.1)
+ *  Typically: "game --bench bench_tasking --csv base.csv" before a scheduler
+ *  change and "game --bench bench_tasking --baseline base.csv" after it
+ */
+namespace pf
+{
+  /*! Interrupts the main thread when the workload is done */
+  class TaskBenchDone : public Task
+  {
+  public:
+    TaskBenchDone(void) : Task("TaskBenchDone") {}
+    virtual Task *run(void) {
+      TaskingSystemInterruptMain();
+      return NULL;
+    }
+  };
+
+  /*! Runs the given root tasks until they are done */
+  static void benchEnter(Task **roots, size_t rootNum) {
+    Task *done = PF_NEW(TaskBenchDone);
+    for (size_t i = 0; i < rootNum; ++i) {
+      roots[i]->starts(done);
+      roots[i]->scheduled();
+    }
+    done->scheduled();
+    TaskingSystemEnter();
+  }
+
+  /*! Binary tree of tasks. Nodes complete the root or their parent (cascade) */
+  class TaskBenchNode : public Task
+  {
+  public:
+    TaskBenchNode(uint32 lvl, Task *root, bool cascade) :
+      Task("TaskBenchNode"), root(root ? root : this), lvl(lvl), cascade(cascade) {}
+    virtual Task *run(void) {
+      if (this->lvl == maxLevel) return NULL;
+      Task *parent = this->cascade ? this : this->root;
+      Task *left  = PF_NEW(TaskBenchNode, this->lvl + 1, this->root, this->cascade);
+      Task *right = PF_NEW(TaskBenchNode, this->lvl + 1, this->root, this->cascade);
+      left->ends(parent);
+      right->ends(parent);
+      left->scheduled();
+      return right;
+    }
+    enum { maxLevel = 16 };
+    Task *root;
+    uint32 lvl;
+    bool cascade;
+  };
+
+  static uint64 benchTree(bool cascade) {
+    Task *root = PF_NEW(TaskBenchNode, 0, NULL, cascade);
+    benchEnter(&root, 1);
+    return (2u << TaskBenchNode::maxLevel) - 1;
+  }
+  static uint64 benchTree(void) { return benchTree(false); }
+  static uint64 benchCascade(void) { return benchTree(true); }
+
+  /*! Exponential Fibonacci: stresses spawning and completions */
+  class TaskBenchFibo : public Task
+  {
+  public:
+    TaskBenchFibo(uint32 rank, Atomic &taskNum) :
+      Task("TaskBenchFibo"), taskNum(taskNum), rank(rank) { taskNum++; }
+    virtual Task *run(void);
+    Atomic &taskNum;
+    uint32 rank;
+  };
+
+  /*! Joins the two Fibonacci children */
+  class TaskBenchFiboSum : public Task
+  {
+  public:
+    TaskBenchFiboSum(Atomic &taskNum) : Task("TaskBenchFiboSum") { taskNum++; }
+    virtual Task *run(void) { return NULL; }
+  };
+
+  Task *TaskBenchFibo::run(void) {
+    if (this->rank <= 1) return NULL;
+    Task *left = PF_NEW(TaskBenchFibo, this->rank - 1, this->taskNum);
+    Task *right = PF_NEW(TaskBenchFibo, this->rank - 2, this->taskNum);
+    Task *sum = PF_NEW(TaskBenchFiboSum, this->taskNum);
+    left->starts(sum);
+    right->starts(sum);
+    sum->ends(this);
+    sum->scheduled();
+    left->scheduled();
+    return right;
+  }
+
+  static uint64 benchFibo(void) {
+    Atomic taskNum(0);
+    Task *root = PF_NEW(TaskBenchFibo, 22, taskNum);
+    benchEnter(&root, 1);
+    return uint64(taskNum);
+  }
+
+  /*! Task set with tiny elements: measures the set distribution overhead */
+  class TaskBenchSet : public TaskSet
+  {
+  public:
+    TaskBenchSet(size_t elemNum, uint32 *array) :
+      TaskSet(elemNum, "TaskBenchSet"), array(array) {}
+    virtual void run(size_t elemID) { array[elemID] = uint32(elemID) * 2654435761u; }
+    uint32 *array;
+  };
+
+  static uint64 benchTaskSet(void) {
+    const size_t elemNum = 1 << 20;
+    uint32 *array = PF_NEW_ARRAY(uint32, elemNum);
+    Task *root = PF_NEW(TaskBenchSet, elemNum, array);
+    benchEnter(&root, 1);
+    PF_DELETE_ARRAY(array);
+    return elemNum;
+  }
+
+  /*! Spawns tasks evenly bound to all threads */
+  class TaskBenchAffinity : public Task
+  {
+  public:
+    TaskBenchAffinity(bool spawn) : Task("TaskBenchAffinity"), spawn(spawn) {}
+    virtual Task *run(void) {
+      if (!this->spawn) return NULL;
+      const uint32 threadNum = TaskingSystemGetThreadNum();
+      for (uint32 i = 0; i < taskToSpawn; ++i) {
+        Task *task = PF_NEW(TaskBenchAffinity, false);
+        task->setAffinity(i % threadNum);
+        task->ends(this);
+        task->scheduled();
+      }
+      return NULL;
+    }
+    enum { taskToSpawn = 1024 };
+    bool spawn;
+  };
+
+  static uint64 benchAffinity(void) {
+    enum { batchNum = 64 };
+    Task *roots[batchNum];
+    for (size_t i = 0; i < batchNum; ++i) roots[i] = PF_NEW(TaskBenchAffinity, true);
+    benchEnter(roots, batchNum);
+    return batchNum * (TaskBenchAffinity::taskToSpawn + 1);
+  }
+
+  /*! Lock the whole tasking system: the most expensive operation there is */
+  class TaskBenchLockUnlock : public Task
+  {
+  public:
+    TaskBenchLockUnlock(void) : Task("TaskBenchLockUnlock") {}
+    virtual Task *run(void) {
+      TaskingSystemLock();
+      TaskingSystemUnlock();
+      return NULL;
+    }
+  };
+
+  static uint64 benchLockUnlock(void) {
+    enum { taskNum = 64 };
+    Task *roots[taskNum];
+    for (size_t i = 0; i < taskNum; ++i) roots[i] = PF_NEW(TaskBenchLockUnlock);
+    benchEnter(roots, taskNum);
+    return taskNum;
+  }
+
+  /*! All the workloads we sweep */
+  static const struct BenchTaskingWorkload {
+    const char *name;
+    uint64 (*run)(void);
+  } workloads[] = {
+    {"tree", benchTree},
+    {"cascade", benchCascade},
+    {"fibo", benchFibo},
+    {"taskset", benchTaskSet},
+    {"affinity", benchAffinity},
+    {"lockunlock", benchLockUnlock}
+  };
+
+  /*! Counts what the scheduler did during one run */
+  class BenchTaskingProfiler : public TaskProfiler
+  {
+  public:
+    BenchTaskingProfiler(void) : runNum(0), stealNum(0), sleepNum(0) {}
+    virtual void onSleep(uint32 threadID) { sleepNum++; }
+    virtual void onWakeUp(uint32 threadID) {}
+    virtual void onLock(uint32 threadID) {}
+    virtual void onUnlock(uint32 threadID) {}
+    virtual void onRunStart(const char *taskName, uint32 threadID) { runNum++; }
+    virtual void onRunEnd(const char *taskName, uint32 threadID) {}
+    virtual void onEnd(const char *taskName, uint32 threadID) {}
+    virtual void onSteal(uint32 threadID, uint32 victimID) { stealNum++; }
+    Atomic runNum, stealNum, sleepNum;
+  };
+
+  /*! Result for one workload and one thread number */
+  struct BenchTaskingResult
+  {
+    const char *workload;  //!< Name of the workload
+    uint32 threadNum;      //!< Main thread included
+    uint64 taskNum;        //!< Tasks (or set elements) per run
+    double seconds;        //!< Median run time
+    double taskPerSecond;  //!< Throughput
+    double speedup;        //!< Against the single thread run
+    double stealRatio;     //!< Stolen over run tasks
+    uint64 sleepNum;       //!< Times the threads went to sleep in one run
+  };
+
+  static void benchOutputCSV(FILE *file, const vector<BenchTaskingResult> &results) {
+    fprintf(file, "workload,threads,tasks,seconds,tasksPerSecond,speedup,stealRatio,sleeps\n");
+    for (size_t i = 0; i < results.size(); ++i) {
+      const BenchTaskingResult &r = results[i];
+      fprintf(file, "%s,%u,%llu,%f,%f,%f,%f,%llu\n",
+              r.workload, r.threadNum, (unsigned long long) r.taskNum,
+              r.seconds, r.taskPerSecond, r.speedup, r.stealRatio,
+              (unsigned long long) r.sleepNum);
+    }
+  }
+
+  static void benchOutputJSON(FILE *file, const vector<BenchTaskingResult> &results) {
+    fprintf(file, "{\"results\":[");
+    for (size_t i = 0; i < results.size(); ++i) {
+      const BenchTaskingResult &r = results[i];
+      fprintf(file, "%s{\"workload\":\"%s\",\"threads\":%u,\"tasks\":%llu,"
+              "\"seconds\":%f,\"tasksPerSecond\":%f,\"speedup\":%f,"
+              "\"stealRatio\":%f,\"sleeps\":%llu}",
+              i ? "," : "", r.workload, r.threadNum,
+              (unsigned long long) r.taskNum, r.seconds, r.taskPerSecond,
+              r.speedup, r.stealRatio, (unsigned long long) r.sleepNum);
+    }
+    fprintf(file, "]}\n");
+  }
+
+  /*! Return false if one throughput is below the baseline one */
+  static bool benchCompare(const char *path,
+                           const vector<BenchTaskingResult> &results,
+                           double tolerance)
+  {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+      std::cerr << "cannot open baseline " << path << std::endl;
+      return false;
+    }
+    bool success = true;
+    char line[256], name[64];
+    uint32 threadNum;
+    double taskPerSecond;
+    std::cout << "against " << path << ":" << std::endl;
+    while (fgets(line, sizeof(line), file)) {
+      if (sscanf(line, "%63[^,],%u,%*[^,],%*[^,],%lf", name, &threadNum, &taskPerSecond) != 3)
+        continue; // header
+      for (size_t i = 0; i < results.size(); ++i) {
+        const BenchTaskingResult &r = results[i];
+        if (r.threadNum != threadNum || !strequal(r.workload, name)) continue;
+        const double ratio = r.taskPerSecond / taskPerSecond;
+        const bool regressed = ratio < 1. - tolerance;
+        printf("  %-12s %3u threads: %6.3fx%s\n", name, threadNum, ratio,
+               regressed ? "  REGRESSION" : "");
+        success = success && !regressed;
+      }
+    }
+    fclose(file);
+    return success;
+  }
+
+  static bool bench_tasking(int argc, const char **argv)
+  {
+    const char *threadStr = Bench::getOption(argc, argv, "--threads");
+    const char *repStr = Bench::getOption(argc, argv, "--reps");
+    const char *warmupStr = Bench::getOption(argc, argv, "--warmup");
+    const char *toleranceStr = Bench::getOption(argc, argv, "--tolerance");
+    const char *only = Bench::getOption(argc, argv, "--workload");
+    const char *csv = Bench::getOption(argc, argv, "--csv");
+    const char *json = Bench::getOption(argc, argv, "--json");
+    const char *baseline = Bench::getOption(argc, argv, "--baseline");
+    const uint32 maxThreadNum = std::max(threadStr ? atoi(threadStr) : getNumberOfLogicalThreads(), 1);
+    const uint32 repNum = std::max(repStr ? atoi(repStr) : 5, 1);
+    const uint32 warmupNum = warmupStr ? atoi(warmupStr) : 1;
+    const double tolerance = toleranceStr ? atof(toleranceStr) : 0.1;
+    const size_t workloadNum = sizeof(workloads) / sizeof(workloads[0]);
+
+    vector<BenchTaskingResult> results;
+    vector<double> times(repNum);
+    vector<double> singleThread(workloadNum, 0.);
+    printf("%-12s %7s %12s %10s %8s %7s %8s\n",
+           "workload", "threads", "tasks/s", "ms", "speedup", "steals", "sleeps");
+    for (uint32 threadNum = 1; threadNum <= maxThreadNum; ++threadNum) {
+      TaskingSystemEnd();
+      TaskingSystemStart(threadNum - 1);
+      for (size_t w = 0; w < workloadNum; ++w) {
+        if (only && !strequal(only, workloads[w].name)) continue;
+        BenchTaskingResult r;
+        r.workload = workloads[w].name;
+        r.threadNum = threadNum;
+        for (uint32 i = 0; i < warmupNum; ++i) workloads[w].run();
+        for (uint32 i = 0; i < repNum; ++i) {
+          const double t = getSeconds();
+          r.taskNum = workloads[w].run();
+          times[i] = getSeconds() - t;
+        }
+        std::sort(times.begin(), times.end());
+        r.seconds = times[repNum / 2];
+        r.taskPerSecond = double(r.taskNum) / r.seconds;
+        if (threadNum == 1) singleThread[w] = r.seconds;
+        r.speedup = singleThread[w] / r.seconds;
+
+        // The profiler slows things down: one more run to get the counters
+        BenchTaskingProfiler *profiler = PF_NEW(BenchTaskingProfiler);
+        TaskingSystemSetProfiler(profiler);
+        workloads[w].run();
+        TaskingSystemSetProfiler(NULL);
+        r.stealRatio = profiler->runNum ? double(profiler->stealNum) / double(profiler->runNum) : 0.;
+        r.sleepNum = profiler->sleepNum;
+        PF_DELETE(profiler);
+
+        printf("%-12s %7u %12.0f %10.3f %8.2f %7.3f %8llu\n",
+               r.workload, r.threadNum, r.taskPerSecond, r.seconds * 1000.,
+               r.speedup, r.stealRatio, (unsigned long long) r.sleepNum);
+        results.push_back(r);
+      }
+    }
+    TaskingSystemEnd();
+    TaskingSystemStart();
+
+    if (csv) {
+      FILE *file = fopen(csv, "w");
+      FATAL_IF (file == NULL, "cannot open CSV output");
+      benchOutputCSV(file, results);
+      fclose(file);
+    }
+    if (json) {
+      FILE *file = fopen(json, "w");
+      FATAL_IF (file == NULL, "cannot open JSON output");
+      benchOutputJSON(file, results);
+      fclose(file);
+    }
+    return baseline ? benchCompare(baseline, results, tolerance) : true;
+  }
+
+  BENCH_REGISTER(bench_tasking);
+} /* namespace pf */
+
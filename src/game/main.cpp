@@ -20,6 +20,7 @@
 #include "sys/tasking.hpp"
 #include "sys/string.hpp"
 #include "utest/utest.hpp"
+#include "bench/bench.hpp"
 
 namespace pf
 {
@@ -76,6 +77,8 @@ int main(int argc, char *argv[])
   TaskingSystemStart();
   LoggerStart();
 
+  int status = 0;
+
   // Run the unit tests specified by the user
   if (argc > 1 && strequal(argv[1], "--utests")) {
     if (argc == 2)
@@ -83,6 +86,11 @@ int main(int argc, char *argv[])
     else for (int i = 2; i < argc; ++i)
       UTest::run(argv[i]);
   }
+  // Run the benchmark specified by the user (fails if it regressed)
+  else if (argc > 2 && strequal(argv[1], "--bench")) {
+    if (!Bench::run(argv[2], argc - 3, (const char **) argv + 3))
+      status = 1;
+  }
   // Run the game
   else
     game(argc, argv);
@@ -90,5 +98,5 @@ int main(int argc, char *argv[])
   LoggerEnd();
   TaskingSystemEnd();
   MemDebuggerDumpAlloc();
-  return 0;
+  return status;
 }
@@ -292,24 +292,29 @@ namespace pf
       const T f16 = c[1][0]*c[2][3] - c[2][0]*c[1][3];
       const T f17 = c[1][0]*c[2][2] - c[2][0]*c[1][2];
       const T f18 = c[1][0]*c[2][1] - c[2][0]*c[1][1];
-      M44 inv(+c[1][1]*f00 - c[1][2]*f01 + c[1][3]*f02,
-              -c[1][0]*f00 + c[1][2]*f03 - c[1][3]*f04,
-              +c[1][0]*f01 - c[1][1]*f03 + c[1][3]*f05,
-              -c[1][0]*f02 + c[1][1]*f04 - c[1][2]*f05,
-              -c[0][1]*f00 + c[0][2]*f01 - c[0][3]*f02,
-              +c[0][0]*f00 - c[0][2]*f03 + c[0][3]*f04,
-              -c[0][0]*f01 + c[0][1]*f03 - c[0][3]*f05,
-              +c[0][0]*f02 - c[0][1]*f04 + c[0][2]*f05,
-              +c[0][1]*f06 - c[0][2]*f07 + c[0][3]*f08,
-              -c[0][0]*f06 + c[0][2]*f09 - c[0][3]*f10,
-              +c[0][0]*f11 - c[0][1]*f09 + c[0][3]*f12,
-              -c[0][0]*f08 + c[0][1]*f10 - c[0][2]*f12,
-              -c[0][1]*f13 + c[0][2]*f14 - c[0][3]*f15,
-              +c[0][0]*f13 - c[0][2]*f16 + c[0][3]*f17,
-              -c[0][0]*f14 + c[0][1]*f16 - c[0][3]*f18,
-              +c[0][0]*f15 - c[0][1]*f17 + c[0][2]*f18);
-      const T det = c[0][0]*inv[0][0] + c[0][1]*inv[1][0] +
-                    c[0][2]*inv[2][0] + c[0][3]*inv[3][0];
+      // The cofactors are listed row by row (i.e. this is the transposed adjoint)
+      const M44 adj(+c[1][1]*f00 - c[1][2]*f01 + c[1][3]*f02,
+                    -c[1][0]*f00 + c[1][2]*f03 - c[1][3]*f04,
+                    +c[1][0]*f01 - c[1][1]*f03 + c[1][3]*f05,
+                    -c[1][0]*f02 + c[1][1]*f04 - c[1][2]*f05,
+                    -c[0][1]*f00 + c[0][2]*f01 - c[0][3]*f02,
+                    +c[0][0]*f00 - c[0][2]*f03 + c[0][3]*f04,
+                    -c[0][0]*f01 + c[0][1]*f03 - c[0][3]*f05,
+                    +c[0][0]*f02 - c[0][1]*f04 + c[0][2]*f05,
+                    +c[0][1]*f06 - c[0][2]*f07 + c[0][3]*f08,
+                    -c[0][0]*f06 + c[0][2]*f09 - c[0][3]*f10,
+                    +c[0][0]*f11 - c[0][1]*f09 + c[0][3]*f12,
+                    -c[0][0]*f08 + c[0][1]*f10 - c[0][2]*f12,
+                    -c[0][1]*f13 + c[0][2]*f14 - c[0][3]*f15,
+                    +c[0][0]*f13 - c[0][2]*f16 + c[0][3]*f17,
+                    -c[0][0]*f14 + c[0][1]*f16 - c[0][3]*f18,
+                    +c[0][0]*f15 - c[0][1]*f17 + c[0][2]*f18);
+      const T det = c[0][0]*adj[0][0] + c[0][1]*adj[0][1] +
+                    c[0][2]*adj[0][2] + c[0][3]*adj[0][3];
+      M44 inv(adj[0][0], adj[1][0], adj[2][0], adj[3][0],
+              adj[0][1], adj[1][1], adj[2][1], adj[3][1],
+              adj[0][2], adj[1][2], adj[2][2], adj[3][2],
+              adj[0][3], adj[1][3], adj[2][3], adj[3][3]);
       inv /= det;
       return inv;
     }
@@ -357,6 +362,18 @@ namespace pf
   DECL bool OP== (M44 m, M44 n) {return (m[0]==n[0]) && (m[1]==n[1]) && (m[2]==n[2]) && (m[3]==n[3]);}
   DECL bool OP!= (M44 m, M44 n) {return (m[0]!=n[0]) || (m[1]!=n[1]) || (m[2]!=n[2]) || (m[3]!=n[3]);}
 
+  /*! Affine transforms (the last row of m is supposed to be {0,0,0,1}) */
+  DECL V3 xfmPoint (M44 m, V3 p) {
+    return V3(m[0][0]*p.x + m[1][0]*p.y + m[2][0]*p.z + m[3][0],
+              m[0][1]*p.x + m[1][1]*p.y + m[2][1]*p.z + m[3][1],
+              m[0][2]*p.x + m[1][2]*p.y + m[2][2]*p.z + m[3][2]);
+  }
+  DECL V3 xfmvector(M44 m, V3 v) {
+    return V3(m[0][0]*v.x + m[1][0]*v.y + m[2][0]*v.z,
+              m[0][1]*v.x + m[1][1]*v.y + m[2][1]*v.z,
+              m[0][2]*v.x + m[1][2]*v.y + m[2][2]*v.z);
+  }
+
   /*! External functions */
   DECL M44 translate (M44 m, V3 v) {
     M44 dst(m);
@@ -21,6 +21,7 @@
 namespace pf
 {
   /*! Task responsible to fill the HiZ buffer */
+  template <uint32 w, uint32 h>
   class TaskRayTraceHiZ : public TaskSet
   {
   public:
@@ -30,7 +31,7 @@ namespace pf
     /*! Ray trace a task tile (equal or bigger than a HiZ tile */
     virtual void run(size_t tileID);
 
-    Ref<HiZ> zBuffer;                 //!< Keep the z buffer alive
+    Ref< HiZT<w,h> > zBuffer;         //!< Keep the z buffer alive
     Ref<Intersector> intersector;     //!< Properly keep a reference on it
     RTCameraPacketGen gen;            //!< Generates the ray
     vec3f view;
@@ -39,13 +40,14 @@ namespace pf
     static const uint32 width  = 16u; //!< Tile width processed per job ...
     static const uint32 height = 16u; //!< ... and its height
     static const uint32 pixelNum = width * height;
-    STATIC_ASSERT(width % HiZ::Tile::width == 0);
-    STATIC_ASSERT(height % HiZ::Tile::height == 0);
+    STATIC_ASSERT(width % w == 0);
+    STATIC_ASSERT(height % h == 0);
   };
 
-  HiZ::HiZ(uint32 width_, uint32 height_) :
-    width(ALIGN(width_, TaskRayTraceHiZ::width)),
-    height(ALIGN(height_, TaskRayTraceHiZ::height)),
+  template <uint32 w, uint32 h>
+  HiZT<w,h>::HiZT(uint32 width_, uint32 height_) :
+    width(ALIGN(width_, (TaskRayTraceHiZ<w,h>::width))),
+    height(ALIGN(height_, (TaskRayTraceHiZ<w,h>::height))),
     pixelNum(width * height),
     tileXNum(width / Tile::width),
     tileYNum(height / Tile::height),
@@ -55,32 +57,35 @@ namespace pf
     this->tiles = (Tile*) PF_ALIGNED_MALLOC(tileSize, sizeof(ssef));
   }
 
-  HiZ::~HiZ(void) { PF_ALIGNED_FREE(this->tiles); }
+  template <uint32 w, uint32 h>
+  HiZT<w,h>::~HiZT(void) { PF_ALIGNED_FREE(this->tiles); }
 
   // We create packets and directly fill each zBuffer tile. Note that we
   // really store t values
-  void TaskRayTraceHiZ::run(size_t taskID)
+  template <uint32 w, uint32 h>
+  void TaskRayTraceHiZ<w,h>::run(size_t taskID)
   {
+    typedef typename HiZT<w,h>::Tile Tile;
     const uint32 taskX = taskID % this->taskXNum;
     const uint32 taskY = taskID / this->taskXNum;
     const uint32 startX = taskX * this->width;
     const uint32 startY = taskY * this->height;
     const uint32 endX = startX + this->width;
     const uint32 endY = startY + this->height;
-    uint32 tileY = startY / HiZ::Tile::height;
+    uint32 tileY = startY / Tile::height;
 
-    for (uint32 y = startY; y < endY; y += RayPacket::height, ++tileY) {
-      uint32 tileX = startX / HiZ::Tile::width;
-      for (uint32 x = startX; x < endX; x += RayPacket::width, ++tileX) {
-        RayPacket pckt;
-        PacketHit hit;
+    for (uint32 y = startY; y < endY; y += h, ++tileY) {
+      uint32 tileX = startX / Tile::width;
+      for (uint32 x = startX; x < endX; x += w, ++tileX) {
+        RayPacketT<w,h> pckt;
+        PacketHitT<w,h> hit;
         gen.generate(pckt, x, y);
         intersector->traverse(pckt, hit);
         ssef zmin(inf), zmax(neg_inf);
         const uint32 tileID = tileX + tileY * zBuffer->tileXNum;
         PF_ASSERT(tileID < zBuffer->tileNum);
-        HiZ::Tile &tile = zBuffer->tiles[tileID];
-        for (uint32 chunkID = 0; chunkID < HiZ::Tile::chunkNum; ++chunkID) {
+        Tile &tile = zBuffer->tiles[tileID];
+        for (uint32 chunkID = 0; chunkID < Tile::chunkNum; ++chunkID) {
           //const ssef t = hit.t[chunkID];
           const ssef t = hit.t[chunkID] *dot(sse3f(view.x,view.y,view.z), pckt.dir[chunkID]);
           tile.z[chunkID] = t;
@@ -93,20 +98,23 @@ namespace pf
     }
   }
 
-  Ref<Task> HiZ::rayTrace(const RTCamera &cam, Ref<Intersector> intersector)
+  template <uint32 w, uint32 h>
+  Ref<Task> HiZT<w,h>::rayTrace(const RTCamera &cam, Ref<Intersector> intersector)
   {
-    const size_t taskNum = this->pixelNum / TaskRayTraceHiZ::pixelNum;
-    Ref<TaskRayTraceHiZ> task = PF_NEW(TaskRayTraceHiZ, taskNum);
+    typedef TaskRayTraceHiZ<w,h> TaskType;
+    const size_t taskNum = this->pixelNum / TaskType::pixelNum;
+    Ref<TaskType> task = PF_NEW(TaskType, taskNum);
     cam.createGenerator(task->gen, this->width, this->height);
     task->zBuffer = this;
     task->view = cam.view;
     task->intersector = intersector;
-    task->taskXNum = this->width  / TaskRayTraceHiZ::width;
-    task->taskYNum = this->height / TaskRayTraceHiZ::height;
-    return task.cast<Task>();
+    task->taskXNum = this->width  / TaskType::width;
+    task->taskYNum = this->height / TaskType::height;
+    return task.template cast<Task>();
   }
 
-  void HiZ::greyRGBA(uint8 **pixels) const
+  template <uint32 w, uint32 h>
+  void HiZT<w,h>::greyRGBA(uint8 **pixels) const
   {
     if (UNLIKELY(pixels == NULL)) return;
     if (UNLIKELY(*pixels == NULL)) return;
@@ -134,8 +142,8 @@ namespace pf
     }
   }
 
-  template <bool outputMin>
-  INLINE void HiZGreyMinMax(const HiZ &hiz, uint8 **pixels)
+  template <bool outputMin, uint32 w, uint32 h>
+  INLINE void HiZGreyMinMax(const HiZT<w,h> &hiz, uint8 **pixels)
   {
     if (UNLIKELY(pixels == NULL)) return;
     if (UNLIKELY(*pixels == NULL)) return;
@@ -146,7 +154,7 @@ namespace pf
     for (uint32 y = 0; y < hiz.tileYNum; ++y)
     for (uint32 x = 0; x < hiz.tileXNum; ++x) {
       const uint32 tileID = x + y * hiz.tileXNum;
-      const HiZ::Tile &tile = hiz.tiles[tileID];
+      const typename HiZT<w,h>::Tile &tile = hiz.tiles[tileID];
       const float z = min((outputMin ? tile.zmin : tile.zmax) * 64.f, 255.f);
       rgba[4*tileID + 0] = uint8(z);
       rgba[4*tileID + 1] = uint8(z);
@@ -155,10 +163,13 @@ namespace pf
     }
   }
 
-  void HiZ::greyMinRGBA(uint8 **pixels) const { HiZGreyMinMax<true>(*this, pixels); }
-  void HiZ::greyMaxRGBA(uint8 **pixels) const { HiZGreyMinMax<false>(*this, pixels); }
+  template <uint32 w, uint32 h>
+  void HiZT<w,h>::greyMinRGBA(uint8 **pixels) const { HiZGreyMinMax<true>(*this, pixels); }
+  template <uint32 w, uint32 h>
+  void HiZT<w,h>::greyMaxRGBA(uint8 **pixels) const { HiZGreyMinMax<false>(*this, pixels); }
 
-  PerspectiveFrustum::PerspectiveFrustum(const RTCamera &cam, Ref<HiZ> hiz)
+  template <uint32 w, uint32 h>
+  PerspectiveFrustumT<w,h>::PerspectiveFrustumT(const RTCamera &cam, Ref< HiZT<w,h> > hiz)
     : hiz(hiz)
   {
     this->org_aos  = ssef(cam.org.x, cam.org.y, cam.org.z, 0.f);
@@ -183,5 +194,13 @@ namespace pf
                            float(hiz->tileYNum-1));
   }
 
+  /*! Explicit instantiation for all the supported tile sizes */
+  template struct HiZT<4,4>;
+  template struct HiZT<8,8>;
+  template struct HiZT<16,16>;
+  template struct PerspectiveFrustumT<4,4>;
+  template struct PerspectiveFrustumT<8,8>;
+  template struct PerspectiveFrustumT<16,16>;
+
 } /* namespace pf */
 
@@ -33,25 +33,26 @@ namespace pf
    *  We build a small z buffer for the current point of view and we use it to
    *  compare the depth of bounding rectangles and cull draw calls. Since we
    *  use ray packets and we want to have a hierarchy over the depth buffer, we
-   *  simply tile the depth buffer with RayPacket::width x RayPacket::height
-   *  tiles. We reference count it since it is possibly filled by several
-   *  threads
+   *  simply tile the depth buffer with w x h tiles (one w x h ray packet per
+   *  tile). Small tiles give a finer culling, large ones a faster ray tracing.
+   *  We reference count it since it is possibly filled by several threads
    */
-  struct HiZ : public RefCount, public NonCopyable
+  template <uint32 w, uint32 h>
+  struct HiZT : public RefCount, public NonCopyable
   {
     /*! width and height will be aligned on Tile::width and Tile::height if
      *  required
      */
-    HiZ(uint32 width = 256u, uint32 height = 256u);
+    HiZT(uint32 width = 256u, uint32 height = 256u);
 
     /*! Free the allocated data */
-    ~HiZ(void);
+    ~HiZT(void);
 
     /*! HiZ is made of tiles. Each tile is traced by _one_ ray packet */
     struct Tile
     {
-      static const uint32 width = RayPacket::width;
-      static const uint32 height = RayPacket::height;
+      static const uint32 width = w;
+      static const uint32 height = h;
       static const uint32 pixelNum = width * height;
       static const uint32 chunkNum = pixelNum / ssef::CHANNEL_NUM;
       ssef z[chunkNum]; //!< Depths per pixel (layout in struct-of-array)
@@ -84,16 +85,24 @@ namespace pf
     const uint32 tileYNum;//!< Number of tiles per column
     const uint32 tileNum; //!< pixelNum / Tile::pixelNum
     Tile *tiles;          //!< The depth buffer data
-    PF_STRUCT(HiZ);
+    PF_STRUCT(HiZT);
   };
 
+  /*! Supported tile sizes (same as the ray packets) */
+  typedef HiZT<4,4>   HiZ4x4;
+  typedef HiZT<8,8>   HiZ;
+  typedef HiZT<16,16> HiZ16x16;
+
   /*! SIMD optimized structure to perform frustum and HiZ culling */
-  struct PerspectiveFrustum
+  template <uint32 w, uint32 h>
+  struct PerspectiveFrustumT
   {
     /*! Setup all values properly */
-    PerspectiveFrustum(const RTCamera &cam, Ref<HiZ> hiz);
+    PerspectiveFrustumT(const RTCamera &cam, Ref< HiZT<w,h> > hiz);
+    /*! Cull a world space box */
+    INLINE bool isVisible(const BBox3f &bbox);
     /*! Cull a segment */
-    INLINE bool isVisible(const RendererSegment &sgmt);
+    INLINE bool isVisible(const RendererSegment &sgmt) { return isVisible(sgmt.bbox); }
   private:
     ssef  org_aos;    //!< Origin in array of struct format
     ssef  view_aos;   //!< View vector in array of struct
@@ -107,10 +116,15 @@ namespace pf
     ssef yMaxInvTanAngle;//!< Maximum tangent value along Z axis
     ssef windowing;      //!< To scale the position in {w,h}
     ssef hizExtent;      //!< Maximum extent in the HiZ {w-1,h-1}
-    Ref<HiZ> hiz;        //!< To perform Z test
-    PF_STRUCT(PerspectiveFrustum);
+    Ref< HiZT<w,h> > hiz;//!< To perform Z test
+    PF_STRUCT(PerspectiveFrustumT);
   };
 
+  /*! Frustums matching the HiZ buffers */
+  typedef PerspectiveFrustumT<4,4>   PerspectiveFrustum4x4;
+  typedef PerspectiveFrustumT<8,8>   PerspectiveFrustum;
+  typedef PerspectiveFrustumT<16,16> PerspectiveFrustum16x16;
+
 // Do we want to use the HiZ buffer?
 #define PF_HIZ_USE_ZBUFFER 1
 
@@ -118,14 +132,17 @@ namespace pf
 // artifacts. Should be a run-time value
 #define PF_HIZ_GROW_AABB 1
 
-  INLINE bool PerspectiveFrustum::isVisible(const RendererSegment &sgmt)
+  template <uint32 w, uint32 h>
+  INLINE bool PerspectiveFrustumT<w,h>::isVisible(const BBox3f &bbox)
   {
+    // The box may be a temporary: do not read past upper.z
+    const vec3f &u = bbox.upper;
 #if PF_HIZ_GROW_AABB
-    const ssef lower = ssef::uload(&sgmt.bbox.lower.x) - ssef(one);
-    const ssef upper = ssef::uload(&sgmt.bbox.upper.x) + ssef(one);
+    const ssef lower = ssef::uload(&bbox.lower.x) - ssef(one);
+    const ssef upper = ssef(u.x, u.y, u.z, u.z) + ssef(one);
 #else
-    const ssef lower = ssef::uload(&sgmt.bbox.lower.x);
-    const ssef upper = ssef::uload(&sgmt.bbox.upper.x);
+    const ssef lower = ssef::uload(&bbox.lower.x);
+    const ssef upper = ssef(u.x, u.y, u.z, u.z);
 #endif /* HIZ_GROW_AABB */
 
     const ssef x0 = lower.xxxx();
@@ -207,7 +224,7 @@ namespace pf
         uint32 tileID = leftID;
         for (int32 tileX = tileMin.x; tileX <= tileMax.x; ++tileX, ++tileID) {
           PF_ASSERT(tileID < hiz->tileNum);
-          const HiZ::Tile &tile = hiz->tiles[tileID];
+          const typename HiZT<w,h>::Tile &tile = hiz->tiles[tileID];
           if (zmin > tile.zmax)
             continue;
           else
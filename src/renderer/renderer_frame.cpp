@@ -20,6 +20,7 @@
 #include "renderer.hpp"
 #include "hiz.hpp"
 #include "rt/rt_camera.hpp"
+#include "rt/instance_intersector.hpp"
 #include "sys/tasking.hpp"
 #include "sys/tasking_utility.hpp"
 #include "GL/gl3.h"
@@ -46,51 +47,102 @@ namespace pf
   uint32 key_k = 0;
   uint32 key_p = 0;
 
-  /*! Contains the data we need to perform the culling */
-  struct HiZCullState
+  /*! One object of the display list with its visible segments */
+  struct HiZCullObject
   {
-    HiZCullState(Ref<RendererObj> &renderObj, const RTCamera &cam) :
+    HiZCullObject(Ref<RendererObj> renderObj, const mat4x4f &model, bool isIdentity) :
       renderObj(renderObj), visible(renderObj->segments.size()),
-      cam(cam)
+      model(model), visibleNum(0), isIdentity(isIdentity)
     {}
     Ref<RendererObj> renderObj; //!< Renderer object we are going to cull
-    vector<uint32> visible;      //!< List of visible objects we update
-    RTCamera cam;               //!< For frustum culling and HiZ culling
-    uint32 visibleNum;          //!< Total number of visible objects
+    vector<uint32> visible;     //!< List of visible segments we update
+    mat4x4f model;              //!< Object to world transform
+    uint32 visibleNum;          //!< Total number of visible segments
+    bool isIdentity;            //!< Segment boxes are already in world space
+  };
+
+  /*! Contains the data we need to perform the culling */
+  struct HiZCullState
+  {
+    HiZCullState(const RTCamera &cam) : cam(cam) {}
+    vector<HiZCullObject> objects; //!< Objects to cull and display
+    Ref<Intersector> occluders;    //!< Traced to compute the HiZ (may be NULL)
+    RTCamera cam;                  //!< For frustum culling and HiZ culling
     PF_STRUCT(HiZCullState);
   };
 
+  /*! Build the top level BVH over the occluders of the frame. A single
+   *  occluder with no transform is directly traced
+   */
+  static Ref<Intersector> buildOccluders(const vector<HiZCullObject> &objects)
+  {
+    if (objects.size() == 1 && objects[0].isIdentity)
+      return objects[0].renderObj->intersector;
+    Ref<InstanceIntersector> top = PF_NEW(InstanceIntersector);
+    for (size_t i = 0; i < objects.size(); ++i) {
+      const RendererObj &obj = *objects[i].renderObj;
+      if (obj.intersector)
+        top->add(obj.intersector, obj.bbox, objects[i].model);
+    }
+    if (top->getInstanceNum() == 0) return NULL;
+    top->compile();
+    return top.cast<Intersector>();
+  }
+
+  /*! Cull the segments of one object */
+  static void HiZCullSegments(PerspectiveFrustum &fr, HiZCullObject &object)
+  {
+    const vector<RendererSegment> &segments = object.renderObj->segments;
+    const uint32 segmentNum = segments.size();
+    object.visibleNum = 0;
+    for (uint32 i = 0; i < segmentNum; ++i) {
+      const bool isVisible = object.isIdentity ?
+        fr.isVisible(segments[i]) :
+        fr.isVisible(xfmBox(object.model, segments[i].bbox));
+      if (isVisible) object.visible[object.visibleNum++] = i;
+    }
+  }
+
   /*! Perform the HiZ culling (Frustum + Z) on the given segments */
   static Task *HiZCull(HiZCullState *state)
   {
+    // Without any occluder, everything is visible
+    if (!state->occluders) {
+      for (size_t i = 0; i < state->objects.size(); ++i) {
+        HiZCullObject &object = state->objects[i];
+        object.visibleNum = object.renderObj->segments.size();
+        for (uint32 j = 0; j < object.visibleNum; ++j) object.visible[j] = j;
+      }
+      return NULL;
+    }
+
     // Compute the HiZ buffer
     Ref<HiZ> hiz = PF_NEW(HiZ, 128, 64);
-    Ref<Task> hizTask = hiz->rayTrace(state->cam, state->renderObj->intersector);
+    Ref<Task> hizTask = hiz->rayTrace(state->cam, state->occluders);
 
     // Then cull the segments
     Ref<Task> cullTask = spawn<Task>(HERE, [=]
     {
       PerspectiveFrustum fr(state->cam, hiz);
-      const uint32 segmentNum = state->renderObj->segments.size();
-      state->visibleNum = 0;
-      for (uint32 i = 0; i < segmentNum; ++i)
-        if (fr.isVisible(state->renderObj->segments[i]))
-          state->visible[state->visibleNum++] = i;
+      for (size_t i = 0; i < state->objects.size(); ++i)
+        HiZCullSegments(fr, state->objects[i]);
 
-      // XXX Saved the currently visible boxes
+      // XXX Saved the currently visible boxes (first object only)
+      HiZCullObject &first = state->objects[0];
+      const uint32 segmentNum = first.renderObj->segments.size();
       if (key_l) {
         if (savedVisible == NULL)
           savedVisible = PF_NEW(vector<uint32>, segmentNum);
-        savedNum = state->visibleNum;
+        savedNum = first.visibleNum;
         for (uint32 i = 0; i < savedNum; ++i)
-          (*savedVisible)[i] = state->visible[i];
+          (*savedVisible)[i] = first.visible[i];
       }
 
       // XXX Restored the previously visible boxes
       if (key_k && savedVisible) {
         for (uint32 i = 0; i < savedNum; ++i)
-          state->visible[i] = (*savedVisible)[i];
-        state->visibleNum = savedNum;
+          first.visible[i] = (*savedVisible)[i];
+        first.visibleNum = savedNum;
       }
 
       // XXX Output the HiZ buffer
@@ -129,18 +181,19 @@ namespace pf
     uint32 elemNum = 0;
     RTCamera cam(org, up, view, fov, ratio);
 
-    // XXX right now we only support one or zero object
+    // Each object is an instance of its BVH in the top level occluder BVH
     if (this->displayList) {
       list<RendererDisplayList::Elem> &elems = this->displayList->getList();
       for (auto it = elems.begin(); it != elems.end(); ++it) elemNum++;
-      FATAL_IF(elemNum > 1, "XXX only one object per display list is supported");
       if (elemNum) {
-        auto elem = elems.begin();
-        FATAL_IF(elem->isIdentity == false, "XXX non identity matrix");
-        FATAL_IF(elem->object->getType() != RN_DISPLAYABLE_WAVEFRONT,
-          "XXX only wavefront object supported");
-        Ref<RendererObj> refObj = elem->object.cast<RendererObj>();
-        state = PF_NEW(HiZCullState, refObj, cam);
+        state = PF_NEW(HiZCullState, cam);
+        for (auto elem = elems.begin(); elem != elems.end(); ++elem) {
+          FATAL_IF(elem->object->getType() != RN_DISPLAYABLE_WAVEFRONT,
+            "XXX only wavefront object supported");
+          Ref<RendererObj> refObj = elem->object.cast<RendererObj>();
+          state->objects.push_back(HiZCullObject(refObj, elem->model, elem->isIdentity));
+        }
+        state->occluders = buildOccluders(state->objects);
         cull = HiZCull(state);
       }
     }
@@ -167,19 +220,29 @@ namespace pf
 
         // Display the objects with their textures
         R_CALL (UseProgram, renderer.driver->diffuse.program);
-        R_CALL (UniformMatrix4fv, renderer.driver->diffuse.uMVP, 1, GL_FALSE, &MVP[0][0]);
-        state->renderObj->display(state->visible, state->visibleNum);
+        uint32 visibleNum = 0;
+        for (size_t i = 0; i < state->objects.size(); ++i) {
+          HiZCullObject &object = state->objects[i];
+          const mat4x4f MVPi = object.isIdentity ? MVP : MVP * object.model;
+          R_CALL (UniformMatrix4fv, renderer.driver->diffuse.uMVP, 1, GL_FALSE, &MVPi[0][0]);
+          object.renderObj->display(object.visible, object.visibleNum);
+          visibleNum += object.visibleNum;
+        }
         R_CALL (UseProgram, 0);
 
-        // Display all the bounding boxes
+        // Display all the bounding boxes (in world space)
         R_CALL (setMVP, MVP);
-        BBox3f *bbox = PF_NEW_ARRAY(BBox3f, state->visibleNum);
-        for (size_t i = 0; i < state->visibleNum; ++i) {
-          const uint32 segmentID = state->visible[i];
-          bbox[i] = state->renderObj->segments[segmentID].bbox;
+        TaskScratch &scratch = TaskingSystemGetScratch();
+        BBox3f *bbox = scratch.allocateArray<BBox3f>(visibleNum);
+        uint32 bboxNum = 0;
+        for (size_t i = 0; i < state->objects.size(); ++i) {
+          const HiZCullObject &object = state->objects[i];
+          for (size_t j = 0; j < object.visibleNum; ++j) {
+            const BBox3f &box = object.renderObj->segments[object.visible[j]].bbox;
+            bbox[bboxNum++] = object.isIdentity ? box : xfmBox(object.model, box);
+          }
         }
-        R_CALL (displayBBox, bbox, state->visibleNum);
-        PF_SAFE_DELETE_ARRAY(bbox);
+        R_CALL (displayBBox, bbox, bboxNum);
         PF_SAFE_DELETE(state);
         R_CALL(swapBuffers);
         if (this->refDec()) PF_DELETE(this);
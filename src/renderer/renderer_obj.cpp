@@ -21,8 +21,8 @@
 #include "renderer/renderer_driver.hpp"
 #include "models/obj.hpp"
 #include "rt/bvh2.hpp"
+#include "rt/bvh2_cache.hpp"
 #include "rt/bvh2_node.hpp"
-#include "rt/bvh2_traverser.hpp"
 #include "rt/rt_triangle.hpp"
 #include "sys/logging.hpp"
 #include "sys/tasking_utility.hpp"
@@ -51,7 +51,7 @@ namespace pf
     virtual Task* run(void) {
       const TextureState state = streamer.getTextureState(name);
       PF_ASSERT(state.value == TextureState::COMPLETE);
-      Lock<MutexSys> lock(renderObj->mutex);
+      Lock<TaskMutex> lock(renderObj->mutex);
       for (size_t matID = 0; matID < renderObj->mat.size(); ++matID)
         if (renderObj->mat[matID].name_Kd == name)
           renderObj->mat[matID].map_Kd = state.tex;
@@ -205,7 +205,9 @@ namespace pf
   {
     // Compute the RT triangles first
     PF_MSG_V("RendererObj: building BVH of segments");
-    RTTriangle *tris = PF_NEW_ARRAY(RTTriangle, obj.triNum);
+    TaskScratch &scratch = TaskingSystemGetScratch();
+    TaskScratchScope scope(scratch);
+    RTTriangle *tris = scratch.allocateArray<RTTriangle>(obj.triNum);
     for (size_t i = 0; i < obj.triNum; ++i) {
       const vec3f &v0 = obj.vert[obj.tri[i].v[0]].p;
       const vec3f &v1 = obj.vert[obj.tri[i].v[1]].p;
@@ -214,11 +216,10 @@ namespace pf
     }
 
     // Build the BVH with appropriate options (this is *not* for ray tracing
-    // but for GPU rasterization)
+    // but for GPU rasterization). Unchanged meshes are found in the cache
     Ref< BVH2<RTTriangle> > bvh = PF_NEW(BVH2<RTTriangle>);
     const BVH2BuildOption option(1024, 0xffffffff, 1.f, 1024.f);
-    buildBVH2(tris, obj.triNum, *bvh, option);
-    PF_DELETE_ARRAY(tris);
+    buildBVH2Cached(tris, obj.triNum, *bvh, option);
 
     // Traverse all leaves and create the segments
     std::vector<RendererSegment> segments;
@@ -336,8 +337,11 @@ namespace pf
     shared->indices = RendererObjSegment(*this, obj);
     shared->indexNum = 3*obj.triNum;
     const uint32 segmentNum = this->segments.size();
-    for (size_t segmentID = 0; segmentID < segmentNum; ++segmentID)
+    this->bbox = BBox3f(empty);
+    for (size_t segmentID = 0; segmentID < segmentNum; ++segmentID) {
       segments[segmentID].matID = matRemap[segments[segmentID].matID];
+      this->bbox.grow(segments[segmentID].bbox);
+    }
     shared->vertices = PF_NEW_ARRAY(Obj::Vertex, obj.vertNum);
     shared->vertNum = obj.vertNum;
     std::memcpy(shared->vertices, obj.vert, obj.vertNum * sizeof(Obj::Vertex));
@@ -350,7 +354,9 @@ namespace pf
       RendererObjSharedData *shared = (RendererObjSharedData*) sharedData.ptr;
       PF_ASSERT(shared->indexNum % 3 == 0);
       const uint32 triNum = shared->indexNum / 3;
-      RTTriangle *tris = PF_NEW_ARRAY(RTTriangle, triNum);
+      TaskScratch &scratch = TaskingSystemGetScratch();
+      TaskScratchScope scope(scratch);
+      RTTriangle *tris = scratch.allocateArray<RTTriangle>(triNum);
       for (size_t index = 0; index < shared->indexNum; index += 3) {
         const uint32 index0 = shared->indices[index+0];
         const uint32 index1 = shared->indices[index+1];
@@ -360,10 +366,9 @@ namespace pf
         const vec3f &v2 = shared->vertices[index2].p;
         tris[index / 3] = RTTriangle(v0,v1,v2);
       }
-      BVH2<RTTriangle>* bvh = PF_NEW(BVH2<RTTriangle>);
-      buildBVH2(tris, triNum, *bvh);
-      PF_DELETE_ARRAY(tris);
-      this->intersector = PF_NEW(BVH2Traverser<RTTriangle>, bvh);
+      BVH2<RTTriangle> bvh;
+      buildBVH2Cached(tris, triNum, bvh);
+      this->intersector = buildIntersector(bvh);
     }
   }
 
@@ -389,7 +394,7 @@ namespace pf
       shared->upload(*this);
       sharedData = NULL;
     }
-    Lock<MutexSys> lock(mutex); // XXX remove that
+    Lock<TaskMutex> lock(mutex); // XXX remove that
     R_CALL (BindVertexArray, vertexArray);
     R_CALL (BindBuffer, GL_ELEMENT_ARRAY_BUFFER, elementBuffer);
     R_CALL (ActiveTexture, GL_TEXTURE0);
@@ -68,6 +68,7 @@ namespace pf
     void display(const vector<uint32> &visible, uint32 visibleNum);
     vector<Material> mat;             //!< All the material of the object
     vector<RendererSegment> segments; //!< All the sub-meshes to display
+    BBox3f bbox;                  //!< Object space box of all the segments
     Ref<Intersector> intersector; //!< Optional BVH
     Ref<Task> texLoading;         //!< Load the textures
     Ref<RefCount> sharedData;     //!< May be needed by other renderer objects
@@ -76,7 +77,7 @@ namespace pf
     GLuint elementBuffer;         //!< Indices
     GLuint topology;              //!< Mostly triangle or triangle strip
     uint32 properties;            //!< occluder == has a BVH
-    MutexSys mutex;               //!< XXX just to play with async load
+    TaskMutex mutex;              //!< XXX just to play with async load
   private:
     virtual void onCompile(void);
     virtual void onUnreferenced(void);
@@ -85,7 +85,7 @@ namespace pf
   { }
 
   TextureState TextureStreamer::getTextureState(const std::string &name) {
-    Lock<MutexSys> lock(mutex);
+    Lock<TaskMutex> lock(mutex);
     auto it = texMap.find(name);
     if (it == texMap.end())
       return TextureState();
@@ -302,7 +302,7 @@ namespace pf
     if (data->isValid() == false) {
       PF_MSG_V("TextureStreamer: texture: " << request.name << " not found");
       PF_DELETE(data);
-      Lock<MutexSys> lock(streamer.mutex);
+      Lock<TaskMutex> lock(streamer.mutex);
       PF_ASSERT(streamer.renderer.defaultTex);
       PF_ASSERT(streamer.texMap.find(request.name) != streamer.texMap.end());
     }
@@ -363,7 +363,7 @@ namespace pf
                   data->texels[lvl]);
 
     // Update the map to say we are done with this texture. We can now use it
-    Lock<MutexSys> lock(streamer.mutex);
+    Lock<TaskMutex> lock(streamer.mutex);
     auto it = streamer.texMap.find(request.name);
     PF_ASSERT(it != streamer.texMap.end());
     it->second.value = TextureState::COMPLETE;
@@ -389,7 +389,7 @@ namespace pf
 
   Ref<Task> TextureStreamer::createLoadTask(const TextureRequest &request)
   {
-    Lock<MutexSys> lock(mutex);
+    Lock<TaskMutex> lock(mutex);
     auto it = texMap.find(request.name);
 
     // Create the task that does the real job
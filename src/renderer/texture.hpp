@@ -131,7 +131,7 @@ namespace pf
     /*! Store for each texture its state */
     hash_map<std::string, TextureState> texMap;
     /*! Serialize the streamer access */
-    MutexSys mutex;
+    TaskMutex mutex;
     Renderer &renderer;              //!< Owner of the streamer
     friend class TaskTextureLoad;    //!< Load the textures from the disk
     friend class TaskTextureLoadOGL; //!< Upload the mip level to OGL
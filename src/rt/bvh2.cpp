@@ -17,13 +17,15 @@
 #include "bvh2.hpp"
 #include "bvh2_node.hpp"
 #include "rt_triangle.hpp"
+#include "rt_instance.hpp"
 
 #include "simd/ssef.hpp"
 #include "math/bbox.hpp"
 #include "sys/logging.hpp"
 #include "sys/tasking.hpp"
-#include "sys/array.hpp"
 #include "sys/vector.hpp"
+#include "sys/mutex.hpp"
+#include "sys/thread.hpp"
 
 #include <algorithm>
 #include <functional>
@@ -50,13 +52,15 @@ namespace pf
     return to;
   }
 
-  /* Just the barycenter of a triangle */
+  /* Just the barycenter of a triangle (or the box center of other prims) */
   struct Centroid : public vec3f {
     Centroid(void) {}
     Centroid(const RTTriangle &t) :
       vec3f(t.v[0].x + t.v[1].x + t.v[2].x,
             t.v[0].y + t.v[1].y + t.v[2].y,
             t.v[0].z + t.v[1].z + t.v[2].z) {}
+    template <typename T>
+    explicit Centroid(const T &prim) : vec3f(center2(prim.getAABB())) {}
     PF_STRUCT(Centroid);
   };
 
@@ -72,7 +76,9 @@ namespace pf
   {
     BVH2Builder(void);
     ~BVH2Builder(void);
-    /*! Compute primitives centroids and sort then for each axis */
+    /*! Compute primitives centroids and sort then for each axis. Temporaries
+     *  are allocated in the scratch arena of the calling thread
+     */
     template <typename T>
     void injection(const T * const RESTRICT soup, uint32 primNum);
     /*! Build the hierarchy itself */
@@ -80,12 +86,12 @@ namespace pf
 
     Box sceneAABB;          //!< AABB of the scene
     vector<uint32> primID;  //!< Sorted array of primitives
-    array<uint32> IDs[3];   //!< Sorted ID per axis
-    array<int32>  pos;      //!< Says if a node is on left or on right of the cut
-    array<uint32> tmpIDs;   //!< Used to temporaly store IDs
-    array<Box> aabbs;       //!< All the bounding boxes
-    array<Box> rlAABBs;     //!< Bounding boxes sorted right to left
-    array<BVH2Node> root;   //!< Root of the tree
+    uint32 *IDs[3];         //!< Sorted ID per axis
+    int32 *pos;             //!< Says if a node is on left or on right of the cut
+    uint32 *tmpIDs;         //!< Used to temporaly store IDs
+    Box *aabbs;             //!< All the bounding boxes
+    Box *rlAABBs;           //!< Bounding boxes sorted right to left
+    BVH2Node *root;         //!< Root of the tree
     int32 n;                //!< NUmber of primitives
     int32 nodeNum;          //!< Maximum number of nodes (== 2*n+1 for a BVH)
     uint32 currID;          //!< Last node pushed
@@ -93,7 +99,12 @@ namespace pf
     PF_STRUCT(BVH2Builder);
   };
 
-  BVH2Builder::BVH2Builder(void) : n(0), nodeNum(0), currID(0) { }
+  BVH2Builder::BVH2Builder(void) :
+    pos(NULL), tmpIDs(NULL), aabbs(NULL), rlAABBs(NULL), root(NULL),
+    n(0), nodeNum(0), currID(0)
+  {
+    IDs[0] = IDs[1] = IDs[2] = NULL;
+  }
   BVH2Builder::~BVH2Builder(void) { }
 
   /*! Sort the centroids along the given axis */
@@ -109,19 +120,20 @@ namespace pf
   template <typename T>
   void BVH2Builder::injection(const T * const RESTRICT soup, uint32 primNum)
   {
-    array<Centroid> centroids(primNum);
+    TaskScratch &scratch = TaskingSystemGetScratch();
+    Centroid *centroids = scratch.allocateArray<Centroid>(primNum);
     double t = getSeconds();
 
     // Allocate nodes and leaves for the BVH2
     nodeNum = 2 * primNum + 1;
-    root.resize(nodeNum);
+    root = scratch.allocateArray<BVH2Node>(nodeNum);
 
     // Allocate the data for the compiler
-    for (int i = 0; i < 3; ++i) IDs[i].resize(primNum);
-    tmpIDs.resize(primNum);
-    pos.resize(primNum);
-    aabbs.resize(primNum);
-    rlAABBs.resize(primNum);
+    for (int i = 0; i < 3; ++i) IDs[i] = scratch.allocateArray<uint32>(primNum);
+    tmpIDs = scratch.allocateArray<uint32>(primNum);
+    pos = scratch.allocateArray<int32>(primNum);
+    aabbs = scratch.allocateArray<Box>(primNum);
+    rlAABBs = scratch.allocateArray<Box>(primNum);
     n = primNum;
 
     // Compute centroids and bounding boxes
@@ -135,9 +147,9 @@ namespace pf
 
     // Sort the bounding boxes along their axes
     for (int j = 0; j < n; ++j) IDs[0][j] = IDs[1][j] = IDs[2][j] = j;
-    std::sort(IDs[0].begin(), IDs[0].end(), CentroidSorter<0>(&centroids[0]));
-    std::sort(IDs[1].begin(), IDs[1].end(), CentroidSorter<1>(&centroids[0]));
-    std::sort(IDs[2].begin(), IDs[2].end(), CentroidSorter<2>(&centroids[0]));
+    std::sort(IDs[0], IDs[0] + n, CentroidSorter<0>(centroids));
+    std::sort(IDs[1], IDs[1] + n, CentroidSorter<1>(centroids));
+    std::sort(IDs[2], IDs[2] + n, CentroidSorter<2>(centroids));
 
     PF_MSG_V("BVH2: Injection time, " << getSeconds() - t);
   }
@@ -339,6 +351,1427 @@ namespace pf
     }
   }
 
+  ///////////////////////////////////////////////////////////////////////////
+  /// Binned SAH compiler
+  ///////////////////////////////////////////////////////////////////////////
+
+  /*! Number of bins per axis */
+  enum { binNum = 32 };
+
+  /*! Sub-trees with more primitives are given to other tasks */
+  enum { binnedTaskPrimNum = 4096 };
+
+  /*! Node to compile: primitives first to last of the ID array */
+  struct BinnedJob
+  {
+    Box aabb;      //!< Bounding box of the primitives
+    Box centroids; //!< Bounding box of their centroids
+    int32 first, last;
+    uint32 id;     //!< Node to fill
+    PF_STRUCT(BinnedJob);
+  };
+
+  /*! Linear compiler with binned SAH. Large sub-trees are pushed into a
+   *  shared job list and one task is spawned per job. The compiling thread
+   *  also pops the jobs while waiting: the compilation therefore completes
+   *  even if no other thread is available
+   */
+  struct BVH2BinnedBuilder : public RefCount
+  {
+    BVH2BinnedBuilder(void);
+    /*! Compute the primitive bounding boxes and centroids. Temporaries are
+     *  allocated in the scratch arena of the calling thread
+     */
+    template <typename T>
+    void injection(const T * const RESTRICT soup, uint32 primNum);
+    /*! Build the hierarchy itself (from the thread that did the injection) */
+    void compile(void);
+    /*! Build a complete sub-tree (large sub-trees are given to other tasks) */
+    void compileSubTree(const BinnedJob &job);
+    /*! Bin the primitives of the job and find the best split */
+    void findSplit(const BinnedJob &job, int32 &axis, int32 &split, float &cost) const;
+    /*! Partition the IDs of the job along the split found by findSplit and
+     *  compute the children ranges and boxes. Return the first right ID
+     */
+    int32 partition(const BinnedJob &job, int32 &axis, int32 split, BinnedJob children[2]);
+    /*! Compile one pending job if any. Return false if there was none */
+    bool compilePending(void);
+    /*! Push a job into the shared job list */
+    void push(const BinnedJob &job);
+
+    BinnedJob rootJob;          //!< Covers all the primitives
+    Box *aabbs;                 //!< All the bounding boxes
+    ssef *centroids;            //!< All the centroids (times two)
+    uint32 *IDs;                //!< Primitives sorted by leaf
+    BVH2Node *root;             //!< Root of the tree
+    Atomic currID;              //!< Last node allocated
+    Atomic pendingNum;          //!< Pushed jobs not compiled yet
+    MutexSys mutex;             //!< Protects the job list
+    vector<BinnedJob> jobs;     //!< Jobs waiting for a task
+    BVH2BuildOption options;    //!< SAH options and stop criterium
+    PF_STRUCT(BVH2BinnedBuilder);
+  };
+
+  /*! Task compiling one pending sub-tree (it may be done by someone else) */
+  class TaskBVH2SubTree : public Task
+  {
+  public:
+    INLINE TaskBVH2SubTree(BVH2BinnedBuilder &builder) :
+      Task("TaskBVH2SubTree"), builder(&builder) {}
+    virtual Task *run(void) {
+      builder->compilePending();
+      return NULL;
+    }
+    Ref<BVH2BinnedBuilder> builder; //!< May outlive the compilation
+  };
+
+  BVH2BinnedBuilder::BVH2BinnedBuilder(void) :
+    aabbs(NULL), centroids(NULL), IDs(NULL), root(NULL), currID(0), pendingNum(0) {}
+
+  template <typename T>
+  void BVH2BinnedBuilder::injection(const T * const RESTRICT soup, uint32 primNum)
+  {
+    TaskScratch &scratch = TaskingSystemGetScratch();
+    double t = getSeconds();
+    root = scratch.allocateArray<BVH2Node>(2 * primNum + 1);
+    aabbs = scratch.allocateArray<Box>(primNum);
+    centroids = scratch.allocateArray<ssef>(primNum);
+    IDs = scratch.allocateArray<uint32>(primNum);
+    rootJob.aabb = rootJob.centroids = Box(empty);
+    for (uint32 j = 0; j < primNum; ++j) {
+      aabbs[j] = convertBox(soup[j].getAABB());
+      centroids[j] = center2(aabbs[j]);
+      rootJob.aabb.grow(aabbs[j]);
+      rootJob.centroids.grow(centroids[j]);
+      IDs[j] = j;
+    }
+    rootJob.first = 0;
+    rootJob.last = primNum - 1;
+    rootJob.id = 0;
+    PF_MSG_V("BVH2: Injection time, " << getSeconds() - t);
+  }
+
+  /*! Small nodes use less bins */
+  INLINE int32 getBinNum(const BinnedJob &job) {
+    const int32 primNum = job.last - job.first + 1;
+    return primNum < binNum ? max(primNum, 4) : int32(binNum);
+  }
+
+  /*! Maps centroids to bins (the same way for binning and partitioning) */
+  struct BinMapping
+  {
+    INLINE BinMapping(const BinnedJob &job) :
+      base(job.centroids.lower), last(float(getBinNum(job) - 1))
+    {
+      const ssef extent = size(job.centroids);
+      const ssef scale = ssef(float(getBinNum(job)) * 0.99f) / extent;
+      this->scale = select(extent > ssef(1e-19f), scale, ssef(zero));
+    }
+    INLINE ssei get(const ssef &centroid) const {
+      const ssef bin = (centroid - base) * scale;
+      return truncate(min(max(bin, ssef(zero)), last));
+    }
+    ssef base, scale, last;
+  };
+
+  void BVH2BinnedBuilder::findSplit(const BinnedJob &job,
+                                    int32 &axis,
+                                    int32 &split,
+                                    float &cost) const
+  {
+    Box bins[3][binNum];
+    int32 counts[3][binNum];
+    const int32 jobBinNum = getBinNum(job);
+    for (int32 a = 0; a < 3; ++a)
+      for (int32 b = 0; b < jobBinNum; ++b) {
+        bins[a][b] = Box(empty);
+        counts[a][b] = 0;
+      }
+
+    // Bin the primitives along the 3 axes at once
+    const BinMapping mapping(job);
+    for (int32 j = job.first; j <= job.last; ++j) {
+      const uint32 id = IDs[j];
+      const ssei bin = mapping.get(centroids[id]);
+      bins[0][bin[0]].grow(aabbs[id]); counts[0][bin[0]]++;
+      bins[1][bin[1]].grow(aabbs[id]); counts[1][bin[1]]++;
+      bins[2][bin[2]].grow(aabbs[id]); counts[2][bin[2]]++;
+    }
+
+    // Sweep the bins from right to left and then from left to right
+    axis = split = -1;
+    cost = FLT_MAX;
+    for (int32 a = 0; a < 3; ++a) {
+      float rightArea[binNum];
+      int32 rightNum[binNum];
+      Box aabb(empty);
+      int32 n = 0;
+      for (int32 b = jobBinNum - 1; b > 0; --b) {
+        aabb.grow(bins[a][b]);
+        n += counts[a][b];
+        rightArea[b] = halfArea(aabb);
+        rightNum[b] = n;
+      }
+      aabb = Box(empty);
+      n = 0;
+      for (int32 b = 1; b < jobBinNum; ++b) {
+        aabb.grow(bins[a][b - 1]);
+        n += counts[a][b - 1];
+        if (n == 0 || rightNum[b] == 0) continue;
+        const float c = halfArea(aabb) * float(n) + rightArea[b] * float(rightNum[b]);
+        if (c >= cost) continue;
+        cost = c;
+        axis = a;
+        split = b;
+      }
+    }
+  }
+
+  int32 BVH2BinnedBuilder::partition(const BinnedJob &job,
+                                     int32 &axis,
+                                     int32 split,
+                                     BinnedJob children[2])
+  {
+    // If all the centroids are in the same bin, we just cut the list in two
+    // halves
+    int32 middle;
+    if (axis != -1) {
+      const BinMapping mapping(job);
+      int32 left = job.first, right = job.last;
+      while (left <= right) {
+        if (mapping.get(centroids[IDs[left]])[axis] < split)
+          left++;
+        else
+          std::swap(IDs[left], IDs[right--]);
+      }
+      middle = left;
+    } else {
+      axis = 0;
+      middle = (job.first + job.last + 1) / 2;
+    }
+    children[ON_LEFT].first = job.first;
+    children[ON_LEFT].last = middle - 1;
+    children[ON_RIGHT].first = middle;
+    children[ON_RIGHT].last = job.last;
+    for (int32 i = 0; i < 2; ++i) {
+      BinnedJob &child = children[i];
+      child.aabb = child.centroids = Box(empty);
+      for (int32 j = child.first; j <= child.last; ++j) {
+        child.aabb.grow(aabbs[IDs[j]]);
+        child.centroids.grow(centroids[IDs[j]]);
+      }
+    }
+    return middle;
+  }
+
+  /*! Store a leaf in the BVH2 */
+  INLINE void doMakeLeaf(BVH2Node &node, const BinnedJob &job) {
+    doSetNodeBBox(node, job.aabb);
+    node.setPrimNum(job.last - job.first + 1);
+    node.setPrimID(job.first);
+    node.setAsLeaf();
+  }
+
+  void BVH2BinnedBuilder::compileSubTree(const BinnedJob &subTree)
+  {
+    enum { MAX_DEPTH = 64 };
+    BinnedJob stack[MAX_DEPTH];
+    int32 stackSize = 0;
+    BinnedJob job = subTree;
+    for (;;) {
+      const uint32 primNum = job.last - job.first + 1;
+      int32 axis = -1, split = -1;
+      float cost = FLT_MAX;
+      bool leaf = primNum <= options.minPrimNum;
+
+      // Same stop criterium as the sweep compiler
+      if (!leaf) {
+        this->findSplit(job, axis, split, cost);
+        if (primNum <= options.maxPrimNum) {
+          const float harea = halfArea(job.aabb);
+          const float leafCost = options.SAHIntersectionCost * harea * primNum;
+          const float splitCost = options.SAHIntersectionCost * cost
+                                + options.SAHTraversalCost * harea;
+          leaf = axis == -1 || leafCost <= splitCost;
+        }
+      }
+      if (leaf) {
+        doMakeLeaf(root[job.id], job);
+        if (stackSize == 0) break;
+        job = stack[--stackSize];
+        continue;
+      }
+
+      // Partition the IDs and compute the boxes of the children
+      BinnedJob children[2];
+      const int32 middle = this->partition(job, axis, split, children);
+
+      // Register this node. Children are allocated by pair
+      const uint32 childID = uint32(currID += 2) - 1;
+      BVH2Node &node = root[job.id];
+      node.setAxis(axis);
+      doSetNodeBBox(node, job.aabb);
+      node.setOffset(childID);
+      node.setAsNonLeaf();
+      children[ON_LEFT].id = childID;
+      children[ON_RIGHT].id = childID + 1;
+
+      // Continue with the smallest child. This bounds the stack depth
+      const int32 leftNum = middle - job.first;
+      const int32 rightNum = job.last - middle + 1;
+      const int32 smallest = leftNum < rightNum ? ON_LEFT : ON_RIGHT;
+      const BinnedJob &large = children[smallest ^ 1];
+      if (large.last - large.first + 1 >= binnedTaskPrimNum)
+        this->push(large);
+      else {
+        PF_ASSERT(stackSize < MAX_DEPTH);
+        stack[stackSize++] = large;
+      }
+      job = children[smallest];
+    }
+  }
+
+  void BVH2BinnedBuilder::push(const BinnedJob &job) {
+    mutex.lock();
+    jobs.push_back(job);
+    pendingNum++;
+    mutex.unlock();
+    Task *task = PF_NEW(TaskBVH2SubTree, *this);
+    task->scheduled();
+  }
+
+  bool BVH2BinnedBuilder::compilePending(void) {
+    mutex.lock();
+    if (jobs.size() == 0) {
+      mutex.unlock();
+      return false;
+    }
+    const BinnedJob job = jobs.back();
+    jobs.pop_back();
+    mutex.unlock();
+    this->compileSubTree(job);
+    pendingNum--;
+    return true;
+  }
+
+  void BVH2BinnedBuilder::compile(void) {
+    this->compileSubTree(rootJob);
+    while (pendingNum > 0)
+      if (!this->compilePending() && !TaskingSystemRunWhileWaiting()) yield();
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Spatial split (SBVH) compiler
+  ///////////////////////////////////////////////////////////////////////////
+
+  /*! Spatial splits are only tried when the children of the object split
+   *  overlap more than this fraction of the root area
+   */
+  static const float spatialOverlap = 1e-5f;
+
+  /*! Relative padding of the clipped reference boxes */
+  static const float splitPadding = 1e-5f;
+
+  /*! SAH weight (area times count) of a possibly empty set of references */
+  INLINE float halfArea(const Box &box, int32 n) {
+    return n == 0 ? 0.f : halfArea(box) * float(n);
+  }
+
+  /*! Split the reference box of a primitive along the given plane. By default,
+   *  we only cut the box in two
+   */
+  template <typename T>
+  INLINE void splitPrimBox(const T &prim, const Box &box,
+                           int32 axis, float pos, Box &left, Box &right)
+  {
+    left = right = box;
+    left.upper[axis] = min(left.upper[axis], pos);
+    right.lower[axis] = max(right.lower[axis], pos);
+  }
+
+  /*! For triangles, we clip the edges to get the tightest boxes */
+  template <>
+  INLINE void splitPrimBox(const RTTriangle &prim, const Box &box,
+                           int32 axis, float pos, Box &left, Box &right)
+  {
+    left = right = Box(empty);
+    for (int32 i = 0; i < 3; ++i) {
+      const vec3f &v0 = prim.v[i], &v1 = prim.v[(i + 1) % 3];
+      const float p0 = v0[axis], p1 = v1[axis];
+      const ssef q0(v0.x, v0.y, v0.z, 0.f);
+      if (p0 <= pos) left.grow(q0);
+      if (p0 >= pos) right.grow(q0);
+      if ((p0 < pos && p1 > pos) || (p0 > pos && p1 < pos)) {
+        const ssef q1(v1.x, v1.y, v1.z, 0.f);
+        const float t = (pos - p0) / (p1 - p0);
+        ssef q = q0 + ssef(t) * (q1 - q0);
+        q[axis] = pos;
+        left.grow(q);
+        right.grow(q);
+      }
+    }
+    // Clipped vertices are rounded: we pad the boxes to stay conservative.
+    // The reference may be already clipped by previous splits
+    const ssef eps = ssef(splitPadding) * max(abs(box.lower), abs(box.upper));
+    left.lower = max(left.lower - eps, box.lower);
+    left.upper = min(left.upper + eps, box.upper);
+    right.lower = max(right.lower - eps, box.lower);
+    right.upper = min(right.upper + eps, box.upper);
+  }
+
+  /*! True if the box has no volume to hold a primitive part */
+  INLINE bool isEmptyBox(const Box &box) {
+    return (movemask(box.lower > box.upper) & 0x7) != 0;
+  }
+
+  /*! Binned SAH compiler that also considers spatial splits (SBVH). A spatial
+   *  split clips the references straddling the plane and puts the two parts
+   *  in both children. References therefore outnumber the primitives: the
+   *  leaves store the indices of the primitives they reference, as the other
+   *  compilers do. The number of extra references is bounded by the budget
+   *  given in the options. The compilation is serial
+   */
+  template <typename T>
+  struct BVH2SpatialBuilder : public BVH2BinnedBuilder
+  {
+    BVH2SpatialBuilder(void);
+    /*! Same as binned injection but the arrays can hold the extra references */
+    void injection(const T * const RESTRICT soup, uint32 primNum);
+    /*! Build the hierarchy itself and output the leaf primitive IDs */
+    void compile(void);
+    /*! Bin the references in space and find the best spatial split */
+    void findSpatialSplit(const BinnedJob &job, int32 &axis, float &pos,
+                          float &cost, Box &leftBox, Box &rightBox,
+                          int32 &leftNum, int32 &rightNum) const;
+    /*! Split the references of the job along the plane and write left then
+     *  right references from job.first. Return the number of left references
+     */
+    int32 spatialPartition(const BinnedJob &job, int32 axis, float pos,
+                           Box leftBox, Box rightBox,
+                           int32 leftNum, int32 rightNum);
+
+    const T *prims;           //!< Primitives to compile
+    uint32 *refPrim;          //!< Primitive of each reference
+    uint32 refNum;            //!< Current number of references
+    uint32 maxRefNum;         //!< References we may allocate at most
+    float rootArea;           //!< To estimate child overlaps
+    vector<uint32> leafIDs;   //!< Primitive IDs per leaf (output)
+    vector<uint32> leftIDs;   //!< Temporary for the spatial partition
+    vector<uint32> rightIDs;  //!< Temporary for the spatial partition
+    PF_STRUCT(BVH2SpatialBuilder);
+  };
+
+  template <typename T>
+  BVH2SpatialBuilder<T>::BVH2SpatialBuilder(void) :
+    prims(NULL), refPrim(NULL), refNum(0), maxRefNum(0), rootArea(0.f) {}
+
+  template <typename T>
+  void BVH2SpatialBuilder<T>::injection(const T * const RESTRICT soup, uint32 primNum)
+  {
+    TaskScratch &scratch = TaskingSystemGetScratch();
+    double t = getSeconds();
+    const float budget = max(options.spatialSplitBudget, 0.f);
+    prims = soup;
+    refNum = primNum;
+    maxRefNum = primNum + uint32(float(primNum) * budget);
+    root = scratch.allocateArray<BVH2Node>(2 * maxRefNum + 1);
+    aabbs = scratch.allocateArray<Box>(maxRefNum);
+    centroids = scratch.allocateArray<ssef>(maxRefNum);
+    IDs = scratch.allocateArray<uint32>(maxRefNum);
+    refPrim = scratch.allocateArray<uint32>(maxRefNum);
+    rootJob.aabb = rootJob.centroids = Box(empty);
+    for (uint32 j = 0; j < primNum; ++j) {
+      aabbs[j] = convertBox(soup[j].getAABB());
+      centroids[j] = center2(aabbs[j]);
+      rootJob.aabb.grow(aabbs[j]);
+      rootJob.centroids.grow(centroids[j]);
+      IDs[j] = refPrim[j] = j;
+    }
+    rootJob.first = 0;
+    rootJob.last = primNum - 1;
+    rootJob.id = 0;
+    rootArea = halfArea(rootJob.aabb);
+    leafIDs.reserve(maxRefNum);
+    PF_MSG_V("BVH2: Injection time, " << getSeconds() - t);
+  }
+
+  template <typename T>
+  void BVH2SpatialBuilder<T>::findSpatialSplit(const BinnedJob &job,
+                                               int32 &axis,
+                                               float &pos,
+                                               float &cost,
+                                               Box &leftBox,
+                                               Box &rightBox,
+                                               int32 &leftNum,
+                                               int32 &rightNum) const
+  {
+    const int32 jobBinNum = getBinNum(job);
+    axis = -1;
+    cost = FLT_MAX;
+    for (int32 a = 0; a < 3; ++a) {
+      const float base = job.aabb.lower[a];
+      const float extent = job.aabb.upper[a] - base;
+      if (extent <= 1e-19f) continue;
+      const float binSize = extent / float(jobBinNum);
+      const float scale = float(jobBinNum) / extent;
+      Box bins[binNum];
+      int32 enter[binNum], exit[binNum];
+      for (int32 b = 0; b < jobBinNum; ++b) {
+        bins[b] = Box(empty);
+        enter[b] = exit[b] = 0;
+      }
+
+      // Clip each reference against the planes it straddles
+      for (int32 j = job.first; j <= job.last; ++j) {
+        const uint32 id = IDs[j];
+        const Box &aabb = aabbs[id];
+        const int32 first = clamp(int32((aabb.lower[a] - base) * scale), 0, jobBinNum - 1);
+        const int32 last = clamp(int32((aabb.upper[a] - base) * scale), first, jobBinNum - 1);
+        enter[first]++;
+        exit[last]++;
+        Box curr = aabb;
+        for (int32 b = first; b < last; ++b) {
+          Box left, right;
+          splitPrimBox(prims[refPrim[id]], curr, a, base + float(b + 1) * binSize, left, right);
+          if (!isEmptyBox(left)) bins[b].grow(left);
+          curr = right;
+        }
+        if (!isEmptyBox(curr)) bins[last].grow(curr);
+      }
+
+      // Same sweeps as the object split
+      float rightArea[binNum];
+      int32 rightCount[binNum];
+      Box rightBoxes[binNum];
+      Box aabb(empty);
+      int32 n = 0;
+      for (int32 b = jobBinNum - 1; b > 0; --b) {
+        aabb.grow(bins[b]);
+        n += exit[b];
+        rightArea[b] = halfArea(aabb, n);
+        rightCount[b] = n;
+        rightBoxes[b] = aabb;
+      }
+      aabb = Box(empty);
+      n = 0;
+      for (int32 b = 1; b < jobBinNum; ++b) {
+        aabb.grow(bins[b - 1]);
+        n += enter[b - 1];
+        if (n == 0 || rightCount[b] == 0) continue;
+        const float c = halfArea(aabb, n) + rightArea[b];
+        if (c >= cost) continue;
+        cost = c;
+        axis = a;
+        pos = base + float(b) * binSize;
+        leftBox = aabb;
+        rightBox = rightBoxes[b];
+        leftNum = n;
+        rightNum = rightCount[b];
+      }
+    }
+  }
+
+  template <typename T>
+  int32 BVH2SpatialBuilder<T>::spatialPartition(const BinnedJob &job,
+                                                int32 axis,
+                                                float pos,
+                                                Box leftBox,
+                                                Box rightBox,
+                                                int32 leftNum,
+                                                int32 rightNum)
+  {
+    leftIDs.resize(0);
+    rightIDs.resize(0);
+    for (int32 j = job.first; j <= job.last; ++j) {
+      const uint32 id = IDs[j];
+      const Box &aabb = aabbs[id];
+      if (aabb.upper[axis] <= pos)
+        leftIDs.push_back(id);
+      else if (aabb.lower[axis] >= pos)
+        rightIDs.push_back(id);
+      else {
+        // Reference unsplitting: putting it in one child may be cheaper
+        Box left, right;
+        splitPrimBox(prims[refPrim[id]], aabb, axis, pos, left, right);
+        Box leftAll = leftBox, rightAll = rightBox;
+        leftAll.grow(aabb);
+        rightAll.grow(aabb);
+        const float splitCost = halfArea(leftBox, leftNum)
+                              + halfArea(rightBox, rightNum);
+        const float leftCost = halfArea(leftAll, leftNum)
+                             + halfArea(rightBox, rightNum - 1);
+        const float rightCost = halfArea(leftBox, leftNum - 1)
+                              + halfArea(rightAll, rightNum);
+        const bool noLeft = isEmptyBox(left), noRight = isEmptyBox(right);
+        const bool canSplit = refNum < maxRefNum && !noLeft && !noRight;
+        if (noRight || ((!canSplit || leftCost <= splitCost) && leftCost <= rightCost)) {
+          leftBox = leftAll;
+          rightNum--;
+          leftIDs.push_back(id);
+        } else if (noLeft || !canSplit || rightCost <= splitCost) {
+          rightBox = rightAll;
+          leftNum--;
+          rightIDs.push_back(id);
+        } else {
+          const uint32 newID = refNum++;
+          aabbs[id] = left;
+          aabbs[newID] = right;
+          centroids[id] = center2(left);
+          centroids[newID] = center2(right);
+          refPrim[newID] = refPrim[id];
+          leftIDs.push_back(id);
+          rightIDs.push_back(newID);
+        }
+      }
+    }
+    uint32 *dst = IDs + job.first;
+    for (size_t j = 0; j < leftIDs.size(); ++j) *dst++ = leftIDs[j];
+    for (size_t j = 0; j < rightIDs.size(); ++j) *dst++ = rightIDs[j];
+    return int32(leftIDs.size());
+  }
+
+  /*! Store a leaf and its primitive IDs */
+  template <typename T>
+  INLINE void doMakeLeaf(BVH2SpatialBuilder<T> &c, const BinnedJob &job) {
+    BVH2Node &node = c.root[job.id];
+    doSetNodeBBox(node, job.aabb);
+    node.setPrimNum(job.last - job.first + 1);
+    node.setPrimID(uint32(c.leafIDs.size()));
+    node.setAsLeaf();
+    for (int32 j = job.first; j <= job.last; ++j)
+      c.leafIDs.push_back(c.refPrim[c.IDs[j]]);
+  }
+
+  template <typename T>
+  void BVH2SpatialBuilder<T>::compile(void)
+  {
+    // The job we process always ends the used part of the ID array. Spatial
+    // splits can then grow it without moving the pending jobs
+    vector<BinnedJob> stack;
+    stack.push_back(rootJob);
+    while (stack.size() > 0) {
+      BinnedJob job = stack.back();
+      stack.pop_back();
+      const uint32 primNum = job.last - job.first + 1;
+      int32 axis = -1, split = -1;
+      float cost = FLT_MAX;
+      bool leaf = primNum <= options.minPrimNum;
+      if (!leaf) {
+        this->findSplit(job, axis, split, cost);
+        if (primNum <= options.maxPrimNum) {
+          const float harea = halfArea(job.aabb);
+          const float leafCost = options.SAHIntersectionCost * harea * primNum;
+          const float splitCost = options.SAHIntersectionCost * cost
+                                + options.SAHTraversalCost * harea;
+          leaf = axis == -1 || leafCost <= splitCost;
+        }
+      }
+      if (leaf) {
+        doMakeLeaf(*this, job);
+        continue;
+      }
+
+      // Object split first. Try a spatial split when the children overlap
+      BinnedJob children[2];
+      int32 middle = this->partition(job, axis, split, children);
+      const Box &left = children[ON_LEFT].aabb, &right = children[ON_RIGHT].aabb;
+      Box overlap;
+      overlap.lower = max(left.lower, right.lower);
+      overlap.upper = min(left.upper, right.upper);
+      if (refNum < maxRefNum &&
+          !isEmptyBox(overlap) &&
+          halfArea(overlap) > spatialOverlap * rootArea) {
+        int32 spatialAxis, leftNum, rightNum;
+        float pos, spatialCost;
+        Box leftBox, rightBox;
+        this->findSpatialSplit(job, spatialAxis, pos, spatialCost,
+                               leftBox, rightBox, leftNum, rightNum);
+        if (spatialAxis != -1 && spatialCost < cost) {
+          const int32 n = this->spatialPartition(job, spatialAxis, pos,
+                                                 leftBox, rightBox,
+                                                 leftNum, rightNum);
+          const int32 total = int32(leftIDs.size() + rightIDs.size());
+          if (n == 0 || n == total)
+            middle = this->partition(job, axis, split, children);
+          else {
+            axis = spatialAxis;
+            middle = job.first + n;
+            children[ON_LEFT].first = job.first;
+            children[ON_LEFT].last = middle - 1;
+            children[ON_RIGHT].first = middle;
+            children[ON_RIGHT].last = job.first + total - 1;
+            for (int32 i = 0; i < 2; ++i) {
+              BinnedJob &child = children[i];
+              child.aabb = child.centroids = Box(empty);
+              for (int32 j = child.first; j <= child.last; ++j) {
+                child.aabb.grow(aabbs[IDs[j]]);
+                child.centroids.grow(centroids[IDs[j]]);
+              }
+            }
+          }
+        }
+      }
+
+      // Register this node. The right child ends the ID array: process it first
+      const uint32 childID = uint32(currID += 2) - 1;
+      BVH2Node &node = root[job.id];
+      node.setAxis(axis);
+      doSetNodeBBox(node, job.aabb);
+      node.setOffset(childID);
+      node.setAsNonLeaf();
+      children[ON_LEFT].id = childID;
+      children[ON_RIGHT].id = childID + 1;
+      stack.push_back(children[ON_LEFT]);
+      stack.push_back(children[ON_RIGHT]);
+    }
+    PF_MSG_V("BVH2: " << refNum - rootJob.last - 1 << " references added by spatial splits");
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Lean (in place) compiler
+  ///////////////////////////////////////////////////////////////////////////
+
+  /*! Nodes of the lean compiler are allocated by blocks of this size */
+  enum { leanBlockNodeNum = 4096 };
+
+  /*! Bytes allocated by a compilation (current and high water mark) */
+  struct BVH2MemoryCounter
+  {
+    INLINE BVH2MemoryCounter(void) : curr(0), peak(0) {}
+    INLINE void allocated(size_t size) { curr += size; peak = max(peak, curr); }
+    INLINE void released(size_t size) { curr -= size; }
+    size_t curr, peak;
+  };
+
+  /*! Binned SAH compiler for large scenes. Neither boxes nor centroids are
+   *  stored: they are recomputed from the primitives each time they are
+   *  needed. IDs are partitioned in place and directly become the primitive
+   *  IDs of the tree. Nodes are allocated by blocks and copied in an array of
+   *  the exact size at the end. Only the IDs and the nodes are allocated
+   *  (against 2n+1 nodes, the boxes and the centroids for the binned
+   *  compiler). The compilation is serial
+   */
+  template <typename T>
+  struct BVH2LeanBuilder : public RefCount
+  {
+    BVH2LeanBuilder(const T *soup, uint32 primNum, BVH2MemoryCounter &memory);
+    ~BVH2LeanBuilder(void);
+    /*! Build the hierarchy itself */
+    void compile(void);
+    /*! Bin the primitives of the job and find the best split */
+    void findSplit(const BinnedJob &job, int32 &axis, int32 &split, float &cost) const;
+    /*! Partition the IDs in place and compute the children ranges and boxes.
+     *  Return the first right ID
+     */
+    int32 partition(const BinnedJob &job, int32 &axis, int32 split, BinnedJob children[2]);
+    /*! Allocate a pair of siblings and return the index of the first one */
+    uint32 allocatePair(void);
+    /*! Copy the nodes in an array of the exact size and free the blocks */
+    BVH2Node *emitNodes(void);
+    /*! Node from its index */
+    INLINE BVH2Node &getNode(uint32 id) {
+      return blocks[id / leanBlockNodeNum][id % leanBlockNodeNum];
+    }
+    /*! Bounding box of a primitive */
+    INLINE Box getBox(uint32 id) const { return convertBox(soup[id].getAABB()); }
+
+    BinnedJob rootJob;          //!< Covers all the primitives
+    const T *soup;              //!< Primitives to compile
+    uint32 *IDs;                //!< Primitives sorted by leaf
+    uint32 primNum;             //!< Number of primitives
+    uint32 currID;              //!< Last node allocated
+    vector<BVH2Node*> blocks;   //!< Nodes allocated so far
+    BVH2MemoryCounter &memory;  //!< Tracks the peak memory
+    BVH2BuildOption options;    //!< SAH options and stop criterium
+    PF_STRUCT(BVH2LeanBuilder);
+  };
+
+  template <typename T>
+  BVH2LeanBuilder<T>::BVH2LeanBuilder(const T *soup,
+                                      uint32 primNum,
+                                      BVH2MemoryCounter &memory) :
+    soup(soup), primNum(primNum), currID(0), memory(memory)
+  {
+    double t = getSeconds();
+    IDs = PF_NEW_ARRAY(uint32, primNum);
+    memory.allocated(sizeof(uint32) * primNum);
+    blocks.push_back((BVH2Node*) PF_ALIGNED_MALLOC(sizeof(BVH2Node) * leanBlockNodeNum, CACHE_LINE));
+    memory.allocated(sizeof(BVH2Node) * leanBlockNodeNum);
+    rootJob.aabb = rootJob.centroids = Box(empty);
+    for (uint32 j = 0; j < primNum; ++j) {
+      const Box aabb = this->getBox(j);
+      rootJob.aabb.grow(aabb);
+      rootJob.centroids.grow(center2(aabb));
+      IDs[j] = j;
+    }
+    rootJob.first = 0;
+    rootJob.last = primNum - 1;
+    rootJob.id = 0;
+    PF_MSG_V("BVH2: Injection time, " << getSeconds() - t);
+  }
+
+  template <typename T>
+  BVH2LeanBuilder<T>::~BVH2LeanBuilder(void) {
+    for (size_t b = 0; b < blocks.size(); ++b) PF_ALIGNED_FREE(blocks[b]);
+    PF_SAFE_DELETE_ARRAY(IDs);
+  }
+
+  template <typename T>
+  void BVH2LeanBuilder<T>::findSplit(const BinnedJob &job,
+                                     int32 &axis,
+                                     int32 &split,
+                                     float &cost) const
+  {
+    Box bins[3][binNum];
+    int32 counts[3][binNum];
+    const int32 jobBinNum = getBinNum(job);
+    for (int32 a = 0; a < 3; ++a)
+      for (int32 b = 0; b < jobBinNum; ++b) {
+        bins[a][b] = Box(empty);
+        counts[a][b] = 0;
+      }
+
+    // Same as the binned compiler but the boxes are recomputed
+    const BinMapping mapping(job);
+    for (int32 j = job.first; j <= job.last; ++j) {
+      const Box aabb = this->getBox(IDs[j]);
+      const ssei bin = mapping.get(center2(aabb));
+      bins[0][bin[0]].grow(aabb); counts[0][bin[0]]++;
+      bins[1][bin[1]].grow(aabb); counts[1][bin[1]]++;
+      bins[2][bin[2]].grow(aabb); counts[2][bin[2]]++;
+    }
+
+    axis = split = -1;
+    cost = FLT_MAX;
+    for (int32 a = 0; a < 3; ++a) {
+      float rightArea[binNum];
+      int32 rightNum[binNum];
+      Box aabb(empty);
+      int32 n = 0;
+      for (int32 b = jobBinNum - 1; b > 0; --b) {
+        aabb.grow(bins[a][b]);
+        n += counts[a][b];
+        rightArea[b] = halfArea(aabb);
+        rightNum[b] = n;
+      }
+      aabb = Box(empty);
+      n = 0;
+      for (int32 b = 1; b < jobBinNum; ++b) {
+        aabb.grow(bins[a][b - 1]);
+        n += counts[a][b - 1];
+        if (n == 0 || rightNum[b] == 0) continue;
+        const float c = halfArea(aabb) * float(n) + rightArea[b] * float(rightNum[b]);
+        if (c >= cost) continue;
+        cost = c;
+        axis = a;
+        split = b;
+      }
+    }
+  }
+
+  template <typename T>
+  int32 BVH2LeanBuilder<T>::partition(const BinnedJob &job,
+                                      int32 &axis,
+                                      int32 split,
+                                      BinnedJob children[2])
+  {
+    for (int32 i = 0; i < 2; ++i)
+      children[i].aabb = children[i].centroids = Box(empty);
+
+    // Children boxes are grown while partitioning: each box is computed once
+    int32 middle;
+    if (axis != -1) {
+      const BinMapping mapping(job);
+      int32 left = job.first, right = job.last;
+      while (left <= right) {
+        const Box aabb = this->getBox(IDs[left]);
+        const ssef centroid = center2(aabb);
+        const int32 side = mapping.get(centroid)[axis] < split ? ON_LEFT : ON_RIGHT;
+        children[side].aabb.grow(aabb);
+        children[side].centroids.grow(centroid);
+        if (side == ON_LEFT)
+          left++;
+        else
+          std::swap(IDs[left], IDs[right--]);
+      }
+      middle = left;
+    } else {
+      axis = 0;
+      middle = (job.first + job.last + 1) / 2;
+      for (int32 j = job.first; j <= job.last; ++j) {
+        const Box aabb = this->getBox(IDs[j]);
+        const int32 side = j < middle ? ON_LEFT : ON_RIGHT;
+        children[side].aabb.grow(aabb);
+        children[side].centroids.grow(center2(aabb));
+      }
+    }
+    children[ON_LEFT].first = job.first;
+    children[ON_LEFT].last = middle - 1;
+    children[ON_RIGHT].first = middle;
+    children[ON_RIGHT].last = job.last;
+    return middle;
+  }
+
+  template <typename T>
+  uint32 BVH2LeanBuilder<T>::allocatePair(void) {
+    const uint32 childID = currID + 1;
+    currID += 2;
+    while (currID >= blocks.size() * leanBlockNodeNum) {
+      const size_t size = sizeof(BVH2Node) * leanBlockNodeNum;
+      blocks.push_back((BVH2Node*) PF_ALIGNED_MALLOC(size, CACHE_LINE));
+      memory.allocated(size);
+    }
+    return childID;
+  }
+
+  template <typename T>
+  BVH2Node *BVH2LeanBuilder<T>::emitNodes(void) {
+    const uint32 nodeNum = currID + 1;
+    BVH2Node *node = (BVH2Node*) PF_ALIGNED_MALLOC(sizeof(BVH2Node) * nodeNum, CACHE_LINE);
+    memory.allocated(sizeof(BVH2Node) * nodeNum);
+    for (size_t b = 0; b < blocks.size(); ++b) {
+      const uint32 first = uint32(b) * leanBlockNodeNum;
+      const uint32 n = min(uint32(leanBlockNodeNum), nodeNum - first);
+      std::memcpy(node + first, blocks[b], sizeof(BVH2Node) * n);
+      PF_ALIGNED_FREE(blocks[b]);
+      memory.released(sizeof(BVH2Node) * leanBlockNodeNum);
+    }
+    blocks.clear();
+    return node;
+  }
+
+  template <typename T>
+  void BVH2LeanBuilder<T>::compile(void)
+  {
+    double t = getSeconds();
+    enum { MAX_DEPTH = 64 };
+    BinnedJob stack[MAX_DEPTH];
+    int32 stackSize = 0;
+    BinnedJob job = rootJob;
+    for (;;) {
+      const uint32 primNum = job.last - job.first + 1;
+      int32 axis = -1, split = -1;
+      float cost = FLT_MAX;
+      bool leaf = primNum <= options.minPrimNum;
+
+      // Same stop criterium as the binned compiler
+      if (!leaf) {
+        this->findSplit(job, axis, split, cost);
+        if (primNum <= options.maxPrimNum) {
+          const float harea = halfArea(job.aabb);
+          const float leafCost = options.SAHIntersectionCost * harea * primNum;
+          const float splitCost = options.SAHIntersectionCost * cost
+                                + options.SAHTraversalCost * harea;
+          leaf = axis == -1 || leafCost <= splitCost;
+        }
+      }
+      if (leaf) {
+        doMakeLeaf(this->getNode(job.id), job);
+        if (stackSize == 0) break;
+        job = stack[--stackSize];
+        continue;
+      }
+
+      BinnedJob children[2];
+      const int32 middle = this->partition(job, axis, split, children);
+      const uint32 childID = this->allocatePair();
+      BVH2Node &node = this->getNode(job.id);
+      node.setAxis(axis);
+      doSetNodeBBox(node, job.aabb);
+      node.setOffset(childID);
+      node.setAsNonLeaf();
+      children[ON_LEFT].id = childID;
+      children[ON_RIGHT].id = childID + 1;
+
+      // Continue with the smallest child. This bounds the stack depth
+      const int32 leftNum = middle - job.first;
+      const int32 rightNum = job.last - middle + 1;
+      const int32 smallest = leftNum < rightNum ? ON_LEFT : ON_RIGHT;
+      PF_ASSERT(stackSize < MAX_DEPTH);
+      stack[stackSize++] = children[smallest ^ 1];
+      job = children[smallest];
+    }
+    PF_MSG_V("BVH2: Compilation time, " << getSeconds() - t);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Chunked loops (Morton compiler and refit)
+  ///////////////////////////////////////////////////////////////////////////
+
+  /*! Counters of one run of a chunked loop. Each run allocates its own:
+   *  helpers of a previous run may still be there and must not take the
+   *  chunks of the current one
+   */
+  struct BVH2ChunkedRun : public RefCount
+  {
+    BVH2ChunkedRun(uint32 chunkNum) :
+      chunkNum(chunkNum), nextChunk(0), doneChunk(0) {}
+    const uint32 chunkNum; //!< Number of chunks of the run
+    Atomic nextChunk;      //!< Next chunk to process
+    Atomic doneChunk;      //!< Number of chunks done
+  };
+
+  /*! Loop over chunks run by the calling thread and by helper tasks. The
+   *  calling thread never waits for the scheduler: it processes the chunks
+   *  too and the loop completes even if no other thread is available
+   */
+  struct BVH2ChunkedLoop : public RefCount
+  {
+    /*! Process all the chunks from this thread and from helper tasks */
+    void run(uint32 chunkNum);
+    /*! Process chunks of the run until there is no more */
+    void processChunks(BVH2ChunkedRun &chunks);
+    /*! Process one chunk */
+    virtual void processChunk(uint32 chunkID) = 0;
+  };
+
+  /*! Task helping the calling thread to process the chunks */
+  class TaskBVH2Chunks : public Task
+  {
+  public:
+    INLINE TaskBVH2Chunks(BVH2ChunkedLoop &loop, BVH2ChunkedRun &chunks) :
+      Task("TaskBVH2Chunks"), loop(&loop), chunks(&chunks) {}
+    virtual Task *run(void) {
+      loop->processChunks(*chunks);
+      return NULL;
+    }
+    Ref<BVH2ChunkedLoop> loop;  //!< May outlive the loop itself
+    Ref<BVH2ChunkedRun> chunks; //!< Run the task was spawned for
+  };
+
+  void BVH2ChunkedLoop::run(uint32 chunkNum)
+  {
+    if (chunkNum == 0) return;
+    Ref<BVH2ChunkedRun> chunks = PF_NEW(BVH2ChunkedRun, chunkNum);
+    const uint32 taskNum = min(TaskingSystemGetThreadNum(), chunkNum) - 1;
+    for (uint32 i = 0; i < taskNum; ++i) {
+      Task *task = PF_NEW(TaskBVH2Chunks, *this, *chunks);
+      task->scheduled();
+    }
+    this->processChunks(*chunks);
+    while (uint32(chunks->doneChunk) < chunkNum)
+      if (!TaskingSystemRunWhileWaiting()) yield();
+  }
+
+  void BVH2ChunkedLoop::processChunks(BVH2ChunkedRun &chunks) {
+    for (;;) {
+      const uint32 chunkID = uint32(chunks.nextChunk++);
+      if (chunkID >= chunks.chunkNum) break;
+      this->processChunk(chunkID);
+      chunks.doneChunk++;
+    }
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Linear (Morton code) compiler
+  ///////////////////////////////////////////////////////////////////////////
+
+  /*! 10 bits per axis */
+  enum { mortonBits = 10, mortonCodeBits = 3 * mortonBits };
+
+  /*! Clusters are the primitives sharing the same 15 first bits */
+  enum { mortonClusterBits = 15 };
+
+  /*! Radix sort with 3 passes of 10 bits */
+  enum { radixBits = 10, radixNum = 1 << radixBits };
+
+  /*! Number of primitives per chunk when running stages in parallel */
+  enum { mortonChunkPrimNum = 8192, mortonMaxChunkNum = 64 };
+
+  /*! Spread the 10 first bits of v: bit i goes to bit 3*i */
+  INLINE uint32 expandMortonBits(uint32 v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+  }
+
+  /*! x is on bits 2, 5, 8... y on bits 1, 4, 7... and z on bits 0, 3, 6... */
+  INLINE uint32 getMortonAxis(int32 bit) { return 2 - bit % 3; }
+
+  /*! Ranges of primitives with the same code prefix (leaves of the top tree) */
+  struct MortonCluster
+  {
+    INLINE BBox3f getAABB(void) const {
+      return BBox3f(vec3f(aabb.lower[0], aabb.lower[1], aabb.lower[2]),
+                    vec3f(aabb.upper[0], aabb.upper[1], aabb.upper[2]));
+    }
+    Box aabb;          //!< Bounding box of the primitives
+    int32 first, last; //!< Range in the sorted ID array
+    PF_STRUCT(MortonCluster);
+  };
+
+  /*! LBVH / HLBVH compiler. Primitives are sorted by the Morton codes of their
+   *  centroids (parallel radix sort) and grouped in clusters sharing the same
+   *  code prefix. The top tree over the clusters is either emitted from the
+   *  code prefixes (LBVH) or compiled with the binned SAH (HLBVH). The
+   *  sub-trees of the clusters are then emitted in parallel from the code
+   *  bits. Bounding boxes are finally computed bottom-up
+   */
+  struct BVH2MortonBuilder : public BVH2ChunkedLoop
+  {
+    BVH2MortonBuilder(void);
+    /*! Compute the primitive bounding boxes and centroids */
+    template <typename T>
+    void injection(const T * const RESTRICT soup, uint32 primNum);
+    /*! Build the hierarchy. Use SAH for the top tree if requested */
+    void compile(bool topSAH);
+    /*! Steps run chunk by chunk by all threads */
+    enum Stage { CODE, HISTOGRAM, SCATTER, EMIT };
+    /*! Run the stage from this thread and from helper tasks */
+    void runStage(Stage stage, uint32 chunkNum);
+    /*! Process one chunk of the current stage */
+    virtual void processChunk(uint32 chunkID);
+    /*! Emit a complete sub-tree from the code bits */
+    void emitSubTree(const uint32 *codes, int32 first, int32 last, uint32 id, uint32 leafPrimNum);
+    /*! Compute all bounding boxes from the leaves to the root */
+    void computeBoxes(void);
+
+    Box *aabbs;                 //!< All the bounding boxes
+    ssef *centroids;            //!< All the centroids (times two)
+    Box centroidBox;            //!< Bounding box of the centroids
+    uint32 *codes, *codesTmp;   //!< Morton codes (sorted at the end)
+    uint32 *IDs, *IDsTmp;       //!< Primitive IDs (sorted at the end)
+    uint32 *histograms;         //!< One histogram per chunk
+    MortonCluster *clusters;    //!< Primitives with the same code prefix
+    uint32 *clusterNodes;       //!< Top tree leaf for each cluster
+    BVH2Node *root;             //!< Root of the tree
+    uint32 primNum;             //!< Number of primitives to sort
+    uint32 clusterNum;          //!< Number of clusters
+    uint32 radixPass;           //!< Current radix sort pass
+    Stage stage;                //!< Currently processed stage
+    uint32 primChunkNum;        //!< Number of chunks over the primitives
+    uint32 chunkPrimNum;        //!< Number of primitives per chunk
+    Atomic currID;              //!< Last node allocated
+    BVH2BuildOption options;    //!< SAH options and stop criterium
+    PF_STRUCT(BVH2MortonBuilder);
+  };
+
+  BVH2MortonBuilder::BVH2MortonBuilder(void) :
+    aabbs(NULL), centroids(NULL), codes(NULL), codesTmp(NULL),
+    IDs(NULL), IDsTmp(NULL), histograms(NULL), clusters(NULL),
+    clusterNodes(NULL), root(NULL), primNum(0), clusterNum(0),
+    radixPass(0), stage(CODE), primChunkNum(0), chunkPrimNum(0), currID(0) {}
+
+  template <typename T>
+  void BVH2MortonBuilder::injection(const T * const RESTRICT soup, uint32 primNum)
+  {
+    TaskScratch &scratch = TaskingSystemGetScratch();
+    double t = getSeconds();
+    this->primNum = primNum;
+    root = scratch.allocateArray<BVH2Node>(2 * primNum + 1);
+    aabbs = scratch.allocateArray<Box>(primNum);
+    centroids = scratch.allocateArray<ssef>(primNum);
+    codes = scratch.allocateArray<uint32>(primNum);
+    codesTmp = scratch.allocateArray<uint32>(primNum);
+    IDs = scratch.allocateArray<uint32>(primNum);
+    IDsTmp = scratch.allocateArray<uint32>(primNum);
+    clusters = scratch.allocateArray<MortonCluster>(primNum);
+    clusterNodes = scratch.allocateArray<uint32>(primNum);
+    centroidBox = Box(empty);
+    for (uint32 j = 0; j < primNum; ++j) {
+      aabbs[j] = convertBox(soup[j].getAABB());
+      centroids[j] = center2(aabbs[j]);
+      centroidBox.grow(centroids[j]);
+    }
+    primChunkNum = min((primNum + mortonChunkPrimNum - 1) / mortonChunkPrimNum,
+                       uint32(mortonMaxChunkNum));
+    chunkPrimNum = (primNum + primChunkNum - 1) / primChunkNum;
+    histograms = scratch.allocateArray<uint32>(primChunkNum * radixNum);
+    PF_MSG_V("BVH2: Injection time, " << getSeconds() - t);
+  }
+
+  void BVH2MortonBuilder::runStage(Stage stage, uint32 chunkNum) {
+    this->stage = stage;
+    this->run(chunkNum);
+  }
+
+  void BVH2MortonBuilder::processChunk(uint32 chunkID)
+  {
+    // Emission of one cluster sub-tree
+    if (stage == EMIT) {
+      const MortonCluster &cluster = clusters[chunkID];
+      const uint32 leafPrimNum = max(options.minPrimNum, 1u);
+      this->emitSubTree(codes, cluster.first, cluster.last,
+                        clusterNodes[chunkID], leafPrimNum);
+      return;
+    }
+
+    // Other stages go over a range of primitives
+    const uint32 first = chunkID * chunkPrimNum;
+    const uint32 last = min(first + chunkPrimNum, primNum);
+    if (stage == CODE) {
+      const ssef extent = size(centroidBox);
+      const ssef maxCode = ssef(float((1 << mortonBits) - 1));
+      const ssef scale = select(extent > ssef(1e-19f),
+                                ssef(float(1 << mortonBits) * 0.99f) / extent,
+                                ssef(zero));
+      for (uint32 j = first; j < last; ++j) {
+        const ssef q = (centroids[j] - centroidBox.lower) * scale;
+        const ssei cell = truncate(min(max(q, ssef(zero)), maxCode));
+        codes[j] = (expandMortonBits(cell[0]) << 2)
+                 | (expandMortonBits(cell[1]) << 1)
+                 |  expandMortonBits(cell[2]);
+        IDs[j] = j;
+      }
+    } else {
+      const uint32 shift = radixPass * radixBits;
+      uint32 *histogram = histograms + chunkID * radixNum;
+      if (stage == HISTOGRAM) {
+        for (uint32 d = 0; d < radixNum; ++d) histogram[d] = 0;
+        for (uint32 j = first; j < last; ++j)
+          histogram[(codes[j] >> shift) & (radixNum - 1)]++;
+      } else {
+        // histogram contains the output offsets of the chunk now
+        for (uint32 j = first; j < last; ++j) {
+          const uint32 to = histogram[(codes[j] >> shift) & (radixNum - 1)]++;
+          codesTmp[to] = codes[j];
+          IDsTmp[to] = IDs[j];
+        }
+      }
+    }
+  }
+
+  void BVH2MortonBuilder::emitSubTree(const uint32 *codes,
+                                      int32 first,
+                                      int32 last,
+                                      uint32 id,
+                                      uint32 leafPrimNum)
+  {
+    enum { MAX_DEPTH = 64 };
+    struct Job { int32 first, last; uint32 id; };
+    Job stack[MAX_DEPTH];
+    int32 stackSize = 0;
+    Job job = {first, last, id};
+    for (;;) {
+      const uint32 primNum = job.last - job.first + 1;
+      const uint32 diff = codes[job.first] ^ codes[job.last];
+
+      // Leaves get their bounding boxes later
+      if (primNum <= leafPrimNum || (diff == 0 && primNum <= options.maxPrimNum)) {
+        BVH2Node &node = root[job.id];
+        node.setPrimNum(primNum);
+        node.setPrimID(job.first);
+        node.setAsLeaf();
+        if (stackSize == 0) break;
+        job = stack[--stackSize];
+        continue;
+      }
+
+      // Split where the highest different bit changes. Codes are identical
+      // when we get here with too many primitives: we cut in two halves
+      int32 middle, axis;
+      if (diff != 0) {
+        const int32 bit = __bsr(int(diff));
+        const uint32 mask = 1u << bit;
+        int32 left = job.first, right = job.last;
+        while (left < right) {
+          const int32 m = (left + right) / 2;
+          if (codes[m] & mask)
+            right = m;
+          else
+            left = m + 1;
+        }
+        middle = left;
+        axis = getMortonAxis(bit);
+      } else {
+        middle = (job.first + job.last + 1) / 2;
+        axis = 0;
+      }
+
+      // Children are allocated by pair
+      const uint32 childID = uint32(currID += 2) - 1;
+      BVH2Node &node = root[job.id];
+      node.setAxis(axis);
+      node.setOffset(childID);
+      node.setAsNonLeaf();
+      const Job left = {job.first, middle - 1, childID};
+      const Job right = {middle, job.last, childID + 1};
+
+      // Continue with the smallest child
+      PF_ASSERT(stackSize < MAX_DEPTH);
+      if (middle - job.first < job.last - middle + 1) {
+        stack[stackSize++] = right;
+        job = left;
+      } else {
+        stack[stackSize++] = left;
+        job = right;
+      }
+    }
+  }
+
+  void BVH2MortonBuilder::computeBoxes(void)
+  {
+    // Children are always stored after their parents
+    const uint32 nodeNum = uint32(currID) + 1;
+    for (int32 nodeID = int32(nodeNum) - 1; nodeID >= 0; --nodeID) {
+      BVH2Node &node = root[nodeID];
+      Box aabb(empty);
+      if (node.isLeaf()) {
+        const uint32 first = node.getPrimID();
+        const uint32 last = first + node.getPrimNum();
+        for (uint32 j = first; j < last; ++j) aabb.grow(aabbs[IDs[j]]);
+      } else {
+        const BVH2Node &left = root[node.getOffset()];
+        const BVH2Node &right = root[node.getOffset() + 1];
+        for (size_t j = 0; j < 3; ++j) {
+          aabb.lower[j] = min(left.pmin[j], right.pmin[j]);
+          aabb.upper[j] = max(left.pmax[j], right.pmax[j]);
+        }
+      }
+      doSetNodeBBox(node, aabb);
+    }
+  }
+
+  void BVH2MortonBuilder::compile(bool topSAH)
+  {
+    double t = getSeconds();
+    this->runStage(CODE, primChunkNum);
+    PF_MSG_V("BVH2: Morton code time, " << getSeconds() - t);
+
+    // Radix sort: each chunk scatters its primitives after the ones of the
+    // previous digits and of the previous chunks for the same digit
+    t = getSeconds();
+    for (radixPass = 0; radixPass < mortonCodeBits / radixBits; ++radixPass) {
+      this->runStage(HISTOGRAM, primChunkNum);
+      uint32 offset = 0;
+      for (uint32 d = 0; d < radixNum; ++d)
+        for (uint32 chunkID = 0; chunkID < primChunkNum; ++chunkID) {
+          uint32 &count = histograms[chunkID * radixNum + d];
+          const uint32 n = count;
+          count = offset;
+          offset += n;
+        }
+      this->runStage(SCATTER, primChunkNum);
+      std::swap(codes, codesTmp);
+      std::swap(IDs, IDsTmp);
+    }
+    PF_MSG_V("BVH2: Radix sort time, " << getSeconds() - t);
+
+    // Group the primitives by code prefix
+    t = getSeconds();
+    const uint32 clusterShift = mortonCodeBits - mortonClusterBits;
+    uint32 *clusterCodes = codesTmp;
+    clusterNum = 0;
+    for (uint32 j = 0; j < primNum; ++j) {
+      const uint32 prefix = codes[j] >> clusterShift;
+      if (clusterNum == 0 || clusterCodes[clusterNum - 1] != prefix) {
+        MortonCluster &cluster = clusters[clusterNum];
+        cluster.first = j;
+        cluster.aabb = Box(empty);
+        clusterCodes[clusterNum++] = prefix;
+      }
+      MortonCluster &cluster = clusters[clusterNum - 1];
+      cluster.last = j;
+      cluster.aabb.grow(aabbs[IDs[j]]);
+    }
+    PF_MSG_V("BVH2: " << clusterNum << " clusters");
+
+    // Top tree with one cluster per leaf
+    if (topSAH && clusterNum > 1) {
+      Ref<BVH2BinnedBuilder> top = PF_NEW(BVH2BinnedBuilder);
+      top->options = BVH2BuildOption(1, 1, options.SAHIntersectionCost,
+                                     options.SAHTraversalCost);
+      top->injection<MortonCluster>(clusters, clusterNum);
+      top->compile();
+      const uint32 topNodeNum = uint32(top->currID) + 1;
+      std::memcpy(root, top->root, sizeof(BVH2Node) * topNodeNum);
+      for (uint32 nodeID = 0; nodeID < topNodeNum; ++nodeID)
+        if (root[nodeID].isLeaf())
+          root[nodeID].setPrimID(top->IDs[root[nodeID].getPrimID()]);
+      currID = topNodeNum - 1;
+    } else
+      this->emitSubTree(clusterCodes, 0, clusterNum - 1, 0, 1);
+    const uint32 topNodeNum = uint32(currID) + 1;
+    for (uint32 nodeID = 0; nodeID < topNodeNum; ++nodeID)
+      if (root[nodeID].isLeaf())
+        clusterNodes[root[nodeID].getPrimID()] = nodeID;
+    PF_MSG_V("BVH2: Top tree time, " << getSeconds() - t);
+
+    // Emit the cluster sub-trees and finally compute the boxes
+    t = getSeconds();
+    this->runStage(EMIT, clusterNum);
+    this->computeBoxes();
+    PF_MSG_V("BVH2: Emission time, " << getSeconds() - t);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Node layout
+  ///////////////////////////////////////////////////////////////////////////
+
+  /*! Sibling pairs grouped in one treelet (one page of nodes) */
+  enum { layoutPairPerTreelet = 4096 / (2 * sizeof(BVH2Node)) };
+
+  /*! Pair of siblings to place. The probability to visit them is the one to
+   *  hit their parent i.e. the surface of its box
+   */
+  struct BVH2LayoutPair {
+    INLINE BVH2LayoutPair(void) {}
+    INLINE BVH2LayoutPair(const BVH2Node &parent) :
+      area(halfArea(BBox3f(parent.getMin(), parent.getMax()))),
+      offset(parent.getOffset()) {}
+    INLINE bool operator< (const BVH2LayoutPair &other) const {
+      return this->area < other.area;
+    }
+    float area;    //!< Surface of the parent
+    uint32 offset; //!< Index of the first sibling in the input tree
+  };
+
+  /*! The builders emit the nodes in their own order (depth first for most of
+   *  them) and siblings straddle two cache lines half of the time. Here, each
+   *  pair of siblings gets its own cache line (node 1 is therefore unused)
+   *  and the pairs are clustered in treelets of one page. Treelets grow from
+   *  their root by always adding the most probable pair (SAH areas). Their
+   *  remaining children are the roots of the next treelets placed depth
+   *  first. Node 1 becomes an inner node with an empty surface and node
+   *  scans simply ignore it
+   */
+  static void relayoutBVH2(BVH2Node *&node, uint32 &nodeNum)
+  {
+    const BVH2Node *from = node;
+    if (from[0].isLeaf()) return;
+    const double start = getSeconds();
+    vector<uint32> remap(nodeNum);
+    vector<BVH2LayoutPair> roots, heap;
+    uint32 currID = 2;
+    remap[0] = 0;
+    roots.push_back(BVH2LayoutPair(from[0]));
+    while (roots.size() > 0) {
+      heap.push_back(roots.back());
+      roots.pop_back();
+      for (uint32 pairNum = 0; pairNum < layoutPairPerTreelet && heap.size() > 0; ++pairNum) {
+        std::pop_heap(heap.begin(), heap.end());
+        const uint32 offset = heap.back().offset;
+        heap.pop_back();
+        for (uint32 j = 0; j < 2; ++j) {
+          remap[offset + j] = currID++;
+          if (from[offset + j].isLeaf()) continue;
+          heap.push_back(BVH2LayoutPair(from[offset + j]));
+          std::push_heap(heap.begin(), heap.end());
+        }
+      }
+      // Most probable sub-trees are laid out first
+      std::sort(heap.begin(), heap.end());
+      roots.insert(roots.end(), heap.begin(), heap.end());
+      heap.clear();
+    }
+    PF_ASSERT(currID == nodeNum + 1);
+
+    BVH2Node *to = (BVH2Node*) PF_ALIGNED_MALLOC(sizeof(BVH2Node) * currID, CACHE_LINE);
+    for (uint32 nodeID = 0; nodeID < nodeNum; ++nodeID) {
+      BVH2Node &dst = to[remap[nodeID]];
+      dst = from[nodeID];
+      if (!dst.isLeaf()) dst.setOffset(remap[dst.getOffset()]);
+    }
+    to[1] = to[0];
+    to[1].setMax(to[1].getMin());
+    PF_ALIGNED_FREE(node);
+    node = to;
+    nodeNum = currID;
+    PF_MSG_V("BVH2: Time to lay out the nodes " << getSeconds() - start << " sec");
+  }
+
   const BVH2BuildOption defaultBVH2Options(2, 16, 1.f, 1.f);
 
   template <typename T>
@@ -347,46 +1780,226 @@ namespace pf
     PF_ASSERT(t != NULL && primNum != 0);
     PF_MSG_V("BVH2: compiling BVH2");
     PF_MSG_V("BVH2: " << primNum << " primitives");
-    BVH2Builder c;
+    TaskScratchScope scope(TaskingSystemGetScratch());
     const double start = getSeconds();
-    c.options = option;
 
-    if (UNLIKELY(c.options.maxPrimNum < c.options.minPrimNum))
+    if (UNLIKELY(option.maxPrimNum < option.minPrimNum))
       FATAL("Bad BVH2 compilation parameters");
 
-    c.injection<T>(t, primNum);
-    c.compile();
+    // All compilers output the nodes and the primitive IDs per leaf
+    const BVH2Node *root = NULL;
+    const uint32 *primID = NULL;
+    BVH2Builder c;
+    Ref<BVH2BinnedBuilder> binned;
+    Ref<BVH2MortonBuilder> morton;
+    Ref<BVH2SpatialBuilder<T> > spatial;
+    Ref<BVH2LeanBuilder<T> > lean;
+    BVH2MemoryCounter memory;
+    uint32 primIDNum = primNum;
+    if (option.algorithm == PF_BVH2_LEAN_SAH) {
+      // Nodes and IDs are directly given to the tree: nothing to copy
+      lean = PF_NEW(BVH2LeanBuilder<T>, t, primNum, memory);
+      lean->options = option;
+      lean->compile();
+      tree.nodeNum = lean->currID + 1;
+      tree.node = lean->emitNodes();
+      tree.primID = lean->IDs;
+      lean->IDs = NULL;
+    } else if (option.algorithm == PF_BVH2_MORTON ||
+        option.algorithm == PF_BVH2_MORTON_SAH) {
+      morton = PF_NEW(BVH2MortonBuilder);
+      morton->options = option;
+      morton->injection<T>(t, primNum);
+      morton->compile(option.algorithm == PF_BVH2_MORTON_SAH);
+      tree.nodeNum = uint32(morton->currID) + 1;
+      root = morton->root;
+      primID = morton->IDs;
+    } else if (option.algorithm == PF_BVH2_SPATIAL_SAH) {
+      spatial = PF_NEW(BVH2SpatialBuilder<T>);
+      spatial->options = option;
+      spatial->injection(t, primNum);
+      spatial->compile();
+      tree.nodeNum = uint32(spatial->currID) + 1;
+      root = spatial->root;
+      primID = &spatial->leafIDs[0];
+      primIDNum = uint32(spatial->leafIDs.size());
+    } else if (option.algorithm == PF_BVH2_BINNED_SAH) {
+      binned = PF_NEW(BVH2BinnedBuilder);
+      binned->options = option;
+      binned->injection<T>(t, primNum);
+      binned->compile();
+      tree.nodeNum = uint32(binned->currID) + 1;
+      root = binned->root;
+      primID = binned->IDs;
+    } else {
+      c.options = option;
+      c.injection<T>(t, primNum);
+      c.compile();
+      tree.nodeNum = c.currID + 1;
+      root = c.root;
+      primID = &c.primID[0];
+    }
 
-    PF_MSG_V("BVH2: Compacting node array");
-    tree.nodeNum = c.currID + 1;
-    const size_t nodeSize = sizeof(BVH2Node) * tree.nodeNum;
-    tree.node = (BVH2Node*) PF_ALIGNED_MALLOC(nodeSize, CACHE_LINE);
-    std::memcpy(tree.node, &c.root[0], nodeSize);
+    if (root != NULL) {
+      PF_MSG_V("BVH2: Compacting node array");
+      const size_t nodeSize = sizeof(BVH2Node) * tree.nodeNum;
+      tree.node = (BVH2Node*) PF_ALIGNED_MALLOC(nodeSize, CACHE_LINE);
+      std::memcpy(tree.node, root, nodeSize);
+    }
     PF_MSG_V("BVH2: " << tree.nodeNum << " nodes");
     uint32 leafNum = 0;
     for (size_t nodeID = 0; nodeID < tree.nodeNum; ++nodeID)
       if (tree.node[nodeID].isLeaf()) leafNum++;
     PF_MSG_V("BVH2: " << leafNum << " leaf nodes");
     PF_MSG_V("BVH2: " << tree.nodeNum - leafNum << " non-leaf nodes");
-    PF_MSG_V("BVH2: " << double(primNum) / double(leafNum) << " primitives per leaf");
+    PF_MSG_V("BVH2: " << double(primIDNum) / double(leafNum) << " primitives per leaf");
 
     PF_MSG_V("BVH2: Copying primitive soup");
     tree.primNum = primNum;
     tree.prim = PF_NEW_ARRAY(T, primNum);
     PF_ASSERT(tree.prim);
     std::memcpy(tree.prim, t, sizeof(T) * primNum);
+    memory.allocated(sizeof(T) * primNum);
 
-    PF_MSG_V("BVH2: Copying primitive IDs");
-    tree.primID = PF_NEW_ARRAY(uint32, tree.primNum);
-    PF_ASSERT(tree.primID != NULL);
-    std::memcpy(tree.primID, &c.primID[0], tree.primNum * sizeof(uint32));
+    tree.primIDNum = primIDNum;
+    if (primID != NULL) {
+      PF_MSG_V("BVH2: Copying primitive IDs");
+      tree.primID = PF_NEW_ARRAY(uint32, tree.primIDNum);
+      PF_ASSERT(tree.primID != NULL);
+      std::memcpy(tree.primID, primID, tree.primIDNum * sizeof(uint32));
+    }
+    if (option.relayout) {
+      // The relayout holds both node arrays and the remapping table
+      const size_t relayoutSize = (sizeof(BVH2Node) + sizeof(uint32)) * tree.nodeNum;
+      memory.allocated(relayoutSize);
+      memory.released(relayoutSize);
+      relayoutBVH2(tree.node, tree.nodeNum);
+    }
+    if (option.algorithm == PF_BVH2_LEAN_SAH)
+      PF_MSG_V("BVH2: Peak memory " << double(memory.peak) / double(1 << 20) << " MB");
     PF_MSG_V("BVH2: Time to build " << getSeconds() - start << " sec");
   }
 
+  ///////////////////////////////////////////////////////////////////////////
+  /// Refit and tree quality
+  ///////////////////////////////////////////////////////////////////////////
+
+  /*! Sub-trees are refitted in parallel. Nodes above them are done last */
+  enum { refitSubTreePerThread = 8 };
+
+  /*! Bottom-up update of the bounding boxes with the same topology */
+  template <typename T>
+  struct BVH2Refitter : public BVH2ChunkedLoop
+  {
+    INLINE BVH2Refitter(BVH2<T> &bvh) : bvh(bvh) {}
+    /*! Refit one sub-tree */
+    virtual void processChunk(uint32 chunkID) { this->refitSubTree(roots[chunkID]); }
+    /*! Recompute the box of the node from its children or primitives */
+    void refitNode(uint32 nodeID);
+    /*! Recursively refit the complete sub-tree */
+    void refitSubTree(uint32 nodeID);
+    BVH2<T> &bvh;          //!< Tree to update
+    vector<uint32> top;    //!< Nodes above the sub-trees (parents first)
+    vector<uint32> roots;  //!< Roots of the sub-trees refitted in parallel
+  };
+
+  template <typename T>
+  void BVH2Refitter<T>::refitNode(uint32 nodeID)
+  {
+    BVH2Node &node = bvh.node[nodeID];
+    BBox3f aabb(empty);
+    if (node.isLeaf()) {
+      const uint32 first = node.getPrimID();
+      const uint32 last = first + node.getPrimNum();
+      for (uint32 j = first; j < last; ++j)
+        aabb.grow(bvh.prim[bvh.primID[j]].getAABB());
+    } else {
+      const BVH2Node &left = bvh.node[node.getOffset()];
+      const BVH2Node &right = bvh.node[node.getOffset() + 1];
+      aabb.lower = min(left.getMin(), right.getMin());
+      aabb.upper = max(left.getMax(), right.getMax());
+    }
+    node.setMin(aabb.lower);
+    node.setMax(aabb.upper);
+  }
+
+  template <typename T>
+  void BVH2Refitter<T>::refitSubTree(uint32 nodeID)
+  {
+    const BVH2Node &node = bvh.node[nodeID];
+    if (!node.isLeaf()) {
+      this->refitSubTree(node.getOffset());
+      this->refitSubTree(node.getOffset() + 1);
+    }
+    this->refitNode(nodeID);
+  }
+
+  template <typename T>
+  void refitBVH2(BVH2<T> &bvh, const T *prims)
+  {
+    PF_ASSERT(bvh.node != NULL && prims != NULL);
+    const double start = getSeconds();
+    if (prims != bvh.prim)
+      std::memcpy(bvh.prim, prims, sizeof(T) * bvh.primNum);
+
+    // Open the tree until we have enough sub-trees for all the threads
+    Ref<BVH2Refitter<T> > refitter = PF_NEW(BVH2Refitter<T>, bvh);
+    const size_t rootNum = TaskingSystemGetThreadNum() * refitSubTreePerThread;
+    vector<uint32> &roots = refitter->roots;
+    roots.push_back(0);
+    while (roots.size() < rootNum) {
+      vector<uint32> next;
+      for (size_t i = 0; i < roots.size(); ++i) {
+        const BVH2Node &node = bvh.node[roots[i]];
+        if (node.isLeaf())
+          next.push_back(roots[i]);
+        else {
+          refitter->top.push_back(roots[i]);
+          next.push_back(node.getOffset());
+          next.push_back(node.getOffset() + 1);
+        }
+      }
+      if (next.size() == roots.size()) break;
+      roots.swap(next);
+    }
+
+    // Sub-trees in parallel and then the top of the tree
+    refitter->run(uint32(roots.size()));
+    for (int32 i = int32(refitter->top.size()) - 1; i >= 0; --i)
+      refitter->refitNode(refitter->top[i]);
+    PF_MSG_V("BVH2: Time to refit " << getSeconds() - start << " sec");
+  }
+
+  template <typename T>
+  float getBVH2Cost(const BVH2<T> &bvh, const BVH2BuildOption &option)
+  {
+    PF_ASSERT(bvh.node != NULL);
+    const BBox3f rootBox(bvh.node[0].getMin(), bvh.node[0].getMax());
+    const float rootArea = halfArea(rootBox);
+    if (rootArea <= 0.f) return 0.f;
+    float cost = 0.f;
+    for (uint32 nodeID = 0; nodeID < bvh.nodeNum; ++nodeID) {
+      const BVH2Node &node = bvh.node[nodeID];
+      const float area = halfArea(BBox3f(node.getMin(), node.getMax()));
+      if (node.isLeaf())
+        cost += option.SAHIntersectionCost * area * float(node.getPrimNum());
+      else
+        cost += option.SAHTraversalCost * area;
+    }
+    return cost / rootArea;
+  }
+
   // Instantiation for RTTriangle
+  template void refitBVH2<RTTriangle>(BVH2<RTTriangle>&, const RTTriangle*);
+  template float getBVH2Cost<RTTriangle>(const BVH2<RTTriangle>&, const BVH2BuildOption&);
   template void buildBVH2<RTTriangle>(const RTTriangle*, uint32, BVH2<RTTriangle>&, const BVH2BuildOption&);
   template BVH2<RTTriangle>::BVH2(void);
   template BVH2<RTTriangle>::~BVH2(void);
 
+  // Instantiation for RTInstance (top level of two-level BVHs)
+  template void buildBVH2<RTInstance>(const RTInstance*, uint32, BVH2<RTInstance>&, const BVH2BuildOption&);
+  template BVH2<RTInstance>::BVH2(void);
+  template BVH2<RTInstance>::~BVH2(void);
+
 } /* namespace pf */
 
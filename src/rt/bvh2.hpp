@@ -20,6 +20,7 @@
 #include "bvh2_node.hpp"
 #include "sys/ref.hpp"
 #include "sys/platform.hpp"
+#include "sys/mapped_file.hpp"
 
 namespace pf
 {
@@ -33,37 +34,63 @@ namespace pf
     virtual ~BVH2(void);
     BVH2Node *node; //!< All nodes. node[0] is the root
     T *prim;        //!< Primitives the BVH sorts
-    uint32 *primID; //!< Indices of primitives per leaf
-    uint32 nodeNum; //!< Number of nodes in the tree
-    uint32 primNum; //!< The number of primitives
+    uint32 *primID;    //!< Indices of primitives per leaf
+    uint32 nodeNum;    //!< Number of nodes in the tree
+    uint32 primNum;    //!< The number of primitives
+    uint32 primIDNum;  //!< Size of primID (> primNum with spatial splits)
+    Ref<MappedFile> mapping; //!< Non NULL if the arrays live in a cache file
     PF_STRUCT(BVH2);
   };
 
   template <typename T>
-  BVH2<T>::BVH2(void) : node(NULL), prim(NULL), primID(NULL), nodeNum(0), primNum(0) {}
+  BVH2<T>::BVH2(void) :
+    node(NULL), prim(NULL), primID(NULL), nodeNum(0), primNum(0), primIDNum(0) {}
 
   template <typename T>
   BVH2<T>::~BVH2(void) {
+    if (this->mapping) return; // Arrays are released with the mapping
     PF_ALIGNED_FREE(this->node);
     PF_SAFE_DELETE_ARRAY(this->primID);
     PF_SAFE_DELETE_ARRAY(this->prim);
   }
 
+  /*! Algorithm used to compile the BVH2 */
+  enum BVH2BuildAlgorithm
+  {
+    PF_BVH2_SWEEP_SAH   = 0, //!< Full SAH sweep (serial, best quality)
+    PF_BVH2_BINNED_SAH  = 1, //!< Binned SAH (large sub-trees built by tasks)
+    PF_BVH2_MORTON      = 2, //!< LBVH: hierarchy emitted from Morton codes
+    PF_BVH2_MORTON_SAH  = 3, //!< HLBVH: LBVH with a binned SAH top tree
+    PF_BVH2_SPATIAL_SAH = 4, //!< SBVH: binned SAH with spatial splits (serial)
+    PF_BVH2_LEAN_SAH    = 5  //!< Binned SAH in place with few temporaries (serial)
+  };
+
   /*! Options to compile the BVH2 */
   struct BVH2BuildOption {
     INLINE BVH2BuildOption(void) {}
     INLINE BVH2BuildOption(uint32 minPrimNum,
                            uint32 maxPrimNum,
                            float SAHIntersectionCost,
-                           float SAHTraversalCost) :
+                           float SAHTraversalCost,
+                           BVH2BuildAlgorithm algorithm = PF_BVH2_BINNED_SAH,
+                           float spatialSplitBudget = 0.3f,
+                           bool relayout = true) :
       minPrimNum(minPrimNum),
       maxPrimNum(maxPrimNum),
       SAHIntersectionCost(SAHIntersectionCost),
-      SAHTraversalCost(SAHTraversalCost) {}
-    uint32 minPrimNum;          //!< Minimum number of primitives per leaf
-    uint32 maxPrimNum;          //!< Maximum number of primitives per leaf
-    float SAHIntersectionCost;  //!< Estimated cost to traverse the leaf
-    float SAHTraversalCost;     //!< Estimated cost to intersect a primitive
+      SAHTraversalCost(SAHTraversalCost),
+      algorithm(algorithm),
+      spatialSplitBudget(spatialSplitBudget),
+      relayout(relayout) {}
+    uint32 minPrimNum;            //!< Minimum number of primitives per leaf
+    uint32 maxPrimNum;            //!< Maximum number of primitives per leaf
+    float SAHIntersectionCost;    //!< Estimated cost to traverse the leaf
+    float SAHTraversalCost;       //!< Estimated cost to intersect a primitive
+    BVH2BuildAlgorithm algorithm; //!< Sweep, binned SAH or Morton codes
+    float spatialSplitBudget;     //!< Spatial splits may add up to this fraction
+                                  //!< of primNum primitive references
+    bool relayout;                //!< Cluster the nodes in cache lines and
+                                  //!< pages once the tree is built
   };
 
   /*! Default options (mostly suitable for ray tracing) */
@@ -74,6 +101,19 @@ namespace pf
   void buildBVH2(const T *t, uint32 primNum, BVH2<T> &bvh,
                  const BVH2BuildOption &option = defaultBVH2Options);
 
+  /*! Update the bounding boxes after the primitives moved. The topology is
+   *  unchanged: prims must be the same primitives in the same order as the
+   *  ones given to buildBVH2. The tree must not be traversed meanwhile. Leaves
+   *  of spatial splits get the complete primitive boxes
+   */
+  template <typename T>
+  void refitBVH2(BVH2<T> &bvh, const T *prims);
+
+  /*! SAH cost of the tree relative to the surface of its root */
+  template <typename T>
+  float getBVH2Cost(const BVH2<T> &bvh,
+                    const BVH2BuildOption &option = defaultBVH2Options);
+
 } /* namespace pf */
 
 #endif /* __PF_BVH2_HPP__ */
@@ -0,0 +1,270 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "bvh2_cache.hpp"
+#include "rt_triangle.hpp"
+#include "sys/logging.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+#if defined(__UNIX__)
+#include <sys/stat.h>
+#include <sys/types.h>
+#else
+#include <direct.h>
+#endif /* __UNIX__ */
+
+namespace pf
+{
+  const char *defaultBVH2CachePath = "bvh_cache";
+
+  /*! Bump it each time the layout of the nodes or of the file changes */
+  static const uint32 BVH2_CACHE_VERSION = 2;
+  static const char BVH2_CACHE_MAGIC[8] = {'P','F','B','V','H','2','\0','\0'};
+  /*! Sections are aligned on cache lines in the file */
+  static const uint64 BVH2_CACHE_ALIGN = 64;
+
+  /*! Starts a BVH2 cache file. Sections follow at the given offsets */
+  struct BVH2CacheHeader
+  {
+    char magic[8];          //!< BVH2_CACHE_MAGIC
+    uint32 version;         //!< BVH2_CACHE_VERSION
+    uint32 nodeSize;        //!< sizeof(BVH2Node)
+    uint32 primSize;        //!< sizeof(T)
+    uint32 nodeNum;         //!< Number of nodes
+    uint32 primNum;         //!< Number of primitives
+    uint32 primIDNum;       //!< Number of primitive IDs
+    uint64 key;             //!< Hash of the input primitives and options
+    uint64 checksum;        //!< Hash of the nodes, primitive IDs and primitives
+    uint64 nodeOffset;      //!< Where the nodes start in the file
+    uint64 primIDOffset;    //!< Where the primitive IDs start in the file
+    uint64 primOffset;      //!< Where the primitives start in the file
+    uint64 fileSize;        //!< Total size of the file
+    BVH2BuildOption option; //!< Options used to compile the BVH
+  };
+
+  /*! 64 bits hash of a memory block (Murmur like, 8 bytes at a time) */
+  static uint64 hashMemory(const void *ptr, size_t size, uint64 h)
+  {
+    static const uint64 m = 0xc6a4a7935bd1e995ull;
+    const char *bytes = (const char *) ptr;
+    const size_t wordNum = size / sizeof(uint64);
+    h ^= size * m;
+    for (size_t i = 0; i < wordNum; ++i) {
+      uint64 k;
+      std::memcpy(&k, bytes + i * sizeof(uint64), sizeof(uint64));
+      k *= m;
+      k ^= k >> 47;
+      k *= m;
+      h ^= k;
+      h *= m;
+    }
+    for (size_t i = wordNum * sizeof(uint64); i < size; ++i) {
+      h ^= uint64(uint8(bytes[i]));
+      h *= m;
+    }
+    h ^= h >> 47;
+    h *= m;
+    h ^= h >> 47;
+    return h;
+  }
+
+  static bool sameOptions(const BVH2BuildOption &a, const BVH2BuildOption &b) {
+    return a.minPrimNum == b.minPrimNum &&
+           a.maxPrimNum == b.maxPrimNum &&
+           a.SAHIntersectionCost == b.SAHIntersectionCost &&
+           a.SAHTraversalCost == b.SAHTraversalCost &&
+           a.algorithm == b.algorithm &&
+           a.spatialSplitBudget == b.spatialSplitBudget &&
+           a.relayout == b.relayout;
+  }
+
+  static INLINE uint64 alignOffset(uint64 offset) {
+    return (offset + BVH2_CACHE_ALIGN - 1) & ~(BVH2_CACHE_ALIGN - 1);
+  }
+
+  /*! Checksum of the three arrays of the BVH */
+  template <typename T>
+  static uint64 getBVH2Checksum(const BVH2<T> &bvh) {
+    uint64 h = BVH2_CACHE_VERSION;
+    h = hashMemory(bvh.node, sizeof(BVH2Node) * bvh.nodeNum, h);
+    h = hashMemory(bvh.primID, sizeof(uint32) * bvh.primIDNum, h);
+    h = hashMemory(bvh.prim, sizeof(T) * bvh.primNum, h);
+    return h;
+  }
+
+  template <typename T>
+  uint64 getBVH2CacheKey(const T *t, uint32 primNum, const BVH2BuildOption &option)
+  {
+    // Hash the options field by field to skip any padding
+    uint64 h = BVH2_CACHE_VERSION;
+    h = hashMemory(&option.minPrimNum, sizeof(option.minPrimNum), h);
+    h = hashMemory(&option.maxPrimNum, sizeof(option.maxPrimNum), h);
+    h = hashMemory(&option.SAHIntersectionCost, sizeof(option.SAHIntersectionCost), h);
+    h = hashMemory(&option.SAHTraversalCost, sizeof(option.SAHTraversalCost), h);
+    h = hashMemory(&option.algorithm, sizeof(option.algorithm), h);
+    h = hashMemory(&option.spatialSplitBudget, sizeof(option.spatialSplitBudget), h);
+    h = hashMemory(&option.relayout, sizeof(option.relayout), h);
+    return hashMemory(t, sizeof(T) * primNum, h);
+  }
+
+  /*! Write size bytes and pad with zeroes up to the next section */
+  static bool writeSection(FILE *file, const void *data, uint64 size, uint64 &offset) {
+    static const char zeroes[BVH2_CACHE_ALIGN] = {0};
+    if (size && fwrite(data, 1, size, file) != size) return false;
+    const uint64 next = alignOffset(offset + size);
+    const uint64 padding = next - offset - size;
+    if (padding && fwrite(zeroes, 1, padding, file) != padding) return false;
+    offset = next;
+    return true;
+  }
+
+  template <typename T>
+  bool saveBVH2(const BVH2<T> &bvh, uint64 key,
+                const BVH2BuildOption &option, const FileName &name)
+  {
+    BVH2CacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, BVH2_CACHE_MAGIC, sizeof(header.magic));
+    header.version = BVH2_CACHE_VERSION;
+    header.nodeSize = sizeof(BVH2Node);
+    header.primSize = sizeof(T);
+    header.nodeNum = bvh.nodeNum;
+    header.primNum = bvh.primNum;
+    header.primIDNum = bvh.primIDNum;
+    header.key = key;
+    header.checksum = getBVH2Checksum(bvh);
+    header.nodeOffset = alignOffset(sizeof(BVH2CacheHeader));
+    header.primIDOffset = alignOffset(header.nodeOffset + sizeof(BVH2Node) * bvh.nodeNum);
+    header.primOffset = alignOffset(header.primIDOffset + sizeof(uint32) * bvh.primIDNum);
+    header.fileSize = alignOffset(header.primOffset + sizeof(T) * bvh.primNum);
+    header.option = option;
+
+    // Write a temporary file first such that nobody maps a partial file
+    char suffix[32];
+    std::snprintf(suffix, sizeof(suffix), ".%p.tmp", (const void *) &bvh);
+    const std::string tmpName = name.str() + suffix;
+    FILE *file = fopen(tmpName.c_str(), "wb");
+    if (file == NULL) return false;
+    uint64 offset = 0;
+    bool success = true;
+    success = success && writeSection(file, &header, sizeof(header), offset);
+    success = success && writeSection(file, bvh.node, sizeof(BVH2Node) * bvh.nodeNum, offset);
+    success = success && writeSection(file, bvh.primID, sizeof(uint32) * bvh.primIDNum, offset);
+    success = success && writeSection(file, bvh.prim, sizeof(T) * bvh.primNum, offset);
+    success = (fclose(file) == 0) && success;
+    PF_ASSERT(!success || offset == header.fileSize);
+    success = success && rename(tmpName.c_str(), name.c_str()) == 0;
+    if (!success) remove(tmpName.c_str());
+    return success;
+  }
+
+  template <typename T>
+  bool loadBVH2(BVH2<T> &bvh, uint64 key,
+                const BVH2BuildOption &option, const FileName &name)
+  {
+    PF_ASSERT(bvh.node == NULL && bvh.prim == NULL && bvh.primID == NULL);
+    Ref<MappedFile> file = PF_NEW(MappedFile);
+    if (file->map(name) == false) return false;
+    if (file->getSize() < sizeof(BVH2CacheHeader)) return false;
+
+    // Check the header first
+    const char *data = file->getData();
+    const BVH2CacheHeader &header = *(const BVH2CacheHeader *) data;
+    if (std::memcmp(header.magic, BVH2_CACHE_MAGIC, sizeof(header.magic)) ||
+        header.version != BVH2_CACHE_VERSION ||
+        header.nodeSize != sizeof(BVH2Node) ||
+        header.primSize != sizeof(T) ||
+        header.key != key ||
+        sameOptions(header.option, option) == false)
+      return false;
+    const uint64 nodeEnd = header.nodeOffset + sizeof(BVH2Node) * uint64(header.nodeNum);
+    const uint64 primIDEnd = header.primIDOffset + sizeof(uint32) * uint64(header.primIDNum);
+    const uint64 primEnd = header.primOffset + sizeof(T) * uint64(header.primNum);
+    if (header.fileSize != file->getSize() ||
+        header.nodeOffset % BVH2_CACHE_ALIGN ||
+        header.primIDOffset % BVH2_CACHE_ALIGN ||
+        header.primOffset % BVH2_CACHE_ALIGN ||
+        header.nodeOffset < sizeof(BVH2CacheHeader) ||
+        nodeEnd > header.primIDOffset ||
+        primIDEnd > header.primOffset ||
+        primEnd > header.fileSize) {
+      PF_WARNING_V("BVH2: corrupted cache file " << name);
+      return false;
+    }
+
+    // The arrays are directly used from the mapped file
+    BVH2<T> mapped;
+    mapped.node = (BVH2Node *) (data + header.nodeOffset);
+    mapped.primID = (uint32 *) (data + header.primIDOffset);
+    mapped.prim = (T *) (data + header.primOffset);
+    mapped.nodeNum = header.nodeNum;
+    mapped.primNum = header.primNum;
+    mapped.primIDNum = header.primIDNum;
+    mapped.mapping = file;
+    if (getBVH2Checksum(mapped) != header.checksum) {
+      PF_WARNING_V("BVH2: bad checksum in cache file " << name);
+      return false;
+    }
+    bvh.node = mapped.node;
+    bvh.primID = mapped.primID;
+    bvh.prim = mapped.prim;
+    bvh.nodeNum = mapped.nodeNum;
+    bvh.primNum = mapped.primNum;
+    bvh.primIDNum = mapped.primIDNum;
+    bvh.mapping = file;
+    return true;
+  }
+
+  /*! Create the cache directory (nothing happens if it already exists) */
+  static void createDirectory(const FileName &path) {
+#if defined(__UNIX__)
+    mkdir(path.c_str(), 0755);
+#else
+    _mkdir(path.c_str());
+#endif /* __UNIX__ */
+  }
+
+  template <typename T>
+  void buildBVH2Cached(const T *t, uint32 primNum, BVH2<T> &bvh,
+                       const BVH2BuildOption &option, const FileName &path)
+  {
+    const double start = getSeconds();
+    const uint64 key = getBVH2CacheKey(t, primNum, option);
+    char base[32];
+    std::snprintf(base, sizeof(base), "%016llx.bvh2", (unsigned long long) key);
+    const FileName name = path + std::string(base);
+    if (loadBVH2(bvh, key, option, name)) {
+      PF_MSG_V("BVH2: " << name << " mapped in " << (getSeconds() - start) * 1000. << " ms");
+      return;
+    }
+    buildBVH2(t, primNum, bvh, option);
+    createDirectory(path);
+    if (saveBVH2(bvh, key, option, name))
+      PF_MSG_V("BVH2: " << name << " stored in the cache");
+    else
+      PF_WARNING_V("BVH2: unable to write " << name);
+  }
+
+  /*! Explicit instantiations for RTTriangle */
+  template uint64 getBVH2CacheKey(const RTTriangle*, uint32, const BVH2BuildOption&);
+  template bool saveBVH2(const BVH2<RTTriangle>&, uint64, const BVH2BuildOption&, const FileName&);
+  template bool loadBVH2(BVH2<RTTriangle>&, uint64, const BVH2BuildOption&, const FileName&);
+  template void buildBVH2Cached(const RTTriangle*, uint32, BVH2<RTTriangle>&, const BVH2BuildOption&, const FileName&);
+
+} /* namespace pf */
+
@@ -0,0 +1,60 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#ifndef __PF_BVH2_CACHE_HPP__
+#define __PF_BVH2_CACHE_HPP__
+
+#include "bvh2.hpp"
+#include "sys/filename.hpp"
+
+namespace pf
+{
+  /*! Directory where buildBVH2Cached stores the BVHs */
+  extern const char *defaultBVH2CachePath;
+
+  /*! Cache key of a BVH: hash of the primitive content and of the options */
+  template <typename T>
+  uint64 getBVH2CacheKey(const T *t, uint32 primNum, const BVH2BuildOption &option);
+
+  /*! Write the BVH in a versioned binary file. Nodes, primitive IDs and
+   *  primitives are stored with the key, the options and a checksum.
+   *  Returns false if the file cannot be written
+   */
+  template <typename T>
+  bool saveBVH2(const BVH2<T> &bvh, uint64 key,
+                const BVH2BuildOption &option, const FileName &name);
+
+  /*! Map a file written by saveBVH2. The nodes, primitive IDs and primitives
+   *  are used in place (nothing is copied). Returns false if the file is
+   *  missing, corrupted or was written for another key, version or options
+   */
+  template <typename T>
+  bool loadBVH2(BVH2<T> &bvh, uint64 key,
+                const BVH2BuildOption &option, const FileName &name);
+
+  /*! Load the BVH from the cache directory if the same primitives were
+   *  already compiled with the same options. Otherwise, compile it and store
+   *  it in the cache
+   */
+  template <typename T>
+  void buildBVH2Cached(const T *t, uint32 primNum, BVH2<T> &bvh,
+                       const BVH2BuildOption &option = defaultBVH2Options,
+                       const FileName &path = defaultBVH2CachePath);
+
+} /* namespace pf */
+
+#endif /* __PF_BVH2_CACHE_HPP__ */
+
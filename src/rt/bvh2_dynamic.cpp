@@ -0,0 +1,92 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "bvh2_dynamic.hpp"
+#include "rt_triangle.hpp"
+#include "sys/tasking.hpp"
+#include "sys/logging.hpp"
+
+#include <cstring>
+
+namespace pf
+{
+  /*! Compile a new tree from a copy of the primitives */
+  template <typename T>
+  class TaskBVH2Rebuild : public Task
+  {
+  public:
+    TaskBVH2Rebuild(DynamicBVH2<T> &dynamic, const T *prims, uint32 primNum) :
+      Task("TaskBVH2Rebuild"), dynamic(&dynamic), primNum(primNum)
+    {
+      this->prims = PF_NEW_ARRAY(T, primNum);
+      std::memcpy(this->prims, prims, sizeof(T) * primNum);
+      this->setPriority(TaskPriority::LOW);
+    }
+    virtual ~TaskBVH2Rebuild(void) { PF_DELETE_ARRAY(this->prims); }
+    virtual Task *run(void) {
+      Ref< BVH2<T> > bvh = PF_NEW(BVH2<T>);
+      buildBVH2(prims, primNum, *bvh, dynamic->option);
+      dynamic->mutex.lock();
+      dynamic->rebuilt = bvh;
+      dynamic->mutex.unlock();
+      dynamic->rebuilding = 0;
+      return NULL;
+    }
+  private:
+    Ref< DynamicBVH2<T> > dynamic; //!< Gets the new tree
+    T *prims;                      //!< Positions when the rebuild started
+    uint32 primNum;                //!< Number of primitives to compile
+  };
+
+  template <typename T>
+  DynamicBVH2<T>::DynamicBVH2(Ref< BVH2<T> > bvh,
+                              float maxCostRatio,
+                              const BVH2BuildOption &option) :
+    bvh(bvh), rebuilding(0), maxCostRatio(maxCostRatio), option(option)
+  {
+    PF_ASSERT(bvh);
+    this->cost = this->referenceCost = getBVH2Cost(*bvh, option);
+  }
+
+  template <typename T>
+  bool DynamicBVH2<T>::update(const T *prims)
+  {
+    // Use the rebuilt tree if it is ready
+    mutex.lock();
+    Ref< BVH2<T> > fresh = this->rebuilt;
+    this->rebuilt = NULL;
+    mutex.unlock();
+    if (fresh) this->bvh = fresh;
+
+    // Refit it and check its quality
+    refitBVH2(*bvh, prims);
+    this->cost = getBVH2Cost(*bvh, option);
+    if (fresh) this->referenceCost = this->cost;
+    if (this->cost > maxCostRatio * this->referenceCost && this->rebuilding == 0) {
+      PF_MSG_V("BVH2: SAH cost went from " << this->referenceCost << " to "
+               << this->cost << ", rebuilding the tree");
+      this->rebuilding = 1;
+      Task *task = PF_NEW(TaskBVH2Rebuild<T>, *this, prims, bvh->primNum);
+      task->scheduled();
+    }
+    return bool(fresh);
+  }
+
+  // Instantiation for RTTriangle
+  template class DynamicBVH2<RTTriangle>;
+
+} /* namespace pf */
+
@@ -0,0 +1,79 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#ifndef __PF_BVH2_DYNAMIC_HPP__
+#define __PF_BVH2_DYNAMIC_HPP__
+
+#include "bvh2.hpp"
+#include "sys/mutex.hpp"
+#include "sys/atomic.hpp"
+
+namespace pf
+{
+  template <typename T> class TaskBVH2Rebuild;
+
+  /*! BVH2 of moving primitives. Each update only refits the current tree
+   *  (same topology). When its SAH cost grew by more than the given ratio, a
+   *  new tree is compiled in the background and replaces the current one
+   *  once ready. The rebuilt tree is refitted with the latest primitives
+   *  before replacing the current one
+   *
+   *  Only the BVH2 is refitted. A BVH2Traverser built on getBVH() directly
+   *  sees the new boxes. The collapsed intersectors (BVH4 / BVH8) keep their
+   *  own copies of the nodes and primitives: refit them with refitBVH4 /
+   *  refitBVH8 after each update returning false. QBVH4 and Triangle4
+   *  intersectors cannot be refitted and must be rebuilt after every update
+   */
+  template <typename T>
+  class DynamicBVH2 : public RefCount, public NonCopyable
+  {
+  public:
+    /*! bvh is the initial tree (compiled with buildBVH2) */
+    DynamicBVH2(Ref< BVH2<T> > bvh,
+                float maxCostRatio = 1.5f,
+                const BVH2BuildOption &option = defaultBVH2Options);
+    /*! prims are the same primitives as the initial ones (with the same
+     *  order) but at their new positions. Return true if the tree changed:
+     *  in that case, all the intersectors built on the previous tree must be
+     *  rebuilt from getBVH(). Otherwise, only the BVH2 was refitted (see
+     *  above for the other intersectors)
+     */
+    bool update(const T *prims);
+    /*! Current tree */
+    INLINE Ref< BVH2<T> > getBVH(void) const { return this->bvh; }
+    /*! SAH cost of the current tree after the last update */
+    INLINE float getCost(void) const { return this->cost; }
+    /*! SAH cost of the current tree when it was compiled */
+    INLINE float getReferenceCost(void) const { return this->referenceCost; }
+    /*! Indicate if a tree is being compiled in the background */
+    INLINE bool isRebuilding(void) const { return this->rebuilding != 0; }
+  private:
+    friend class TaskBVH2Rebuild<T>; //!< Compiles the new tree
+    Ref< BVH2<T> > bvh;       //!< Tree currently used
+    Ref< BVH2<T> > rebuilt;   //!< Compiled in the background and not used yet
+    MutexSys mutex;           //!< Protects the rebuilt tree
+    Atomic32 rebuilding;      //!< 1 when a rebuild task is running
+    float cost;               //!< Current SAH cost
+    float referenceCost;      //!< SAH cost when the tree was compiled
+    float maxCostRatio;       //!< Rebuild when cost > maxCostRatio * reference
+    BVH2BuildOption option;   //!< To compile the new trees
+    PF_CLASS(DynamicBVH2);
+  };
+
+} /* namespace pf */
+
+#endif /* __PF_BVH2_DYNAMIC_HPP__ */
+
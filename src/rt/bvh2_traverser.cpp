@@ -20,45 +20,35 @@
 #include "ray.hpp"
 #include "ray_packet.hpp"
 #include "rt_triangle.hpp"
+#include "rt_triangle4.hpp"
+#include "rt_instance.hpp"
+#include "rt_intersect.hpp"
+
+#include <cstring>
+
+// Convenient shortcut macro for traversal statistics
+#if PF_BVH2_STATISTICS
+#define IF_BVH2_STATISTICS(EXPR) EXPR
+#else
+#define IF_BVH2_STATISTICS(EXPR)
+#endif /* PF_BVH2_STATISTICS */
 
 namespace pf
 {
+  /*! Counters of each thread */
+  static THREAD BVH2Stats bvh2Stats;
+
+  BVH2Stats getBVH2Stats(void) { return bvh2Stats; }
+  void resetBVH2Stats(void) { std::memset(&bvh2Stats, 0, sizeof(BVH2Stats)); }
+
   ///////////////////////////////////////////////////////////////////////////
   /// Single Ray Routines
   ///////////////////////////////////////////////////////////////////////////
 
-  /*! Generic ray / primitive intersection */
-  template <typename T>
-  INLINE void PrimIntersect(const T&, uint32, const ssef&, const sse3f&, Hit&);
-
-  INLINE ssef crossZXY(const ssef &a, const ssef &b) {
-    return a*b.yzxx() - a.yzxx()*b;
-  }
-  INLINE ssef dotZXY(const ssef &a, const ssef &b) {
-    return a.xxxx()*b.zzzz() + a.yyyy()*b.xxxx() + a.zzzz()*b.yyyy();
-  }
-  INLINE ssef dotZXY(const sse3f &a, const sse3f &b) {
-    return a.x*b.z + a.y*b.x + a.z * b.y;
-  }
-  INLINE ssef cross(const ssef &a, const ssef &b) {
-    return a.yzxx()*b.zxyy() - a.zxyy()*b.yzxx();
-  }
-
-  INLINE void transpose4x3(const ssef &r0, const ssef &r1, const ssef &r2, const ssef &r3,
-                           ssef& c0,             ssef& c1,       ssef& c2)
-  {
-    const ssef l02 = unpacklo(r0,r2);
-    const ssef h02 = unpackhi(r0,r2);
-    const ssef l13 = unpacklo(r1,r3);
-    const ssef h13 = unpackhi(r1,r3);
-    c0 = unpacklo(l02,l13);
-    c1 = unpackhi(l02,l13);
-    c2 = unpacklo(h02,h13);
-  }
-
   /*! Node AABB / ray intersection */
   INLINE bool AABBIntersect(const BVH2Node &node, const ssef &org, const ssef &rdir, float t)
   {
+    IF_BVH2_STATISTICS(bvh2Stats.nodeNum++);
     const ssef lower = ssef::load(&node.pmin.x).xyzz();
     const ssef upper = ssef::load(&node.pmax.x).xyzz();
     const ssef l1 = (lower - org) * rdir;
@@ -77,44 +67,24 @@ namespace pf
   {
     const uint32 firstPrim = node.getPrimID();
     const uint32 primNum = node.getPrimNum();
+    IF_BVH2_STATISTICS(bvh2Stats.leafNum++);
+    IF_BVH2_STATISTICS(bvh2Stats.primNum += primNum);
     for(uint32 i = 0; i < primNum; ++i) {
       const uint32 primID = bvh.primID[firstPrim + i];
       PrimIntersect(bvh.prim[primID], primID, org, dir, hit);
     }
   }
 
-  /*! Single ray / Pluecker triangle intersection. For single rays, it is
-   *  actually bad (see the remark done about Pluecker intersector for
-   *  packets). I should clearly replace it by something else
-   */
-  template <>
-  INLINE void PrimIntersect<RTTriangle>
-    (const RTTriangle &tri, uint32 id, const ssef &org, const sse3f &dir, Hit &hit)
+  /*! Leaves of 4-wide triangles directly index the blocks */
+  INLINE void LeafIntersect
+    (const BVH2<RTTriangle4> &bvh, const BVH2Node &node, const ssef &org, const sse3f &dir, Hit &hit)
   {
-    const ssef a(&tri.v[0].x);
-    const ssef b(&tri.v[1].x);
-    const ssef c(&tri.v[2].x);
-    const ssef n(&tri.n.x);
-    const ssef d0 = a - org;
-    const ssef d1 = b - org;
-    const ssef d2 = c - org;
-    const ssef num = reduce_add(n * d0);
-    const ssef v0 = cross(d1, d2);
-    const ssef v1 = cross(d0, d1);
-    const ssef v2 = cross(d2, d0);
-    sse3f v012n;
-    transpose4x3(n, v0, v1, v2, v012n.x, v012n.y, v012n.z);
-    ssef tuvw = dot(v012n, dir);
-    const int m0 = movemask(sseb(tuvw)) & 0xe;
-    if ((m0 != 0xe) & (m0 != 0)) return;
-
-    const ssef t = divss(num, tuvw.m128);
-    const ssef t0 = subss(ssef(hit.t), t);
-    const ssef m = t | t0;
-    if ((movemask(m) & 0x1) == 0) {
-      ssef::store(t, &hit.t);
-      hit.id0 = id;
-    }
+    const RTTriangle4 *tri = bvh.prim + node.getPrimID();
+    const uint32 blockNum = node.getPrimNum();
+    IF_BVH2_STATISTICS(bvh2Stats.leafNum++);
+    IF_BVH2_STATISTICS(bvh2Stats.primNum += blockNum * RTTriangle4::CHANNEL_NUM);
+    for(uint32 i = 0; i < blockNum; ++i)
+      PrimIntersect(tri[i], org, dir, hit);
   }
 
   /*! To store call stack while traversing the BVH */
@@ -131,16 +101,18 @@ namespace pf
     int32 top;                                 //!< Current size of the stack
   };
 
-  template <typename T>
-  void BVH2Traverser<T>::traverse(const Ray &ray, Hit &hit) const
+  /*! Closest hit or any hit single ray traversal of the sub-tree rooted at
+   *  "root". With anyHit, we stop as soon as something is hit
+   */
+  template <bool anyHit, typename T>
+  INLINE void traverseRay(const BVH2<T> &bvh, const BVH2Node *root,
+                          const ssef &org, const ssef &rdir,
+                          const sse3f &dir, Hit &hit)
   {
     RayStack stack;
-    const ssef org = ssef(&ray.org.x).xyzz();
-    const ssef rdir = ssef(&ray.rdir.x).xyzz();
-    const sse3f dir(ray.dir.x, ray.dir.y, ray.dir.z);
     const uint32 s = movemask(rdir);
     const uint32 signArray[] = { s&1, (s>>1)&1, (s>>2)&1 };
-    stack.push(bvh->node);
+    stack.push(root);
 
   popNode:
     // Recurse until we find a leaf
@@ -151,278 +123,137 @@ namespace pf
           const uint32 offset = node->getOffset();
           const uint32 first = signArray[node->getAxis()];
           const uint32 second = first ^ 1;
-          stack.push(bvh->node + offset + second);
-          node = bvh->node + offset + first;
+          stack.push(bvh.node + offset + second);
+          node = bvh.node + offset + first;
         } else {
-          LeafIntersect(*bvh, *node, org, dir, hit);
+          LeafIntersect(bvh, *node, org, dir, hit);
+          if (anyHit && hit.id0 != -1) return;
           goto popNode;
         }
       }
     }
   }
 
+  template <typename T>
+  void BVH2Traverser<T>::traverse(const Ray &ray, Hit &hit) const
+  {
+    const ssef org = ssef(&ray.org.x).xyzz();
+    const ssef rdir = ssef(&ray.rdir.x).xyzz();
+    const sse3f dir(ray.dir.x, ray.dir.y, ray.dir.z);
+    traverseRay<false>(*bvh, bvh->node, org, rdir, dir, hit);
+  }
+
   template <typename T>
   bool BVH2Traverser<T>::occluded(const Ray &ray) const {
     NOT_IMPLEMENTED;
     return false;
   }
 
-  /*! Explicit instantiation for BVH2s of RTTriangle */
+  /*! Explicit instantiation for BVH2s of RTTriangle(4) and RTInstance */
   template void BVH2Traverser<RTTriangle>::traverse(const Ray&, Hit&) const;
   template bool BVH2Traverser<RTTriangle>::occluded(const Ray&) const;
+  template void BVH2Traverser<RTTriangle4>::traverse(const Ray&, Hit&) const;
+  template bool BVH2Traverser<RTTriangle4>::occluded(const Ray&) const;
+  template void BVH2Traverser<RTInstance>::traverse(const Ray&, Hit&) const;
+  template bool BVH2Traverser<RTInstance>::occluded(const Ray&) const;
 
   ///////////////////////////////////////////////////////////////////////////
   /// Ray Packet Routines
   ///////////////////////////////////////////////////////////////////////////
 
-  /*! Generic ray / primitive intersection */
-  template <typename T>
-  INLINE void PrimIntersect
-    (const T &, uint32, const RayPacket&, const uint32*, uint32, PacketHit&);
-
-  /*! Kay-Kajiya AABB intersection */
-  INLINE void slab
-    (const sse3f &rdir, const sse3f &minOrg, const sse3f &maxOrg, ssef &near, ssef &far)
-  {
-    ssef l1 = minOrg.x * rdir.x;
-    ssef l2 = maxOrg.x * rdir.x;
-    near = min(l1,l2);
-    far  = max(l1,l2);
-    l1   = minOrg.y * rdir.y;
-    l2   = maxOrg.y * rdir.y;
-    near = max(min(l1,l2), near);
-    far  = min(max(l1,l2), far);
-    l1   = minOrg.z * rdir.z;
-    l2   = maxOrg.z * rdir.z;
-    near = max(min(l1,l2), near);
-    far  = min(max(l1,l2), far);
-  }
-
-  /*! Kay-Kajiya AABB with interval arithmetic */
-  INLINE int slabIA(const ssef &minOrg, const ssef &maxOrg,
-                    const sseb &sign,
-                    const ssef &rcpMin, const ssef &rcpMax)
+#if PF_BVH2_STATISTICS
+  /*! Count one packet / box test and whether interval arithmetic culls it */
+  template <uint32 w, uint32 h>
+  INLINE void countBoxTest(const ssef &lower, const ssef &upper,
+                           const RayPacketT<w,h> &pckt)
   {
-    const ssef minusMin = -minOrg;
-    const ssef minusMax = -maxOrg;
-    const ssef aMin = select(sign, minusMax, minOrg);
-    const ssef aMax = select(sign, minusMin, maxOrg);
-    const ssef pMin = aMin * rcpMin;
-    const ssef pMax = aMax * rcpMax;
-    const ssef aMinMM = min(pMin, pMax);
-    const ssef aMaxMM = max(pMin, pMax);
-    const ssef near = aMinMM;
-    const ssef far = reduce_min(aMaxMM);
-    const sseb ia = (near > far) | sseb(far);
-    return movemask(ia) & 0x7;
+    bvh2Stats.nodeNum++;
+    if (pckt.properties & RAY_PACKET_IA)
+      if (slabIA(lower - pckt.iaMaxOrg, upper - pckt.iaMinOrg,
+                 pckt.iasign, pckt.iaMinrDir, pckt.iaMaxrDir))
+        bvh2Stats.iaExitNum++;
   }
+#endif /* PF_BVH2_STATISTICS */
 
   /*! AABB (non leaf node) / packet intersection */
-  INLINE bool AABBIntersect
-    (const BVH2Node &node, const RayPacket &pckt, const PacketHit &hit, uint32 &first)
+  template <uint32 w, uint32 h>
+  INLINE bool AABBIntersect(const BVH2Node &node, const RayPacketT<w,h> &pckt,
+                            const PacketHitT<w,h> &hit, uint32 &first)
   {
     // Avoid issues with w unused channel
     const ssef lower = ssef::load(&node.pmin.x).xyzz();
     const ssef upper = ssef::load(&node.pmax.x).xyzz();
-    const ssef tmpMin = lower - pckt.iaMaxOrg;
-    const ssef tmpMax = upper - pckt.iaMinOrg;
-
-    // Try fast exit if the packet supports interval arithmetic
-    if (pckt.properties & RAY_PACKET_IA)
-      if (slabIA(tmpMin, tmpMax, pckt.iasign, pckt.iaMinrDir, pckt.iaMaxrDir))
-        return false;
-
-    // Fast path with common origin packets
-    if (pckt.properties & RAY_PACKET_CO) {
-      const sse3f dmin(tmpMin.xxxx(), tmpMin.yyyy(), tmpMin.zzzz());
-      const sse3f dmax(tmpMax.xxxx(), tmpMax.yyyy(), tmpMax.zzzz());
-      for (uint32 i = first; i < pckt.chunkNum; ++i) {
-        ssef near, far;
-        slab(pckt.rdir[i], dmin, dmax, near, far);
-        const sseb test = (far >= near) & (far > 0.f) & (near < hit.t[i]);
-        if (movemask(test)) {
-          first = i;
-          return true;
-        }
-      }
-    } else {
-      const sse3f pmin(node.pmin.x, node.pmin.y, node.pmin.z);
-      const sse3f pmax(node.pmax.x, node.pmax.y, node.pmax.z);
-      for (uint32 i = first; i < pckt.chunkNum; ++i) {
-        const sse3f dmin = pmin - pckt.org[i];
-        const sse3f dmax = pmax - pckt.org[i];
-        ssef near, far;
-        slab(pckt.rdir[i], dmin, dmax, near, far);
-        const sseb test = (far >= near) & (far > 0.f) & (near < hit.t[i]);
-        if (movemask(test)) {
-          first = i;
-          return true;
-        }
-      }
-    }
-    return false;
+    IF_BVH2_STATISTICS(countBoxTest(lower, upper, pckt));
+    return AABBIntersect(lower, upper, pckt, hit, first);
   }
 
   /*! AABB (leaf node) / packet intersection. Track all active rays */
-  INLINE bool AABBIntersect
-    (const BVH2Node &node, const RayPacket &pckt, const PacketHit &hit,
-     uint32 first, uint32 *active, uint32 &activeNum)
+  template <uint32 w, uint32 h>
+  INLINE bool AABBIntersect(const BVH2Node &node, const RayPacketT<w,h> &pckt,
+                            const PacketHitT<w,h> &hit, uint32 first,
+                            uint32 *active, uint32 &activeNum)
   {
     // Avoid issues with w unused channel
     const ssef lower = ssef::load(&node.pmin.x).xyzz();
     const ssef upper = ssef::load(&node.pmax.x).xyzz();
-    const ssef tmpMin = lower - pckt.iaMaxOrg;
-    const ssef tmpMax = upper - pckt.iaMinOrg;
+    IF_BVH2_STATISTICS(countBoxTest(lower, upper, pckt));
+    return AABBIntersect(lower, upper, pckt, hit, first, active, activeNum);
+  }
 
-    // Use interval arithmetic test if supported
-    if (pckt.properties & RAY_PACKET_IA)
-      if (slabIA(tmpMin, tmpMax, pckt.iasign, pckt.iaMinrDir, pckt.iaMaxrDir))
-        return false;
-
-    // Fast path with common origin packets
-    bool isIntersected = false;
-    activeNum = 0;
-    if (pckt.properties & RAY_PACKET_CO) {
-      const sse3f dmin(tmpMin.xxxx(), tmpMin.yyyy(), tmpMin.zzzz());
-      const sse3f dmax(tmpMax.xxxx(), tmpMax.yyyy(), tmpMax.zzzz());
-      for(uint32 i = first; i < pckt.chunkNum; ++i) {
-        ssef near, far;
-        slab(pckt.rdir[i], dmin, dmax, near, far);
-        const sseb test = (far >= near) & (far > 0.f) & (near < hit.t[i]);
-        if (movemask(test)) {
-          active[activeNum++] = i;
-          isIntersected = true;
-        }
-      }
-    } else {
-      const sse3f pmin(node.pmin.x, node.pmin.y, node.pmin.z);
-      const sse3f pmax(node.pmax.x, node.pmax.y, node.pmax.z);
-      for (uint32 i = first; i < pckt.chunkNum; ++i) {
-        const sse3f dmin = pmin - pckt.org[i];
-        const sse3f dmax = pmax - pckt.org[i];
-        ssef near, far;
-        slab(pckt.rdir[i], dmin, dmax, near, far);
-        const sseb test = (far >= near) & (far > 0.f) & (near < hit.t[i]);
-        if (movemask(test)) {
-          active[activeNum++] = i;
-          isIntersected = true;
-        }
-      }
-    }
-    return isIntersected;
+  /*! AABB (non leaf node) / packet intersection. Collect the rays if sparse */
+  template <uint32 w, uint32 h>
+  INLINE bool AABBIntersect(const BVH2Node &node, const RayPacketT<w,h> &pckt,
+                            const PacketHitT<w,h> &hit, uint32 &first,
+                            uint32 *rayIDs, uint32 maxRayNum, uint32 &rayNum)
+  {
+    // Avoid issues with w unused channel
+    const ssef lower = ssef::load(&node.pmin.x).xyzz();
+    const ssef upper = ssef::load(&node.pmax.x).xyzz();
+    IF_BVH2_STATISTICS(countBoxTest(lower, upper, pckt));
+    return AABBIntersect(lower, upper, pckt, hit, first, rayIDs, maxRayNum, rayNum);
   }
 
-  /*! Generic Packet / Leaf intersection */
-  template <typename T>
-  INLINE void LeafIntersect
-    (const BVH2<T> &bvh, const BVH2Node &node, const RayPacket &pckt, uint32 first, PacketHit &hit)
+  /*! Generic Packet / Leaf intersection. With anyHit, hit rays are killed */
+  template <bool anyHit, typename T, uint32 w, uint32 h>
+  INLINE void LeafIntersect(const BVH2<T> &bvh, const BVH2Node &node,
+                            const RayPacketT<w,h> &pckt, uint32 first,
+                            PacketHitT<w,h> &hit)
   {
-    uint32 active[RayPacket::chunkNum];
+    uint32 active[RayPacketT<w,h>::chunkNum];
     uint32 activeNum;
     if (AABBIntersect(node, pckt, hit, first, active, activeNum)) {
       const uint32 firstPrim = node.getPrimID();
       const uint32 primNum = node.getPrimNum();
+      IF_BVH2_STATISTICS(bvh2Stats.leafNum++);
+      IF_BVH2_STATISTICS(bvh2Stats.primNum += primNum);
       for(uint32 i = 0; i < primNum; ++i) {
         const uint32 primID = bvh.primID[firstPrim + i];
-        PrimIntersect(bvh.prim[primID], primID, pckt, active, activeNum, hit);
+        if (anyHit)
+          PrimOccluded(bvh.prim[primID], pckt, active, activeNum, hit);
+        else
+          PrimIntersect(bvh.prim[primID], primID, pckt, active, activeNum, hit);
       }
     }
   }
 
-  /*! Pluecker intersection
-   *  Pros:
-   *  - super fast with common origin rays. You precompute the planes and then
-   *    it is mostly three dot products
-   *  - aperture test is done first and this is really better than doing the
-   *    depth test first
-   *  Cons:
-   *  - Numerically bad when triangles are far away
-   *  - Expensive when origin is not shared
-   *  TODO Take a better intersector for non-common-origin ray packets
-   * */
-  template <>
-  INLINE void PrimIntersect<RTTriangle>
-    (const RTTriangle &tri, uint32 id, const RayPacket &pckt,
-     const uint32 *active, uint32 activeNum, PacketHit &hit)
+  /*! Same for the leaves of 4-wide triangles */
+  template <bool anyHit, uint32 w, uint32 h>
+  INLINE void LeafIntersect(const BVH2<RTTriangle4> &bvh, const BVH2Node &node,
+                            const RayPacketT<w,h> &pckt, uint32 first,
+                            PacketHitT<w,h> &hit)
   {
-    if (pckt.properties & RAY_PACKET_CO) {
-      const ssef a(&tri.v[0].x);
-      const ssef b(&tri.v[1].x);
-      const ssef c(&tri.v[2].x);
-      const ssef d0 = a - pckt.iaMinOrg;
-      const ssef ca = c - a;
-      const ssef ba = b - a;
-      const ssef cb = c - b;
-      const ssef sn = crossZXY(ca, ba);
-      const ssef snum = dotZXY(sn, d0);
-      const ssef d1 = b - pckt.iaMinOrg;
-      const ssef sv0 = crossZXY(d1, cb);
-      const ssef sv1 = crossZXY(d0, ba);
-      const ssef sv2 = crossZXY(ca, d0);
-      const sse3f v0(sv0.xxxx(), sv0.yyyy(), sv0.zzzz());
-      const sse3f v1(sv1.xxxx(), sv1.yyyy(), sv1.zzzz());
-      const sse3f v2(sv2.xxxx(), sv2.yyyy(), sv2.zzzz());
-      const sse3f n(sn.xxxx(), sn.yyyy(), sn.zzzz());
-      const ssef cru = dotZXY(v0, pckt.crdir);
-      const ssef crv = dotZXY(v1, pckt.crdir);
-      const ssef crw = dotZXY(v2, pckt.crdir);
-      if (movemask(cru) == 0) return;
-      if (movemask(crv) == 0) return;
-      if (movemask(crw) == 0) return;
-
-      for(uint32 i = 0; i < activeNum; ++i) {
-        const uint32 curr = active[i];
-        const ssef u = dotZXY(v0, pckt.dir[curr]);
-        const ssef v = dotZXY(v1, pckt.dir[curr]);
-        const ssef w = dotZXY(v2, pckt.dir[curr]);
-        const uint32 us = movemask(u);
-        const uint32 vs = movemask(v);
-        const uint32 ws = movemask(w);
-        //const uint32 aperture = (us&vs&ws) | ((us^0xf)&(vs^0xf)&(ws^0xf));
-        const uint32 aperture = (us&vs&ws);
-        if (!aperture) continue;
-        const ssef n0 = dotZXY(n, pckt.dir[curr]);
-        const ssef num = snum.xxxx();
-        const ssef t = num / n0;
-        const ssei triID(id);
-        const sseb inside = unmovemask(aperture);
-        const sseb mask = inside & (t<hit.t[curr]) & (t>0.f);
-        hit.t[curr]   = select(mask, t, hit.t[curr]);
-        hit.u[curr]   = select(mask, u, hit.u[curr]);
-        hit.v[curr]   = select(mask, v, hit.v[curr]);
-        hit.id0[curr] = select(mask, triID, hit.id0[curr]);
-      }
-    } else {
-      const sse3f a(tri.v[0].x, tri.v[0].y, tri.v[0].z);
-      const sse3f b(tri.v[1].x, tri.v[1].y, tri.v[1].z);
-      const sse3f c(tri.v[2].x, tri.v[2].y, tri.v[2].z);
-      const sse3f n = cross(c - a, b - a);
-      const ssei triID(id);
-
-      for(uint32 i = 0; i < activeNum; ++i) {
-        const uint32 curr = active[i];
-        const sse3f d0 = a - pckt.org[curr];
-        const sse3f d1 = b - pckt.org[curr];
-        const sse3f d2 = c - pckt.org[curr];
-        const sse3f v0 = cross(d1, d2);
-        const sse3f v1 = cross(d0, d1);
-        const sse3f v2 = cross(d2, d0);
-        const ssef num = dot(n, d0);
-        const ssef u = dot(v0, pckt.dir[curr]);
-        const ssef v = dot(v1, pckt.dir[curr]);
-        const ssef w = dot(v2, pckt.dir[curr]);
-        const uint32 us = movemask(u);
-        const uint32 vs = movemask(v);
-        const uint32 ws = movemask(w);
-        const uint32 aperture = (us&vs&ws)|((us^0xf)&(vs^0xf)&(ws^0xf));
-        if(!aperture) continue;
-        const ssef t = num / dot(pckt.dir[curr], n);
-        const sseb inside = unmovemask(aperture);
-        const sseb mask = inside & (t<hit.t[curr]) & (t>0.f);
-        hit.t[curr]   = select(mask, t, hit.t[curr]);
-        hit.u[curr]   = select(mask, u, hit.u[curr]);
-        hit.v[curr]   = select(mask, v, hit.v[curr]);
-        hit.id0[curr] = select(mask, triID, hit.id0[curr]);
+    uint32 active[RayPacketT<w,h>::chunkNum];
+    uint32 activeNum;
+    if (AABBIntersect(node, pckt, hit, first, active, activeNum)) {
+      const RTTriangle4 *tri = bvh.prim + node.getPrimID();
+      const uint32 blockNum = node.getPrimNum();
+      IF_BVH2_STATISTICS(bvh2Stats.leafNum++);
+      IF_BVH2_STATISTICS(bvh2Stats.primNum += blockNum * RTTriangle4::CHANNEL_NUM);
+      for(uint32 i = 0; i < blockNum; ++i) {
+        if (anyHit)
+          PrimOccluded(tri[i], pckt, active, activeNum, hit);
+        else
+          PrimIntersect(tri[i], pckt, active, activeNum, hit);
       }
     }
   }
@@ -448,35 +279,117 @@ namespace pf
     int32 top;                //!< Current size of the stack
   };
 
-  template <typename T>
-  void BVH2Traverser<T>::traverse(const RayPacket &pckt, PacketHit &hit) const
+  /*! Traverse the sub-tree rooted at "node" with single rays for the given
+   *  rays of the packet. Hit rays are updated (or killed with anyHit)
+   */
+  template <bool anyHit, typename T, uint32 w, uint32 h>
+  INLINE void traverseRays(const BVH2<T> &bvh, const BVH2Node *node,
+                           const RayPacketT<w,h> &pckt,
+                           const uint32 *rayIDs, uint32 rayNum,
+                           PacketHitT<w,h> &hit)
+  {
+    for (uint32 i = 0; i < rayNum; ++i) {
+      const uint32 chunkID = rayIDs[i] / ssef::CHANNEL_NUM;
+      const uint32 laneID = rayIDs[i] % ssef::CHANNEL_NUM;
+      const sse3f &o = pckt.org[chunkID];
+      const sse3f &d = pckt.dir[chunkID];
+      const sse3f &r = pckt.rdir[chunkID];
+      const ssef org(o.x[laneID], o.y[laneID], o.z[laneID], o.z[laneID]);
+      const ssef rdir(r.x[laneID], r.y[laneID], r.z[laneID], r.z[laneID]);
+      const sse3f dir(d.x[laneID], d.y[laneID], d.z[laneID]);
+      Hit single;
+      single.t = hit.t[chunkID][laneID];
+      single.id1 = hit.id1[chunkID][laneID];
+      traverseRay<anyHit>(bvh, node, org, rdir, dir, single);
+      if (single.id0 == -1) continue;
+      if (anyHit)
+        hit.t[chunkID][laneID] = neg_inf;
+      else {
+        hit.t[chunkID][laneID] = single.t;
+        hit.u[chunkID][laneID] = single.u;
+        hit.v[chunkID][laneID] = single.v;
+        hit.id0[chunkID][laneID] = single.id0;
+        hit.id1[chunkID][laneID] = single.id1;
+      }
+    }
+  }
+
+  /*! Divergent packets (no common origin) switch to single rays below this
+   *  number of active rays. Rays then resume from the current node
+   */
+  enum { hybridMaxRayNum = 8 };
+
+  /*! Closest hit or any hit (occlusion) packet traversal */
+  template <bool anyHit, typename T, uint32 w, uint32 h>
+  static void traversePacket(const BVH2<T> &bvh,
+                             const RayPacketT<w,h> &pckt,
+                             PacketHitT<w,h> &hit)
   {
     PacketStack stack;
     const uint32 s = movemask(pckt.iasign);
     const uint32 signArray[] = { s&1, (s>>1)&1, (s>>2)&1 };
     stack.push(0,0);
 
+    // Common origin packets are coherent primary rays. Their triangle test
+    // also culls back faces while the single ray one does not
+    const bool hybrid = !(pckt.properties & RAY_PACKET_CO);
+
   popNode:
     while (LIKELY(stack.pop())) {
       const uint32 nodeID = stack.elem[stack.top].nodeID;
       uint32 firstActive = stack.elem[stack.top].first;
-      const BVH2Node * RESTRICT node = &bvh->node[nodeID];
+      const BVH2Node * RESTRICT node = &bvh.node[nodeID];
       while (LIKELY(!node->isLeaf())) {
-        if(!AABBIntersect(*node, pckt, hit, firstActive)) goto popNode;
+        if (hybrid) {
+          uint32 rayIDs[hybridMaxRayNum], rayNum;
+          if (!AABBIntersect(*node, pckt, hit, firstActive, rayIDs, hybridMaxRayNum, rayNum))
+            goto popNode;
+          if (rayNum <= hybridMaxRayNum) {
+            traverseRays<anyHit>(bvh, node, pckt, rayIDs, rayNum, hit);
+            if (anyHit && isOccluded(hit)) return;
+            goto popNode;
+          }
+        } else if(!AABBIntersect(*node, pckt, hit, firstActive))
+          goto popNode;
         const uint32 offset = node->getOffset();
         const uint32 first = signArray[node->getAxis()];
         const uint32 second = first ^ 1;
         stack.push(offset + second, firstActive);
-        node = &bvh->node[offset + first];
+        node = &bvh.node[offset + first];
       }
 
       // Intersect BVH leaf and its primitives
-      LeafIntersect(*bvh, *node, pckt, firstActive, hit);
+      LeafIntersect<anyHit>(bvh, *node, pckt, firstActive, hit);
+      if (anyHit && isOccluded(hit)) return;
     }
   }
 
-  /*! Explicit instantiation for BVH2s of RTTriangle */
-  template void BVH2Traverser<RTTriangle>::traverse(const RayPacket&, PacketHit&) const;
+  /*! Closest hit and any hit routines for one packet size */
+#define DECL_PACKET_TRAVERSAL(W,H) \
+  template <typename T> \
+  void BVH2Traverser<T>::traverse(const RayPacketT<W,H> &pckt, PacketHitT<W,H> &hit) const { \
+    traversePacket<false>(*bvh, pckt, hit); \
+  } \
+  template <typename T> \
+  void BVH2Traverser<T>::occluded(const RayPacketT<W,H> &pckt, const ssef tfar[], sseb mask[]) const { \
+    PacketHitT<W,H> hit; \
+    initOcclusion(mask, tfar, hit); \
+    traversePacket<true>(*bvh, pckt, hit); \
+    getOcclusion(hit, mask); \
+  } \
+  template void BVH2Traverser<RTTriangle>::traverse(const RayPacketT<W,H>&, PacketHitT<W,H>&) const; \
+  template void BVH2Traverser<RTTriangle>::occluded(const RayPacketT<W,H>&, const ssef[], sseb[]) const; \
+  template void BVH2Traverser<RTTriangle4>::traverse(const RayPacketT<W,H>&, PacketHitT<W,H>&) const; \
+  template void BVH2Traverser<RTTriangle4>::occluded(const RayPacketT<W,H>&, const ssef[], sseb[]) const; \
+  template void BVH2Traverser<RTInstance>::traverse(const RayPacketT<W,H>&, PacketHitT<W,H>&) const; \
+  template void BVH2Traverser<RTInstance>::occluded(const RayPacketT<W,H>&, const ssef[], sseb[]) const;
+
+  /*! Explicit instantiation for BVH2s of RTTriangle(4) and RTInstance */
+  DECL_PACKET_TRAVERSAL(4,4)
+  DECL_PACKET_TRAVERSAL(8,8)
+  DECL_PACKET_TRAVERSAL(16,16)
+#undef DECL_PACKET_TRAVERSAL
+#undef IF_BVH2_STATISTICS
 
 } /* namespace BKY */
 
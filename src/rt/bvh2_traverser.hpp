@@ -19,11 +19,34 @@
 
 #include "intersector.hpp"
 
+/*! Set to 1 to count the traversal steps of the BVH2 traversers */
+#ifndef PF_BVH2_STATISTICS
+#define PF_BVH2_STATISTICS 0
+#endif /* PF_BVH2_STATISTICS */
+
 namespace pf
 {
   // Structure to traverse
   template <typename T> struct BVH2;
 
+  /*! Traversal counters. With PF_BVH2_STATISTICS, each traversal (single ray
+   *  or packet) adds its numbers to the counters of the calling thread. Reset
+   *  them before a traversal to get the numbers of one ray or one packet.
+   *  Without it, the counters are always zero and nothing is counted
+   */
+  struct BVH2Stats
+  {
+    uint32 nodeNum;   //!< Node boxes tested (leaves included)
+    uint32 leafNum;   //!< Leaves whose box is hit
+    uint32 primNum;   //!< Primitives tested (4 per block of RTTriangle4)
+    uint32 iaExitNum; //!< Packet / box tests culled by interval arithmetic
+  };
+
+  /*! Get the counters of the calling thread */
+  BVH2Stats getBVH2Stats(void);
+  /*! Zero the counters of the calling thread */
+  void resetBVH2Stats(void);
+
   /*! Represents any kind of intersectable geometry that we are going to
    *  traverse with rays or packet of rays
    */
@@ -40,11 +63,18 @@ namespace pf
     /*! Traverse routine for ray packets. Return u,v,t and ID of primitive of
      *  for each ray of the packet
      */
+    virtual void traverse(const RayPacket4x4 &pckt, PacketHit4x4 &hit) const;
     virtual void traverse(const RayPacket &pckt, PacketHit &hit) const;
+    virtual void traverse(const RayPacket16x16 &pckt, PacketHit16x16 &hit) const;
 
     /*! Shadow ray routine for rays. True if occluded */
     virtual bool occluded(const Ray &ray) const;
 
+    /*! Shadow ray routine for ray packets (see Intersector) */
+    virtual void occluded(const RayPacket4x4 &pckt, const ssef tfar[], sseb mask[]) const;
+    virtual void occluded(const RayPacket &pckt, const ssef tfar[], sseb mask[]) const;
+    virtual void occluded(const RayPacket16x16 &pckt, const ssef tfar[], sseb mask[]) const;
+
     /*! The BVH we intersect */
     Ref< BVH2<T> > bvh;
     PF_CLASS(BVH2Traverser);
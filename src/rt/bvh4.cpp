@@ -0,0 +1,68 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "bvh4.hpp"
+#include "bvh_collapse.hpp"
+#include "rt_triangle.hpp"
+#include "sys/logging.hpp"
+
+#include <cstring>
+
+namespace pf
+{
+  template <typename T>
+  void buildBVH4(const BVH2<T> &bvh2, BVH4<T> &bvh4)
+  {
+    PF_MSG_V("BVH4: collapsing BVH2");
+    const double start = getSeconds();
+    bvh4.nodeNum = collapseBVH2<4>(bvh2, bvh4.node);
+    PF_MSG_V("BVH4: " << bvh4.nodeNum << " nodes");
+
+    PF_MSG_V("BVH4: Copying primitives and primitive IDs");
+    bvh4.primNum = bvh2.primNum;
+    bvh4.prim = PF_NEW_ARRAY(T, bvh2.primNum);
+    bvh4.primID = PF_NEW_ARRAY(uint32, bvh2.primIDNum);
+    std::memcpy(bvh4.prim, bvh2.prim, sizeof(T) * bvh2.primNum);
+    std::memcpy(bvh4.primID, bvh2.primID, sizeof(uint32) * bvh2.primIDNum);
+    PF_MSG_V("BVH4: Time to collapse " << getSeconds() - start << " sec");
+  }
+
+  template <typename T>
+  void buildBVH4(const T *t, uint32 primNum, BVH4<T> &bvh, const BVH2BuildOption &option)
+  {
+    BVH2<T> bvh2;
+    buildBVH2(t, primNum, bvh2, option);
+    buildBVH4(bvh2, bvh);
+  }
+
+  template <typename T>
+  void refitBVH4(BVH4<T> &bvh, const T *prims)
+  {
+    PF_ASSERT(bvh.node != NULL && prims != NULL);
+    if (prims != bvh.prim)
+      std::memcpy(bvh.prim, prims, sizeof(T) * bvh.primNum);
+    refitCollapsedBVH<4>(bvh.node, bvh.nodeNum, bvh.prim, bvh.primID);
+  }
+
+  // Instantiation for RTTriangle
+  template void buildBVH4<RTTriangle>(const BVH2<RTTriangle>&, BVH4<RTTriangle>&);
+  template void buildBVH4<RTTriangle>(const RTTriangle*, uint32, BVH4<RTTriangle>&, const BVH2BuildOption&);
+  template void refitBVH4<RTTriangle>(BVH4<RTTriangle>&, const RTTriangle*);
+  template BVH4<RTTriangle>::BVH4(void);
+  template BVH4<RTTriangle>::~BVH4(void);
+
+} /* namespace pf */
+
@@ -0,0 +1,294 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "bvh4.hpp"
+#include "bvh4_traverser.hpp"
+#include "ray.hpp"
+#include "ray_packet.hpp"
+#include "rt_triangle.hpp"
+#include "rt_intersect.hpp"
+
+namespace pf
+{
+  ///////////////////////////////////////////////////////////////////////////
+  /// Single Ray Routines
+  ///////////////////////////////////////////////////////////////////////////
+
+  /*! Generic ray / leaf intersection */
+  template <typename T>
+  INLINE void LeafIntersect(const BVH4<T> &bvh, uint32 ref, uint32 primNum,
+                            const ssef &org, const sse3f &dir, Hit &hit)
+  {
+    const uint32 firstPrim = BVH4Node::getPrimID(ref);
+    for (uint32 i = 0; i < primNum; ++i) {
+      const uint32 primID = bvh.primID[firstPrim + i];
+      PrimIntersect(bvh.prim[primID], primID, org, dir, hit);
+    }
+  }
+
+  /*! Stack of children to visit with their entry distance */
+  struct BVH4RayStack
+  {
+    /*! Stack is empty */
+    INLINE BVH4RayStack(void) : top(0) {}
+    /*! Remove one element from the stack */
+    INLINE bool pop(void) { return --top >= 0; }
+    /*! Push a new element */
+    INLINE void push(uint32 ref, uint32 primNum, float dist) {
+      elem[top].ref = ref;
+      elem[top].primNum = primNum;
+      elem[top++].dist = dist;
+    }
+    /*! Element of the stack */
+    struct Elem {
+      uint32 ref;
+      uint32 primNum;
+      float dist;
+    };
+    enum { MAX_DEPTH = 3*64+1 }; //!< Maximum stack depth
+    Elem elem[MAX_DEPTH];        //!< All the pushed nodes
+    int32 top;                   //!< Current size of the stack
+  };
+
+  template <typename T>
+  void BVH4Traverser<T>::traverse(const Ray &ray, Hit &hit) const
+  {
+    BVH4RayStack stack;
+    const ssef org = ssef(&ray.org.x).xyzz();
+    const sse3f dir(ray.dir.x, ray.dir.y, ray.dir.z);
+    const sse3f rdir(ray.rdir.x, ray.rdir.y, ray.rdir.z);
+    const sse3f orgSoA(ray.org.x, ray.org.y, ray.org.z);
+
+    // Closest and farthest planes of the boxes depend on the ray direction
+    const uint32 nearX = ray.rdir.x < 0.f ? 1 : 0;
+    const uint32 nearY = ray.rdir.y < 0.f ? 1 : 0;
+    const uint32 nearZ = ray.rdir.z < 0.f ? 1 : 0;
+    const uint32 farX = nearX ^ 1, farY = nearY ^ 1, farZ = nearZ ^ 1;
+    stack.push(BVH4Node::makeNode(0), 0, 0.f);
+
+  popNode:
+    while (LIKELY(stack.pop())) {
+      const BVH4RayStack::Elem &elem = stack.elem[stack.top];
+      if (elem.dist > hit.t) continue;
+      uint32 ref = elem.ref;
+      uint32 primNum = elem.primNum;
+      for (;;) {
+        if (BVH4Node::isLeaf(ref)) {
+          LeafIntersect(*bvh, ref, primNum, org, dir, hit);
+          goto popNode;
+        }
+
+        // Intersect the 4 children at once
+        const BVH4Node &node = bvh->node[BVH4Node::getNodeID(ref)];
+        const ssef tNearX = (node.bounds[0][nearX] - orgSoA.x) * rdir.x;
+        const ssef tNearY = (node.bounds[1][nearY] - orgSoA.y) * rdir.y;
+        const ssef tNearZ = (node.bounds[2][nearZ] - orgSoA.z) * rdir.z;
+        const ssef tFarX = (node.bounds[0][farX] - orgSoA.x) * rdir.x;
+        const ssef tFarY = (node.bounds[1][farY] - orgSoA.y) * rdir.y;
+        const ssef tFarZ = (node.bounds[2][farZ] - orgSoA.z) * rdir.z;
+        const ssef tNear = max(max(tNearX, tNearY), max(tNearZ, ssef(zero)));
+        const ssef tFar = min(min(tFarX, tFarY), min(tFarZ, ssef(hit.t)));
+        size_t mask = movemask(tNear <= tFar);
+        if (mask == 0) goto popNode;
+
+        // Only one child is hit: just go down
+        const size_t r0 = __bsf(mask);
+        mask &= mask - 1;
+        if (LIKELY(mask == 0)) {
+          ref = node.child[r0];
+          primNum = node.primNum[r0];
+          continue;
+        }
+
+        // Two children: push the farthest and go down into the closest one
+        const size_t r1 = __bsf(mask);
+        mask &= mask - 1;
+        if (LIKELY(mask == 0)) {
+          const size_t closest = tNear[r0] < tNear[r1] ? r0 : r1;
+          const size_t farthest = closest ^ r0 ^ r1;
+          stack.push(node.child[farthest], node.primNum[farthest], tNear[farthest]);
+          ref = node.child[closest];
+          primNum = node.primNum[closest];
+          continue;
+        }
+
+        // Three or four children: push them all and sort them from the
+        // farthest to the closest one
+        const int32 first = stack.top;
+        stack.push(node.child[r0], node.primNum[r0], tNear[r0]);
+        stack.push(node.child[r1], node.primNum[r1], tNear[r1]);
+        while (mask) {
+          const size_t r = __bsf(mask);
+          mask &= mask - 1;
+          stack.push(node.child[r], node.primNum[r], tNear[r]);
+        }
+        for (int32 i = first + 1; i < stack.top; ++i) {
+          const BVH4RayStack::Elem curr = stack.elem[i];
+          int32 j = i - 1;
+          for (; j >= first && stack.elem[j].dist < curr.dist; --j)
+            stack.elem[j + 1] = stack.elem[j];
+          stack.elem[j + 1] = curr;
+        }
+        stack.pop();
+        ref = stack.elem[stack.top].ref;
+        primNum = stack.elem[stack.top].primNum;
+      }
+    }
+  }
+
+  template <typename T>
+  bool BVH4Traverser<T>::occluded(const Ray &ray) const {
+    NOT_IMPLEMENTED;
+    return false;
+  }
+
+  /*! Explicit instantiation for BVH4s of RTTriangle */
+  template void BVH4Traverser<RTTriangle>::traverse(const Ray&, Hit&) const;
+  template bool BVH4Traverser<RTTriangle>::occluded(const Ray&) const;
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Ray Packet Routines
+  ///////////////////////////////////////////////////////////////////////////
+
+  /*! Bounds of one child (w is a copy of z like for the BVH2 nodes) */
+  INLINE void getChildBBox(const BVH4Node &node, uint32 childID, ssef &lower, ssef &upper) {
+    const float lowerZ = node.bounds[2][0][childID];
+    const float upperZ = node.bounds[2][1][childID];
+    lower = ssef(node.bounds[0][0][childID], node.bounds[1][0][childID], lowerZ, lowerZ);
+    upper = ssef(node.bounds[0][1][childID], node.bounds[1][1][childID], upperZ, upperZ);
+  }
+
+  /*! Generic Packet / Leaf intersection. With anyHit, hit rays are killed */
+  template <bool anyHit, typename T, uint32 w, uint32 h>
+  INLINE void LeafIntersect(const BVH4<T> &bvh, const BVH4Node &node, uint32 childID,
+                            const RayPacketT<w,h> &pckt, uint32 first,
+                            PacketHitT<w,h> &hit)
+  {
+    uint32 active[RayPacketT<w,h>::chunkNum];
+    uint32 activeNum;
+    ssef lower, upper;
+    getChildBBox(node, childID, lower, upper);
+    if (AABBIntersect(lower, upper, pckt, hit, first, active, activeNum)) {
+      const uint32 firstPrim = BVH4Node::getPrimID(node.child[childID]);
+      const uint32 primNum = node.primNum[childID];
+      for (uint32 i = 0; i < primNum; ++i) {
+        const uint32 primID = bvh.primID[firstPrim + i];
+        if (anyHit)
+          PrimOccluded(bvh.prim[primID], pckt, active, activeNum, hit);
+        else
+          PrimIntersect(bvh.prim[primID], primID, pckt, active, activeNum, hit);
+      }
+    }
+  }
+
+  /*! Call stack for packets (only inner nodes are pushed) */
+  struct BVH4PacketStack
+  {
+    BVH4PacketStack(void) : top(0) {}
+    /*! Update top of the stack value */
+    INLINE bool pop(void) { return --top >= 0; }
+    /*! Push a new element */
+    INLINE void push(uint32 nodeID, uint32 first) {
+      elem[top].nodeID = nodeID;
+      elem[top++].first = first;
+    }
+    /*! Element of the stack */
+    struct Elem {
+      uint32 first;
+      uint32 nodeID;
+    };
+    enum { MAX_DEPTH = 3*64+1 }; //! Maximum stack depth
+    Elem elem[MAX_DEPTH];        //!< All the pushed nodes
+    int32 top;                   //!< Current size of the stack
+  };
+
+  /*! Closest hit or any hit (occlusion) packet traversal */
+  template <bool anyHit, typename T, uint32 w, uint32 h>
+  static void traversePacket(const BVH4<T> &bvh,
+                             const RayPacketT<w,h> &pckt,
+                             PacketHitT<w,h> &hit)
+  {
+    BVH4PacketStack stack;
+    stack.push(0,0);
+
+    // Children are sorted along the direction of the first ray
+    const ssef org(pckt.org[0].x[0], pckt.org[0].y[0], pckt.org[0].z[0], 0.f);
+    const ssef dir(pckt.dir[0].x[0], pckt.dir[0].y[0], pckt.dir[0].z[0], 0.f);
+
+    while (LIKELY(stack.pop())) {
+      const uint32 nodeID = stack.elem[stack.top].nodeID;
+      const uint32 firstActive = stack.elem[stack.top].first;
+      const BVH4Node &node = bvh.node[nodeID];
+
+      // Find the intersected children
+      uint32 hitID[4], hitFirst[4];
+      float hitDist[4];
+      uint32 hitNum = 0;
+      for (uint32 i = 0; i < 4; ++i) {
+        if (BVH4Node::isLeaf(node.child[i]) && node.primNum[i] == 0) continue;
+        ssef lower, upper;
+        getChildBBox(node, i, lower, upper);
+        uint32 first = firstActive;
+        if (!AABBIntersect(lower, upper, pckt, hit, first)) continue;
+        const float dist = reduce_add(((lower + upper) * ssef(.5f) - org) * dir)[0];
+        uint32 j = hitNum++;
+        for (; j > 0 && hitDist[j - 1] > dist; --j) {
+          hitID[j] = hitID[j - 1];
+          hitFirst[j] = hitFirst[j - 1];
+          hitDist[j] = hitDist[j - 1];
+        }
+        hitID[j] = i;
+        hitFirst[j] = first;
+        hitDist[j] = dist;
+      }
+
+      // Leaves are intersected right now and inner nodes are pushed from the
+      // farthest to the closest
+      for (uint32 i = 0; i < hitNum; ++i)
+        if (BVH4Node::isLeaf(node.child[hitID[i]])) {
+          LeafIntersect<anyHit>(bvh, node, hitID[i], pckt, hitFirst[i], hit);
+          if (anyHit && isOccluded(hit)) return;
+        }
+      for (int32 i = int32(hitNum) - 1; i >= 0; --i)
+        if (!BVH4Node::isLeaf(node.child[hitID[i]]))
+          stack.push(BVH4Node::getNodeID(node.child[hitID[i]]), hitFirst[i]);
+    }
+  }
+
+  /*! Closest hit and any hit routines for one packet size */
+#define DECL_PACKET_TRAVERSAL(W,H) \
+  template <typename T> \
+  void BVH4Traverser<T>::traverse(const RayPacketT<W,H> &pckt, PacketHitT<W,H> &hit) const { \
+    traversePacket<false>(*bvh, pckt, hit); \
+  } \
+  template <typename T> \
+  void BVH4Traverser<T>::occluded(const RayPacketT<W,H> &pckt, const ssef tfar[], sseb mask[]) const { \
+    PacketHitT<W,H> hit; \
+    initOcclusion(mask, tfar, hit); \
+    traversePacket<true>(*bvh, pckt, hit); \
+    getOcclusion(hit, mask); \
+  } \
+  template void BVH4Traverser<RTTriangle>::traverse(const RayPacketT<W,H>&, PacketHitT<W,H>&) const; \
+  template void BVH4Traverser<RTTriangle>::occluded(const RayPacketT<W,H>&, const ssef[], sseb[]) const;
+
+  /*! Explicit instantiation for BVH4s of RTTriangle */
+  DECL_PACKET_TRAVERSAL(4,4)
+  DECL_PACKET_TRAVERSAL(8,8)
+  DECL_PACKET_TRAVERSAL(16,16)
+#undef DECL_PACKET_TRAVERSAL
+
+} /* namespace pf */
+
@@ -0,0 +1,68 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "bvh8.hpp"
+#include "bvh_collapse.hpp"
+#include "rt_triangle.hpp"
+#include "sys/logging.hpp"
+
+#include <cstring>
+
+namespace pf
+{
+  template <typename T>
+  void buildBVH8(const BVH2<T> &bvh2, BVH8<T> &bvh8)
+  {
+    PF_MSG_V("BVH8: collapsing BVH2");
+    const double start = getSeconds();
+    bvh8.nodeNum = collapseBVH2<8>(bvh2, bvh8.node);
+    PF_MSG_V("BVH8: " << bvh8.nodeNum << " nodes");
+
+    PF_MSG_V("BVH8: Copying primitives and primitive IDs");
+    bvh8.primNum = bvh2.primNum;
+    bvh8.prim = PF_NEW_ARRAY(T, bvh2.primNum);
+    bvh8.primID = PF_NEW_ARRAY(uint32, bvh2.primIDNum);
+    std::memcpy(bvh8.prim, bvh2.prim, sizeof(T) * bvh2.primNum);
+    std::memcpy(bvh8.primID, bvh2.primID, sizeof(uint32) * bvh2.primIDNum);
+    PF_MSG_V("BVH8: Time to collapse " << getSeconds() - start << " sec");
+  }
+
+  template <typename T>
+  void buildBVH8(const T *t, uint32 primNum, BVH8<T> &bvh, const BVH2BuildOption &option)
+  {
+    BVH2<T> bvh2;
+    buildBVH2(t, primNum, bvh2, option);
+    buildBVH8(bvh2, bvh);
+  }
+
+  template <typename T>
+  void refitBVH8(BVH8<T> &bvh, const T *prims)
+  {
+    PF_ASSERT(bvh.node != NULL && prims != NULL);
+    if (prims != bvh.prim)
+      std::memcpy(bvh.prim, prims, sizeof(T) * bvh.primNum);
+    refitCollapsedBVH<8>(bvh.node, bvh.nodeNum, bvh.prim, bvh.primID);
+  }
+
+  // Instantiation for RTTriangle
+  template void buildBVH8<RTTriangle>(const BVH2<RTTriangle>&, BVH8<RTTriangle>&);
+  template void buildBVH8<RTTriangle>(const RTTriangle*, uint32, BVH8<RTTriangle>&, const BVH2BuildOption&);
+  template void refitBVH8<RTTriangle>(BVH8<RTTriangle>&, const RTTriangle*);
+  template BVH8<RTTriangle>::BVH8(void);
+  template BVH8<RTTriangle>::~BVH8(void);
+
+} /* namespace pf */
+
@@ -0,0 +1,108 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#ifndef __PF_BVH8_HPP__
+#define __PF_BVH8_HPP__
+
+#include "bvh2.hpp"
+#include "sys/ref.hpp"
+#include "sys/platform.hpp"
+
+namespace pf
+{
+  /*! 8-wide BVH node. Like the BVH4 node, the boxes of the children are
+   *  stored in SoA format but as plain floats such that the node can be built
+   *  and stored from code compiled without AVX support. The AVX traverser
+   *  loads each row with one 256 bits load
+   */
+  struct ALIGNED(32) BVH8Node
+  {
+    /* Aligned new and delete */
+    PF_ALIGNED_STRUCT(32);
+    /*! Child reference for a leaf and for an inner node */
+    static INLINE uint32 makeLeaf(uint32 primID) { return primID | BIT_FLAG; }
+    static INLINE uint32 makeNode(uint32 nodeID) { return nodeID; }
+    /*! Child reference decoding */
+    static INLINE bool isLeaf(uint32 ref) { return (ref & BIT_FLAG) != 0; }
+    static INLINE uint32 getPrimID(uint32 ref) { return ref & ~BIT_FLAG; }
+    static INLINE uint32 getNodeID(uint32 ref) { return ref; }
+    /*! Set the box of the given child */
+    INLINE void setBBox(uint32 childID, const vec3f &lower, const vec3f &upper) {
+      for (uint32 axis = 0; axis < 3; ++axis) {
+        bounds[axis][0][childID] = lower[axis];
+        bounds[axis][1][childID] = upper[axis];
+      }
+    }
+    /*! Make the child unused */
+    INLINE void setEmpty(uint32 childID) {
+      for (uint32 axis = 0; axis < 3; ++axis) {
+        bounds[axis][0][childID] = pos_inf;
+        bounds[axis][1][childID] = neg_inf;
+      }
+      child[childID] = makeLeaf(0);
+      primNum[childID] = 0;
+    }
+    float bounds[3][2][8]; //!< Lower and upper bounds per axis of the 8 children
+    uint32 child[8];       //!< Node ID or leaf first primitive ID index
+    uint32 primNum[8];     //!< Number of primitives (for leaves only)
+    static const uint32 BIT_FLAG = 0x80000000;
+  };
+
+  /*! 8-wide BVH. Primitive and primitive ID arrays have the same meaning as
+   *  for the BVH2
+   */
+  template <typename T>
+  struct BVH8 : public RefCount, public NonCopyable
+  {
+    /*! Empty tree */
+    BVH8(void);
+    /*! Release everything */
+    virtual ~BVH8(void);
+    BVH8Node *node; //!< All nodes. node[0] is the root
+    T *prim;        //!< Primitives the BVH sorts
+    uint32 *primID; //!< Indices of primitives per leaf
+    uint32 nodeNum; //!< Number of nodes in the tree
+    uint32 primNum; //!< The number of primitives
+    PF_STRUCT(BVH8);
+  };
+
+  template <typename T>
+  BVH8<T>::BVH8(void) : node(NULL), prim(NULL), primID(NULL), nodeNum(0), primNum(0) {}
+
+  template <typename T>
+  BVH8<T>::~BVH8(void) {
+    PF_ALIGNED_FREE(this->node);
+    PF_SAFE_DELETE_ARRAY(this->primID);
+    PF_SAFE_DELETE_ARRAY(this->prim);
+  }
+
+  /*! Collapse a BVH2 into a BVH8 (same greedy scheme as the BVH4) */
+  template <typename T>
+  void buildBVH8(const BVH2<T> &bvh2, BVH8<T> &bvh8);
+
+  /*! Compile a BVH2 and collapse it */
+  template <typename T>
+  void buildBVH8(const T *t, uint32 primNum, BVH8<T> &bvh,
+                 const BVH2BuildOption &option = defaultBVH2Options);
+
+  /*! Update the boxes after the primitives moved (see refitBVH2) */
+  template <typename T>
+  void refitBVH8(BVH8<T> &bvh, const T *prims);
+
+} /* namespace pf */
+
+#endif /* __PF_BVH8_HPP__ */
+
@@ -0,0 +1,389 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! This file is compiled with AVX enabled (see CMakeLists.txt). The rest of
+ *  the code base is not, so the routines here must only be reached when the
+ *  CPU supports AVX. Only use always inlined helpers here: an out-of-line
+ *  function shared with other files could end up with AVX encoded code
+ */
+#include "bvh8.hpp"
+#include "bvh8_traverser.hpp"
+#include "ray.hpp"
+#include "ray_packet.hpp"
+#include "rt_triangle.hpp"
+#include "rt_intersect.hpp"
+#include "simd/avx.hpp"
+
+namespace pf
+{
+  ///////////////////////////////////////////////////////////////////////////
+  /// Single Ray Routines
+  ///////////////////////////////////////////////////////////////////////////
+
+  /*! Generic ray / leaf intersection */
+  template <typename T>
+  INLINE void LeafIntersect(const BVH8<T> &bvh, uint32 ref, uint32 primNum,
+                            const ssef &org, const sse3f &dir, Hit &hit)
+  {
+    const uint32 firstPrim = BVH8Node::getPrimID(ref);
+    for (uint32 i = 0; i < primNum; ++i) {
+      const uint32 primID = bvh.primID[firstPrim + i];
+      PrimIntersect(bvh.prim[primID], primID, org, dir, hit);
+    }
+  }
+
+  /*! Stack of children to visit with their entry distance */
+  struct BVH8RayStack
+  {
+    /*! Stack is empty */
+    INLINE BVH8RayStack(void) : top(0) {}
+    /*! Remove one element from the stack */
+    INLINE bool pop(void) { return --top >= 0; }
+    /*! Push a new element */
+    INLINE void push(uint32 ref, uint32 primNum, float dist) {
+      elem[top].ref = ref;
+      elem[top].primNum = primNum;
+      elem[top++].dist = dist;
+    }
+    /*! Element of the stack */
+    struct Elem {
+      uint32 ref;
+      uint32 primNum;
+      float dist;
+    };
+    enum { MAX_DEPTH = 7*64+1 }; //!< Maximum stack depth
+    Elem elem[MAX_DEPTH];        //!< All the pushed nodes
+    int32 top;                   //!< Current size of the stack
+  };
+
+  template <typename T>
+  void BVH8Traverser<T>::traverse(const Ray &ray, Hit &hit) const
+  {
+    BVH8RayStack stack;
+    const ssef org = ssef(&ray.org.x).xyzz();
+    const sse3f dir(ray.dir.x, ray.dir.y, ray.dir.z);
+    const avxf rdirX(ray.rdir.x), rdirY(ray.rdir.y), rdirZ(ray.rdir.z);
+    const avxf orgX(ray.org.x), orgY(ray.org.y), orgZ(ray.org.z);
+
+    // Closest and farthest planes of the boxes depend on the ray direction
+    const uint32 nearX = ray.rdir.x < 0.f ? 1 : 0;
+    const uint32 nearY = ray.rdir.y < 0.f ? 1 : 0;
+    const uint32 nearZ = ray.rdir.z < 0.f ? 1 : 0;
+    const uint32 farX = nearX ^ 1, farY = nearY ^ 1, farZ = nearZ ^ 1;
+    stack.push(BVH8Node::makeNode(0), 0, 0.f);
+
+  popNode:
+    while (LIKELY(stack.pop())) {
+      const BVH8RayStack::Elem &elem = stack.elem[stack.top];
+      if (elem.dist > hit.t) continue;
+      uint32 ref = elem.ref;
+      uint32 primNum = elem.primNum;
+      for (;;) {
+        if (BVH8Node::isLeaf(ref)) {
+          LeafIntersect(*bvh, ref, primNum, org, dir, hit);
+          goto popNode;
+        }
+
+        // Intersect the 8 children at once
+        const BVH8Node &node = bvh->node[BVH8Node::getNodeID(ref)];
+        const avxf tNearX = (avxf(node.bounds[0][nearX]) - orgX) * rdirX;
+        const avxf tNearY = (avxf(node.bounds[1][nearY]) - orgY) * rdirY;
+        const avxf tNearZ = (avxf(node.bounds[2][nearZ]) - orgZ) * rdirZ;
+        const avxf tFarX = (avxf(node.bounds[0][farX]) - orgX) * rdirX;
+        const avxf tFarY = (avxf(node.bounds[1][farY]) - orgY) * rdirY;
+        const avxf tFarZ = (avxf(node.bounds[2][farZ]) - orgZ) * rdirZ;
+        const avxf tNear = max(max(tNearX, tNearY), max(tNearZ, avxf(zero)));
+        const avxf tFar = min(min(tFarX, tFarY), min(tFarZ, avxf(hit.t)));
+        size_t mask = movemask(tNear <= tFar);
+        if (mask == 0) goto popNode;
+
+        // Only one child is hit: just go down
+        const size_t r0 = __bsf(mask);
+        mask &= mask - 1;
+        if (LIKELY(mask == 0)) {
+          ref = node.child[r0];
+          primNum = node.primNum[r0];
+          continue;
+        }
+
+        // Two children: push the farthest and go down into the closest one
+        const size_t r1 = __bsf(mask);
+        mask &= mask - 1;
+        if (LIKELY(mask == 0)) {
+          const size_t closest = tNear[r0] < tNear[r1] ? r0 : r1;
+          const size_t farthest = closest ^ r0 ^ r1;
+          stack.push(node.child[farthest], node.primNum[farthest], tNear[farthest]);
+          ref = node.child[closest];
+          primNum = node.primNum[closest];
+          continue;
+        }
+
+        // More children: push them all and sort them from the farthest to
+        // the closest one
+        const int32 first = stack.top;
+        stack.push(node.child[r0], node.primNum[r0], tNear[r0]);
+        stack.push(node.child[r1], node.primNum[r1], tNear[r1]);
+        while (mask) {
+          const size_t r = __bsf(mask);
+          mask &= mask - 1;
+          stack.push(node.child[r], node.primNum[r], tNear[r]);
+        }
+        for (int32 i = first + 1; i < stack.top; ++i) {
+          const BVH8RayStack::Elem curr = stack.elem[i];
+          int32 j = i - 1;
+          for (; j >= first && stack.elem[j].dist < curr.dist; --j)
+            stack.elem[j + 1] = stack.elem[j];
+          stack.elem[j + 1] = curr;
+        }
+        stack.pop();
+        ref = stack.elem[stack.top].ref;
+        primNum = stack.elem[stack.top].primNum;
+      }
+    }
+  }
+
+  template <typename T>
+  bool BVH8Traverser<T>::occluded(const Ray &ray) const {
+    NOT_IMPLEMENTED;
+    return false;
+  }
+
+  /*! Explicit instantiation for BVH8s of RTTriangle */
+  template void BVH8Traverser<RTTriangle>::traverse(const Ray&, Hit&) const;
+  template bool BVH8Traverser<RTTriangle>::occluded(const Ray&) const;
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Ray Packet Routines
+  ///////////////////////////////////////////////////////////////////////////
+
+  /*! Packet origins and inverse directions repacked in AVX registers. Two
+   *  chunks of 4 rays are processed at once
+   */
+  template <uint32 w, uint32 h>
+  struct BVH8PacketT
+  {
+    static const uint32 pairNum = RayPacketT<w,h>::chunkNum / 2;
+    STATIC_ASSERT((RayPacketT<w,h>::chunkNum % 2) == 0);
+    INLINE BVH8PacketT(const RayPacketT<w,h> &pckt) {
+      for (uint32 i = 0; i < pairNum; ++i) {
+        const sse3f &r0 = pckt.rdir[2*i+0], &r1 = pckt.rdir[2*i+1];
+        const sse3f &o0 = pckt.org[2*i+0], &o1 = pckt.org[2*i+1];
+        rdir[0][i] = avxf(r0.x, r1.x);
+        rdir[1][i] = avxf(r0.y, r1.y);
+        rdir[2][i] = avxf(r0.z, r1.z);
+        org[0][i] = avxf(o0.x, o1.x);
+        org[1][i] = avxf(o0.y, o1.y);
+        org[2][i] = avxf(o0.z, o1.z);
+      }
+    }
+    avxf rdir[3][pairNum]; //!< Inverse directions per axis
+    avxf org[3][pairNum];  //!< Origins per axis
+  };
+
+  /*! Kay-Kajiya AABB intersection for 8 rays */
+  template <uint32 w, uint32 h>
+  INLINE avxb slab(const BVH8PacketT<w,h> &pckt8, uint32 pairID,
+                   const avxf dmin[3], const avxf dmax[3], const avxf &t)
+  {
+    avxf l1 = dmin[0] * pckt8.rdir[0][pairID];
+    avxf l2 = dmax[0] * pckt8.rdir[0][pairID];
+    avxf near = min(l1,l2);
+    avxf far  = max(l1,l2);
+    l1   = dmin[1] * pckt8.rdir[1][pairID];
+    l2   = dmax[1] * pckt8.rdir[1][pairID];
+    near = max(min(l1,l2), near);
+    far  = min(max(l1,l2), far);
+    l1   = dmin[2] * pckt8.rdir[2][pairID];
+    l2   = dmax[2] * pckt8.rdir[2][pairID];
+    near = max(min(l1,l2), near);
+    far  = min(max(l1,l2), far);
+    return (far >= near) & (far > avxf(zero)) & (near < t);
+  }
+
+  /*! Box / packet intersection by pairs of chunks. With active == NULL,
+   *  stop at the first intersecting chunk and return it in "first".
+   *  Otherwise, output all the intersecting chunks
+   */
+  template <uint32 w, uint32 h>
+  INLINE bool AABBIntersect(const BVH8Node &node, uint32 childID,
+                            const RayPacketT<w,h> &pckt,
+                            const BVH8PacketT<w,h> &pckt8,
+                            const PacketHitT<w,h> &hit, uint32 &first,
+                            uint32 *active = NULL, uint32 *activeNum = NULL)
+  {
+    // Interval arithmetic test is done with SSE (w is a copy of z)
+    const float lowerZ = node.bounds[2][0][childID];
+    const float upperZ = node.bounds[2][1][childID];
+    const ssef lower(node.bounds[0][0][childID], node.bounds[1][0][childID], lowerZ, lowerZ);
+    const ssef upper(node.bounds[0][1][childID], node.bounds[1][1][childID], upperZ, upperZ);
+    const ssef tmpMin = lower - pckt.iaMaxOrg;
+    const ssef tmpMax = upper - pckt.iaMinOrg;
+    if (pckt.properties & RAY_PACKET_IA)
+      if (slabIA(tmpMin, tmpMax, pckt.iasign, pckt.iaMinrDir, pckt.iaMaxrDir))
+        return false;
+
+    // Chunks before "first" already missed the parent box
+    bool isIntersected = false;
+    if (active) *activeNum = 0;
+    size_t valid = (first & 1) ? 0xf0 : 0xff;
+    for (uint32 i = first / 2; i < pckt8.pairNum; ++i, valid = 0xff) {
+      avxf dmin[3], dmax[3];
+      if (pckt.properties & RAY_PACKET_CO)
+        for (uint32 axis = 0; axis < 3; ++axis) {
+          dmin[axis] = avxf(tmpMin[axis]);
+          dmax[axis] = avxf(tmpMax[axis]);
+        }
+      else
+        for (uint32 axis = 0; axis < 3; ++axis) {
+          dmin[axis] = avxf(node.bounds[axis][0][childID]) - pckt8.org[axis][i];
+          dmax[axis] = avxf(node.bounds[axis][1][childID]) - pckt8.org[axis][i];
+        }
+      const avxf t(hit.t[2*i], hit.t[2*i+1]);
+      const size_t mask = movemask(slab(pckt8, i, dmin, dmax, t)) & valid;
+      if (mask == 0) continue;
+      if (active == NULL) {
+        first = 2*i + ((mask & 0xf) ? 0 : 1);
+        return true;
+      }
+      if (mask & 0x0f) active[(*activeNum)++] = 2*i;
+      if (mask & 0xf0) active[(*activeNum)++] = 2*i+1;
+      isIntersected = true;
+    }
+    return isIntersected;
+  }
+
+  /*! Generic Packet / Leaf intersection. With anyHit, hit rays are killed */
+  template <bool anyHit, typename T, uint32 w, uint32 h>
+  INLINE void LeafIntersect(const BVH8<T> &bvh, const BVH8Node &node, uint32 childID,
+                            const RayPacketT<w,h> &pckt,
+                            const BVH8PacketT<w,h> &pckt8,
+                            uint32 first, PacketHitT<w,h> &hit)
+  {
+    uint32 active[RayPacketT<w,h>::chunkNum];
+    uint32 activeNum;
+    if (AABBIntersect(node, childID, pckt, pckt8, hit, first, active, &activeNum)) {
+      const uint32 firstPrim = BVH8Node::getPrimID(node.child[childID]);
+      const uint32 primNum = node.primNum[childID];
+      for (uint32 i = 0; i < primNum; ++i) {
+        const uint32 primID = bvh.primID[firstPrim + i];
+        if (anyHit)
+          PrimOccluded(bvh.prim[primID], pckt, active, activeNum, hit);
+        else
+          PrimIntersect(bvh.prim[primID], primID, pckt, active, activeNum, hit);
+      }
+    }
+  }
+
+  /*! Call stack for packets (only inner nodes are pushed) */
+  struct BVH8PacketStack
+  {
+    BVH8PacketStack(void) : top(0) {}
+    /*! Update top of the stack value */
+    INLINE bool pop(void) { return --top >= 0; }
+    /*! Push a new element */
+    INLINE void push(uint32 nodeID, uint32 first) {
+      elem[top].nodeID = nodeID;
+      elem[top++].first = first;
+    }
+    /*! Element of the stack */
+    struct Elem {
+      uint32 first;
+      uint32 nodeID;
+    };
+    enum { MAX_DEPTH = 7*64+1 }; //! Maximum stack depth
+    Elem elem[MAX_DEPTH];        //!< All the pushed nodes
+    int32 top;                   //!< Current size of the stack
+  };
+
+  /*! Closest hit or any hit (occlusion) packet traversal */
+  template <bool anyHit, typename T, uint32 w, uint32 h>
+  static void traversePacket(const BVH8<T> &bvh,
+                             const RayPacketT<w,h> &pckt,
+                             PacketHitT<w,h> &hit)
+  {
+    const BVH8PacketT<w,h> pckt8(pckt);
+    BVH8PacketStack stack;
+    stack.push(0,0);
+
+    // Children are sorted along the direction of the first ray
+    const float orgX = pckt.org[0].x[0], orgY = pckt.org[0].y[0], orgZ = pckt.org[0].z[0];
+    const float dirX = pckt.dir[0].x[0], dirY = pckt.dir[0].y[0], dirZ = pckt.dir[0].z[0];
+
+    while (LIKELY(stack.pop())) {
+      const uint32 nodeID = stack.elem[stack.top].nodeID;
+      const uint32 firstActive = stack.elem[stack.top].first;
+      const BVH8Node &node = bvh.node[nodeID];
+
+      // Find the intersected children
+      uint32 hitID[8], hitFirst[8];
+      float hitDist[8];
+      uint32 hitNum = 0;
+      for (uint32 i = 0; i < 8; ++i) {
+        if (BVH8Node::isLeaf(node.child[i]) && node.primNum[i] == 0) continue;
+        uint32 first = firstActive;
+        if (!AABBIntersect(node, i, pckt, pckt8, hit, first)) continue;
+        const float dist =
+          (.5f * (node.bounds[0][0][i] + node.bounds[0][1][i]) - orgX) * dirX +
+          (.5f * (node.bounds[1][0][i] + node.bounds[1][1][i]) - orgY) * dirY +
+          (.5f * (node.bounds[2][0][i] + node.bounds[2][1][i]) - orgZ) * dirZ;
+        uint32 j = hitNum++;
+        for (; j > 0 && hitDist[j - 1] > dist; --j) {
+          hitID[j] = hitID[j - 1];
+          hitFirst[j] = hitFirst[j - 1];
+          hitDist[j] = hitDist[j - 1];
+        }
+        hitID[j] = i;
+        hitFirst[j] = first;
+        hitDist[j] = dist;
+      }
+
+      // Leaves are intersected right now and inner nodes are pushed from the
+      // farthest to the closest
+      for (uint32 i = 0; i < hitNum; ++i)
+        if (BVH8Node::isLeaf(node.child[hitID[i]])) {
+          LeafIntersect<anyHit>(bvh, node, hitID[i], pckt, pckt8, hitFirst[i], hit);
+          if (anyHit && isOccluded(hit)) return;
+        }
+      for (int32 i = int32(hitNum) - 1; i >= 0; --i)
+        if (!BVH8Node::isLeaf(node.child[hitID[i]]))
+          stack.push(BVH8Node::getNodeID(node.child[hitID[i]]), hitFirst[i]);
+    }
+  }
+
+  /*! Closest hit and any hit routines for one packet size */
+#define DECL_PACKET_TRAVERSAL(W,H) \
+  template <typename T> \
+  void BVH8Traverser<T>::traverse(const RayPacketT<W,H> &pckt, PacketHitT<W,H> &hit) const { \
+    traversePacket<false>(*bvh, pckt, hit); \
+  } \
+  template <typename T> \
+  void BVH8Traverser<T>::occluded(const RayPacketT<W,H> &pckt, const ssef tfar[], sseb mask[]) const { \
+    PacketHitT<W,H> hit; \
+    initOcclusion(mask, tfar, hit); \
+    traversePacket<true>(*bvh, pckt, hit); \
+    getOcclusion(hit, mask); \
+  } \
+  template void BVH8Traverser<RTTriangle>::traverse(const RayPacketT<W,H>&, PacketHitT<W,H>&) const; \
+  template void BVH8Traverser<RTTriangle>::occluded(const RayPacketT<W,H>&, const ssef[], sseb[]) const;
+
+  /*! Explicit instantiation for BVH8s of RTTriangle */
+  DECL_PACKET_TRAVERSAL(4,4)
+  DECL_PACKET_TRAVERSAL(8,8)
+  DECL_PACKET_TRAVERSAL(16,16)
+#undef DECL_PACKET_TRAVERSAL
+
+} /* namespace pf */
+
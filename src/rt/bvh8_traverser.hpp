@@ -0,0 +1,65 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#ifndef __PF_BVH8_TRAVERSER_HPP__
+#define __PF_BVH8_TRAVERSER_HPP__
+
+#include "intersector.hpp"
+
+namespace pf
+{
+  // Structure to traverse
+  template <typename T> struct BVH8;
+
+  /*! Traverse a 8-wide BVH with AVX. Single rays test the 8 children of a
+   *  node at once. Packets test two chunks of 4 rays at once. The traversal
+   *  routines are compiled with AVX enabled and must only be called when
+   *  hasAVX() is true (see buildIntersector)
+   */
+  template <typename T>
+  class BVH8Traverser : public Intersector
+  {
+  public:
+    /*! We keep a reference on the BVH */
+    BVH8Traverser(Ref< BVH8<T> > bvh) : bvh(bvh) {}
+
+    /*! Traverse routine for rays */
+    virtual void traverse(const Ray &ray, Hit &hit) const;
+
+    /*! Traverse routine for ray packets. Return u,v,t and ID of primitive of
+     *  for each ray of the packet
+     */
+    virtual void traverse(const RayPacket4x4 &pckt, PacketHit4x4 &hit) const;
+    virtual void traverse(const RayPacket &pckt, PacketHit &hit) const;
+    virtual void traverse(const RayPacket16x16 &pckt, PacketHit16x16 &hit) const;
+
+    /*! Shadow ray routine for rays. True if occluded */
+    virtual bool occluded(const Ray &ray) const;
+
+    /*! Shadow ray routine for ray packets (see Intersector) */
+    virtual void occluded(const RayPacket4x4 &pckt, const ssef tfar[], sseb mask[]) const;
+    virtual void occluded(const RayPacket &pckt, const ssef tfar[], sseb mask[]) const;
+    virtual void occluded(const RayPacket16x16 &pckt, const ssef tfar[], sseb mask[]) const;
+
+    /*! The BVH we intersect */
+    Ref< BVH8<T> > bvh;
+    PF_CLASS(BVH8Traverser);
+  };
+
+} /* namespace pf */
+
+#endif /* __PF_BVH8_TRAVERSER_HPP__ */
+
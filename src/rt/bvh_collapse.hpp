@@ -0,0 +1,142 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#ifndef __PF_BVH_COLLAPSE_HPP__
+#define __PF_BVH_COLLAPSE_HPP__
+
+#include "bvh2.hpp"
+#include "math/bbox.hpp"
+#include "sys/tasking.hpp"
+
+#include <cstring>
+
+namespace pf
+{
+  /*! Half surface of a BVH2 node */
+  static INLINE float halfArea(const BVH2Node &node) {
+    return halfArea(BBox3f(node.getMin(), node.getMax()));
+  }
+
+  /*! Collapse a BVH2 into a N-wide tree. The children of the largest (by
+   *  surface) inner child are pulled up until each node has N children.
+   *  NodeType provides makeLeaf, makeNode, setBBox, setEmpty and the child
+   *  and primNum arrays. Return the number of nodes allocated in "out"
+   */
+  template <uint32 width, typename NodeType, typename T>
+  uint32 collapseBVH2(const BVH2<T> &bvh2, NodeType *&out)
+  {
+    PF_ASSERT(bvh2.node != NULL && bvh2.nodeNum > 0);
+    TaskScratchScope scope(TaskingSystemGetScratch());
+
+    // Each N-wide node consumes at least one BVH2 inner node
+    const uint32 maxNodeNum = max(bvh2.nodeNum / 2, 1u);
+    TaskScratch &scratch = TaskingSystemGetScratch();
+    NodeType *node = scratch.allocateArray<NodeType>(maxNodeNum);
+    struct Job { uint32 from, to; };
+    Job *stack = scratch.allocateArray<Job>(maxNodeNum);
+    int32 stackSize = 0;
+    uint32 nodeNum = 1;
+    stack[stackSize].from = 0;
+    stack[stackSize++].to = 0;
+
+    while (stackSize > 0) {
+      const Job job = stack[--stackSize];
+      const BVH2Node &from = bvh2.node[job.from];
+      NodeType &to = node[job.to];
+
+      // Open the largest inner children until we have N of them
+      uint32 children[width];
+      uint32 childNum = 0;
+      if (from.isLeaf())
+        children[childNum++] = job.from;
+      else {
+        children[childNum++] = from.getOffset();
+        children[childNum++] = from.getOffset() + 1;
+      }
+      while (childNum < width) {
+        int32 largest = -1;
+        float largestArea = -1.f;
+        for (uint32 i = 0; i < childNum; ++i) {
+          const BVH2Node &child = bvh2.node[children[i]];
+          if (child.isLeaf()) continue;
+          const float area = halfArea(child);
+          if (area <= largestArea) continue;
+          largest = i;
+          largestArea = area;
+        }
+        if (largest == -1) break;
+        const uint32 offset = bvh2.node[children[largest]].getOffset();
+        children[largest] = offset;
+        children[childNum++] = offset + 1;
+      }
+
+      // Output the children and compile the inner ones later
+      for (uint32 i = 0; i < childNum; ++i) {
+        const BVH2Node &child = bvh2.node[children[i]];
+        to.setBBox(i, child.getMin(), child.getMax());
+        if (child.isLeaf()) {
+          to.child[i] = NodeType::makeLeaf(child.getPrimID());
+          to.primNum[i] = child.getPrimNum();
+        } else {
+          PF_ASSERT(nodeNum < maxNodeNum);
+          to.child[i] = NodeType::makeNode(nodeNum);
+          to.primNum[i] = 0;
+          stack[stackSize].from = children[i];
+          stack[stackSize++].to = nodeNum++;
+        }
+      }
+      for (uint32 i = childNum; i < width; ++i) to.setEmpty(i);
+    }
+
+    out = (NodeType*) PF_ALIGNED_MALLOC(sizeof(NodeType) * nodeNum, CACHE_LINE);
+    std::memcpy(out, node, sizeof(NodeType) * nodeNum);
+    return nodeNum;
+  }
+
+  /*! Update the child boxes of a collapsed tree after its primitives moved
+   *  (same topology). Children always come after their parent: the nodes are
+   *  simply processed from the last one
+   */
+  template <uint32 width, typename NodeType, typename T>
+  void refitCollapsedBVH(NodeType *node, uint32 nodeNum,
+                         const T *prim, const uint32 *primID)
+  {
+    for (int32 nodeID = int32(nodeNum) - 1; nodeID >= 0; --nodeID) {
+      NodeType &to = node[nodeID];
+      for (uint32 i = 0; i < width; ++i) {
+        BBox3f aabb(empty);
+        if (NodeType::isLeaf(to.child[i])) {
+          if (to.primNum[i] == 0) continue; // Unused child
+          const uint32 first = NodeType::getPrimID(to.child[i]);
+          for (uint32 j = first; j < first + to.primNum[i]; ++j)
+            aabb.grow(prim[primID[j]].getAABB());
+        } else {
+          const NodeType &child = node[NodeType::getNodeID(to.child[i])];
+          for (uint32 j = 0; j < width; ++j)
+            for (uint32 axis = 0; axis < 3; ++axis) {
+              aabb.lower[axis] = min(aabb.lower[axis], float(child.bounds[axis][0][j]));
+              aabb.upper[axis] = max(aabb.upper[axis], float(child.bounds[axis][1][j]));
+            }
+        }
+        to.setBBox(i, aabb.lower, aabb.upper);
+      }
+    }
+  }
+
+} /* namespace pf */
+
+#endif /* __PF_BVH_COLLAPSE_HPP__ */
+
@@ -0,0 +1,92 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "instance_intersector.hpp"
+#include "bvh2.hpp"
+#include "bvh2_traverser.hpp"
+#include "ray.hpp"
+#include "ray_packet.hpp"
+
+namespace pf
+{
+  /*! Instances are few: small leaves are better */
+  static const BVH2BuildOption instanceBVH2Options(1, 4, 1.f, 1.f);
+
+  InstanceIntersector::InstanceIntersector(void) {}
+  InstanceIntersector::~InstanceIntersector(void) {}
+
+  uint32 InstanceIntersector::add(Ref<Intersector> object,
+                                  const BBox3f &box,
+                                  const mat4x4f &model)
+  {
+    PF_ASSERT(object && !this->bvh);
+    this->instances.push_back(RTInstance(object.ptr, box, model));
+    this->objects.push_back(object);
+    return uint32(this->instances.size()) - 1;
+  }
+
+  void InstanceIntersector::compile(void)
+  {
+    PF_ASSERT(!this->bvh);
+    FATAL_IF(instances.size() == 0, "No instance to compile");
+    this->bvh = PF_NEW(BVH2<RTInstance>);
+    buildBVH2(&instances[0], uint32(instances.size()), *bvh, instanceBVH2Options);
+    this->top = PF_NEW(BVH2Traverser<RTInstance>, bvh);
+  }
+
+  void InstanceIntersector::traverse(const Ray &ray, Hit &hit) const {
+    PF_ASSERT(this->top);
+    top->traverse(ray, hit);
+  }
+
+  void InstanceIntersector::traverse(const RayPacket4x4 &pckt, PacketHit4x4 &hit) const {
+    PF_ASSERT(this->top);
+    top->traverse(pckt, hit);
+  }
+
+  void InstanceIntersector::traverse(const RayPacket &pckt, PacketHit &hit) const {
+    PF_ASSERT(this->top);
+    top->traverse(pckt, hit);
+  }
+
+  void InstanceIntersector::traverse(const RayPacket16x16 &pckt, PacketHit16x16 &hit) const {
+    PF_ASSERT(this->top);
+    top->traverse(pckt, hit);
+  }
+
+  bool InstanceIntersector::occluded(const Ray &ray) const {
+    Hit hit;
+    this->traverse(ray, hit);
+    return hit.id0 != -1;
+  }
+
+  void InstanceIntersector::occluded(const RayPacket4x4 &pckt, const ssef tfar[], sseb mask[]) const {
+    PF_ASSERT(this->top);
+    top->occluded(pckt, tfar, mask);
+  }
+
+  void InstanceIntersector::occluded(const RayPacket &pckt, const ssef tfar[], sseb mask[]) const {
+    PF_ASSERT(this->top);
+    top->occluded(pckt, tfar, mask);
+  }
+
+  void InstanceIntersector::occluded(const RayPacket16x16 &pckt, const ssef tfar[], sseb mask[]) const {
+    PF_ASSERT(this->top);
+    top->occluded(pckt, tfar, mask);
+  }
+
+} /* namespace pf */
+
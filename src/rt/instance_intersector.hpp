@@ -0,0 +1,70 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#ifndef __PF_INSTANCE_INTERSECTOR_HPP__
+#define __PF_INSTANCE_INTERSECTOR_HPP__
+
+#include "intersector.hpp"
+#include "rt_instance.hpp"
+#include "sys/vector.hpp"
+
+namespace pf
+{
+  template <typename T> struct BVH2; // Top level BVH
+
+  /*! Two-level intersector: a BVH2 over instances of other intersectors. Each
+   *  instance only stores a transform such that many instances share the same
+   *  bottom level. Rays and packets are transformed in object space when they
+   *  reach an instance. The top level is small and meant to be rebuilt as
+   *  often as the instances move (typically once per frame)
+   */
+  class InstanceIntersector : public Intersector
+  {
+  public:
+    InstanceIntersector(void);
+    ~InstanceIntersector(void);
+    /*! Add an instance of object. box is the object space bounding box of the
+     *  object and model transforms from object to world space. Returns the
+     *  instance ID reported in id1 of the hits
+     */
+    uint32 add(Ref<Intersector> object, const BBox3f &box, const mat4x4f &model);
+    /*! Build the top level BVH over the instances added so far */
+    void compile(void);
+    /*! Traverse routine for rays */
+    virtual void traverse(const Ray &ray, Hit &hit) const;
+    /*! Traverse routine for ray packets */
+    virtual void traverse(const RayPacket4x4 &pckt, PacketHit4x4 &hit) const;
+    virtual void traverse(const RayPacket &pckt, PacketHit &hit) const;
+    virtual void traverse(const RayPacket16x16 &pckt, PacketHit16x16 &hit) const;
+    /*! Shadow ray routine for rays. True if occluded */
+    virtual bool occluded(const Ray &ray) const;
+    /*! Shadow ray routine for ray packets (see Intersector) */
+    virtual void occluded(const RayPacket4x4 &pckt, const ssef tfar[], sseb mask[]) const;
+    virtual void occluded(const RayPacket &pckt, const ssef tfar[], sseb mask[]) const;
+    virtual void occluded(const RayPacket16x16 &pckt, const ssef tfar[], sseb mask[]) const;
+    /*! Number of instances */
+    INLINE uint32 getInstanceNum(void) const { return uint32(instances.size()); }
+  private:
+    vector<RTInstance> instances;     //!< Instances to put in the BVH
+    vector<Ref<Intersector> > objects;//!< Keep the bottom levels alive
+    Ref<BVH2<RTInstance> > bvh;       //!< Top level BVH
+    Ref<Intersector> top;             //!< Traverses the top level BVH
+    PF_CLASS(InstanceIntersector);
+  };
+} /* namespace pf */
+
+#endif /* __PF_INSTANCE_INTERSECTOR_HPP__ */
+
@@ -0,0 +1,53 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "intersector.hpp"
+#include "bvh2.hpp"
+#include "bvh4.hpp"
+#include "bvh4_traverser.hpp"
+#include "bvh8.hpp"
+#include "bvh8_traverser.hpp"
+#include "rt_triangle.hpp"
+#include "sys/logging.hpp"
+#include "sys/sysinfo.hpp"
+
+namespace pf
+{
+  Ref<Intersector> buildIntersector(const BVH2<RTTriangle> &bvh2)
+  {
+    static const bool avx = hasAVX();
+    if (avx) {
+      PF_MSG_V("Intersector: AVX supported, using a BVH8");
+      Ref< BVH8<RTTriangle> > bvh = PF_NEW(BVH8<RTTriangle>);
+      buildBVH8(bvh2, *bvh);
+      return PF_NEW(BVH8Traverser<RTTriangle>, bvh);
+    } else {
+      PF_MSG_V("Intersector: AVX not supported, using a BVH4");
+      Ref< BVH4<RTTriangle> > bvh = PF_NEW(BVH4<RTTriangle>);
+      buildBVH4(bvh2, *bvh);
+      return PF_NEW(BVH4Traverser<RTTriangle>, bvh);
+    }
+  }
+
+  Ref<Intersector> buildIntersector(const RTTriangle *tris, uint32 triNum)
+  {
+    BVH2<RTTriangle> bvh2;
+    buildBVH2(tris, triNum, bvh2);
+    return buildIntersector(bvh2);
+  }
+
+} /* namespace pf */
+
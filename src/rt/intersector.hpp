@@ -23,8 +23,20 @@ namespace pf
 {
   struct Ray;             // Single ray structure
   struct Hit;             // Store ray hit information
-  struct RayPacket;       // Packet of rays
-  struct PacketHit;       // Store ray packet hit information
+  template <uint32 w, uint32 h> struct RayPacketT; // Packet of rays
+  template <uint32 w, uint32 h> struct PacketHitT; // Store packet hit information
+  typedef RayPacketT<4,4>   RayPacket4x4;
+  typedef RayPacketT<8,8>   RayPacket;
+  typedef RayPacketT<16,16> RayPacket16x16;
+  typedef PacketHitT<4,4>   PacketHit4x4;
+  typedef PacketHitT<8,8>   PacketHit;
+  typedef PacketHitT<16,16> PacketHit16x16;
+  struct sseb;            // Occlusion mask of 4 rays
+  struct ssef;            // Segment ends of 4 shadow rays
+  struct RayStream;       // Large batch of rays
+  struct HitStream;       // Store ray stream hit information
+  struct RTTriangle;      // Triangle we may build an intersector for
+  template <typename T> struct BVH2; // Binary BVH we may collapse
 
   /*! Represents any kind of intersectable geometry that we are going to
    *  traverse with rays or packet of rays
@@ -36,13 +48,38 @@ namespace pf
     virtual void traverse(const Ray &ray, Hit &hit) const = 0;
 
     /*! Traverse routine for ray packets. Return u,v,t and ID of primitive of
-     *  for each ray of the packet
+     *  for each ray of the packet. All packet sizes are supported
      */
+    virtual void traverse(const RayPacket4x4 &pckt, PacketHit4x4 &hit) const = 0;
     virtual void traverse(const RayPacket &pckt, PacketHit &hit) const = 0;
+    virtual void traverse(const RayPacket16x16 &pckt, PacketHit16x16 &hit) const = 0;
+
+    /*! Traverse routine for ray streams. Rays are sorted by direction octant
+     *  and origin cell. Coherent groups are then traversed as packets and the
+     *  remaining rays one by one
+     */
+    virtual void traverse(const RayStream &stream, HitStream &hit) const;
 
     /*! Shadow ray routine for rays. True if occluded */
     virtual bool occluded(const Ray &ray) const = 0;
+
+    /*! Shadow ray routine for ray packets. On entry, "mask" gives the rays
+     *  to test. On exit, it gives the occluded ones. Only the occluders
+     *  closer than tfar (one distance per ray) are considered
+     */
+    virtual void occluded(const RayPacket4x4 &pckt, const ssef tfar[], sseb mask[]) const = 0;
+    virtual void occluded(const RayPacket &pckt, const ssef tfar[], sseb mask[]) const = 0;
+    virtual void occluded(const RayPacket16x16 &pckt, const ssef tfar[], sseb mask[]) const = 0;
   };
+
+  /*! Build the fastest intersector the CPU supports for the given triangles:
+   *  a BVH8 traversed with AVX if available, a BVH4 traversed with SSE
+   *  otherwise
+   */
+  Ref<Intersector> buildIntersector(const RTTriangle *tris, uint32 triNum);
+
+  /*! Same as above but collapse an already compiled BVH2 */
+  Ref<Intersector> buildIntersector(const BVH2<RTTriangle> &bvh2);
 } /* namespace pf */
 
 #endif /* __PF_INTERSECTOR_HPP__ */
@@ -0,0 +1,120 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "qbvh4.hpp"
+#include "bvh4.hpp"
+#include "bvh_collapse.hpp"
+#include "rt_triangle.hpp"
+#include "sys/logging.hpp"
+
+#include <cmath>
+#include <cstring>
+
+namespace pf
+{
+  /*! Quantize the 4 child boxes of a full precision node */
+  template <typename Q>
+  static void quantize(const BVH4Node &from, QBVH4Node<Q> &to)
+  {
+    const int32 qMax = QBVH4Node<Q>::QUANT_MAX;
+    for (uint32 axis = 0; axis < 3; ++axis) {
+      const ssef &lower = from.bounds[axis][0];
+      const ssef &upper = from.bounds[axis][1];
+
+      // Node box along this axis (empty children are ignored)
+      float lo = FLT_MAX, hi = -FLT_MAX;
+      for (uint32 i = 0; i < 4; ++i) {
+        if (lower[i] > upper[i]) continue;
+        lo = min(lo, lower[i]);
+        hi = max(hi, upper[i]);
+      }
+      if (lo > hi) lo = hi = 0.f;
+
+      // Smallest power of two scale such that qMax steps cover the box
+      int32 e;
+      std::frexp((hi - lo) / float(qMax), &e);
+      e = max(min(e, 127), -126);
+      while (e < 127 && lo + float(qMax) * std::ldexp(1.f, e) < hi) ++e;
+      to.org[axis] = lo;
+      to.exp[axis] = uint8(e + 127);
+      const float scale = to.getScale(axis);
+
+      // Round down the lower bounds and round up the upper ones. Empty
+      // children get an empty box
+      for (uint32 i = 0; i < 4; ++i) {
+        if (lower[i] > upper[i]) {
+          to.bounds[axis][0][i] = Q(qMax);
+          to.bounds[axis][1][i] = Q(0);
+          continue;
+        }
+        int32 qlo = int32(std::floor((lower[i] - lo) / scale));
+        int32 qhi = int32(std::ceil((upper[i] - lo) / scale));
+        qlo = max(min(qlo, qMax), 0);
+        qhi = max(min(qhi, qMax), 0);
+        while (qlo > 0 && lo + float(qlo) * scale > lower[i]) --qlo;
+        while (qhi < qMax && lo + float(qhi) * scale < upper[i]) ++qhi;
+        PF_ASSERT(lo + float(qlo) * scale <= lower[i]);
+        PF_ASSERT(lo + float(qhi) * scale >= upper[i]);
+        to.bounds[axis][0][i] = Q(qlo);
+        to.bounds[axis][1][i] = Q(qhi);
+      }
+    }
+    to.exp[3] = 0;
+    for (uint32 i = 0; i < 4; ++i) {
+      FATAL_IF (from.primNum[i] > 0xffff, "QBVH4: too many primitives in a leaf");
+      to.child[i] = from.child[i];
+      to.primNum[i] = uint16(from.primNum[i]);
+    }
+  }
+
+  template <typename T, typename Q>
+  void buildQBVH4(const BVH2<T> &bvh2, QBVH4<T,Q> &qbvh)
+  {
+    PF_MSG_V("QBVH4: collapsing BVH2");
+    const double start = getSeconds();
+    BVH4Node *node = NULL;
+    const uint32 nodeNum = collapseBVH2<4>(bvh2, node);
+
+    PF_MSG_V("QBVH4: quantizing " << nodeNum << " nodes on " << 8*sizeof(Q) << " bits");
+    qbvh.nodeNum = nodeNum;
+    qbvh.node = (QBVH4Node<Q>*) PF_ALIGNED_MALLOC(sizeof(QBVH4Node<Q>) * nodeNum, CACHE_LINE);
+    for (uint32 nodeID = 0; nodeID < nodeNum; ++nodeID)
+      quantize(node[nodeID], qbvh.node[nodeID]);
+    PF_ALIGNED_FREE(node);
+    PF_MSG_V("QBVH4: " << sizeof(QBVH4Node<Q>) * nodeNum << " bytes of nodes (BVH2: "
+             << sizeof(BVH2Node) * bvh2.nodeNum << " bytes)");
+
+    PF_MSG_V("QBVH4: Copying primitives and primitive IDs");
+    qbvh.primNum = bvh2.primNum;
+    qbvh.prim = PF_NEW_ARRAY(T, bvh2.primNum);
+    qbvh.primID = PF_NEW_ARRAY(uint32, bvh2.primIDNum);
+    std::memcpy(qbvh.prim, bvh2.prim, sizeof(T) * bvh2.primNum);
+    std::memcpy(qbvh.primID, bvh2.primID, sizeof(uint32) * bvh2.primIDNum);
+    PF_MSG_V("QBVH4: Time to compress " << getSeconds() - start << " sec");
+  }
+
+  // Instantiation for RTTriangle
+#define DECL_QBVH4(Q)                                                      \
+  template void buildQBVH4<RTTriangle,Q>(const BVH2<RTTriangle>&,          \
+                                         QBVH4<RTTriangle,Q>&);            \
+  template QBVH4<RTTriangle,Q>::QBVH4(void);                               \
+  template QBVH4<RTTriangle,Q>::~QBVH4(void);
+  DECL_QBVH4(uint8)
+  DECL_QBVH4(uint16)
+#undef DECL_QBVH4
+
+} /* namespace pf */
+
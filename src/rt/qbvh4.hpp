@@ -0,0 +1,99 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#ifndef __PF_QBVH4_HPP__
+#define __PF_QBVH4_HPP__
+
+#include "bvh2.hpp"
+#include "sys/ref.hpp"
+#include "sys/platform.hpp"
+
+#include <cstring>
+
+namespace pf
+{
+  /*! Compressed 4-wide BVH node. The child boxes are quantized on 8 or 16
+   *  bits (Q is uint8 or uint16) relative to the node box: along each axis,
+   *  bound = org + q * 2^exp. Using a power of two scale makes the decoding
+   *  exact such that the boxes are conservatively rounded by construction.
+   *  With Q = uint8, a node is 64 bytes i.e. half a BVH4Node
+   */
+  template <typename Q>
+  struct ALIGNED(16) QBVH4Node
+  {
+    /* Aligned new and delete */
+    PF_ALIGNED_STRUCT(16);
+    /*! Child reference for a leaf and for an inner node */
+    static INLINE uint32 makeLeaf(uint32 primID) { return primID | BIT_FLAG; }
+    static INLINE uint32 makeNode(uint32 nodeID) { return nodeID; }
+    /*! Child reference decoding */
+    static INLINE bool isLeaf(uint32 ref) { return (ref & BIT_FLAG) != 0; }
+    static INLINE uint32 getPrimID(uint32 ref) { return ref & ~BIT_FLAG; }
+    static INLINE uint32 getNodeID(uint32 ref) { return ref; }
+    /*! Scale of the quantization grid along the given axis */
+    INLINE float getScale(uint32 axis) const {
+      const uint32 bits = uint32(exp[axis]) << 23;
+      float scale;
+      std::memcpy(&scale, &bits, sizeof(float));
+      return scale;
+    }
+    float org[3];            //!< Lower corner of the node box
+    uint8 exp[4];            //!< Biased exponents of the scales (w is unused)
+    Q bounds[3][2][4];       //!< Quantized lower and upper bounds per axis
+    uint32 child[4];         //!< Node ID or leaf first primitive ID index
+    uint16 primNum[4];       //!< Number of primitives (for leaves only)
+    static const uint32 BIT_FLAG = 0x80000000;
+    static const uint32 QUANT_MAX = (1u << (8 * sizeof(Q))) - 1;
+  };
+
+  /*! Compressed 4-wide BVH. Primitive and primitive ID arrays have the same
+   *  meaning as for the BVH2
+   */
+  template <typename T, typename Q = uint8>
+  struct QBVH4 : public RefCount, public NonCopyable
+  {
+    /*! Empty tree */
+    QBVH4(void);
+    /*! Release everything */
+    virtual ~QBVH4(void);
+    QBVH4Node<Q> *node; //!< All nodes. node[0] is the root
+    T *prim;            //!< Primitives the BVH sorts
+    uint32 *primID;     //!< Indices of primitives per leaf
+    uint32 nodeNum;     //!< Number of nodes in the tree
+    uint32 primNum;     //!< The number of primitives
+    PF_STRUCT(QBVH4);
+  };
+
+  template <typename T, typename Q>
+  QBVH4<T,Q>::QBVH4(void) : node(NULL), prim(NULL), primID(NULL), nodeNum(0), primNum(0) {}
+
+  template <typename T, typename Q>
+  QBVH4<T,Q>::~QBVH4(void) {
+    PF_ALIGNED_FREE(this->node);
+    PF_SAFE_DELETE_ARRAY(this->primID);
+    PF_SAFE_DELETE_ARRAY(this->prim);
+  }
+
+  /*! Post-pass over an existing BVH2: collapse it like a BVH4 and quantize
+   *  the child boxes of every node
+   */
+  template <typename T, typename Q>
+  void buildQBVH4(const BVH2<T> &bvh2, QBVH4<T,Q> &qbvh);
+
+} /* namespace pf */
+
+#endif /* __PF_QBVH4_HPP__ */
+
@@ -0,0 +1,325 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "qbvh4.hpp"
+#include "qbvh4_traverser.hpp"
+#include "ray.hpp"
+#include "ray_packet.hpp"
+#include "rt_triangle.hpp"
+#include "rt_intersect.hpp"
+
+#include <cstring>
+
+namespace pf
+{
+  /*! Load 4 quantized bounds as 4 integers */
+  template <typename Q> INLINE __m128i loadQuantized(const Q *q);
+  template <> INLINE __m128i loadQuantized<uint8>(const uint8 *q) {
+    int32 bits;
+    std::memcpy(&bits, q, sizeof(int32));
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i x = _mm_cvtsi32_si128(bits);
+    return _mm_unpacklo_epi16(_mm_unpacklo_epi8(x, zero), zero);
+  }
+  template <> INLINE __m128i loadQuantized<uint16>(const uint16 *q) {
+    const __m128i x = _mm_loadl_epi64((const __m128i*) q);
+    return _mm_unpacklo_epi16(x, _mm_setzero_si128());
+  }
+
+  /*! Decode the lower or upper bounds of the 4 children along one axis.
+   *  "shift" is substracted to the node origin
+   */
+  template <typename Q>
+  INLINE ssef decode(const QBVH4Node<Q> &node, uint32 axis, uint32 side, float shift = 0.f) {
+    const ssef q(loadQuantized(node.bounds[axis][side]));
+    return q * ssef(node.getScale(axis)) + ssef(node.org[axis] - shift);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Single Ray Routines
+  ///////////////////////////////////////////////////////////////////////////
+
+  /*! Generic ray / leaf intersection */
+  template <typename T, typename Q>
+  INLINE void LeafIntersect(const QBVH4<T,Q> &bvh, uint32 ref, uint32 primNum,
+                            const ssef &org, const sse3f &dir, Hit &hit)
+  {
+    const uint32 firstPrim = QBVH4Node<Q>::getPrimID(ref);
+    for (uint32 i = 0; i < primNum; ++i) {
+      const uint32 primID = bvh.primID[firstPrim + i];
+      PrimIntersect(bvh.prim[primID], primID, org, dir, hit);
+    }
+  }
+
+  /*! Stack of children to visit with their entry distance */
+  struct QBVH4RayStack
+  {
+    /*! Stack is empty */
+    INLINE QBVH4RayStack(void) : top(0) {}
+    /*! Remove one element from the stack */
+    INLINE bool pop(void) { return --top >= 0; }
+    /*! Push a new element */
+    INLINE void push(uint32 ref, uint32 primNum, float dist) {
+      elem[top].ref = ref;
+      elem[top].primNum = primNum;
+      elem[top++].dist = dist;
+    }
+    /*! Element of the stack */
+    struct Elem {
+      uint32 ref;
+      uint32 primNum;
+      float dist;
+    };
+    enum { MAX_DEPTH = 3*64+1 }; //!< Maximum stack depth
+    Elem elem[MAX_DEPTH];        //!< All the pushed nodes
+    int32 top;                   //!< Current size of the stack
+  };
+
+  template <typename T, typename Q>
+  void QBVH4Traverser<T,Q>::traverse(const Ray &ray, Hit &hit) const
+  {
+    typedef QBVH4Node<Q> Node;
+    QBVH4RayStack stack;
+    const ssef org = ssef(&ray.org.x).xyzz();
+    const sse3f dir(ray.dir.x, ray.dir.y, ray.dir.z);
+    const sse3f rdir(ray.rdir.x, ray.rdir.y, ray.rdir.z);
+
+    // Closest and farthest planes of the boxes depend on the ray direction
+    const uint32 nearX = ray.rdir.x < 0.f ? 1 : 0;
+    const uint32 nearY = ray.rdir.y < 0.f ? 1 : 0;
+    const uint32 nearZ = ray.rdir.z < 0.f ? 1 : 0;
+    const uint32 farX = nearX ^ 1, farY = nearY ^ 1, farZ = nearZ ^ 1;
+    stack.push(Node::makeNode(0), 0, 0.f);
+
+  popNode:
+    while (LIKELY(stack.pop())) {
+      const QBVH4RayStack::Elem &elem = stack.elem[stack.top];
+      if (elem.dist > hit.t) continue;
+      uint32 ref = elem.ref;
+      uint32 primNum = elem.primNum;
+      for (;;) {
+        if (Node::isLeaf(ref)) {
+          LeafIntersect(*bvh, ref, primNum, org, dir, hit);
+          goto popNode;
+        }
+
+        // Decode and intersect the 4 children at once
+        const Node &node = bvh->node[Node::getNodeID(ref)];
+        const ssef tNearX = decode(node, 0, nearX, ray.org.x) * rdir.x;
+        const ssef tNearY = decode(node, 1, nearY, ray.org.y) * rdir.y;
+        const ssef tNearZ = decode(node, 2, nearZ, ray.org.z) * rdir.z;
+        const ssef tFarX = decode(node, 0, farX, ray.org.x) * rdir.x;
+        const ssef tFarY = decode(node, 1, farY, ray.org.y) * rdir.y;
+        const ssef tFarZ = decode(node, 2, farZ, ray.org.z) * rdir.z;
+        const ssef tNear = max(max(tNearX, tNearY), max(tNearZ, ssef(zero)));
+        const ssef tFar = min(min(tFarX, tFarY), min(tFarZ, ssef(hit.t)));
+        size_t mask = movemask(tNear <= tFar);
+        if (mask == 0) goto popNode;
+
+        // Only one child is hit: just go down
+        const size_t r0 = __bsf(mask);
+        mask &= mask - 1;
+        if (LIKELY(mask == 0)) {
+          ref = node.child[r0];
+          primNum = node.primNum[r0];
+          continue;
+        }
+
+        // Two children: push the farthest and go down into the closest one
+        const size_t r1 = __bsf(mask);
+        mask &= mask - 1;
+        if (LIKELY(mask == 0)) {
+          const size_t closest = tNear[r0] < tNear[r1] ? r0 : r1;
+          const size_t farthest = closest ^ r0 ^ r1;
+          stack.push(node.child[farthest], node.primNum[farthest], tNear[farthest]);
+          ref = node.child[closest];
+          primNum = node.primNum[closest];
+          continue;
+        }
+
+        // Three or four children: push them all and sort them from the
+        // farthest to the closest one
+        const int32 first = stack.top;
+        stack.push(node.child[r0], node.primNum[r0], tNear[r0]);
+        stack.push(node.child[r1], node.primNum[r1], tNear[r1]);
+        while (mask) {
+          const size_t r = __bsf(mask);
+          mask &= mask - 1;
+          stack.push(node.child[r], node.primNum[r], tNear[r]);
+        }
+        for (int32 i = first + 1; i < stack.top; ++i) {
+          const QBVH4RayStack::Elem curr = stack.elem[i];
+          int32 j = i - 1;
+          for (; j >= first && stack.elem[j].dist < curr.dist; --j)
+            stack.elem[j + 1] = stack.elem[j];
+          stack.elem[j + 1] = curr;
+        }
+        stack.pop();
+        ref = stack.elem[stack.top].ref;
+        primNum = stack.elem[stack.top].primNum;
+      }
+    }
+  }
+
+  template <typename T, typename Q>
+  bool QBVH4Traverser<T,Q>::occluded(const Ray &ray) const {
+    NOT_IMPLEMENTED;
+    return false;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Ray Packet Routines
+  ///////////////////////////////////////////////////////////////////////////
+
+  /*! Bounds of one child (w is a copy of z like for the BVH2 nodes) */
+  INLINE void getChildBBox(const sse3f &lower, const sse3f &upper, uint32 childID,
+                           ssef &childLower, ssef &childUpper) {
+    const float lowerZ = lower.z[childID], upperZ = upper.z[childID];
+    childLower = ssef(lower.x[childID], lower.y[childID], lowerZ, lowerZ);
+    childUpper = ssef(upper.x[childID], upper.y[childID], upperZ, upperZ);
+  }
+
+  /*! Generic Packet / Leaf intersection. With anyHit, hit rays are killed */
+  template <bool anyHit, typename T, typename Q, uint32 w, uint32 h>
+  INLINE void LeafIntersect(const QBVH4<T,Q> &bvh, const QBVH4Node<Q> &node,
+                            uint32 childID, const ssef &lower, const ssef &upper,
+                            const RayPacketT<w,h> &pckt, uint32 first,
+                            PacketHitT<w,h> &hit)
+  {
+    uint32 active[RayPacketT<w,h>::chunkNum];
+    uint32 activeNum;
+    if (AABBIntersect(lower, upper, pckt, hit, first, active, activeNum)) {
+      const uint32 firstPrim = QBVH4Node<Q>::getPrimID(node.child[childID]);
+      const uint32 primNum = node.primNum[childID];
+      for (uint32 i = 0; i < primNum; ++i) {
+        const uint32 primID = bvh.primID[firstPrim + i];
+        if (anyHit)
+          PrimOccluded(bvh.prim[primID], pckt, active, activeNum, hit);
+        else
+          PrimIntersect(bvh.prim[primID], primID, pckt, active, activeNum, hit);
+      }
+    }
+  }
+
+  /*! Call stack for packets (only inner nodes are pushed) */
+  struct QBVH4PacketStack
+  {
+    QBVH4PacketStack(void) : top(0) {}
+    /*! Update top of the stack value */
+    INLINE bool pop(void) { return --top >= 0; }
+    /*! Push a new element */
+    INLINE void push(uint32 nodeID, uint32 first) {
+      elem[top].nodeID = nodeID;
+      elem[top++].first = first;
+    }
+    /*! Element of the stack */
+    struct Elem {
+      uint32 first;
+      uint32 nodeID;
+    };
+    enum { MAX_DEPTH = 3*64+1 }; //! Maximum stack depth
+    Elem elem[MAX_DEPTH];        //!< All the pushed nodes
+    int32 top;                   //!< Current size of the stack
+  };
+
+  /*! Closest hit or any hit (occlusion) packet traversal */
+  template <bool anyHit, typename T, typename Q, uint32 w, uint32 h>
+  static void traversePacket(const QBVH4<T,Q> &bvh,
+                             const RayPacketT<w,h> &pckt,
+                             PacketHitT<w,h> &hit)
+  {
+    typedef QBVH4Node<Q> Node;
+    QBVH4PacketStack stack;
+    stack.push(0,0);
+
+    // Children are sorted along the direction of the first ray
+    const ssef org(pckt.org[0].x[0], pckt.org[0].y[0], pckt.org[0].z[0], 0.f);
+    const ssef dir(pckt.dir[0].x[0], pckt.dir[0].y[0], pckt.dir[0].z[0], 0.f);
+
+    while (LIKELY(stack.pop())) {
+      const uint32 nodeID = stack.elem[stack.top].nodeID;
+      const uint32 firstActive = stack.elem[stack.top].first;
+      const Node &node = bvh.node[nodeID];
+
+      // Decode the 4 boxes at once
+      const sse3f lower(decode(node, 0, 0), decode(node, 1, 0), decode(node, 2, 0));
+      const sse3f upper(decode(node, 0, 1), decode(node, 1, 1), decode(node, 2, 1));
+
+      // Find the intersected children
+      uint32 hitID[4], hitFirst[4];
+      float hitDist[4];
+      ssef hitLower[4], hitUpper[4];
+      uint32 hitNum = 0;
+      for (uint32 i = 0; i < 4; ++i) {
+        if (Node::isLeaf(node.child[i]) && node.primNum[i] == 0) continue;
+        ssef childLower, childUpper;
+        getChildBBox(lower, upper, i, childLower, childUpper);
+        uint32 first = firstActive;
+        if (!AABBIntersect(childLower, childUpper, pckt, hit, first)) continue;
+        const float dist = reduce_add(((childLower + childUpper) * ssef(.5f) - org) * dir)[0];
+        uint32 j = hitNum++;
+        for (; j > 0 && hitDist[j - 1] > dist; --j) {
+          hitID[j] = hitID[j - 1];
+          hitFirst[j] = hitFirst[j - 1];
+          hitDist[j] = hitDist[j - 1];
+          hitLower[j] = hitLower[j - 1];
+          hitUpper[j] = hitUpper[j - 1];
+        }
+        hitID[j] = i;
+        hitFirst[j] = first;
+        hitDist[j] = dist;
+        hitLower[j] = childLower;
+        hitUpper[j] = childUpper;
+      }
+
+      // Leaves are intersected right now and inner nodes are pushed from the
+      // farthest to the closest
+      for (uint32 i = 0; i < hitNum; ++i)
+        if (Node::isLeaf(node.child[hitID[i]])) {
+          LeafIntersect<anyHit>(bvh, node, hitID[i], hitLower[i], hitUpper[i], pckt, hitFirst[i], hit);
+          if (anyHit && isOccluded(hit)) return;
+        }
+      for (int32 i = int32(hitNum) - 1; i >= 0; --i)
+        if (!Node::isLeaf(node.child[hitID[i]]))
+          stack.push(Node::getNodeID(node.child[hitID[i]]), hitFirst[i]);
+    }
+  }
+
+  /*! Closest hit and any hit routines for one packet size */
+#define DECL_PACKET_TRAVERSAL(W,H) \
+  template <typename T, typename Q> \
+  void QBVH4Traverser<T,Q>::traverse(const RayPacketT<W,H> &pckt, PacketHitT<W,H> &hit) const { \
+    traversePacket<false>(*bvh, pckt, hit); \
+  } \
+  template <typename T, typename Q> \
+  void QBVH4Traverser<T,Q>::occluded(const RayPacketT<W,H> &pckt, const ssef tfar[], sseb mask[]) const { \
+    PacketHitT<W,H> hit; \
+    initOcclusion(mask, tfar, hit); \
+    traversePacket<true>(*bvh, pckt, hit); \
+    getOcclusion(hit, mask); \
+  }
+
+  DECL_PACKET_TRAVERSAL(4,4)
+  DECL_PACKET_TRAVERSAL(8,8)
+  DECL_PACKET_TRAVERSAL(16,16)
+#undef DECL_PACKET_TRAVERSAL
+
+  /*! Explicit instantiation for QBVH4s of RTTriangle */
+  template class QBVH4Traverser<RTTriangle,uint8>;
+  template class QBVH4Traverser<RTTriangle,uint16>;
+
+} /* namespace pf */
+
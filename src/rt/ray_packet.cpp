@@ -17,7 +17,14 @@
 #include "ray_packet.hpp"
 
 namespace pf {
-  const ssef RayPacket::crx(0.f,0.f,float(RayPacket::width),float(RayPacket::width));
-  const ssef RayPacket::cry(0.f,float(RayPacket::height),0.f,float(RayPacket::height));
+  template <uint32 w, uint32 h>
+  const ssef RayPacketT<w,h>::crx(0.f,0.f,float(w),float(w));
+  template <uint32 w, uint32 h>
+  const ssef RayPacketT<w,h>::cry(0.f,float(h),0.f,float(h));
+
+  /*! Explicit instantiation for all the supported packet sizes */
+  template struct RayPacketT<4,4>;
+  template struct RayPacketT<8,8>;
+  template struct RayPacketT<16,16>;
 } /* namespace pf */
 
@@ -28,14 +28,19 @@ namespace pf
   static const uint32 RAY_PACKET_CR = 1 << 1; //!< Does it have corner rays?
   static const uint32 RAY_PACKET_CO = 1 << 2; //!< Do rays have common origin?
 
-  /*! Packet of rays grouped together for faster traversal */
-  struct RayPacket
+  /*! Packet of w x h rays grouped together for faster traversal. Small packets
+   *  lose less time with incoherent rays, large ones amortize more the node
+   *  fetches with coherent rays
+   */
+  template <uint32 w, uint32 h>
+  struct RayPacketT
   {
     static const uint32 laneNum = sizeof(ssef) / sizeof(int32);
-    static const uint32 width  = 8;
-    static const uint32 height = 8;
+    static const uint32 width  = w;
+    static const uint32 height = h;
     static const uint32 rayNum = width * height;
     static const uint32 chunkNum = rayNum / laneNum;
+    STATIC_ASSERT(rayNum % laneNum == 0);
     static const ssef crx;//!< X coordinates of the 4 corner rays
     static const ssef cry;//!< Y coordinates of the 4 corner rays
     sse3f org[chunkNum]; //!< Origin of each ray
@@ -48,24 +53,35 @@ namespace pf
     ssef iaMaxrDir;      //!< Maximum rcp(direction) for IA
     sseb iasign;         //!< Sign of the ray directions
     uint32 properties;   //!< CR / IA / CO (see above)
-    PF_STRUCT(RayPacket);
+    PF_STRUCT(RayPacketT);
   };
 
   /*! Set of hit points for a ray packet */
-  struct PacketHit
+  template <uint32 w, uint32 h>
+  struct PacketHitT
   {
-    INLINE PacketHit(void) {
-      for (uint32 i = 0; i < RayPacket::chunkNum; ++i) t[i] = FLT_MAX;
-      for (uint32 i = 0; i < RayPacket::chunkNum; ++i) id0[i] = -1;
+    static const uint32 chunkNum = RayPacketT<w,h>::chunkNum;
+    INLINE PacketHitT(void) {
+      for (uint32 i = 0; i < chunkNum; ++i) t[i] = FLT_MAX;
+      for (uint32 i = 0; i < chunkNum; ++i) id0[i] = -1;
+      for (uint32 i = 0; i < chunkNum; ++i) id1[i] = -1;
     }
-    ssef t[RayPacket::chunkNum];   //!< Distance intersection
-    ssef u[RayPacket::chunkNum];   //!< u barycentric coordinate
-    ssef v[RayPacket::chunkNum];   //!< v barycentric coordinate
-    ssei id0[RayPacket::chunkNum]; //!< First ID of intersection
-    ssei id1[RayPacket::chunkNum]; //!< Second ID of intersection
-    PF_STRUCT(PacketHit);
+    ssef t[chunkNum];   //!< Distance intersection
+    ssef u[chunkNum];   //!< u barycentric coordinate
+    ssef v[chunkNum];   //!< v barycentric coordinate
+    ssei id0[chunkNum]; //!< First ID of intersection
+    ssei id1[chunkNum]; //!< Second ID of intersection
+    PF_STRUCT(PacketHitT);
   };
 
+  /*! Supported packet sizes. 8x8 is the default one */
+  typedef RayPacketT<4,4>   RayPacket4x4;
+  typedef RayPacketT<8,8>   RayPacket;
+  typedef RayPacketT<16,16> RayPacket16x16;
+  typedef PacketHitT<4,4>   PacketHit4x4;
+  typedef PacketHitT<8,8>   PacketHit;
+  typedef PacketHitT<16,16> PacketHit16x16;
+
 } /* namespace pf */
 
 #endif /* __PF_RAY_PACKET_HPP__ */
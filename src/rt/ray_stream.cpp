@@ -0,0 +1,235 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "ray_stream.hpp"
+#include "ray.hpp"
+#include "ray_packet.hpp"
+#include "intersector.hpp"
+#include "sys/alloc.hpp"
+
+#include <algorithm>
+
+namespace pf
+{
+  RayStream::RayStream(uint32 rayNum) : rayNum(rayNum) {
+    orgX = PF_NEW_ARRAY(float, rayNum);
+    orgY = PF_NEW_ARRAY(float, rayNum);
+    orgZ = PF_NEW_ARRAY(float, rayNum);
+    dirX = PF_NEW_ARRAY(float, rayNum);
+    dirY = PF_NEW_ARRAY(float, rayNum);
+    dirZ = PF_NEW_ARRAY(float, rayNum);
+  }
+
+  RayStream::~RayStream(void) {
+    PF_DELETE_ARRAY(orgX);
+    PF_DELETE_ARRAY(orgY);
+    PF_DELETE_ARRAY(orgZ);
+    PF_DELETE_ARRAY(dirX);
+    PF_DELETE_ARRAY(dirY);
+    PF_DELETE_ARRAY(dirZ);
+  }
+
+  HitStream::HitStream(uint32 rayNum) : rayNum(rayNum) {
+    t = PF_NEW_ARRAY(float, rayNum);
+    u = PF_NEW_ARRAY(float, rayNum);
+    v = PF_NEW_ARRAY(float, rayNum);
+    id0 = PF_NEW_ARRAY(int32, rayNum);
+    id1 = PF_NEW_ARRAY(int32, rayNum);
+  }
+
+  HitStream::~HitStream(void) {
+    PF_DELETE_ARRAY(t);
+    PF_DELETE_ARRAY(u);
+    PF_DELETE_ARRAY(v);
+    PF_DELETE_ARRAY(id0);
+    PF_DELETE_ARRAY(id1);
+  }
+
+  /*! Spread the 5 first bits of v: bit i goes to bit 3*i */
+  static INLINE uint32 spreadBits(uint32 v) {
+    uint32 r = 0;
+    for (uint32 i = 0; i < 5; ++i) r |= ((v >> i) & 1) << (3*i);
+    return r;
+  }
+
+  /*! Sort key: direction octant (3 bits), Morton code of the origin cell (15
+   *  bits) and Morton code of the direction inside the octant (12 bits)
+   */
+  enum {
+    streamOctantShift = 27,
+    streamOrgShift = 12,
+    streamOrgCellNum = 32,
+    streamDirCellNum = 16
+  };
+
+  /*! Groups of rays are traversed as packets only when they are coherent
+   *  enough: at least 16 rays with origins spanning at most 2 cells per axis.
+   *  Otherwise, single ray traversal is faster
+   */
+  enum {
+    streamMinPacketRayNum = 16,
+    streamMaxOrgCellSpread = 2
+  };
+
+  /*! Rays outside the packet are dead (see PrimOccluded) */
+  static INLINE void killLanes(uint32 rayNum, PacketHit &hit) {
+    for (uint32 i = rayNum; i < RayPacket::rayNum; ++i)
+      hit.t[i / ssef::CHANNEL_NUM][i % ssef::CHANNEL_NUM] = neg_inf;
+  }
+
+  /*! Cells per unit of length along one axis. All the origins may share the
+   *  same coordinate (pinhole cameras, rays leaving a floor...): such axes
+   *  get one single cell
+   */
+  static INLINE float getCellScale(float extent) {
+    return extent > 1e-19f ? float(streamOrgCellNum) * 0.99999f / extent : 0.f;
+  }
+
+  void Intersector::traverse(const RayStream &stream, HitStream &hit) const
+  {
+    PF_ASSERT(hit.rayNum >= stream.rayNum);
+    const uint32 rayNum = stream.rayNum;
+    if (rayNum == 0) return;
+
+    // Origin cells are defined by the bounding box of the origins
+    vec3f lower(inf), upper(neg_inf);
+    for (uint32 i = 0; i < rayNum; ++i) {
+      const vec3f org(stream.orgX[i], stream.orgY[i], stream.orgZ[i]);
+      lower = min(lower, org);
+      upper = max(upper, org);
+    }
+    const vec3f extent = upper - lower;
+    const vec3f scale(getCellScale(extent.x),
+                      getCellScale(extent.y),
+                      getCellScale(extent.z));
+
+    // Sort the rays by octant, origin cell and direction cell
+    uint64 *sorted = PF_NEW_ARRAY(uint64, rayNum);
+    for (uint32 i = 0; i < rayNum; ++i) {
+      const vec3f org(stream.orgX[i], stream.orgY[i], stream.orgZ[i]);
+      const vec3f dir(stream.dirX[i], stream.dirY[i], stream.dirZ[i]);
+      const vec3f cell = (org - lower) * scale;
+      const uint32 orgCode = (spreadBits(uint32(cell.x)) << 2) |
+                             (spreadBits(uint32(cell.y)) << 1) |
+                              spreadBits(uint32(cell.z));
+      const vec3f absDir(fabsf(dir.x), fabsf(dir.y), fabsf(dir.z));
+      const float maxDir = max(max(absDir.x, absDir.y), max(absDir.z, FLT_MIN));
+      const vec3f dirCell = absDir * (float(streamDirCellNum) * 0.99999f / maxDir);
+      const uint32 dirCode = (spreadBits(uint32(dirCell.x)) << 2) |
+                             (spreadBits(uint32(dirCell.y)) << 1) |
+                              spreadBits(uint32(dirCell.z));
+      const uint32 octant = (dir.x < 0.f ? 1 : 0) |
+                            (dir.y < 0.f ? 2 : 0) |
+                            (dir.z < 0.f ? 4 : 0);
+      const uint32 key = (octant << streamOctantShift) |
+                         (orgCode << streamOrgShift) | dirCode;
+      sorted[i] = (uint64(key) << 32) | uint64(i);
+    }
+    std::sort(sorted, sorted + rayNum);
+
+    // Gather consecutive rays of the same octant in packets. Rays are
+    // compacted at the front: the traversal skips the trailing dead chunks
+    ALIGNED(16) float data[6][RayPacket::rayNum];
+    uint32 IDs[RayPacket::rayNum];
+    for (uint32 first = 0; first < rayNum;) {
+      const uint32 octant = uint32(sorted[first] >> (32 + streamOctantShift));
+      const uint32 end = min(first + RayPacket::rayNum, rayNum);
+      uint32 last = first + 1;
+      while (last < end && uint32(sorted[last] >> (32 + streamOctantShift)) == octant)
+        ++last;
+      const uint32 packetRayNum = last - first;
+
+      // Dead lanes replicate the last ray to keep the maths safe
+      vec3f minOrg(inf), maxOrg(neg_inf), minDir(inf), maxDir(neg_inf);
+      for (uint32 i = 0; i < RayPacket::rayNum; ++i) {
+        const uint32 id = uint32(sorted[first + min(i, packetRayNum - 1)]);
+        const vec3f org(stream.orgX[id], stream.orgY[id], stream.orgZ[id]);
+        const vec3f dir(stream.dirX[id], stream.dirY[id], stream.dirZ[id]);
+        data[0][i] = org.x; data[1][i] = org.y; data[2][i] = org.z;
+        data[3][i] = dir.x; data[4][i] = dir.y; data[5][i] = dir.z;
+        minOrg = min(minOrg, org); maxOrg = max(maxOrg, org);
+        minDir = min(minDir, dir); maxDir = max(maxDir, dir);
+        IDs[i] = id;
+      }
+      // Incoherent groups are faster with single rays
+      const vec3f orgSpread = (maxOrg - minOrg) * scale;
+      const float maxOrgSpread = max(max(orgSpread.x, orgSpread.y), orgSpread.z);
+      if (packetRayNum < streamMinPacketRayNum ||
+          maxOrgSpread > float(streamMaxOrgCellSpread)) {
+        for (uint32 i = 0; i < packetRayNum; ++i) {
+          const Ray ray(vec3f(data[0][i], data[1][i], data[2][i]),
+                        vec3f(data[3][i], data[4][i], data[5][i]));
+          Hit rayHit;
+          this->traverse(ray, rayHit);
+          const uint32 id = IDs[i];
+          hit.t[id] = rayHit.t;
+          hit.u[id] = rayHit.u;
+          hit.v[id] = rayHit.v;
+          hit.id0[id] = rayHit.id0;
+          hit.id1[id] = rayHit.id1;
+        }
+        first = last;
+        continue;
+      }
+
+      RayPacket pckt;
+      for (uint32 i = 0; i < RayPacket::chunkNum; ++i) {
+        pckt.org[i] = sse3f(ssef::load(&data[0][4*i]),
+                            ssef::load(&data[1][4*i]),
+                            ssef::load(&data[2][4*i]));
+        pckt.dir[i] = sse3f(ssef::load(&data[3][4*i]),
+                            ssef::load(&data[4][4*i]),
+                            ssef::load(&data[5][4*i]));
+        pckt.rdir[i].x = rcp(fixup(pckt.dir[i].x));
+        pckt.rdir[i].y = rcp(fixup(pckt.dir[i].y));
+        pckt.rdir[i].z = rcp(fixup(pckt.dir[i].z));
+      }
+
+      // All the rays share the same octant: interval arithmetic is valid
+      // (zero components are fixed up like for the inverse directions)
+      const ssef dmin = fixup(ssef(minDir.x, minDir.y, minDir.z, minDir.z));
+      const ssef dmax = fixup(ssef(maxDir.x, maxDir.y, maxDir.z, maxDir.z));
+      const ssef rcpMin = rcp(dmax);
+      const ssef rcpMax = rcp(dmin);
+      const sseb sign = unmovemask(movemask(rcpMin));
+      pckt.iaMinOrg = ssef(minOrg.x, minOrg.y, minOrg.z, minOrg.z);
+      pckt.iaMaxOrg = ssef(maxOrg.x, maxOrg.y, maxOrg.z, maxOrg.z);
+      pckt.iasign = sign;
+      pckt.iaMinrDir = select(sign, -rcpMax, rcpMin);
+      pckt.iaMaxrDir = select(sign, -rcpMin, rcpMax);
+      pckt.properties = movemask(dmin ^ dmax) == 0 ? RAY_PACKET_IA : 0;
+
+      // Traverse and scatter the hit points back
+      PacketHit packetHit;
+      killLanes(packetRayNum, packetHit);
+      this->traverse(pckt, packetHit);
+      for (uint32 i = 0; i < packetRayNum; ++i) {
+        const uint32 id = IDs[i];
+        const uint32 chunkID = i / ssef::CHANNEL_NUM;
+        const uint32 laneID = i % ssef::CHANNEL_NUM;
+        hit.t[id] = packetHit.t[chunkID][laneID];
+        hit.u[id] = packetHit.u[chunkID][laneID];
+        hit.v[id] = packetHit.v[chunkID][laneID];
+        hit.id0[id] = packetHit.id0[chunkID][laneID];
+        hit.id1[id] = packetHit.id1[chunkID][laneID];
+      }
+      first = last;
+    }
+    PF_DELETE_ARRAY(sorted);
+  }
+
+} /* namespace pf */
+
@@ -0,0 +1,62 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#ifndef __PF_RAY_STREAM_HPP__
+#define __PF_RAY_STREAM_HPP__
+
+#include "math/vec.hpp"
+#include "sys/platform.hpp"
+
+namespace pf
+{
+  /*! Large batch of (possibly incoherent) rays stored in SoA form. Like the
+   *  ray packets, rays are not bounded
+   */
+  struct RayStream : public NonCopyable
+  {
+    /*! Allocate the storage for rayNum rays */
+    RayStream(uint32 rayNum);
+    /*! Release the arrays */
+    ~RayStream(void);
+    /*! Set ray "id" */
+    INLINE void set(uint32 id, const vec3f &org, const vec3f &dir) {
+      PF_ASSERT(id < rayNum);
+      orgX[id] = org.x; orgY[id] = org.y; orgZ[id] = org.z;
+      dirX[id] = dir.x; dirY[id] = dir.y; dirZ[id] = dir.z;
+    }
+    float *orgX, *orgY, *orgZ; //!< Origins of the rays
+    float *dirX, *dirY, *dirZ; //!< Directions of the rays
+    uint32 rayNum;             //!< Number of rays in the stream
+    PF_STRUCT(RayStream);
+  };
+
+  /*! Hit points of a ray stream (same format as the packet hit points) */
+  struct HitStream : public NonCopyable
+  {
+    /*! Allocate the storage for rayNum hit points */
+    HitStream(uint32 rayNum);
+    /*! Release the arrays */
+    ~HitStream(void);
+    float *t, *u, *v;  //!< Distances and barycentric coordinates
+    int32 *id0, *id1;  //!< IDs of the hit (-1 means no intersection)
+    uint32 rayNum;     //!< Number of hit points in the stream
+    PF_STRUCT(HitStream);
+  };
+
+} /* namespace pf */
+
+#endif /* __PF_RAY_STREAM_HPP__ */
+
@@ -74,13 +74,15 @@ namespace pf
     PF_CLASS(RTCameraRayGen);
   };
 
-  /*! Generate packet of rays from a pinhole camera */
+  /*! Generate packet of rays (of any size) from a pinhole camera */
   struct RTCameraPacketGen
   {
     /*! Generate a ray at pixel (x,y) */
-    INLINE void generate(RayPacket &pckt, int x, int y) const;
+    template <uint32 w, uint32 h>
+    INLINE void generate(RayPacketT<w,h> &pckt, int x, int y) const;
     /*! Idem but with a z-curve order for the rays */
-    INLINE void generateMorton(RayPacket &pckt, int x, int y) const;
+    template <uint32 w, uint32 h>
+    INLINE void generateMorton(RayPacketT<w,h> &pckt, int x, int y) const;
     /*! Look up table for Morton curve (X coordinate) */
     static const int32 mortonX[];
     /*! Look up table for Morton curve (Y coordinate) */
@@ -88,13 +90,17 @@ namespace pf
   private:
     friend class RTCamera; //!< Create this structure
     /*! Generate the rays */
-    INLINE void generateRay(RayPacket &pckt, int x, int y) const;
+    template <uint32 w, uint32 h>
+    INLINE void generateRay(RayPacketT<w,h> &pckt, int x, int y) const;
     /*! Generate the ray data (in Morton order) */
-    INLINE void generateRayMorton(RayPacket &pckt, int x, int y) const;
+    template <uint32 w, uint32 h>
+    INLINE void generateRayMorton(RayPacketT<w,h> &pckt, int x, int y) const;
     /*! Generate the corner rays */
-    INLINE void generateCR(RayPacket &pckt, int x, int y) const;
+    template <uint32 w, uint32 h>
+    INLINE void generateCR(RayPacketT<w,h> &pckt, int x, int y) const;
     /*! Generate the interval arithmetic vector. Says if IA can be used */
-    INLINE bool generateIA(RayPacket &pckt, int x, int y) const;
+    template <uint32 w, uint32 h>
+    INLINE bool generateIA(RayPacketT<w,h> &pckt, int x, int y) const;
     sse3f org;           //!< Origin
     sse3f imagePlaneOrg; //!< Image plane origin
     sse3f xAxis;         //!< X axis of the image plane
@@ -120,7 +126,8 @@ namespace pf
     ray.tfar = FLT_MAX;
   }
 
-  INLINE void RTCameraPacketGen::generateRay(RayPacket &pckt, int x, int y) const
+  template <uint32 w, uint32 h>
+  INLINE void RTCameraPacketGen::generateRay(RayPacketT<w,h> &pckt, int x, int y) const
   {
     const sse3f org(aOrg.xxxx(), aOrg.yyyy(), aOrg.zzzz());
     const ssef left = ssef(ssei(x))+ ssef::identity();
@@ -149,7 +156,8 @@ namespace pf
     }
   }
 
-  INLINE void RTCameraPacketGen::generateRayMorton(RayPacket &pckt, int x, int y) const
+  template <uint32 w, uint32 h>
+  INLINE void RTCameraPacketGen::generateRayMorton(RayPacketT<w,h> &pckt, int x, int y) const
   {
     const sse3f org(aOrg.xxxx(), aOrg.yyyy(), aOrg.zzzz());
     const ssef left = ssef(ssei(x));
@@ -177,7 +185,8 @@ namespace pf
   }
 
   // Unused since we do not use back face culling right now
-  INLINE void RTCameraPacketGen::generateCR(RayPacket &pckt, int x, int y) const
+  template <uint32 w, uint32 h>
+  INLINE void RTCameraPacketGen::generateCR(RayPacketT<w,h> &pckt, int x, int y) const
   {
     const ssef left = ssef(ssei(x)) + pckt.crx;
     const ssef top  = ssef(ssei(y)) + pckt.cry;
@@ -186,7 +195,8 @@ namespace pf
     pckt.crdir.z = imagePlaneOrg.z + left*xAxis.z + top*zAxis.z;
   }
 
-  INLINE bool RTCameraPacketGen::generateIA(RayPacket &pckt, int x, int y) const
+  template <uint32 w, uint32 h>
+  INLINE bool RTCameraPacketGen::generateIA(RayPacketT<w,h> &pckt, int x, int y) const
   {
     const ssef fw = (float) pckt.width;
     const ssef fh = (float) pckt.height;
@@ -210,7 +220,8 @@ namespace pf
     return movemask(dmin ^ dmax) == 0;
   }
 
-  INLINE void RTCameraPacketGen::generate(RayPacket &pckt, int x, int y) const
+  template <uint32 w, uint32 h>
+  INLINE void RTCameraPacketGen::generate(RayPacketT<w,h> &pckt, int x, int y) const
   {
     this->generateRay(pckt,x,y);
     // Unused since we do not use back face culling right now
@@ -220,7 +231,8 @@ namespace pf
       pckt.properties |= RAY_PACKET_IA;
   }
 
-  INLINE void RTCameraPacketGen::generateMorton(RayPacket &pckt, int x, int y) const
+  template <uint32 w, uint32 h>
+  INLINE void RTCameraPacketGen::generateMorton(RayPacketT<w,h> &pckt, int x, int y) const
   {
     this->generateRayMorton(pckt,x,y);
     // Unused since we do not use back face culling right now
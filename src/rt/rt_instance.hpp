@@ -0,0 +1,67 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#ifndef __RT_INSTANCE_HPP__
+#define __RT_INSTANCE_HPP__
+
+#include "math/bbox.hpp"
+#include "math/matrix.hpp"
+
+namespace pf
+{
+  class Intersector; // Bottom level shared by the instances
+
+  /*! Compute the box of the transformed box (8 transformed corners) */
+  INLINE BBox3f xfmBox(const mat4x4f &m, const BBox3f &box) {
+    BBox3f to(empty);
+    for (uint32 i = 0; i < 8; ++i) {
+      const vec3f p(i & 1 ? box.upper.x : box.lower.x,
+                    i & 2 ? box.upper.y : box.lower.y,
+                    i & 4 ? box.upper.z : box.lower.z);
+      to.grow(xfmPoint(m, p));
+    }
+    return to;
+  }
+
+  /*! Primitive of a top level BVH: an intersector placed in the world with an
+   *  affine transform. Many instances may share the same intersector. This is
+   *  a POD (the BVH copies the primitives): the instance does not hold a
+   *  reference on the intersector
+   */
+  struct RTInstance
+  {
+    /*! Nothing is done */
+    RTInstance(void);
+    /*! box is the object space box of the object */
+    RTInstance(const Intersector *object, const BBox3f &box, const mat4x4f &model);
+    /*! World space bounding box */
+    INLINE BBox3f getAABB(void) const { return this->box; }
+    mat4x4f worldToObject;     //!< Transforms the rays in object space
+    BBox3f box;                //!< World space box of the instance
+    const Intersector *object; //!< Shared bottom level
+    PF_STRUCT(RTInstance);
+  };
+
+  INLINE RTInstance::RTInstance(void) {}
+  INLINE RTInstance::RTInstance(const Intersector *object,
+                                const BBox3f &box,
+                                const mat4x4f &model) :
+    worldToObject(model.inverse()), box(xfmBox(model, box)), object(object) {}
+
+} /* namespace pf */
+
+#endif /* __RT_INSTANCE_HPP__ */
+
@@ -0,0 +1,627 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#ifndef __PF_RT_INTERSECT_HPP__
+#define __PF_RT_INTERSECT_HPP__
+
+#include "ray.hpp"
+#include "ray_packet.hpp"
+#include "rt_triangle.hpp"
+#include "rt_triangle4.hpp"
+#include "rt_instance.hpp"
+#include "intersector.hpp"
+#include "simd/ssef.hpp"
+#include "simd/sse_vec.hpp"
+
+/*! Ray / primitive and packet / box intersection routines shared by all the
+ *  traversers
+ */
+namespace pf
+{
+  ///////////////////////////////////////////////////////////////////////////
+  /// Single Ray Routines
+  ///////////////////////////////////////////////////////////////////////////
+
+  /*! Generic ray / primitive intersection */
+  template <typename T>
+  INLINE void PrimIntersect(const T&, uint32, const ssef&, const sse3f&, Hit&);
+
+  INLINE ssef crossZXY(const ssef &a, const ssef &b) {
+    return a*b.yzxx() - a.yzxx()*b;
+  }
+  INLINE ssef dotZXY(const ssef &a, const ssef &b) {
+    return a.xxxx()*b.zzzz() + a.yyyy()*b.xxxx() + a.zzzz()*b.yyyy();
+  }
+  INLINE ssef dotZXY(const sse3f &a, const sse3f &b) {
+    return a.x*b.z + a.y*b.x + a.z * b.y;
+  }
+  INLINE ssef cross(const ssef &a, const ssef &b) {
+    return a.yzxx()*b.zxyy() - a.zxyy()*b.yzxx();
+  }
+
+  INLINE void transpose4x3(const ssef &r0, const ssef &r1, const ssef &r2, const ssef &r3,
+                           ssef& c0,             ssef& c1,       ssef& c2)
+  {
+    const ssef l02 = unpacklo(r0,r2);
+    const ssef h02 = unpackhi(r0,r2);
+    const ssef l13 = unpacklo(r1,r3);
+    const ssef h13 = unpackhi(r1,r3);
+    c0 = unpacklo(l02,l13);
+    c1 = unpackhi(l02,l13);
+    c2 = unpacklo(h02,h13);
+  }
+
+  /*! Single ray / Pluecker triangle intersection. The three edge functions
+   *  are computed with the vertices relative to the ray origin: two triangles
+   *  sharing an edge get exactly opposite values for it and no ray leaks
+   *  between them (this is watertight). Since u + v + w == -dot(n, dir), the
+   *  barycentric coordinates are free once the hit is validated. The depth
+   *  is compared with the closest hit before any division.
+   *  NB: a Moller-Trumbore test with the precomputed normal was measured
+   *  about 20% slower here (one cross product less but two more subtractions
+   *  and a less compact sign test) and it is not watertight
+   */
+  template <>
+  INLINE void PrimIntersect<RTTriangle>
+    (const RTTriangle &tri, uint32 id, const ssef &org, const sse3f &dir, Hit &hit)
+  {
+    const ssef a(&tri.v[0].x);
+    const ssef b(&tri.v[1].x);
+    const ssef c(&tri.v[2].x);
+    const ssef n(&tri.n.x);
+    const ssef d0 = a - org;
+    const ssef d1 = b - org;
+    const ssef d2 = c - org;
+    const ssef v0 = cross(d1, d2);
+    const ssef v1 = cross(d0, d1);
+    const ssef v2 = cross(d2, d0);
+    sse3f v012n;
+    transpose4x3(n, v0, v1, v2, v012n.x, v012n.y, v012n.z);
+    const ssef tuvw = dot(v012n, dir);
+    const int m0 = movemask(tuvw) & 0xe;
+    if ((m0 != 0xe) & (m0 != 0)) return;
+
+    // Flip everything to get a positive denominator and test the depth
+    const ssef sign = shuffle<0,0,0,0>(tuvw) & ssei(0x80000000);
+    const ssef denUVW = tuvw ^ sign;
+    const float den = extract<0>(denUVW);
+    const float num = extract<0>(reduce_add(n * d0) ^ sign);
+    if ((num < 0.f) | (num >= hit.t * den)) return;
+    const float rcpDen = 1.f / den;
+    hit.t = num * rcpDen;
+    hit.u = -extract<3>(denUVW) * rcpDen;
+    hit.v = -extract<2>(denUVW) * rcpDen;
+    hit.id0 = id;
+  }
+
+  /*! Single ray / 4 triangles intersection. This is the same Pluecker test
+   *  as above (with the same results) done on 4 triangles at once. The
+   *  closest valid hit is then selected
+   */
+  INLINE void PrimIntersect(const RTTriangle4 &tri, const ssef &org, const sse3f &dir, Hit &hit)
+  {
+    const sse3f o(org.xxxx(), org.yyyy(), org.zzzz());
+    const sse3f n = cross(tri.v[2] - tri.v[0], tri.v[1] - tri.v[0]);
+    const sse3f d0 = tri.v[0] - o;
+    const sse3f d1 = tri.v[1] - o;
+    const sse3f d2 = tri.v[2] - o;
+    const ssef u = dot(cross(d1, d2), dir);
+    const ssef v = dot(cross(d0, d1), dir);
+    const ssef w = dot(cross(d2, d0), dir);
+    const ssef den = dot(n, dir);
+    const ssef sign = den & ssei(0x80000000);
+    const ssef absDen = den ^ sign;
+    const ssef num = dot(n, d0) ^ sign;
+    const int outside = movemask((u ^ v) | (u ^ w)) |
+                        movemask((num < 0.f) | (num >= absDen * ssef(hit.t)));
+    if (outside == 0xf) return;
+
+    // Closest hit. Ties go to the first triangle as with RTTriangle
+    const ssef rcpDen = rcp(absDen);
+    const sseb valid = unmovemask(~outside & 0xf);
+    const ssef t = select(valid, num * rcpDen, ssef(pos_inf));
+    const int lane = __bsf(movemask(valid & (t == reduce_min(t))));
+    hit.t = t[lane];
+    hit.u = -(w ^ sign)[lane] * rcpDen[lane];
+    hit.v = -(v ^ sign)[lane] * rcpDen[lane];
+    hit.id0 = tri.id[lane];
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Ray Packet Routines
+  ///////////////////////////////////////////////////////////////////////////
+
+  /*! Packet routines are templated on the packet dimensions. Packet / primitive
+   *  intersection (PrimIntersect) and occlusion (PrimOccluded) are overloaded
+   *  for every primitive type. For occlusion, occluded rays get a -inf
+   *  distance: they then miss every box and primitive and the traversal
+   *  simply ignores them
+   */
+
+  /*! Only rays from the mask are traversed. Other ones are already dead.
+   *  Occluders must be closer than tfar
+   */
+  template <uint32 w, uint32 h>
+  INLINE void initOcclusion(const sseb mask[], const ssef tfar[], PacketHitT<w,h> &hit) {
+    for (uint32 i = 0; i < RayPacketT<w,h>::chunkNum; ++i)
+      hit.t[i] = select(mask[i], tfar[i], ssef(neg_inf));
+  }
+
+  /*! Occluded rays are the active rays that were killed */
+  template <uint32 w, uint32 h>
+  INLINE void getOcclusion(const PacketHitT<w,h> &hit, sseb mask[]) {
+    for (uint32 i = 0; i < RayPacketT<w,h>::chunkNum; ++i)
+      mask[i] = mask[i] & (hit.t[i] == ssef(neg_inf));
+  }
+
+  /*! Packet traversal can stop when no ray is alive anymore */
+  template <uint32 w, uint32 h>
+  INLINE bool isOccluded(const PacketHitT<w,h> &hit) {
+    sseb alive = hit.t[0] != ssef(neg_inf);
+    for (uint32 i = 1; i < RayPacketT<w,h>::chunkNum; ++i)
+      alive |= hit.t[i] != ssef(neg_inf);
+    return movemask(alive) == 0;
+  }
+
+  /*! Kay-Kajiya AABB intersection */
+  INLINE void slab
+    (const sse3f &rdir, const sse3f &minOrg, const sse3f &maxOrg, ssef &near, ssef &far)
+  {
+    ssef l1 = minOrg.x * rdir.x;
+    ssef l2 = maxOrg.x * rdir.x;
+    near = min(l1,l2);
+    far  = max(l1,l2);
+    l1   = minOrg.y * rdir.y;
+    l2   = maxOrg.y * rdir.y;
+    near = max(min(l1,l2), near);
+    far  = min(max(l1,l2), far);
+    l1   = minOrg.z * rdir.z;
+    l2   = maxOrg.z * rdir.z;
+    near = max(min(l1,l2), near);
+    far  = min(max(l1,l2), far);
+  }
+
+  /*! Kay-Kajiya AABB with interval arithmetic */
+  INLINE int slabIA(const ssef &minOrg, const ssef &maxOrg,
+                    const sseb &sign,
+                    const ssef &rcpMin, const ssef &rcpMax)
+  {
+    const ssef minusMin = -minOrg;
+    const ssef minusMax = -maxOrg;
+    const ssef aMin = select(sign, minusMax, minOrg);
+    const ssef aMax = select(sign, minusMin, maxOrg);
+    const ssef pMin = aMin * rcpMin;
+    const ssef pMax = aMax * rcpMax;
+    const ssef aMinMM = min(pMin, pMax);
+    const ssef aMaxMM = max(pMin, pMax);
+    const ssef near = aMinMM;
+    const ssef far = reduce_min(aMaxMM);
+    const sseb ia = (near > far) | sseb(far);
+    return movemask(ia) & 0x7;
+  }
+
+  /*! Box (non leaf node) / packet intersection. w channel of the bounds must
+   *  be a copy of z. Return the first intersecting chunk
+   */
+  template <uint32 w, uint32 h>
+  INLINE bool AABBIntersect
+    (const ssef &lower, const ssef &upper, const RayPacketT<w,h> &pckt,
+     const PacketHitT<w,h> &hit, uint32 &first)
+  {
+    const ssef tmpMin = lower - pckt.iaMaxOrg;
+    const ssef tmpMax = upper - pckt.iaMinOrg;
+
+    // Try fast exit if the packet supports interval arithmetic
+    if (pckt.properties & RAY_PACKET_IA)
+      if (slabIA(tmpMin, tmpMax, pckt.iasign, pckt.iaMinrDir, pckt.iaMaxrDir))
+        return false;
+
+    // Fast path with common origin packets
+    if (pckt.properties & RAY_PACKET_CO) {
+      const sse3f dmin(tmpMin.xxxx(), tmpMin.yyyy(), tmpMin.zzzz());
+      const sse3f dmax(tmpMax.xxxx(), tmpMax.yyyy(), tmpMax.zzzz());
+      for (uint32 i = first; i < pckt.chunkNum; ++i) {
+        ssef near, far;
+        slab(pckt.rdir[i], dmin, dmax, near, far);
+        const sseb test = (far >= near) & (far > 0.f) & (near < hit.t[i]);
+        if (movemask(test)) {
+          first = i;
+          return true;
+        }
+      }
+    } else {
+      const sse3f pmin(lower.xxxx(), lower.yyyy(), lower.zzzz());
+      const sse3f pmax(upper.xxxx(), upper.yyyy(), upper.zzzz());
+      for (uint32 i = first; i < pckt.chunkNum; ++i) {
+        const sse3f dmin = pmin - pckt.org[i];
+        const sse3f dmax = pmax - pckt.org[i];
+        ssef near, far;
+        slab(pckt.rdir[i], dmin, dmax, near, far);
+        const sseb test = (far >= near) & (far > 0.f) & (near < hit.t[i]);
+        if (movemask(test)) {
+          first = i;
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  /*! Append the rays of "mask" (4 lanes of chunk "chunkID") to rayIDs while
+   *  there are at most maxRayNum of them. Return false when there are more
+   */
+  INLINE bool appendRays(uint32 chunkID, uint32 mask, uint32 *rayIDs,
+                         uint32 maxRayNum, uint32 &rayNum)
+  {
+    while (mask) {
+      if (rayNum == maxRayNum) {
+        rayNum++;
+        return false;
+      }
+      rayIDs[rayNum++] = chunkID * ssef::CHANNEL_NUM + __bsf(int(mask));
+      mask &= mask - 1;
+    }
+    return true;
+  }
+
+  /*! Box (non leaf node) / packet intersection for hybrid traversal. Like
+   *  above, return the first intersecting chunk but also collect the
+   *  intersecting rays (chunkID * 4 + laneID) while there are at most
+   *  maxRayNum of them. rayNum > maxRayNum means the packet is still dense.
+   *  Chunks are only tested until that is known
+   */
+  template <uint32 w, uint32 h>
+  INLINE bool AABBIntersect
+    (const ssef &lower, const ssef &upper, const RayPacketT<w,h> &pckt,
+     const PacketHitT<w,h> &hit, uint32 &first,
+     uint32 *rayIDs, uint32 maxRayNum, uint32 &rayNum)
+  {
+    const ssef tmpMin = lower - pckt.iaMaxOrg;
+    const ssef tmpMax = upper - pckt.iaMinOrg;
+    rayNum = 0;
+
+    // Try fast exit if the packet supports interval arithmetic
+    if (pckt.properties & RAY_PACKET_IA)
+      if (slabIA(tmpMin, tmpMax, pckt.iasign, pckt.iaMinrDir, pckt.iaMaxrDir))
+        return false;
+
+    // Fast path with common origin packets
+    if (pckt.properties & RAY_PACKET_CO) {
+      const sse3f dmin(tmpMin.xxxx(), tmpMin.yyyy(), tmpMin.zzzz());
+      const sse3f dmax(tmpMax.xxxx(), tmpMax.yyyy(), tmpMax.zzzz());
+      for (uint32 i = first; i < pckt.chunkNum; ++i) {
+        ssef near, far;
+        slab(pckt.rdir[i], dmin, dmax, near, far);
+        const sseb test = (far >= near) & (far > 0.f) & (near < hit.t[i]);
+        const uint32 mask = movemask(test);
+        if (mask == 0) continue;
+        if (rayNum == 0) first = i;
+        if (!appendRays(i, mask, rayIDs, maxRayNum, rayNum)) break;
+      }
+    } else {
+      const sse3f pmin(lower.xxxx(), lower.yyyy(), lower.zzzz());
+      const sse3f pmax(upper.xxxx(), upper.yyyy(), upper.zzzz());
+      for (uint32 i = first; i < pckt.chunkNum; ++i) {
+        const sse3f dmin = pmin - pckt.org[i];
+        const sse3f dmax = pmax - pckt.org[i];
+        ssef near, far;
+        slab(pckt.rdir[i], dmin, dmax, near, far);
+        const sseb test = (far >= near) & (far > 0.f) & (near < hit.t[i]);
+        const uint32 mask = movemask(test);
+        if (mask == 0) continue;
+        if (rayNum == 0) first = i;
+        if (!appendRays(i, mask, rayIDs, maxRayNum, rayNum)) break;
+      }
+    }
+    return rayNum != 0;
+  }
+
+  /*! Box (leaf node) / packet intersection. Track all active rays */
+  template <uint32 w, uint32 h>
+  INLINE bool AABBIntersect
+    (const ssef &lower, const ssef &upper, const RayPacketT<w,h> &pckt,
+     const PacketHitT<w,h> &hit, uint32 first, uint32 *active, uint32 &activeNum)
+  {
+    const ssef tmpMin = lower - pckt.iaMaxOrg;
+    const ssef tmpMax = upper - pckt.iaMinOrg;
+
+    // Use interval arithmetic test if supported
+    if (pckt.properties & RAY_PACKET_IA)
+      if (slabIA(tmpMin, tmpMax, pckt.iasign, pckt.iaMinrDir, pckt.iaMaxrDir))
+        return false;
+
+    // Fast path with common origin packets
+    bool isIntersected = false;
+    activeNum = 0;
+    if (pckt.properties & RAY_PACKET_CO) {
+      const sse3f dmin(tmpMin.xxxx(), tmpMin.yyyy(), tmpMin.zzzz());
+      const sse3f dmax(tmpMax.xxxx(), tmpMax.yyyy(), tmpMax.zzzz());
+      for(uint32 i = first; i < pckt.chunkNum; ++i) {
+        ssef near, far;
+        slab(pckt.rdir[i], dmin, dmax, near, far);
+        const sseb test = (far >= near) & (far > 0.f) & (near < hit.t[i]);
+        if (movemask(test)) {
+          active[activeNum++] = i;
+          isIntersected = true;
+        }
+      }
+    } else {
+      const sse3f pmin(lower.xxxx(), lower.yyyy(), lower.zzzz());
+      const sse3f pmax(upper.xxxx(), upper.yyyy(), upper.zzzz());
+      for (uint32 i = first; i < pckt.chunkNum; ++i) {
+        const sse3f dmin = pmin - pckt.org[i];
+        const sse3f dmax = pmax - pckt.org[i];
+        ssef near, far;
+        slab(pckt.rdir[i], dmin, dmax, near, far);
+        const sseb test = (far >= near) & (far > 0.f) & (near < hit.t[i]);
+        if (movemask(test)) {
+          active[activeNum++] = i;
+          isIntersected = true;
+        }
+      }
+    }
+    return isIntersected;
+  }
+
+  /*! Pluecker intersection
+   *  Pros:
+   *  - super fast with common origin rays. You precompute the planes and then
+   *    it is mostly three dot products
+   *  - aperture test is done first and this is really better than doing the
+   *    depth test first
+   *  Cons:
+   *  - Numerically bad when triangles are far away
+   *  - Expensive when origin is not shared
+   *  TODO Take a better intersector for non-common-origin ray packets
+   *  With anyHit, the hit rays are just killed (see PrimOccluded)
+   * */
+  template <bool anyHit, uint32 width, uint32 height>
+  INLINE void PacketTriangleIntersect
+    (const RTTriangle &tri, uint32 id, const RayPacketT<width,height> &pckt,
+     const uint32 *active, uint32 activeNum, PacketHitT<width,height> &hit)
+  {
+    if (pckt.properties & RAY_PACKET_CO) {
+      const ssef a(&tri.v[0].x);
+      const ssef b(&tri.v[1].x);
+      const ssef c(&tri.v[2].x);
+      const ssef d0 = a - pckt.iaMinOrg;
+      const ssef ca = c - a;
+      const ssef ba = b - a;
+      const ssef cb = c - b;
+      const ssef sn = crossZXY(ca, ba);
+      const ssef snum = dotZXY(sn, d0);
+      const ssef d1 = b - pckt.iaMinOrg;
+      const ssef sv0 = crossZXY(d1, cb);
+      const ssef sv1 = crossZXY(d0, ba);
+      const ssef sv2 = crossZXY(ca, d0);
+      const sse3f v0(sv0.xxxx(), sv0.yyyy(), sv0.zzzz());
+      const sse3f v1(sv1.xxxx(), sv1.yyyy(), sv1.zzzz());
+      const sse3f v2(sv2.xxxx(), sv2.yyyy(), sv2.zzzz());
+      const sse3f n(sn.xxxx(), sn.yyyy(), sn.zzzz());
+      const ssef cru = dotZXY(v0, pckt.crdir);
+      const ssef crv = dotZXY(v1, pckt.crdir);
+      const ssef crw = dotZXY(v2, pckt.crdir);
+      if (movemask(cru) == 0) return;
+      if (movemask(crv) == 0) return;
+      if (movemask(crw) == 0) return;
+
+      for(uint32 i = 0; i < activeNum; ++i) {
+        const uint32 curr = active[i];
+        const ssef u = dotZXY(v0, pckt.dir[curr]);
+        const ssef v = dotZXY(v1, pckt.dir[curr]);
+        const ssef w = dotZXY(v2, pckt.dir[curr]);
+        const uint32 us = movemask(u);
+        const uint32 vs = movemask(v);
+        const uint32 ws = movemask(w);
+        //const uint32 aperture = (us&vs&ws) | ((us^0xf)&(vs^0xf)&(ws^0xf));
+        const uint32 aperture = (us&vs&ws);
+        if (!aperture) continue;
+        const ssef n0 = dotZXY(n, pckt.dir[curr]);
+        const ssef num = snum.xxxx();
+        const ssef t = num / n0;
+        const ssei triID(id);
+        const sseb inside = unmovemask(aperture);
+        const sseb mask = inside & (t<hit.t[curr]) & (t>0.f);
+        if (anyHit) {
+          hit.t[curr] = select(mask, ssef(neg_inf), hit.t[curr]);
+          continue;
+        }
+        hit.t[curr]   = select(mask, t, hit.t[curr]);
+        hit.u[curr]   = select(mask, u, hit.u[curr]);
+        hit.v[curr]   = select(mask, v, hit.v[curr]);
+        hit.id0[curr] = select(mask, triID, hit.id0[curr]);
+      }
+    } else {
+      const sse3f a(tri.v[0].x, tri.v[0].y, tri.v[0].z);
+      const sse3f b(tri.v[1].x, tri.v[1].y, tri.v[1].z);
+      const sse3f c(tri.v[2].x, tri.v[2].y, tri.v[2].z);
+      const sse3f n = cross(c - a, b - a);
+      const ssei triID(id);
+
+      for(uint32 i = 0; i < activeNum; ++i) {
+        const uint32 curr = active[i];
+        const sse3f d0 = a - pckt.org[curr];
+        const sse3f d1 = b - pckt.org[curr];
+        const sse3f d2 = c - pckt.org[curr];
+        const sse3f v0 = cross(d1, d2);
+        const sse3f v1 = cross(d0, d1);
+        const sse3f v2 = cross(d2, d0);
+        const ssef num = dot(n, d0);
+        const ssef u = dot(v0, pckt.dir[curr]);
+        const ssef v = dot(v1, pckt.dir[curr]);
+        const ssef w = dot(v2, pckt.dir[curr]);
+        const uint32 us = movemask(u);
+        const uint32 vs = movemask(v);
+        const uint32 ws = movemask(w);
+        const uint32 aperture = (us&vs&ws)|((us^0xf)&(vs^0xf)&(ws^0xf));
+        if(!aperture) continue;
+        const ssef t = num / dot(pckt.dir[curr], n);
+        const sseb inside = unmovemask(aperture);
+        const sseb mask = inside & (t<hit.t[curr]) & (t>0.f);
+        if (anyHit) {
+          hit.t[curr] = select(mask, ssef(neg_inf), hit.t[curr]);
+          continue;
+        }
+        hit.t[curr]   = select(mask, t, hit.t[curr]);
+        hit.u[curr]   = select(mask, u, hit.u[curr]);
+        hit.v[curr]   = select(mask, v, hit.v[curr]);
+        hit.id0[curr] = select(mask, triID, hit.id0[curr]);
+      }
+    }
+  }
+
+  template <uint32 w, uint32 h>
+  INLINE void PrimIntersect
+    (const RTTriangle &tri, uint32 id, const RayPacketT<w,h> &pckt,
+     const uint32 *active, uint32 activeNum, PacketHitT<w,h> &hit)
+  {
+    PacketTriangleIntersect<false>(tri, id, pckt, active, activeNum, hit);
+  }
+
+  /*! Same as above but any hit kills the ray */
+  template <uint32 w, uint32 h>
+  INLINE void PrimOccluded
+    (const RTTriangle &tri, const RayPacketT<w,h> &pckt,
+     const uint32 *active, uint32 activeNum, PacketHitT<w,h> &hit)
+  {
+    PacketTriangleIntersect<true>(tri, 0, pckt, active, activeNum, hit);
+  }
+
+  /*! Packets are already 4-wide: the triangles of the block are tested one
+   *  after the other with the regular packet routines
+   */
+  template <bool anyHit, uint32 w, uint32 h>
+  INLINE void PacketTriangle4Intersect
+    (const RTTriangle4 &tri4, const RayPacketT<w,h> &pckt,
+     const uint32 *active, uint32 activeNum, PacketHitT<w,h> &hit)
+  {
+    for (uint32 i = 0; i < RTTriangle4::CHANNEL_NUM; ++i) {
+      if (tri4.id[i] == -1) break; // Unused lanes are at the end
+      RTTriangle tri;
+      for (uint32 j = 0; j < 3; ++j)
+        tri.v[j] = vec3f(tri4.v[j].x[i], tri4.v[j].y[i], tri4.v[j].z[i]);
+      PacketTriangleIntersect<anyHit>(tri, tri4.id[i], pckt, active, activeNum, hit);
+    }
+  }
+
+  template <uint32 w, uint32 h>
+  INLINE void PrimIntersect
+    (const RTTriangle4 &tri, const RayPacketT<w,h> &pckt,
+     const uint32 *active, uint32 activeNum, PacketHitT<w,h> &hit)
+  {
+    PacketTriangle4Intersect<false>(tri, pckt, active, activeNum, hit);
+  }
+
+  template <uint32 w, uint32 h>
+  INLINE void PrimOccluded
+    (const RTTriangle4 &tri, const RayPacketT<w,h> &pckt,
+     const uint32 *active, uint32 activeNum, PacketHitT<w,h> &hit)
+  {
+    PacketTriangle4Intersect<true>(tri, pckt, active, activeNum, hit);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// Instances (top level of two-level BVHs)
+  ///////////////////////////////////////////////////////////////////////////
+
+  /*! Transform the ray in object space and traverse the instanced object. The
+   *  direction is not normalized: t is therefore the same in both spaces. id1
+   *  is the instance ID of the hit
+   */
+  template <>
+  INLINE void PrimIntersect<RTInstance>
+    (const RTInstance &inst, uint32 id, const ssef &org, const sse3f &dir, Hit &hit)
+  {
+    const vec3f o(org[0], org[1], org[2]);
+    const vec3f d(dir.x[0], dir.y[0], dir.z[0]);
+    const Ray ray(xfmPoint(inst.worldToObject, o), xfmvector(inst.worldToObject, d));
+    const float t = hit.t;
+    inst.object->traverse(ray, hit);
+    if (hit.t < t) hit.id1 = id;
+  }
+
+  /*! Affine transforms of SoA points and vectors */
+  INLINE sse3f xfmPoint(const mat4x4f &m, const sse3f &p) {
+    return sse3f(ssef(m[0][0])*p.x + ssef(m[1][0])*p.y + ssef(m[2][0])*p.z + ssef(m[3][0]),
+                 ssef(m[0][1])*p.x + ssef(m[1][1])*p.y + ssef(m[2][1])*p.z + ssef(m[3][1]),
+                 ssef(m[0][2])*p.x + ssef(m[1][2])*p.y + ssef(m[2][2])*p.z + ssef(m[3][2]));
+  }
+  INLINE sse3f xfmvector(const mat4x4f &m, const sse3f &v) {
+    return sse3f(ssef(m[0][0])*v.x + ssef(m[1][0])*v.y + ssef(m[2][0])*v.z,
+                 ssef(m[0][1])*v.x + ssef(m[1][1])*v.y + ssef(m[2][1])*v.z,
+                 ssef(m[0][2])*v.x + ssef(m[1][2])*v.y + ssef(m[2][2])*v.z);
+  }
+
+  /*! Transform the packet with an affine transform. Interval arithmetic is
+   *  dropped: the transformed packet only keeps common origin and corner rays
+   */
+  template <uint32 w, uint32 h>
+  INLINE void transformPacket(const mat4x4f &m, const RayPacketT<w,h> &pckt, RayPacketT<w,h> &to)
+  {
+    for (uint32 i = 0; i < RayPacketT<w,h>::chunkNum; ++i) {
+      to.org[i] = xfmPoint(m, pckt.org[i]);
+      to.dir[i] = xfmvector(m, pckt.dir[i]);
+      to.rdir[i].x = rcp(to.dir[i].x);
+      to.rdir[i].y = rcp(to.dir[i].y);
+      to.rdir[i].z = rcp(to.dir[i].z);
+    }
+    const vec3f org(pckt.iaMinOrg[0], pckt.iaMinOrg[1], pckt.iaMinOrg[2]);
+    const vec3f o = xfmPoint(m, org);
+    to.iaMinOrg = to.iaMaxOrg = ssef(o.x, o.y, o.z, o.z);
+    to.crdir = xfmvector(m, pckt.crdir);
+    // Only used to order the children
+    const sse3f &d = to.dir[0];
+    to.iasign = unmovemask(movemask(ssef(d.x[0], d.y[0], d.z[0], d.z[0])));
+    to.properties = pckt.properties & (RAY_PACKET_CO | RAY_PACKET_CR);
+  }
+
+  /*! Same as single rays. The complete packet is given to the object
+   *  traverser that culls the rays itself
+   */
+  template <uint32 w, uint32 h>
+  INLINE void PrimIntersect
+    (const RTInstance &inst, uint32 id, const RayPacketT<w,h> &pckt,
+     const uint32 *active, uint32 activeNum, PacketHitT<w,h> &hit)
+  {
+    RayPacketT<w,h> local;
+    ssef t[RayPacketT<w,h>::chunkNum];
+    transformPacket(inst.worldToObject, pckt, local);
+    for (uint32 i = 0; i < RayPacketT<w,h>::chunkNum; ++i) t[i] = hit.t[i];
+    inst.object->traverse(local, hit);
+    const ssei instID(id);
+    for (uint32 i = 0; i < RayPacketT<w,h>::chunkNum; ++i)
+      hit.id1[i] = select(hit.t[i] < t[i], instID, hit.id1[i]);
+  }
+
+  /*! The object traverser kills the occluded rays in the transformed packet */
+  template <uint32 w, uint32 h>
+  INLINE void PrimOccluded
+    (const RTInstance &inst, const RayPacketT<w,h> &pckt,
+     const uint32 *active, uint32 activeNum, PacketHitT<w,h> &hit)
+  {
+    RayPacketT<w,h> local;
+    sseb mask[RayPacketT<w,h>::chunkNum];
+    transformPacket(inst.worldToObject, pckt, local);
+    for (uint32 i = 0; i < RayPacketT<w,h>::chunkNum; ++i) mask[i] = hit.t[i] != ssef(neg_inf);
+    inst.object->occluded(local, hit.t, mask);
+    for (uint32 i = 0; i < RayPacketT<w,h>::chunkNum; ++i)
+      hit.t[i] = select(mask[i], ssef(neg_inf), hit.t[i]);
+  }
+
+} /* namespace pf */
+
+#endif /* __PF_RT_INTERSECT_HPP__ */
+
@@ -0,0 +1,81 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "rt_triangle4.hpp"
+#include "rt_triangle.hpp"
+#include "bvh2.hpp"
+#include "sys/logging.hpp"
+
+#include <cstring>
+
+namespace pf
+{
+  void buildTriangle4(const BVH2<RTTriangle> &bvh, BVH2<RTTriangle4> &bvh4)
+  {
+    PF_MSG_V("BVH2: packing leaves into 4-wide triangles");
+    const double start = getSeconds();
+    const uint32 width = RTTriangle4::CHANNEL_NUM;
+    bvh4.nodeNum = bvh.nodeNum;
+    const size_t nodeSize = sizeof(BVH2Node) * bvh.nodeNum;
+    bvh4.node = (BVH2Node*) PF_ALIGNED_MALLOC(nodeSize, CACHE_LINE);
+    std::memcpy(bvh4.node, bvh.node, nodeSize);
+
+    // Each leaf gets its own blocks (primitives may be shared with spatial
+    // splits)
+    uint32 blockNum = 0;
+    for (uint32 nodeID = 0; nodeID < bvh.nodeNum; ++nodeID) {
+      const BVH2Node &node = bvh.node[nodeID];
+      if (node.isLeaf()) blockNum += (node.getPrimNum() + width - 1) / width;
+    }
+    bvh4.primNum = blockNum;
+    bvh4.prim = PF_NEW_ARRAY(RTTriangle4, blockNum);
+    PF_ASSERT(bvh4.prim);
+
+    uint32 blockID = 0;
+    for (uint32 nodeID = 0; nodeID < bvh.nodeNum; ++nodeID) {
+      BVH2Node &node = bvh4.node[nodeID];
+      if (!node.isLeaf()) continue;
+      const uint32 firstPrim = node.getPrimID();
+      const uint32 primNum = node.getPrimNum();
+      node.setPrimID(blockID);
+      node.setPrimNum((primNum + width - 1) / width);
+      for (uint32 first = 0; first < primNum; first += width, ++blockID) {
+        RTTriangle4 &block = bvh4.prim[blockID];
+        for (uint32 lane = 0; lane < width; ++lane) {
+          const bool used = first + lane < primNum;
+          const uint32 primID = used ? bvh.primID[firstPrim + first + lane] : 0;
+          for (uint32 j = 0; j < 3; ++j) {
+            const vec3f v = used ? bvh.prim[primID].v[j] : vec3f(zero);
+            block.v[j].x[lane] = v.x;
+            block.v[j].y[lane] = v.y;
+            block.v[j].z[lane] = v.z;
+          }
+          block.id[lane] = used ? int32(primID) : -1;
+        }
+      }
+    }
+    PF_ASSERT(blockID == blockNum);
+
+    // Leaves directly index the blocks
+    bvh4.primID = NULL;
+    bvh4.primIDNum = 0;
+    PF_MSG_V("BVH2: " << blockNum << " triangle blocks ("
+             << double(bvh.primIDNum) / double(blockNum * width) << " occupancy)");
+    PF_MSG_V("BVH2: Time to pack triangles " << getSeconds() - start << " sec");
+  }
+
+} /* namespace pf */
+
@@ -0,0 +1,52 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#ifndef __RT_TRIANGLE4_HPP__
+#define __RT_TRIANGLE4_HPP__
+
+#include "simd/sse_vec.hpp"
+
+namespace pf
+{
+  template <typename T> struct BVH2;
+  struct RTTriangle;
+
+  /*! Up to 4 triangles stored in SoA. BVH leaves directly point to them (no
+   *  primitive ID indirection) and one SIMD pass tests the 4 triangles. The
+   *  vertices are kept (and not the edges) to get the exact same watertight
+   *  Pluecker test as RTTriangle. Unused lanes have null vertices (they never
+   *  hit) and a -1 ID
+   */
+  struct ALIGNED(16) RTTriangle4
+  {
+    /* Aligned new and delete */
+    PF_ALIGNED_STRUCT(16);
+    sse3f v[3];  //!< Vertices of the 4 triangles
+    int32 id[4]; //!< Index of the triangles in the original soup
+    /*! Number of triangles per block */
+    enum { CHANNEL_NUM = 4 };
+  };
+
+  /*! Repack the leaf primitives of a triangle BVH into blocks of 4 triangles.
+   *  The nodes are copied and leaves reference the blocks instead of the
+   *  primitive IDs. A refit of the source BVH requires to rebuild it
+   */
+  void buildTriangle4(const BVH2<RTTriangle> &bvh, BVH2<RTTriangle4> &bvh4);
+
+} /* namespace pf */
+
+#endif /* __RT_TRIANGLE4_HPP__ */
+
@@ -33,7 +33,8 @@ INLINE __m256  _mm256_maskload_ps  (float const *ptr, __m256 mask) {
 INLINE void    _mm256_maskstore_ps (float *ptr, __m256 mask, __m256 data) {
   _mm256_maskstore_ps(ptr, _mm256_castps_si256(mask), data);
 }
-#elif !defined(_MSC_VER)
+#elif !defined(_MSC_VER) && defined(__GNUC__) && !defined(__clang__) && \
+      (__GNUC__ < 4 || (__GNUC__ == 4 && __GNUC_MINOR__ < 6))
 INLINE __m256  _mm256_maskload_ps  (float const *ptr, __m256i mask) {
   return _mm256_maskload_ps(ptr, _mm256_castsi256_ps(mask));
 }
@@ -25,6 +25,9 @@
 #include <tr1/unordered_map>
 #endif /* __MSVC__ */
 #include <cstring>
+#if defined(__UNIX__)
+#include <pthread.h>
+#endif /* __UNIX__ */
 #endif /* PF_DEBUG_MEMORY */
 
 #if defined(__ICC__)
@@ -144,9 +147,19 @@ namespace pf
   void MemDebuggerInitializeMem(void *mem, size_t sz) {
     if (memoryInitializationEnabled) std::memset(mem, 0xcd, sz);
   }
+  /*! A forked process must not inherit the mutex from another thread */
+  static void MemDebuggerLockFork(void) { if (memDebugger) memDebugger->mutex.lock(); }
+  static void MemDebuggerUnlockFork(void) { if (memDebugger) memDebugger->mutex.unlock(); }
   void MemDebuggerStart(void) {
     if (memDebugger) MemDebuggerEnd();
     memDebugger = new MemDebugger;
+#if defined(__UNIX__)
+    static bool forkHandlers = false;
+    if (!forkHandlers)
+      forkHandlers = pthread_atfork(MemDebuggerLockFork,
+                                    MemDebuggerUnlockFork,
+                                    MemDebuggerUnlockFork) == 0;
+#endif /* __UNIX__ */
   }
   void MemDebuggerEnd(void) {
     MemDebugger *_debug = memDebugger;
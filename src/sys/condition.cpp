@@ -59,7 +59,9 @@ namespace pf
     PF_DELETE((Mingw32Cond *)cond);
   }
 
-  void ConditionSys::wait(MutexSys& mutex)
+  void ConditionSys::wait(MutexSys& mutex) { this->wait(mutex, -1.); }
+
+  void ConditionSys::wait(MutexSys& mutex, double seconds)
   {
     Mingw32Cond *cv = (Mingw32Cond *) cond;
     int result, last_waiter;
@@ -73,7 +75,7 @@ namespace pf
     // It's ok to release the mutex here since Win32 manual-reset events
     // maintain state when used with SetEvent()
     LeaveCriticalSection((CRITICAL_SECTION *) mutex.mutex);
-    timeout_ms = INFINITE;
+    timeout_ms = seconds < 0. ? INFINITE : DWORD(seconds * 1000.) + 1;
 
     // Wait for either event to become signaled
     result = WaitForMultipleObjects(2, cv->events, FALSE, timeout_ms);
@@ -118,6 +120,10 @@ namespace pf
   ConditionSys::ConditionSys () { cond = PF_NEW(CONDITION_VARIABLE); InitializeConditionVariable((CONDITION_VARIABLE*)cond); }
   ConditionSys::~ConditionSys() { PF_DELETE((CONDITION_VARIABLE*)cond); }
   void ConditionSys::wait(MutexSys& mutex) { SleepConditionVariableCS((CONDITION_VARIABLE*)cond, (CRITICAL_SECTION*)mutex.mutex, INFINITE); }
+  void ConditionSys::wait(MutexSys& mutex, double seconds) {
+    const DWORD ms = seconds < 0. ? INFINITE : DWORD(seconds * 1000.) + 1;
+    SleepConditionVariableCS((CONDITION_VARIABLE*)cond, (CRITICAL_SECTION*)mutex.mutex, ms);
+  }
   void ConditionSys::broadcast() { WakeAllConditionVariable((CONDITION_VARIABLE*)cond); }
 } /* namespace pf */
 #endif /* __GNUC__ */
@@ -125,11 +131,26 @@ namespace pf
 
 #if defined(__UNIX__)
 #include <pthread.h>
+#include <sys/time.h>
 namespace pf
 {
   ConditionSys::ConditionSys () { cond = PF_NEW(pthread_cond_t); pthread_cond_init((pthread_cond_t*)cond,NULL); }
   ConditionSys::~ConditionSys() { PF_DELETE((pthread_cond_t*)cond); }
   void ConditionSys::wait(MutexSys& mutex) { pthread_cond_wait((pthread_cond_t*)cond, (pthread_mutex_t*)mutex.mutex); }
+  void ConditionSys::wait(MutexSys& mutex, double seconds) {
+    if (seconds < 0.) {
+      this->wait(mutex);
+      return;
+    }
+    // pthread wants an absolute time
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    const double deadline = double(now.tv_sec) + double(now.tv_usec) * 1e-6 + seconds;
+    struct timespec abstime;
+    abstime.tv_sec = time_t(deadline);
+    abstime.tv_nsec = long((deadline - double(abstime.tv_sec)) * 1e9);
+    pthread_cond_timedwait((pthread_cond_t*)cond, (pthread_mutex_t*)mutex.mutex, &abstime);
+  }
   void ConditionSys::broadcast() { pthread_cond_broadcast((pthread_cond_t*)cond); }
 } /* namespace pf */
 #endif /* __UNIX__ */
@@ -27,6 +27,8 @@ namespace pf
     ConditionSys(void);
     ~ConditionSys(void);
     void wait(class MutexSys& mutex);
+    /*! Wait at most "seconds" seconds (negative means forever) */
+    void wait(class MutexSys& mutex, double seconds);
     void broadcast(void);
   protected:
     void* cond;
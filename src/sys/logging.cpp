@@ -18,6 +18,10 @@
 #include "sys/tasking.hpp"
 #include "sys/filename.hpp"
 
+#if defined(__UNIX__)
+#include <pthread.h>
+#endif /* __UNIX__ */
+
 namespace pf
 {
   LoggerStream::LoggerStream(void) : next(NULL) {}
@@ -36,7 +40,16 @@ namespace pf
     return *this << fileName.base() << " at " << info.function << " line " << info.line;
   }
 
+  void Logger::lockFork(void) { if (logger) logger->mutex.lock(); }
+  void Logger::unlockFork(void) { if (logger) logger->mutex.unlock(); }
+
   Logger::Logger(void) : streams(NULL) {
+#if defined(__UNIX__)
+    // A forked process must not inherit the mutex from another thread
+    static bool forkHandlers = false;
+    if (!forkHandlers)
+      forkHandlers = pthread_atfork(lockFork, unlockFork, unlockFork) == 0;
+#endif /* __UNIX__ */
     const uint32 threadNum = TaskingSystemGetThreadNum();
     this->buffers = PF_NEW_ARRAY(LoggerBuffer, threadNum);
     for (uint32 i = 0; i < threadNum; ++i) this->buffers[i].logger = this;
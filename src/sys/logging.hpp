@@ -92,6 +92,9 @@ namespace pf
     void insert(LoggerStream &stream);
     void remove(LoggerStream &stream);
   private:
+    /*! The mutex is held around fork (see TaskDistributedSet) */
+    static void lockFork(void);
+    static void unlockFork(void);
     MutexSys mutex;        //!< To insert / remove streams and output strings
     LoggerStream *streams; //!< All the output streams
     LoggerBuffer *buffers; //!< One buffer per thread
@@ -0,0 +1,82 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "sys/mapped_file.hpp"
+#include "sys/filename.hpp"
+#include "sys/alloc.hpp"
+#include <cstdio>
+
+#if defined(__UNIX__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif /* __UNIX__ */
+
+namespace pf
+{
+  MappedFile::MappedFile(void) : data(NULL), size(0) {}
+
+  MappedFile::~MappedFile(void) {
+    if (this->data == NULL) return;
+#if defined(__UNIX__)
+    munmap(this->data, this->size);
+#else
+    PF_ALIGNED_FREE(this->data);
+#endif /* __UNIX__ */
+  }
+
+  bool MappedFile::map(const FileName &name)
+  {
+    PF_ASSERT(this->data == NULL);
+#if defined(__UNIX__)
+    const int fd = open(name.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+      close(fd);
+      return false;
+    }
+    void *ptr = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping keeps the file alive
+    if (ptr == MAP_FAILED) return false;
+    this->data = (char *) ptr;
+    this->size = info.st_size;
+#else
+    FILE *file = fopen(name.c_str(), "rb");
+    if (file == NULL) return false;
+    fseek(file, 0, SEEK_END);
+    const long fileSize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (fileSize <= 0) {
+      fclose(file);
+      return false;
+    }
+    this->data = (char *) PF_ALIGNED_MALLOC(fileSize, 4096);
+    this->size = fileSize;
+    const size_t readSize = fread(this->data, 1, fileSize, file);
+    fclose(file);
+    if (readSize != this->size) {
+      PF_ALIGNED_FREE(this->data);
+      this->data = NULL;
+      this->size = 0;
+      return false;
+    }
+#endif /* __UNIX__ */
+    return true;
+  }
+} /* namespace pf */
+
@@ -0,0 +1,52 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#ifndef __PF_MAPPED_FILE_HPP__
+#define __PF_MAPPED_FILE_HPP__
+
+#include "sys/ref.hpp"
+#include "sys/platform.hpp"
+
+namespace pf
+{
+  class FileName;
+
+  /*! Read-only file mapped in memory. Pages are private and copy-on-write:
+   *  the data may be modified in place but the file itself is never updated.
+   *  On systems without mmap, the file is simply loaded in memory
+   */
+  class MappedFile : public RefCount, public NonCopyable
+  {
+  public:
+    /*! Nothing is mapped */
+    MappedFile(void);
+    /*! Unmap the file */
+    virtual ~MappedFile(void);
+    /*! Map the complete file. False if the file cannot be opened */
+    bool map(const FileName &name);
+    /*! Mapped data (page aligned) */
+    INLINE char *getData(void) const { return this->data; }
+    /*! Size of the mapped file */
+    INLINE size_t getSize(void) const { return this->size; }
+  private:
+    char *data;  //!< Start of the file in memory
+    size_t size; //!< Size of the file
+    PF_CLASS(MappedFile);
+  };
+} /* namespace pf */
+
+#endif /* __PF_MAPPED_FILE_HPP__ */
+
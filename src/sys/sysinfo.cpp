@@ -16,6 +16,10 @@
 
 #include "sys/sysinfo.hpp"
 
+#if defined(__MSVC__)
+#include <intrin.h>
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 /// All Platforms
 ////////////////////////////////////////////////////////////////////////////////
@@ -52,6 +56,35 @@ namespace pf
     return "Unknown";
 #endif
   }
+
+  /* cpuid and xgetbv wrappers */
+#if defined(__MSVC__)
+  static INLINE void cpuid(int32 info[4], int32 op) { __cpuidex(info, op, 0); }
+  static INLINE uint64 xgetbv(void) { return _xgetbv(0); }
+#else
+  static INLINE void cpuid(int32 info[4], int32 op) {
+    asm volatile ("cpuid"
+                  : "=a" (info[0]), "=b" (info[1]), "=c" (info[2]), "=d" (info[3])
+                  : "a" (op), "c" (0));
+  }
+  static INLINE uint64 xgetbv(void) {
+    uint32 lo, hi;
+    asm volatile (".byte 0x0f, 0x01, 0xd0" : "=a" (lo), "=d" (hi) : "c" (0));
+    return (uint64(hi) << 32) | lo;
+  }
+#endif
+
+  /* AVX requires the CPU flag and the OS saving the YMM registers */
+  bool hasAVX() {
+    int32 info[4];
+    cpuid(info, 0);
+    if (info[0] < 1) return false;
+    cpuid(info, 1);
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx) return false;
+    return (xgetbv() & 0x6) == 0x6;
+  }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -29,6 +29,8 @@ namespace pf
   std::string getPlatformName();
   /*! return the number of logical threads of the system */
   int getNumberOfLogicalThreads();
+  /*! true if both the CPU and the OS support AVX */
+  bool hasAVX();
 }
 
 #endif
@@ -159,6 +159,39 @@ namespace pf
 #endif /* PF_TASK_STATICTICS */
   };
 
+  /*! Task started by a timer (see Task::scheduledAt) */
+  struct TaskTimer {
+    Task *task;      //!< Task to start when the deadline is reached
+    TaskTimer *next; //!< Next timer in the same slot
+    uint64 tick;     //!< Deadline in ticks
+  };
+
+  /*! Hierarchical timer wheel (Varghese & Lauck). Each level has 64 slots
+   *  and one slot of level n spans 64^n ticks. Timers are cascaded down to
+   *  the lower level when the lower level wraps around. Timers too far in the
+   *  future are parked in the farthest slot and simply cascaded again
+   */
+  struct TaskTimerWheel
+  {
+    enum {
+      slotBits = 6,
+      slotNum = 1 << slotBits,
+      slotMask = slotNum - 1,
+      levelNum = 4
+    };
+    TaskTimerWheel(void);
+    /*! Insert a timer (its deadline may already be passed) */
+    void insert(TaskTimer *timer);
+    /*! Advance the wheel up to "now" and return the list of expired timers */
+    TaskTimer *advance(uint64 now);
+    /*! Earliest deadline (only valid when timerNum != 0) */
+    uint64 getNextDeadline(void) const;
+    TaskTimer *slot[levelNum][slotNum]; //!< Timer lists
+    uint32 levelTimerNum[levelNum];     //!< Number of timers per level
+    uint32 timerNum;                    //!< Number of timers in the wheel
+    uint64 current;                     //!< All ticks before it are done
+  };
+
   /*! We will switch off the thread if nothing can be run */
   enum TaskThreadState {
     TASK_THREAD_STATE_SLEEPING = 0,
@@ -189,6 +222,9 @@ namespace pf
     enum { queueSize = 512 };                //!< Number of task per queue
     TaskWorkStealingQueue<queueSize> wsQueue;//!< Per thread work stealing queue
     TaskAffinityQueue<queueSize> afQueue;    //!< Per thread affinity queue
+    TaskScratch scratch;            //!< Temporaries of the tasks we run
+    TaskTimerWheel timers;          //!< Tasks delayed with scheduledAt
+    MutexActive timerMutex;         //!< Any thread may insert timers
     thread_t thread;                //!< System thread handle
     TaskScheduler *scheduler;       //!< It owns us
     ConditionSys cond;              //!< Condition variable for state
@@ -235,10 +271,30 @@ namespace pf
     INLINE uint32 getWorkerNum(void) { return uint32(this->workerNum); }
     /*! ID of the calling thread in the tasking system */
     INLINE uint32 getThreadID(void) { return uint32(this->threadID); }
+    /*! Scratch arena of the calling thread */
+    INLINE TaskScratch &getScratch(void) {
+      PF_ASSERT(this->inside);
+      return this->taskThread[this->threadID].scratch;
+    }
     /*! Try to get a task from all the current queues */
     INLINE Task* getTask(void);
     /*! Run the task and recursively handle the tasks to start and to end */
     void runTask(Task *task);
+    /*! Run one ready task while waiting (TaskMutex, ...). False if we cannot */
+    bool runWhileWaiting(void);
+    /*! Insert a timer that will start the task at the given time */
+    void scheduleAt(Task &task, double time);
+    /*! Start the tasks of the expired timers of the given thread */
+    void expireTimers(TaskThread &thread);
+    /*! Get the earliest timer deadline of the thread. False if none */
+    bool getNextDeadline(TaskThread &thread, double &deadline);
+    /*! Convert a time in seconds into timer ticks (rounded up or down) */
+    INLINE uint64 getTick(double time, bool roundUp) const {
+      const double tick = (time - this->timerEpoch) / PF_TASK_TIMER_RESOLUTION;
+      if (tick <= 0.) return 0;
+      const uint64 floorTick = uint64(tick);
+      return roundUp && double(floorTick) < tick ? floorTick + 1 : floorTick;
+    }
     /*! Lock the scheduler. The locking thread is the only to run */
     void lock(void);
     /*! Unlock the scheduler */
@@ -262,11 +318,18 @@ namespace pf
     INLINE void schedule(Task &task);
     /*! Try to push a task in the queue. Returns false if queues are full */
     INLINE bool trySchedule(Task &task);
+    /*! Decrement the end counter and handle the completions if we are done */
+    void endTask(Task *task);
+    /*! Close the successor list of the task and start / end its content */
+    void closeSuccessors(Task &task);
+    /*! One dependency (start or end) of the other task is now satisfied */
+    INLINE void satisfy(Task *other, bool isEnd);
     friend class Task;            //!< Tasks ...
     friend class TaskSet;         // ... task sets ...
     friend class TaskAllocator;   // ... task allocator use the tasking system
     friend class TaskThread;      //!< Update the sleeping bitfield
     static THREAD uint32 threadID;//!< ThreadID for each thread
+    static THREAD bool inside;    //!< Main or worker thread (others have ID 0 too)
     TaskThread *taskThread;       //!< Per thread state
 #if PF_TASK_PROFILER
     TaskProfiler * volatile profiler; //!< Registers events
@@ -276,6 +339,9 @@ namespace pf
     volatile size_t sleeping;     //!< Bitfields that gives the sleeping threads
     volatile size_t sleepingNum;  //!< Number of threads sleeping
     MutexActive sleepMutex;       //!< Protect the sleeping field
+    double timerEpoch;            //!< Origin of the timer ticks
+    Atomic timerNum;              //!< Total number of pending timers
+    Atomic timerVictim;           //!< Gets timers when main is outside
     CACHE_LINE_ALIGNED volatile int32 locked; //!< To globally lock the tasking system
     PF_ALIGNED_CLASS(CACHE_LINE);
   };
@@ -535,6 +601,13 @@ namespace pf
     if (afQueue.getActiveMask() && !scheduler->locked) return;
     if (state == TASK_THREAD_STATE_DEAD) return;
 
+    // We cannot sleep after the next timer deadline (ignored when locked).
+    // Timers inserted by other threads after this point will wake us up
+    double deadline = 0.;
+    const bool isTimed = !scheduler->locked &&
+                         scheduler->getNextDeadline(*this, deadline);
+    if (isTimed && deadline <= getSeconds()) return;
+
     // Previous state is not necessarily RUNNING. It can be "OUTSIDE"
     const TaskThreadState prevState = state;
     state = TASK_THREAD_STATE_SLEEPING;
@@ -546,8 +619,17 @@ namespace pf
     scheduler->sleepingNum++;
     scheduler->sleepMutex.unlock();
     IF_TASK_STATISTICS(this->sleepNum++);
-    while (state == TASK_THREAD_STATE_SLEEPING)
-      cond.wait(mutex);
+    while (state == TASK_THREAD_STATE_SLEEPING) {
+      if (isTimed) {
+        const double remaining = deadline - getSeconds();
+        if (remaining <= 0.) {
+          TASK_PROFILE(scheduler->profiler, onWakeUp, threadID);
+          break;
+        }
+        cond.wait(mutex, remaining);
+      } else
+        cond.wait(mutex);
+    }
 
     // We are not sleeping anymore. Return to our previous state
     scheduler->sleepMutex.lock();
@@ -582,6 +664,97 @@ namespace pf
     cond.broadcast();
   }
 
+  TaskTimerWheel::TaskTimerWheel(void) : timerNum(0), current(0) {
+    for (uint32 level = 0; level < levelNum; ++level) {
+      for (uint32 index = 0; index < slotNum; ++index)
+        this->slot[level][index] = NULL;
+      this->levelTimerNum[level] = 0;
+    }
+  }
+
+  void TaskTimerWheel::insert(TaskTimer *timer) {
+    static const uint64 maxDelta = uint64(1) << (slotBits * levelNum);
+    const uint64 tick = timer->tick > current ? timer->tick : current;
+    const uint64 delta = tick - current;
+    uint32 level = 0, index;
+    if (UNLIKELY(delta >= maxDelta)) {
+      level = levelNum - 1;
+      index = uint32((current >> (slotBits * level)) + slotMask) & slotMask;
+    } else {
+      while (delta >= uint64(1) << (slotBits * (level + 1))) level++;
+      index = uint32(tick >> (slotBits * level)) & slotMask;
+    }
+    timer->next = this->slot[level][index];
+    this->slot[level][index] = timer;
+    this->levelTimerNum[level]++;
+    this->timerNum++;
+  }
+
+  TaskTimer *TaskTimerWheel::advance(uint64 now) {
+    TaskTimer *expired = NULL;
+    while (current <= now && timerNum > 0) {
+      const uint32 index = uint32(current) & slotMask;
+
+      // The lower level wrapped around. Cascade the upper levels
+      if (index == 0) {
+        for (uint32 level = 1; level < levelNum; ++level) {
+          const uint32 upper = uint32(current >> (slotBits * level)) & slotMask;
+          TaskTimer *list = this->slot[level][upper];
+          this->slot[level][upper] = NULL;
+          while (list) {
+            TaskTimer *next = list->next;
+            this->levelTimerNum[level]--;
+            this->timerNum--;
+            this->insert(list);
+            list = next;
+          }
+          if (upper != 0) break;
+        }
+      }
+
+      // Nothing at the lowest level. Directly go to the next wrap around
+      if (this->levelTimerNum[0] == 0) {
+        const uint64 next = (current | slotMask) + 1;
+        current = next > now + 1 ? now + 1 : next;
+        continue;
+      }
+
+      // Everything in this slot is expired
+      TaskTimer *list = this->slot[0][index];
+      this->slot[0][index] = NULL;
+      while (list) {
+        TaskTimer *next = list->next;
+        list->next = expired;
+        expired = list;
+        this->levelTimerNum[0]--;
+        this->timerNum--;
+        list = next;
+      }
+      current++;
+    }
+    if (timerNum == 0 && current <= now) current = now + 1;
+    return expired;
+  }
+
+  uint64 TaskTimerWheel::getNextDeadline(void) const {
+    uint64 deadline = uint64(-1);
+    for (uint32 level = 0; level < levelNum; ++level) {
+      if (this->levelTimerNum[level] == 0) continue;
+      // The slot of the current position was already cascaded in the upper
+      // levels so it may only contain the farthest timers
+      const uint32 first = level == 0 ? 0 : 1;
+      const uint32 base = uint32(current >> (slotBits * level));
+      for (uint32 i = first; i < first + slotNum; ++i) {
+        const TaskTimer *timer = this->slot[level][(base + i) & slotMask];
+        if (timer == NULL) continue;
+        for (; timer; timer = timer->next)
+          if (timer->tick < deadline) deadline = timer->tick;
+        break;
+      }
+    }
+    return deadline;
+  }
+
   void TaskStorage::pushGlobal(uint32 chunkID) {
     IF_TASK_STATISTICS(statPushGlobalNum++);
 
@@ -664,10 +837,12 @@ namespace pf
   void TaskScheduler::threadFunction(TaskScheduler::ThreadStartup *threadData)
   {
     threadID = uint32(threadData->tid);
+    inside = true;
     TaskScheduler *This = &threadData->scheduler;
     TaskThread &myself = This->taskThread[threadID];
     const int maxInactivityNum = (This->getWorkerNum()+1) * PF_TASK_TRIES_BEFORE_YIELD;
     int inactivityNum = 0;
+    uint32 runNum = 0;
 
     // We do not need it anymore
     PF_DELETE(threadData);
@@ -678,10 +853,15 @@ namespace pf
     // We try to pick up a task from our queue and then we try to steal a task
     // from other queues
     for (;;) {
+      // Timers are checked when idle and from time to time when busy
+      if (UNLIKELY(myself.timers.timerNum != 0))
+        if (inactivityNum > 0 || (runNum % PF_TASK_TIMER_CHECK_PERIOD) == 0)
+          This->expireTimers(myself);
       Task *task = This->getTask();
       if (task) {
         This->runTask(task);
         inactivityNum = 0;
+        runNum++;
       } else
         inactivityNum++; 
       if (UNLIKELY(myself.state == TASK_THREAD_STATE_DEAD)) break;
@@ -699,7 +879,9 @@ namespace pf
 #if PF_TASK_PROFILER
     profiler(NULL),
 #endif /* PF_TASK_PROFILER */      
-    sleeping(0u), sleepingNum(0), locked(0)
+    sleeping(0u), sleepingNum(0),
+    timerEpoch(getSeconds()), timerNum(0), timerVictim(0),
+    locked(0)
   {
     if (workerNum_ < 0) workerNum_ = getNumberOfLogicalThreads() - 1;
     this->workerNum = workerNum_;
@@ -710,6 +892,7 @@ namespace pf
     this->taskThread[PF_TASK_MAIN_THREAD].thread = NULL;
     this->taskThread[PF_TASK_MAIN_THREAD].scheduler = this;
     this->taskThread[PF_TASK_MAIN_THREAD].threadID = 0;
+    inside = true; // We are the main thread
     this->taskThread[PF_TASK_MAIN_THREAD].state = TASK_THREAD_STATE_OUTSIDE;
 
     // Only if we have dedicated worker threads
@@ -718,9 +901,10 @@ namespace pf
       for (size_t i = 0; i < workerNum; ++i) {
         const int affinity = int(i+1);
         ThreadStartup *threadData = PF_NEW(ThreadStartup,i+1,*this);
+        // The thread may already sleep before createThread returns
         this->taskThread[i+1].scheduler = this;
-        this->taskThread[i+1].thread = createThread((pf::thread_func) threadFunction, threadData, stackSize, affinity);
         this->taskThread[i+1].threadID = i+1;
+        this->taskThread[i+1].thread = createThread((pf::thread_func) threadFunction, threadData, stackSize, affinity);
       }
     }
   }
@@ -802,6 +986,7 @@ namespace pf
   }
 
   THREAD uint32 TaskScheduler::threadID = 0;
+  THREAD bool TaskScheduler::inside = false;
 
   Task* TaskScheduler::getTask() {
     Task *task = NULL;
@@ -827,11 +1012,40 @@ namespace pf
       // Case 2: try to steal some task from another thread
       const uint32 victimID = this->taskThread[this->threadID].victim % queueNum;
       this->taskThread[this->threadID].victim++;
-      return this->taskThread[victimID].wsQueue.steal();
+      task = this->taskThread[victimID].wsQueue.steal();
+      if (task && victimID != this->threadID)
+        TASK_PROFILE(this->profiler, onSteal, this->threadID, victimID);
+      return task;
     }
     return task;
   }
 
+  void TaskScheduler::endTask(Task *task) {
+    do {
+      // We are done here
+      if (--task->toEnd == 0) {
+        __store_release(&task->state, uint8(TaskState::DONE));
+        TASK_PROFILE(this->profiler, onEnd, task->name, threadID);
+        TASK_PROFILE(this->profiler, onTaskEnd, task, threadID);
+        // Start the tasks if they become ready
+        if (task->toBeStarted) {
+          TASK_PROFILE(this->profiler, onTaskEdge, task, task->toBeStarted.ptr, false);
+          if (--task->toBeStarted->toStart == 0)
+            this->schedule(*task->toBeStarted);
+        }
+        // Extra successors are only there with a MultiDependencyPolicy
+        if (UNLIKELY(task->successors != NULL))
+          this->closeSuccessors(*task);
+        // Traverse all completions to signal we are done
+        if (task->toBeEnded)
+          TASK_PROFILE(this->profiler, onTaskEdge, task, task->toBeEnded.ptr, true);
+        task = task->toBeEnded.ptr;
+      }
+      else
+        task = NULL;
+    } while (task);
+  }
+
   void TaskScheduler::runTask(Task *task) {
     // Execute the function
     Task *nextToRun = NULL;
@@ -844,27 +1058,17 @@ namespace pf
 #endif /* NDEBUG */
       __store_release(&task->state, uint8(TaskState::RUNNING));
       TASK_PROFILE(this->profiler, onRunStart, task->name, threadID);
+      TASK_PROFILE(this->profiler, onTaskRunStart, task, threadID);
+      TaskScratch &scratch = this->getScratch();
+      const TaskScratch::Marker marker = scratch.getMarker();
       nextToRun = task->run();
+      scratch.rewind(marker);
       TASK_PROFILE(this->profiler, onRunEnd, task->name, threadID);
+      TASK_PROFILE(this->profiler, onTaskRunEnd, task, threadID);
       Task *toRelease = task;
 
       // Explore the completions and runs all continuations if any
-      do {
-        // We are done here
-        if (--task->toEnd == 0) {
-          __store_release(&task->state, uint8(TaskState::DONE));
-          TASK_PROFILE(this->profiler, onEnd, task->name, threadID);
-          // Start the tasks if they become ready
-          if (task->toBeStarted) {
-            if (--task->toBeStarted->toStart == 0)
-              this->schedule(*task->toBeStarted);
-          }
-          // Traverse all completions to signal we are done
-          task = task->toBeEnded.ptr;
-        }
-        else
-          task = NULL;
-      } while (task);
+      this->endTask(task);
 
       // Now the run function is done, we can remove the scheduler reference
       if (toRelease->refDec()) PF_DELETE(toRelease);
@@ -893,6 +1097,27 @@ namespace pf
     } while (task);
   }
 
+  /*! TaskMutexes held by the current thread */
+  static THREAD uint32 taskMutexHeldNum = 0;
+  /*! Number of tasks currently run by a thread waiting for a TaskMutex */
+  static THREAD uint32 taskMutexDepth = 0;
+
+  bool TaskScheduler::runWhileWaiting(void) {
+    // Other threads would use the queues of the main thread
+    if (!inside) return false;
+    // The task we would run may need a lock we own
+    if (taskMutexHeldNum > 0) return false;
+    if (taskMutexDepth >= PF_TASK_MUTEX_MAX_DEPTH) return false;
+    // Only the locking thread can run when the system is locked
+    if (this->locked) return false;
+    Task *task = this->getTask();
+    if (task == NULL) return false;
+    taskMutexDepth++;
+    this->runTask(task);
+    taskMutexDepth--;
+    return true;
+  }
+
   void TaskScheduler::go(void)
   {
     TaskThread &myself = this->taskThread[PF_TASK_MAIN_THREAD];
@@ -925,6 +1150,7 @@ namespace pf
     PF_ASSERT(myself.state == TASK_THREAD_STATE_OUTSIDE);
     if (LIKELY(task)) {
       while (__load_acquire(&task->state) != TaskState::DONE) {
+        if (UNLIKELY(myself.timers.timerNum != 0)) this->expireTimers(myself);
         Ref<Task> someTask = this->getTask();
         if (someTask) this->runTask(someTask);
         while (UNLIKELY(this->locked)) myself.sleep();
@@ -937,10 +1163,13 @@ namespace pf
     PF_ASSERT(threadID == PF_TASK_MAIN_THREAD);
     PF_ASSERT(myself.state == TASK_THREAD_STATE_OUTSIDE);
     for (;;) {
+      if (UNLIKELY(myself.timers.timerNum != 0)) this->expireTimers(myself);
       Task *task = this->getTask();
       if (task) this->runTask(task);
       while (UNLIKELY(this->locked)) myself.sleep();
-      if (task == NULL && this->sleepingNum == this->queueNum - 1)
+      if (task == NULL &&
+          this->sleepingNum == this->queueNum - 1 &&
+          this->timerNum == 0)
         return;
     }
   }
@@ -953,6 +1182,108 @@ namespace pf
     if (--this->toStart == 0) scheduler->schedule(*this);
   }
 
+  void Task::scheduledAt(double time) {
+    this->toStart++; // The timer is one more start dependency
+    scheduler->scheduleAt(*this, time);
+    this->scheduled();
+  }
+
+  /*! Extra successors are stored in a lock-free stack. Pushing is a simple
+   *  CAS while the scheduler atomically exchanges the complete stack with the
+   *  "closed" sentinel when the task ends. Once closed, nothing can be pushed
+   *  anymore. Nodes come from the task allocator (thread local free lists)
+   */
+  struct TaskSuccessor {
+    Task *task;          //!< Task to start or to end
+    TaskSuccessor *next; //!< Next node in the stack
+    bool isEnd;          //!< End the task instead of starting it
+  };
+
+  /*! Empty open list and closed list (only their addresses matter) */
+  static TaskSuccessor successorOpen, successorClosed;
+
+  /*! Atomic compare and swap on a successor list */
+  static INLINE TaskSuccessor *cmpxchg(TaskSuccessor * volatile *list,
+                                       TaskSuccessor *v,
+                                       TaskSuccessor *c)
+  {
+    return (TaskSuccessor *) atomic_cmpxchg((volatile atomic_t *) list,
+                                            (atomic_t) v,
+                                            (atomic_t) c);
+  }
+
+  /*! Small internal nodes also come from the task allocator */
+  template <typename T>
+  static INLINE T *newNode(void) {
+#if PF_TASK_USE_DEDICATED_ALLOCATOR
+    return (T *) allocator->allocate(sizeof(T));
+#else
+    return (T *) alignedMalloc(sizeof(T), 16);
+#endif /* PF_TASK_USE_DEDICATED_ALLOCATOR */
+  }
+
+  static INLINE void deleteNode(void *node) {
+#if PF_TASK_USE_DEDICATED_ALLOCATOR
+    allocator->deallocate(node);
+#else
+    alignedFree(node);
+#endif /* PF_TASK_USE_DEDICATED_ALLOCATOR */
+  }
+
+  INLINE void TaskScheduler::satisfy(Task *other, bool isEnd) {
+    if (isEnd) {
+      this->endTask(other);
+      // The node owned one reference since the scheduler may have already
+      // released its own one if the other task already ran
+      if (other->refDec()) PF_DELETE(other);
+    } else if (--other->toStart == 0)
+      this->schedule(*other);
+  }
+
+  void Task::openSuccessors(void) {
+    PF_ASSERT(this->state == TaskState::NEW);
+    this->successors = &successorOpen;
+  }
+
+  void Task::pushSuccessor(Task *other, bool isEnd) {
+    TaskSuccessor *head = this->successors;
+    PF_ASSERT(head != NULL);
+    if (head == &successorClosed) return;
+    if (isEnd) {
+      other->refInc();
+      other->toEnd++;
+    } else
+      other->toStart++;
+    TaskSuccessor *node = newNode<TaskSuccessor>();
+    node->task = other;
+    node->isEnd = isEnd;
+    for (;;) {
+      node->next = head;
+      TaskSuccessor *const prev = cmpxchg(&this->successors, node, head);
+      if (prev == head) return;
+      // We ended in the meantime. The dependency is already satisfied
+      if ((head = prev) == &successorClosed) {
+        deleteNode(node);
+        scheduler->satisfy(other, isEnd);
+        return;
+      }
+    }
+  }
+
+  void TaskScheduler::closeSuccessors(Task &task) {
+    TaskSuccessor *list = task.successors, *prev;
+    while ((prev = cmpxchg(&task.successors, &successorClosed, list)) != list)
+      list = prev;
+    PF_ASSERT(list != &successorClosed);
+    while (list != &successorOpen) {
+      TaskSuccessor *next = list->next;
+      TASK_PROFILE(this->profiler, onTaskEdge, &task, list->task, list->isEnd);
+      this->satisfy(list->task, list->isEnd);
+      deleteNode(list);
+      list = next;
+    }
+  }
+
 #if PF_TASK_USE_DEDICATED_ALLOCATOR
   void *Task::operator new(size_t size) {
     void *ptr = allocator->allocate(size);
@@ -968,6 +1299,148 @@ namespace pf
   void* Task::operator new[](size_t size) { NOT_IMPLEMENTED; return fake; }
   void  Task::operator delete[](void* ptr){ NOT_IMPLEMENTED; }
 
+  void TaskScheduler::scheduleAt(Task &task, double time) {
+    // The main thread may stay outside the tasking system for a long time. Its
+    // timers would not expire. So, we give them to the workers
+    uint32 target = this->threadID;
+    if (target == PF_TASK_MAIN_THREAD && this->workerNum > 0 &&
+        this->taskThread[PF_TASK_MAIN_THREAD].state == TASK_THREAD_STATE_OUTSIDE)
+      target = 1 + uint32(this->timerVictim++ % this->workerNum);
+    TaskThread &thread = this->taskThread[target];
+    TaskTimer *timer = newNode<TaskTimer>();
+    timer->task = &task;
+    timer->tick = this->getTick(time, true);
+    this->timerNum++;
+    thread.timerMutex.lock();
+    thread.timers.insert(timer);
+    thread.timerMutex.unlock();
+
+    // The thread may sleep with an older deadline
+    if (target != this->threadID) thread.wakeUp();
+  }
+
+  void TaskScheduler::expireTimers(TaskThread &thread) {
+    const uint64 now = this->getTick(getSeconds(), false);
+    thread.timerMutex.lock();
+    TaskTimer *expired = thread.timers.advance(now);
+    thread.timerMutex.unlock();
+
+    // Scheduling may run tasks that insert timers. So, no lock here
+    while (expired) {
+      TaskTimer *next = expired->next;
+      Task *task = expired->task;
+      deleteNode(expired);
+      this->timerNum--;
+      if (--task->toStart == 0) this->schedule(*task);
+      expired = next;
+    }
+  }
+
+  bool TaskScheduler::getNextDeadline(TaskThread &thread, double &deadline) {
+    Lock<MutexActive> lock(thread.timerMutex);
+    if (thread.timers.timerNum == 0) return false;
+    const uint64 tick = thread.timers.getNextDeadline();
+    deadline = this->timerEpoch + double(tick) * PF_TASK_TIMER_RESOLUTION;
+    return true;
+  }
+
+  TaskScratch::TaskScratch(void) :
+    first(NULL), chunk(NULL), curr(NULL), end(NULL) {}
+
+  TaskScratch::~TaskScratch(void) {
+    Chunk *toFree = this->first;
+    while (toFree) {
+      Chunk *next = toFree->next;
+      PF_ALIGNED_FREE(toFree);
+      toFree = next;
+    }
+  }
+
+  void *TaskScratch::allocateSlow(size_t size, size_t align) {
+    const size_t needed = sizeof(Chunk) + size + align;
+    Chunk *next = this->chunk ? this->chunk->next : this->first;
+
+    // Reuse the next chunk if large enough. Otherwise, insert a new one
+    if (next == NULL || next->size < needed) {
+      const size_t chunkSize = needed > PF_TASK_SCRATCH_CHUNK_SIZE ?
+                               needed : PF_TASK_SCRATCH_CHUNK_SIZE;
+      Chunk *fresh = (Chunk *) PF_ALIGNED_MALLOC(chunkSize, CACHE_LINE);
+      fresh->next = next;
+      fresh->size = chunkSize;
+      if (this->chunk)
+        this->chunk->next = fresh;
+      else
+        this->first = fresh;
+      next = fresh;
+    }
+    this->chunk = next;
+    this->curr = (char *) (next + 1);
+    this->end = (char *) next + next->size;
+    return this->allocate(size, align);
+  }
+
+  void TaskScratch::rewindSlow(const Marker &marker) {
+    // Large chunks are only there for one big allocation. Release them
+    Chunk **link = marker.chunk ? &marker.chunk->next : &this->first;
+    while (*link) {
+      Chunk *next = (*link)->next;
+      if ((*link)->size > PF_TASK_SCRATCH_CHUNK_SIZE) {
+        PF_ALIGNED_FREE(*link);
+        *link = next;
+      } else
+        link = &(*link)->next;
+    }
+    this->chunk = marker.chunk;
+    this->curr = marker.curr;
+    this->end = marker.chunk ? (char *) marker.chunk + marker.chunk->size : NULL;
+  }
+
+  TaskMutex::TaskMutex(void) : taken(0), parkedNum(0) {}
+
+  bool TaskMutex::tryLock(void) {
+    if (this->taken != 0 || cmpxchg(this->taken, 1, 0) != 0)
+      return false;
+    taskMutexHeldNum++;
+    return true;
+  }
+
+  void TaskMutex::lock(void) {
+    uint32 failedNum = 0;
+    for (;;) {
+      // Critical sections are usually short. Spin first
+      for (uint32 i = 0; i < PF_TASK_MUTEX_SPIN_TRIES; ++i) {
+        if (this->tryLock()) return;
+        _mm_pause();
+      }
+      // Do something useful. Otherwise, go to sleep
+      if (scheduler && scheduler->runWhileWaiting())
+        failedNum = 0;
+      else if (++failedNum >= PF_TASK_MUTEX_TRIES_BEFORE_PARK) {
+        this->park();
+        failedNum = 0;
+      }
+    }
+  }
+
+  void TaskMutex::park(void) {
+    Lock<MutexSys> lock(this->parkMutex);
+    this->parkedNum++;
+    while (this->taken) this->parkCond.wait(this->parkMutex);
+    this->parkedNum--;
+  }
+
+  void TaskMutex::unlock(void) {
+    PF_ASSERT(taskMutexHeldNum > 0);
+    taskMutexHeldNum--;
+    // Both are locked operations. So we cannot miss a parked thread: either it
+    // sees the mutex free or we see it and wake it up
+    this->taken--;
+    if (this->parkedNum > 0) {
+      Lock<MutexSys> lock(this->parkMutex);
+      this->parkCond.broadcast();
+    }
+  }
+
   Task* TaskSet::run(void)
   {
     // The basic idea with task sets is to reschedule the task in its own
@@ -1063,6 +1536,15 @@ namespace pf
     return scheduler->getThreadID();
   }
 
+  bool TaskingSystemRunWhileWaiting(void) {
+    return scheduler != NULL && scheduler->runWhileWaiting();
+  }
+
+  TaskScratch &TaskingSystemGetScratch(void) {
+    PF_ASSERT(scheduler != NULL);
+    return scheduler->getScratch();
+  }
+
 #if PF_TASK_PROFILER
   void TaskingSystemSetProfiler(TaskProfiler *profiler) {
     FATAL_IF (scheduler == NULL, "scheduler not started");
@@ -19,6 +19,8 @@
 
 #include "sys/ref.hpp"
 #include "sys/atomic.hpp"
+#include "sys/mutex.hpp"
+#include "sys/condition.hpp"
 
 /*                   *** OVERVIEW OF THE TASKING SYSTEM ***
  *
@@ -51,6 +53,10 @@
  * n times (concurrently on any number of threads). TaskSet are a particularly
  * efficient way to logically create n tasks in one chunk.
  *
+ * A task can also be delayed with Task::scheduledAt. Each thread owns a
+ * hierarchical timer wheel checked in its scheduling loop. An idle thread only
+ * sleeps until the next deadline of its wheel so no polling is needed.
+ *
  * Last feature we added is the ability to run *some* task (ie the user cannot
  * decide what it will run) from a running task (ie from the run function of the
  * task). The basic idea here is to overcome typical issues with tasking system:
@@ -139,6 +145,24 @@
 /*! Give number of tries before yielding (multiplied by number of threads) */
 #define PF_TASK_TRIES_BEFORE_YIELD 64
 
+/*! Spins on a contended TaskMutex before trying to run another task */
+#define PF_TASK_MUTEX_SPIN_TRIES 64
+
+/*! Maximum number of nested tasks run by a thread waiting for a TaskMutex */
+#define PF_TASK_MUTEX_MAX_DEPTH 4
+
+/*! Rounds of spinning without finding any task before parking the thread */
+#define PF_TASK_MUTEX_TRIES_BEFORE_PARK 16
+
+/*! Duration of one tick of the per-thread timer wheels (in seconds) */
+#define PF_TASK_TIMER_RESOLUTION 1e-3
+
+/*! A busy thread checks its timers every n tasks it runs */
+#define PF_TASK_TIMER_CHECK_PERIOD 16
+
+/*! Size of the chunks allocated by the per-thread scratch arenas */
+#define PF_TASK_SCRATCH_CHUNK_SIZE (256 * 1024)
+
 /*! Main thread (the one that the system gives us) is always 0 */
 #define PF_TASK_MAIN_THREAD 0
 
@@ -180,6 +204,9 @@ namespace pf
     };
   };
 
+  /*! Node of the lock-free list of extra successors (see tasking_utility) */
+  struct TaskSuccessor;
+
   /*! Interface for all tasks handled by the tasking system */
   class Task : public RefCount, public NonCopyable
   {
@@ -194,6 +221,10 @@ namespace pf
     virtual Task* run(void) = 0;
     /*! Task is built and will be ready when all start dependencies are over */
     void scheduled(void);
+    /*! Same as scheduled but the task cannot start before the given time (in
+     *  seconds as returned by getSeconds)
+     */
+    void scheduledAt(double time);
     /*! The given task cannot *start* as long as "other" is not complete */
     INLINE void starts(Task *other);
     /*! The given task cannot *end* as long as "other" is not complete */
@@ -205,6 +236,8 @@ namespace pf
     INLINE uint16 getAffinity(void) const;
     /*! Get the current task state */
     INLINE uint8 getState(void) const;
+    /*! Get the task name (may be NULL) */
+    INLINE const char *getName(void) const { return this->name; }
     /*! Tasks may use a scalable fixed size allocator */
     void* operator new(size_t size);
     /*! Deallocations may go through the dedicated allocator too */
@@ -213,10 +246,18 @@ namespace pf
   private:
     template <int> friend struct TaskWorkStealingQueue; //!< Contains tasks
     template <int> friend struct TaskAffinityQueue;     //!< Contains tasks
+    template <typename> friend class MultiDependencyPolicy; //!< Successors
     friend class TaskSet;      //!< Will tweak the ending criterium
     friend class TaskScheduler;//!< Needs to access everything
+    /*! Open the successor list. Only tasks that call it have one */
+    void openSuccessors(void);
+    /*! Lock-free push of a task to start (or to end) when this one is done.
+     *  If we are already done, the dependency is immediately satisfied
+     */
+    void pushSuccessor(Task *other, bool isEnd);
     Ref<Task> toBeEnded;       //!< Signals it when finishing
     Ref<Task> toBeStarted;     //!< Triggers it when ready
+    TaskSuccessor * volatile successors; //!< NULL if no extra successor
     const char *name;          //!< Debug facility mostly
     Atomic32 toStart;          //!< MBZ before starting
     Atomic32 toEnd;            //!< MBZ before ending
@@ -240,6 +281,89 @@ namespace pf
     Atomic elemNum;          //!< Number of outstanding elements
   };
 
+  /*! Mutex to use inside tasks. On contention, the waiting thread first
+   *  spins for a while and then runs other ready tasks from the scheduler
+   *  (with a bounded recursion). It only parks itself on a system condition
+   *  when nothing else can be done. To avoid dead locks, a thread that
+   *  already holds a TaskMutex never runs other tasks while waiting. Note that
+   *  the mutex must be unlocked by the thread that locked it
+   */
+  class TaskMutex : public NonCopyable
+  {
+  public:
+    TaskMutex(void);
+    /*! Lock it. May run other tasks while waiting */
+    void lock(void);
+    /*! Try to lock it without waiting. Return true if we got it */
+    bool tryLock(void);
+    /*! Unlock it and wake up the parked threads if any */
+    void unlock(void);
+  private:
+    /*! Put the thread to sleep until the mutex is released */
+    void park(void);
+    Atomic32 taken;        //!< 1 when somebody owns the mutex
+    Atomic32 parkedNum;    //!< Number of threads sleeping on the condition
+    MutexSys parkMutex;    //!< Protects the condition
+    ConditionSys parkCond; //!< Parked threads sleep on it
+    PF_CLASS(TaskMutex);
+  };
+
+  /*! Per-thread bump pointer arena for the temporaries of the tasks. The
+   *  scheduler rewinds it after each run function so the memory is valid until
+   *  the task returns (or until the enclosing TaskScratchScope is left).
+   *  Chunks are chained when the current one overflows. Standard size chunks
+   *  are kept for the next allocations while larger ones are freed on rewind.
+   *  Nothing is constructed nor destructed
+   */
+  class TaskScratch : public NonCopyable
+  {
+  private:
+    struct Chunk {
+      Chunk *next; //!< Next chunk in the chain
+      size_t size; //!< Total size of the chunk (header included)
+    };
+  public:
+    /*! Position in the arena to rewind to */
+    struct Marker {
+      Chunk *chunk; //!< Chunk we were using
+      char *curr;   //!< Bump pointer in this chunk
+    };
+    TaskScratch(void);
+    ~TaskScratch(void);
+    /*! Allocate size bytes aligned on align bytes (align is a power of 2) */
+    INLINE void *allocate(size_t size, size_t align = 16);
+    /*! Allocate an array of elemNum *uninitialized* elements */
+    template <typename T>
+    INLINE T *allocateArray(size_t elemNum) {
+      return (T *) this->allocate(elemNum * sizeof(T));
+    }
+    /*! Get the current position */
+    INLINE Marker getMarker(void) const;
+    /*! Release everything allocated after the marker */
+    INLINE void rewind(const Marker &marker);
+  private:
+    /*! Go to the next chunk (allocate it if needed) and allocate there */
+    void *allocateSlow(size_t size, size_t align);
+    /*! Marker is in a previous chunk */
+    void rewindSlow(const Marker &marker);
+    Chunk *first; //!< Head of the chunk chain
+    Chunk *chunk; //!< Chunk we currently allocate from
+    char *curr;   //!< Bump pointer
+    char *end;    //!< End of the current chunk
+  };
+
+  /*! Rewinds the scratch arena when leaving the scope */
+  class TaskScratchScope : public NonCopyable
+  {
+  public:
+    INLINE TaskScratchScope(TaskScratch &scratch) :
+      scratch(scratch), marker(scratch.getMarker()) {}
+    INLINE ~TaskScratchScope(void) { scratch.rewind(marker); }
+  private:
+    TaskScratch &scratch;
+    TaskScratch::Marker marker;
+  };
+
 #if PF_TASK_PROFILER
   /*! Callback collection to record useful events in the tasking system */
   class TaskProfiler
@@ -259,6 +383,21 @@ namespace pf
     virtual void onRunEnd(const char *taskName, uint32 threadID) = 0;
     /*! Triggered when the task finishes (possibly later due to dependencies) */
     virtual void onEnd(const char *taskName, uint32 threadID) = 0;
+    /*! Same as onRunStart but with the task itself (default does nothing) */
+    virtual void onTaskRunStart(const Task *task, uint32 threadID) {}
+    /*! Same as onRunEnd but with the task itself (default does nothing) */
+    virtual void onTaskRunEnd(const Task *task, uint32 threadID) {}
+    /*! Same as onEnd but with the task itself (default does nothing) */
+    virtual void onTaskEnd(const Task *task, uint32 threadID) {}
+    /*! Triggered when a finished task releases one of its dependencies:
+     *  task->starts(other) if isEnd is false, other->ends(task) otherwise.
+     *  Always follows onTaskEnd(task). Default does nothing
+     */
+    virtual void onTaskEdge(const Task *task, const Task *other, bool isEnd) {}
+    /*! Triggered when thread threadID steals a task from thread victimID
+     *  (default does nothing)
+     */
+    virtual void onSteal(uint32 threadID, uint32 victimID) {}
   };
 #endif /* PF_TASK_PROFILER */
 
@@ -291,6 +430,12 @@ namespace pf
   /*! Unlock the tasking system. Basically wake up the other threads */
   void TaskingSystemUnlock(void);
 
+  /*! Run one ready task while the calling thread waits for other threads
+   *  (as TaskMutex does). Return false if nothing was run: the caller may
+   *  then yield
+   */
+  bool TaskingSystemRunWhileWaiting(void);
+
   /*! Signal the main thread to return to the application (THREAD SAFE) */
   void TaskingSystemInterruptMain(void);
 
@@ -300,6 +445,11 @@ namespace pf
   /*! Return the ID of the calling thread (between 0 and threadNum) */
   uint32 TaskingSystemGetThreadID(void);
 
+  /*! Scratch arena of the calling thread. It must be the main thread or a
+   *  worker thread: other threads would share the arena of the main thread
+   */
+  TaskScratch &TaskingSystemGetScratch(void);
+
 #if PF_TASK_PROFILER
   /*! Set the profiling interface (can be NULL) */
   void TaskingSystemSetProfiler(TaskProfiler *profiler);
@@ -310,6 +460,7 @@ namespace pf
   ///////////////////////////////////////////////////////////////////////////
 
   INLINE Task::Task(const char *taskName) :
+    successors(NULL),
     name(taskName),
     toStart(1), toEnd(1),
     affinity(PF_TASK_NO_AFFINITY),
@@ -357,6 +508,29 @@ namespace pf
   INLINE uint16 Task::getAffinity(void) const { return this->affinity; }
   INLINE uint8 Task::getState(void)  const { return this->state; }
 
+  INLINE void *TaskScratch::allocate(size_t size, size_t align) {
+    const size_t mask = align - 1;
+    char *ptr = (char *) ((size_t(this->curr) + mask) & ~mask);
+    if (UNLIKELY(ptr + size > this->end))
+      return this->allocateSlow(size, align);
+    this->curr = ptr + size;
+    return ptr;
+  }
+
+  INLINE TaskScratch::Marker TaskScratch::getMarker(void) const {
+    Marker marker;
+    marker.chunk = this->chunk;
+    marker.curr = this->curr;
+    return marker;
+  }
+
+  INLINE void TaskScratch::rewind(const Marker &marker) {
+    if (LIKELY(marker.chunk == this->chunk))
+      this->curr = marker.curr;
+    else
+      this->rewindSlow(marker);
+  }
+
   INLINE TaskSet::TaskSet(size_t elemNum, const char *name) :
     Task(name), elemNum(elemNum) {}
 
@@ -0,0 +1,239 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "sys/tasking_distributed.hpp"
+#include "sys/logging.hpp"
+#include "sys/alloc.hpp"
+
+#if defined(__UNIX__)
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif /* __UNIX__ */
+
+namespace pf
+{
+  /*! True in the forked helper processes */
+  static bool isHelper = false;
+
+  /*! Per-process queue of work descriptors. It lives in shared memory so
+   *  helpers can pop and steal from each other. A descriptor is just the
+   *  index of a range of "grain" elements. The owner pops from the head while
+   *  the thieves steal from the tail
+   */
+  struct CACHE_LINE_ALIGNED TaskDistributedQueue
+  {
+    /*! The lock stores the process that holds it (1 + its queue index) */
+    INLINE bool tryLock(uint32 me) {
+      return atomic_cmpxchg(&this->owner, int32(me + 1), 0) == 0;
+    }
+    INLINE void unlock(void) { __store_release(&this->owner, int32(0)); }
+    /*! Release the lock if the given (dead) process holds it */
+    INLINE void breakLock(uint32 dead) { atomic_cmpxchg(&this->owner, 0, int32(dead + 1)); }
+    volatile int32 owner;    //!< Spin lock (atomics work across processes)
+    volatile int64 head;     //!< First remaining descriptor
+    volatile int64 tail;     //!< One after the last remaining descriptor
+    volatile int64 inFlight; //!< Descriptor being run by the owner (or -1)
+  };
+
+  /*! Queues and helpers of one run of a distributed set. The last helpers may
+   *  be reaped by another task once the set is over
+   */
+  struct TaskDistributedRun : public RefCount
+  {
+    TaskDistributedRun(uint32 helperNum) :
+      queueNum(helperNum + 1)
+    {
+      const size_t queueSize = sizeof(TaskDistributedQueue) * queueNum;
+      this->queues = (TaskDistributedQueue *) TaskingSystemSharedAlloc(queueSize);
+      this->pids = PF_NEW_ARRAY(int32, helperNum);
+    }
+    ~TaskDistributedRun(void) {
+      PF_DELETE_ARRAY(this->pids);
+      TaskingSystemSharedFree(this->queues);
+    }
+    TaskDistributedQueue *queues; //!< One queue per process (parent first)
+    int32 *pids;                  //!< Helper processes (0 once reaped)
+    uint32 queueNum;              //!< Helper number + 1
+  };
+
+  /*! Poll the helpers still running when the set found no more work. The set
+   *  cannot end before it: no worker thread is blocked in waitpid
+   */
+  class TaskDistributedReap : public Task
+  {
+  public:
+    TaskDistributedReap(TaskDistributedSet &set, TaskDistributedRun &helpers) :
+      Task("TaskDistributedReap"), set(&set), helpers(&helpers) {}
+    virtual Task *run(void) {
+      if (set->reapHelpers(*helpers) > 0) {
+        Task *next = PF_NEW(TaskDistributedReap, *set, *helpers);
+        next->ends(set.ptr);
+        next->scheduledAt(getSeconds() + PF_TASK_DISTRIBUTED_REAP_PERIOD);
+      }
+      return NULL;
+    }
+  private:
+    Ref<TaskDistributedSet> set;     //!< Cannot end before its helpers
+    Ref<TaskDistributedRun> helpers; //!< Helpers to reap
+  };
+
+  TaskDistributedSet::TaskDistributedSet(size_t elemNum,
+                                         uint32 helperNum,
+                                         const char *name) :
+    Task(name), elemNum(elemNum),
+    grain(PF_TASK_DISTRIBUTED_GRAIN), helperNum(helperNum) {}
+
+  void TaskDistributedSet::runDescriptor(int64 desc) {
+    const size_t first = size_t(desc) * this->grain;
+    const size_t end = first + this->grain;
+    const size_t last = end < this->elemNum ? end : this->elemNum;
+    for (size_t elemID = first; elemID < last; ++elemID)
+      this->run(elemID);
+  }
+
+  bool TaskDistributedSet::getWork(TaskDistributedRun &helpers, uint32 me, int64 &desc)
+  {
+    // The parent is the only one able to see dead helpers
+    if (me == 0) this->reapHelpers(helpers);
+    TaskDistributedQueue &mine = helpers.queues[me];
+    for (uint32 i = 0; i < helpers.queueNum; ++i) {
+      TaskDistributedQueue &victim = helpers.queues[(me + i) % helpers.queueNum];
+      for (uint32 tries = 1; !victim.tryLock(me); ++tries) {
+        _mm_pause();
+        if (me == 0 && tries % PF_TASK_DISTRIBUTED_SPIN_TRIES == 0)
+          this->reapHelpers(helpers);
+      }
+      if (victim.head < victim.tail) {
+        // If we die here, the descriptor is run twice but never lost
+        desc = i == 0 ? victim.head : victim.tail - 1;
+        mine.inFlight = desc;
+        if (i == 0) victim.head++; else victim.tail--;
+        victim.unlock();
+        return true;
+      }
+      victim.unlock();
+    }
+    return false;
+  }
+
+  void TaskDistributedSet::participate(TaskDistributedRun &helpers, uint32 me)
+  {
+    int64 desc;
+    while (this->getWork(helpers, me, desc)) {
+      this->runDescriptor(desc);
+      __store_release(&helpers.queues[me].inFlight, int64(-1));
+    }
+  }
+
+  uint32 TaskDistributedSet::reapHelpers(TaskDistributedRun &helpers)
+  {
+    uint32 runningNum = 0;
+#if defined(__UNIX__)
+    for (uint32 h = 0; h < this->helperNum; ++h) {
+      if (helpers.pids[h] <= 0) continue;
+      int status = 0;
+      const pid_t pid = waitpid(pid_t(helpers.pids[h]), &status, WNOHANG);
+      if (pid == 0) {
+        runningNum++;
+        continue;
+      }
+      helpers.pids[h] = 0;
+      if (pid > 0 && (!WIFEXITED(status) || WEXITSTATUS(status) != 0))
+        PF_WARNING_V("TaskDistributedSet: helper " << h + 1 << " died");
+
+      // Its locks are released and its descriptor run again (if any)
+      for (uint32 q = 0; q < helpers.queueNum; ++q) helpers.queues[q].breakLock(h + 1);
+      const int64 desc = helpers.queues[h + 1].inFlight;
+      if (desc >= 0) this->runDescriptor(desc);
+    }
+#endif /* __UNIX__ */
+    return runningNum;
+  }
+
+  Task *TaskDistributedSet::run(void)
+  {
+#if defined(__UNIX__)
+    if (this->helperNum > 0 && this->elemNum > this->grain) {
+      Ref<TaskDistributedRun> helpers = PF_NEW(TaskDistributedRun, this->helperNum);
+      const uint32 queueNum = helpers->queueNum;
+      const int64 descNum = int64((this->elemNum + this->grain - 1) / this->grain);
+
+      // Evenly split the descriptors. Stealing will do the rest
+      for (uint32 q = 0; q < queueNum; ++q) {
+        helpers->queues[q].owner = 0;
+        helpers->queues[q].head = descNum * q / queueNum;
+        helpers->queues[q].tail = descNum * (q + 1) / queueNum;
+        helpers->queues[q].inFlight = -1;
+      }
+
+      // Spawn the helpers. If we cannot fork, the others steal their work
+      for (uint32 h = 0; h < this->helperNum; ++h) {
+        const pid_t pid = fork();
+        if (pid == 0) {
+          isHelper = true;
+          this->participate(*helpers, h + 1);
+          _exit(0);
+        }
+        helpers->pids[h] = int32(pid);
+      }
+      this->participate(*helpers, 0);
+
+      // Do not wait for the helpers still running their last descriptors
+      if (this->reapHelpers(*helpers) > 0) {
+        Task *reap = PF_NEW(TaskDistributedReap, *this, *helpers);
+        reap->ends(this);
+        reap->scheduledAt(getSeconds() + PF_TASK_DISTRIBUTED_REAP_PERIOD);
+      }
+      return NULL;
+    }
+#endif /* __UNIX__ */
+    for (size_t elemID = 0; elemID < this->elemNum; ++elemID)
+      this->run(elemID);
+    return NULL;
+  }
+
+  void *TaskingSystemSharedAlloc(size_t size) {
+#if defined(__UNIX__)
+    // The header stores the size of the mapping
+    const size_t totalSize = size + CACHE_LINE;
+    void *ptr = mmap(NULL, totalSize, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    FATAL_IF (ptr == MAP_FAILED, "Unable to allocate shared memory");
+    *(size_t *) ptr = totalSize;
+    return (char *) ptr + CACHE_LINE;
+#else
+    return alignedMalloc(size, CACHE_LINE);
+#endif /* __UNIX__ */
+  }
+
+  void TaskingSystemSharedFree(void *ptr) {
+    if (ptr == NULL) return;
+#if defined(__UNIX__)
+    char *base = (char *) ptr - CACHE_LINE;
+    munmap(base, *(size_t *) base);
+#else
+    alignedFree(ptr);
+#endif /* __UNIX__ */
+  }
+
+  bool TaskingSystemIsHelper(void) { return isHelper; }
+
+} /* namespace pf */
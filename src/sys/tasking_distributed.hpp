@@ -0,0 +1,94 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#ifndef __PF_TASKING_DISTRIBUTED_HPP__
+#define __PF_TASKING_DISTRIBUTED_HPP__
+
+#include "sys/tasking.hpp"
+
+/*! Default number of elements in one work descriptor */
+#define PF_TASK_DISTRIBUTED_GRAIN 64
+/*! Spins on a contended queue before the parent looks for dead helpers */
+#define PF_TASK_DISTRIBUTED_SPIN_TRIES 1024
+/*! Period (in seconds) to check the helpers still running at the end */
+#define PF_TASK_DISTRIBUTED_REAP_PERIOD 1e-3
+
+namespace pf
+{
+  struct TaskDistributedQueue; //!< Work descriptors in shared memory
+  struct TaskDistributedRun;   //!< Queues and helpers of one run
+  class TaskDistributedReap;   //!< Waits for the last helpers
+
+  /*! Task set whose elements can also be run by helper processes on the same
+   *  host. When the task runs, helperNum processes are forked. Together with
+   *  the running thread, they grab work descriptors (ranges of elements) from
+   *  per-process queues living in shared memory and steal from each other when
+   *  their queue is empty. This isolates crashes: if a helper dies, the range
+   *  it was processing is simply run again by the parent. Therefore:
+   *  - run(elemID) must be idempotent
+   *  - run(elemID) must write its results in memory allocated with
+   *    TaskingSystemSharedAlloc *before* the task set runs (helpers only see a
+   *    copy-on-write snapshot of the rest of the address space)
+   *  - run(elemID) must not use the tasking system (helpers only have one
+   *    thread, see TaskingSystemIsHelper)
+   *  - run(elemID) must not take locks other threads may hold when forking.
+   *    Only the logger and memory debugger locks are taken around fork
+   *  The parent never blocks on its helpers. A dead helper never releases the
+   *  queue it locked: the parent breaks the lock when it reaps the helper.
+   *  Helpers still running when the queues are empty are polled by a delayed
+   *  task the set waits for (see Task::ends).
+   *  Without helpers (or on systems without fork), everything runs locally
+   */
+  class TaskDistributedSet : public Task
+  {
+  public:
+    /*! elemNum is the number of times to execute the run function */
+    TaskDistributedSet(size_t elemNum, uint32 helperNum, const char *name = NULL);
+    /*! This function is user-specified */
+    virtual void run(size_t elemID) = 0;
+    /*! Set the number of elements per work descriptor */
+    INLINE void setGrain(size_t grain_) { this->grain = grain_ ? grain_ : 1; }
+  private:
+    friend class TaskDistributedReap; //!< Reaps the last helpers
+    virtual Task* run(void); //!< Distributes the elements
+    /*! Run all the elements of the given descriptor */
+    void runDescriptor(int64 desc);
+    /*! Get a descriptor from our queue or steal one from the others */
+    bool getWork(TaskDistributedRun &helpers, uint32 me, int64 &desc);
+    /*! Run descriptors (ours or stolen) until all queues are empty */
+    void participate(TaskDistributedRun &helpers, uint32 me);
+    /*! Reap the helpers that exited without waiting for the other ones. Run
+     *  again what the dead ones did not finish. Return the number of helpers
+     *  still running
+     */
+    uint32 reapHelpers(TaskDistributedRun &helpers);
+    size_t elemNum;          //!< Total number of elements to run
+    size_t grain;            //!< Number of elements per work descriptor
+    uint32 helperNum;        //!< Number of processes to fork
+  };
+
+  /*! Allocate memory shared with the helper processes */
+  void *TaskingSystemSharedAlloc(size_t size);
+
+  /*! Release memory allocated with TaskingSystemSharedAlloc */
+  void TaskingSystemSharedFree(void *ptr);
+
+  /*! Return true if the caller is a helper process of a distributed set */
+  bool TaskingSystemIsHelper(void);
+
+} /* namespace pf */
+
+#endif /* __PF_TASKING_DISTRIBUTED_HPP__ */
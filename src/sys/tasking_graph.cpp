@@ -0,0 +1,350 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "sys/tasking_graph.hpp"
+#include "sys/platform.hpp"
+
+#if PF_TASK_PROFILER
+
+#include <algorithm>
+#include <iomanip>
+#include <ostream>
+
+namespace pf
+{
+  TaskGraphRecorder::TaskGraphRecorder(void) { this->clear(); }
+  TaskGraphRecorder::~TaskGraphRecorder(void) {}
+
+  void TaskGraphRecorder::clear(void) {
+    Lock<MutexSys> lock(this->mutex);
+    this->nodes.clear();
+    this->edges.clear();
+    this->criticalPath.clear();
+    this->current.clear();
+    this->runs.clear();
+    this->work = this->span = this->elapsed = this->parallelism = 0.;
+    this->startTime = getSeconds();
+  }
+
+  uint32 TaskGraphRecorder::getNode(const Task *task, bool canBeEnded) {
+    hash_map<const Task*, uint32>::iterator it = this->current.find(task);
+    if (it != this->current.end())
+      if (canBeEnded || !this->nodes[it->second].ended)
+        return it->second;
+    Node node;
+    node.name = task->getName();
+    node.runStart = node.runEnd = node.work = node.end = 0.;
+    node.earliestStart = node.earliestEnd = node.latestEnd = 0.;
+    node.threadID = 0;
+    node.runNum = 0;
+    node.ended = node.critical = false;
+    const uint32 nodeID = uint32(this->nodes.size());
+    this->nodes.push_back(node);
+    this->current[task] = nodeID;
+    return nodeID;
+  }
+
+  void TaskGraphRecorder::onTaskRunStart(const Task *task, uint32 threadID) {
+    const double t = getSeconds() - this->startTime;
+    Lock<MutexSys> lock(this->mutex);
+    Node &node = this->nodes[this->getNode(task)];
+    if (node.runNum++ == 0) {
+      node.runStart = node.runEnd = t;
+      node.threadID = threadID;
+    }
+    if (threadID >= this->runs.size()) this->runs.resize(threadID + 1);
+    const Run run = {t, 0.};
+    this->runs[threadID].push_back(run);
+  }
+
+  void TaskGraphRecorder::onTaskRunEnd(const Task *task, uint32 threadID) {
+    const double t = getSeconds() - this->startTime;
+    Lock<MutexSys> lock(this->mutex);
+    Node &node = this->nodes[this->getNode(task)];
+    node.runEnd = std::max(node.runEnd, t);
+    // The run may have started before clear()
+    if (threadID >= this->runs.size() || this->runs[threadID].size() == 0)
+      return;
+    vector<Run> &stack = this->runs[threadID];
+    const Run run = stack.back();
+    stack.pop_back();
+    const double total = t - run.start;
+    node.work += total - run.nested;
+    if (stack.size() > 0) stack.back().nested += total;
+  }
+
+  void TaskGraphRecorder::onTaskEnd(const Task *task, uint32 threadID) {
+    const double t = getSeconds() - this->startTime;
+    Lock<MutexSys> lock(this->mutex);
+    Node &node = this->nodes[this->getNode(task)];
+    node.end = t;
+    node.ended = true;
+  }
+
+  void TaskGraphRecorder::onTaskEdge(const Task *task, const Task *other, bool isEnd) {
+    Lock<MutexSys> lock(this->mutex);
+    Edge edge;
+    edge.from = this->getNode(task, true);
+    edge.to = this->getNode(other);
+    edge.isEnd = isEnd;
+    this->edges.push_back(edge);
+  }
+
+  /*! Compressed adjacency lists (one list of edge indices per node) */
+  static void buildAdjacency(const vector<TaskGraphRecorder::Edge> &edges,
+                             uint32 nodeNum,
+                             bool incoming,
+                             vector<uint32> &first,
+                             vector<uint32> &list)
+  {
+    first.clear();
+    first.resize(nodeNum + 1, 0);
+    list.resize(edges.size());
+    for (size_t i = 0; i < edges.size(); ++i)
+      first[(incoming ? edges[i].to : edges[i].from) + 1]++;
+    for (uint32 i = 0; i < nodeNum; ++i) first[i + 1] += first[i];
+    vector<uint32> curr(first.begin(), first.end() - 1);
+    for (size_t i = 0; i < edges.size(); ++i)
+      list[curr[incoming ? edges[i].to : edges[i].from]++] = uint32(i);
+  }
+
+  void TaskGraphRecorder::analyze(void) {
+    Lock<MutexSys> lock(this->mutex);
+    const uint32 nodeNum = uint32(this->nodes.size());
+    vector<uint32> outFirst, outList, inFirst, inList;
+    buildAdjacency(this->edges, nodeNum, false, outFirst, outList);
+    buildAdjacency(this->edges, nodeNum, true, inFirst, inList);
+
+    // Topological order. A dependency cycle would have been a dead lock
+    vector<uint32> order, inDegree(nodeNum);
+    order.reserve(nodeNum);
+    for (uint32 i = 0; i < nodeNum; ++i) {
+      inDegree[i] = inFirst[i + 1] - inFirst[i];
+      if (inDegree[i] == 0) order.push_back(i);
+    }
+    for (size_t i = 0; i < order.size(); ++i)
+      for (uint32 j = outFirst[order[i]]; j < outFirst[order[i] + 1]; ++j)
+        if (--inDegree[this->edges[outList[j]].to] == 0)
+          order.push_back(this->edges[outList[j]].to);
+    PF_ASSERT(order.size() == nodeNum);
+
+    // Forward pass: a task starts when its starts() predecessors are done and
+    // ends when both its run and its ends() predecessors are done
+    this->work = this->span = this->elapsed = 0.;
+    double first = 0., last = 0.;
+    bool anyRun = false;
+    for (size_t i = 0; i < order.size(); ++i) {
+      Node &node = this->nodes[order[i]];
+      node.earliestStart = 0.;
+      double endMin = 0.;
+      for (uint32 j = inFirst[order[i]]; j < inFirst[order[i] + 1]; ++j) {
+        const Edge &edge = this->edges[inList[j]];
+        const double predEnd = this->nodes[edge.from].earliestEnd;
+        if (edge.isEnd)
+          endMin = std::max(endMin, predEnd);
+        else
+          node.earliestStart = std::max(node.earliestStart, predEnd);
+      }
+      node.earliestEnd = std::max(endMin, node.earliestStart + node.getDuration());
+      node.critical = false;
+      this->span = std::max(this->span, node.earliestEnd);
+      this->work += node.work;
+      if (node.runNum) {
+        first = anyRun ? std::min(first, node.runStart) : node.runStart;
+        anyRun = true;
+      }
+      last = std::max(last, node.ended ? node.end : node.runEnd);
+    }
+    this->elapsed = anyRun ? last - first : 0.;
+    this->parallelism = this->span > 0. ? this->work / this->span : 0.;
+
+    // Backward pass: latest end not delaying any successor
+    for (size_t i = order.size(); i > 0; --i) {
+      Node &node = this->nodes[order[i - 1]];
+      node.latestEnd = this->span;
+      for (uint32 j = outFirst[order[i - 1]]; j < outFirst[order[i - 1] + 1]; ++j) {
+        const Edge &edge = this->edges[outList[j]];
+        const Node &succ = this->nodes[edge.to];
+        const double succLatest = edge.isEnd ?
+          succ.latestEnd : succ.latestEnd - succ.getDuration();
+        node.latestEnd = std::min(node.latestEnd, succLatest);
+      }
+    }
+
+    // Walk back from the last task along the predecessors that delayed it
+    this->criticalPath.clear();
+    uint32 curr = nodeNum;
+    for (uint32 i = 0; i < nodeNum; ++i) {
+      if (outFirst[i] != outFirst[i + 1]) continue;
+      if (curr == nodeNum || this->nodes[i].earliestEnd > this->nodes[curr].earliestEnd)
+        curr = i;
+    }
+    while (curr != nodeNum) {
+      Node &node = this->nodes[curr];
+      node.critical = true;
+      this->criticalPath.push_back(curr);
+      uint32 byStart = nodeNum, byEnd = nodeNum;
+      for (uint32 j = inFirst[curr]; j < inFirst[curr + 1]; ++j) {
+        const Edge &edge = this->edges[inList[j]];
+        uint32 &best = edge.isEnd ? byEnd : byStart;
+        if (best == nodeNum || this->nodes[edge.from].earliestEnd > this->nodes[best].earliestEnd)
+          best = edge.from;
+      }
+      // Either a task it waited for to end or the task that started it
+      if (byEnd != nodeNum && this->nodes[byEnd].earliestEnd >= node.earliestStart + node.getDuration())
+        curr = byEnd;
+      else
+        curr = byStart;
+    }
+    std::reverse(this->criticalPath.begin(), this->criticalPath.end());
+  }
+
+  const char *TaskGraphRecorder::getName(uint32 nodeID) const {
+    const char *name = this->nodes[nodeID].name;
+    return name ? name : "unnamed";
+  }
+
+  /*! Milliseconds are more readable for frames */
+  static INLINE double ms(double t) { return t * 1000.; }
+
+  /*! Escape the quotes for both JSON and DOT strings */
+  static void outputEscaped(std::ostream &out, const char *str) {
+    for (; *str; ++str) {
+      if (*str == '"' || *str == '\\') out << '\\';
+      out << *str;
+    }
+  }
+
+  /*! Sort nodes by increasing slack */
+  struct TaskGraphSlackCompare {
+    INLINE TaskGraphSlackCompare(const vector<TaskGraphRecorder::Node> &nodes) :
+      nodes(nodes) {}
+    INLINE bool operator() (uint32 a, uint32 b) const {
+      return nodes[a].getSlack() < nodes[b].getSlack();
+    }
+    const vector<TaskGraphRecorder::Node> &nodes;
+  };
+
+  void TaskGraphRecorder::outputText(std::ostream &out) const {
+    const std::ios::fmtflags flags = out.flags();
+    const std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(3);
+    out << "task graph: " << this->nodes.size() << " tasks, "
+        << this->edges.size() << " dependencies" << std::endl;
+    out << "elapsed " << ms(this->elapsed) << " ms, work " << ms(this->work)
+        << " ms, critical path " << ms(this->span) << " ms, parallelism "
+        << std::setprecision(2) << this->parallelism << std::endl;
+    out << std::setprecision(3) << "critical path:" << std::endl;
+    for (size_t i = 0; i < this->criticalPath.size(); ++i) {
+      const Node &node = this->nodes[this->criticalPath[i]];
+      out << "  " << std::setw(10) << ms(node.getDuration()) << " ms  "
+          << this->getName(this->criticalPath[i])
+          << " (thread " << node.threadID << ")" << std::endl;
+    }
+    vector<uint32> sorted(this->nodes.size());
+    for (uint32 i = 0; i < sorted.size(); ++i) sorted[i] = i;
+    std::stable_sort(sorted.begin(), sorted.end(), TaskGraphSlackCompare(this->nodes));
+    out << "tasks by slack (ms): slack start duration work thread runs name" << std::endl;
+    for (size_t i = 0; i < sorted.size(); ++i) {
+      const Node &node = this->nodes[sorted[i]];
+      out << (node.critical ? "* " : "  ")
+          << std::setw(10) << ms(node.getSlack())
+          << std::setw(10) << ms(node.runStart)
+          << std::setw(10) << ms(node.getDuration())
+          << std::setw(10) << ms(node.work)
+          << std::setw(4) << node.threadID
+          << std::setw(6) << node.runNum
+          << "  " << this->getName(sorted[i]) << std::endl;
+    }
+    out.flags(flags);
+    out.precision(precision);
+  }
+
+  void TaskGraphRecorder::outputDOT(std::ostream &out) const {
+    const std::ios::fmtflags flags = out.flags();
+    const std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(3);
+    out << "digraph tasks {" << std::endl;
+    out << "  node [shape=box];" << std::endl;
+    for (size_t i = 0; i < this->nodes.size(); ++i) {
+      const Node &node = this->nodes[i];
+      out << "  t" << i << " [label=\"" << i << ": ";
+      outputEscaped(out, this->getName(uint32(i)));
+      out << "\\n" << ms(node.getDuration()) << " ms, slack "
+          << ms(node.getSlack()) << " ms\"";
+      if (node.critical) out << ", color=red, penwidth=2";
+      out << "];" << std::endl;
+    }
+    // Solid edges for starts(), dashed edges for ends()
+    for (size_t i = 0; i < this->edges.size(); ++i) {
+      const Edge &edge = this->edges[i];
+      const bool critical = this->nodes[edge.from].critical &&
+                            this->nodes[edge.to].critical;
+      out << "  t" << edge.from << " -> t" << edge.to;
+      if (edge.isEnd || critical) {
+        out << " [";
+        if (edge.isEnd) out << "style=dashed";
+        if (edge.isEnd && critical) out << ", ";
+        if (critical) out << "color=red";
+        out << "]";
+      }
+      out << ";" << std::endl;
+    }
+    out << "}" << std::endl;
+    out.flags(flags);
+    out.precision(precision);
+  }
+
+  void TaskGraphRecorder::outputJSON(std::ostream &out) const {
+    const std::ios::fmtflags flags = out.flags();
+    const std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(6);
+    out << "{\"elapsed\":" << this->elapsed
+        << ",\"work\":" << this->work
+        << ",\"span\":" << this->span
+        << ",\"parallelism\":" << this->parallelism
+        << ",\"tasks\":[";
+    for (size_t i = 0; i < this->nodes.size(); ++i) {
+      const Node &node = this->nodes[i];
+      out << (i ? "," : "") << "{\"id\":" << i << ",\"name\":\"";
+      outputEscaped(out, this->getName(uint32(i)));
+      out << "\",\"thread\":" << node.threadID
+          << ",\"runs\":" << node.runNum
+          << ",\"runStart\":" << node.runStart
+          << ",\"runEnd\":" << node.runEnd
+          << ",\"end\":" << node.end
+          << ",\"work\":" << node.work
+          << ",\"slack\":" << node.getSlack()
+          << ",\"critical\":" << (node.critical ? "true" : "false") << "}";
+    }
+    out << "],\"edges\":[";
+    for (size_t i = 0; i < this->edges.size(); ++i) {
+      const Edge &edge = this->edges[i];
+      out << (i ? "," : "") << "{\"from\":" << edge.from
+          << ",\"to\":" << edge.to
+          << ",\"type\":\"" << (edge.isEnd ? "ends" : "starts") << "\"}";
+    }
+    out << "],\"criticalPath\":[";
+    for (size_t i = 0; i < this->criticalPath.size(); ++i)
+      out << (i ? "," : "") << this->criticalPath[i];
+    out << "]}" << std::endl;
+    out.flags(flags);
+    out.precision(precision);
+  }
+} /* namespace pf */
+
+#endif /* PF_TASK_PROFILER */
+
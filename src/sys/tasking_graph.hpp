@@ -0,0 +1,125 @@
+// ======================================================================== //
+// Copyright (C) 2011 Benjamin Segovia                                      //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#ifndef __PF_TASKING_GRAPH_HPP__
+#define __PF_TASKING_GRAPH_HPP__
+
+#include "sys/tasking.hpp"
+#include "sys/mutex.hpp"
+#include "sys/vector.hpp"
+#include "sys/hash_map.hpp"
+
+#if PF_TASK_PROFILER
+
+namespace pf
+{
+  /*! Records the task graph run by the tasking system (tasks, run timestamps
+   *  and starts / ends dependencies) and finds the dependency chain that
+   *  determines its length. Typical use to capture one frame:
+   *  - recorder.clear() and TaskingSystemSetProfiler(&recorder) before it
+   *  - TaskingSystemSetProfiler(NULL) when it is done
+   *  - recorder.analyze() and output the results as text, DOT or JSON
+   *  The analysis replays the graph with unlimited threads and the measured
+   *  run times: time spent in the queues is not part of the critical path.
+   *  Slack is how much a task can be delayed without delaying the frame and
+   *  parallelism is the total work divided by the critical path length
+   */
+  class TaskGraphRecorder : public TaskProfiler
+  {
+  public:
+    /*! One recorded task (all times are in seconds since clear()) */
+    struct Node
+    {
+      const char *name;     //!< Name of the task (may be NULL)
+      double runStart;      //!< First time the run function was entered
+      double runEnd;        //!< Last time the run function was left
+      double work;          //!< Time spent in run (summed over threads)
+      double end;           //!< Time the task was done (with dependencies)
+      double earliestStart; //!< Earliest start with unlimited threads
+      double earliestEnd;   //!< Earliest end with unlimited threads
+      double latestEnd;     //!< Latest end not delaying the graph
+      uint32 threadID;      //!< Thread that first ran it
+      uint32 runNum;        //!< Number of times run was called (> 1 for sets)
+      bool ended;           //!< True when the task is done
+      bool critical;        //!< True when on the critical path
+      /*! Time the task takes with unlimited threads */
+      INLINE double getDuration(void) const {
+        return this->runNum ? this->runEnd - this->runStart : 0.;
+      }
+      /*! How much the task can be delayed without delaying the graph */
+      INLINE double getSlack(void) const {
+        return this->latestEnd - this->earliestEnd;
+      }
+    };
+    /*! from->starts(to) if isEnd is false, to->ends(from) otherwise */
+    struct Edge
+    {
+      uint32 from, to;
+      bool isEnd;
+    };
+    TaskGraphRecorder(void);
+    virtual ~TaskGraphRecorder(void);
+    /*! Forget everything recorded so far and restart the clock */
+    void clear(void);
+    /*! Compute the critical path, the slacks and the parallelism */
+    void analyze(void);
+    /*! Summary, critical path and per-task slacks (call analyze first) */
+    void outputText(std::ostream &out) const;
+    /*! Graphviz graph with the critical path in red (call analyze first) */
+    void outputDOT(std::ostream &out) const;
+    /*! Everything in one JSON object (call analyze first) */
+    void outputJSON(std::ostream &out) const;
+    // Profiler interface
+    virtual void onSleep(uint32 threadID) {}
+    virtual void onWakeUp(uint32 threadID) {}
+    virtual void onLock(uint32 threadID) {}
+    virtual void onUnlock(uint32 threadID) {}
+    virtual void onRunStart(const char *taskName, uint32 threadID) {}
+    virtual void onRunEnd(const char *taskName, uint32 threadID) {}
+    virtual void onEnd(const char *taskName, uint32 threadID) {}
+    virtual void onTaskRunStart(const Task *task, uint32 threadID);
+    virtual void onTaskRunEnd(const Task *task, uint32 threadID);
+    virtual void onTaskEnd(const Task *task, uint32 threadID);
+    virtual void onTaskEdge(const Task *task, const Task *other, bool isEnd);
+    vector<Node> nodes;          //!< All recorded tasks
+    vector<Edge> edges;          //!< All recorded dependencies
+    vector<uint32> criticalPath; //!< Nodes on the critical path (in order)
+    double work;                 //!< Sum of all the task works
+    double span;                 //!< Length of the critical path
+    double elapsed;              //!< Measured time from first run to last end
+    double parallelism;          //!< work / span
+  private:
+    /*! Get the node of a task. Tasks are allocated and freed all the time so
+     *  a pointer refers to a new node once its previous task is done
+     */
+    uint32 getNode(const Task *task, bool canBeEnded = false);
+    /*! Name to display for the given node */
+    const char *getName(uint32 nodeID) const;
+    /*! Run function in flight. Runs nest when a thread runs other tasks
+     *  while waiting (TaskMutex) and their time is not counted twice
+     */
+    struct Run { double start, nested; };
+    hash_map<const Task*, uint32> current; //!< Last node for each task
+    vector<vector<Run>> runs;             //!< Runs in flight per thread
+    MutexSys mutex;                       //!< Callbacks come from all threads
+    double startTime;                     //!< Set by clear()
+    PF_CLASS(TaskGraphRecorder);
+  };
+} /* namespace pf */
+
+#endif /* PF_TASK_PROFILER */
+#endif /* __PF_TASKING_GRAPH_HPP__ */
+
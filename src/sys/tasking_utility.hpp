@@ -56,48 +56,26 @@ namespace pf
     Task *succ;
   };
 
-  /*! Dependency root is the first task that triggers the multiple
-   *  dependencies. It includes a mutex protected variable that allows the
-   *  start dependencies to be added at any time
-   */
-  class TaskDependencyRoot : public TaskChained
-  {
-  public:
-    TaskDependencyRoot(void);
-    virtual Task *run(void);
-    /*! Lock the run function (then we can modify variable "done") */
-    void lock(void);
-    /*! Unlock the run function */
-    void unlock(void);
-    /*! Once done, the parent task cannot be a input dependency anymore */
-    INLINE bool isDone(void) const { return done; }
-  private:
-    MutexActive mutex;  //!< Protect isDone variable
-    volatile bool done; //!< true means the parent task is ended
-  };
-
   /*! MultipleDependency is a policy that allows a task to start and end
    *  several tasks (instead of one with the standard task).
    *  - More importantly, MultipleDependency also relaxes the requirement to add
    *  a start dependency (method "multiStarts"). multiStarts can be called
    *  from anywhere regardless the current state the task (it can be NEW,
    *  RUNNING or DONE)
-   *  - Internally, it simply uses a list of dummy tasks to trigger the
-   *  dependencies
+   *  - Internally, the task owns a lock-free list of successors that the
+   *  scheduler closes and processes when the task ends. Adding a dependency
+   *  is one CAS and no extra task is ever allocated
    */
   template <typename T>
   class MultiDependencyPolicy
   {
   public:
-    /*! Allocate the chained list of dependency tasks */
+    /*! Open the list of successors */
     INLINE MultiDependencyPolicy(void);
     /*! Add one more task to start */
     INLINE void multiStarts(Task *other);
     /*! Add one more task to end */
     INLINE void multiEnds(Task *other);
-  private:
-    Ref<TaskDependencyRoot> tail; //!< First dependency task
-    TaskChained *head;            //!< Ends us and triggers the dependencies
   };
 
   /*! Task with multiple dependencies */
@@ -130,27 +108,16 @@ namespace pf
   ///////////////////////////////////////////////////////////////////////////
 
   template <typename T>
-  INLINE MultiDependencyPolicy<T>::MultiDependencyPolicy(void)
-  {
-    this->tail = PF_NEW(TaskDependencyRoot);
-    this->head = this->tail;
-    static_cast<T*>(this)->starts(head);
-    head->scheduled();
+  INLINE MultiDependencyPolicy<T>::MultiDependencyPolicy(void) {
+    static_cast<T*>(this)->openSuccessors();
   }
 
   template <typename T>
   INLINE void MultiDependencyPolicy<T>::multiStarts(Task *other)
   {
     if (UNLIKELY(other == NULL)) return;
-    if (tail->isDone() == true) return;
-    tail->lock();
-    if (tail->isDone() == false) {
-      TaskChained *newHead = PF_NEW(TaskChained);
-      newHead->starts(other);
-      head->setNext(newHead);
-      head = newHead;
-    }
-    tail->unlock();
+    PF_ASSERT(other->getState() == TaskState::NEW);
+    static_cast<T*>(this)->pushSuccessor(other, false);
   }
 
   template <typename T>
@@ -163,10 +130,7 @@ namespace pf
               state == TaskState::SCHEDULED ||
               state == TaskState::RUNNING);
 #endif /* NDEBUG */
-    TaskChained *newHead = PF_NEW(TaskChained);
-    newHead->ends(other);
-    head->setNext(newHead);
-    head = newHead;
+    static_cast<T*>(this)->pushSuccessor(other, true);
   }
 
   template <typename T, typename TaskType>
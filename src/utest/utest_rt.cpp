@@ -18,8 +18,19 @@
 #include "renderer/renderer.hpp"
 #include "rt/bvh2_traverser.hpp"
 #include "rt/bvh2.hpp"
+#include "rt/bvh2_cache.hpp"
+#include "rt/bvh2_dynamic.hpp"
+#include "rt/bvh4_traverser.hpp"
+#include "rt/bvh4.hpp"
+#include "rt/bvh8_traverser.hpp"
+#include "rt/bvh8.hpp"
+#include "rt/qbvh4_traverser.hpp"
+#include "rt/qbvh4.hpp"
+#include "rt/instance_intersector.hpp"
 #include "rt/rt_triangle.hpp"
+#include "rt/rt_triangle4.hpp"
 #include "rt/rt_camera.hpp"
+#include "rt/ray_stream.hpp"
 #include "models/obj.hpp"
 #include "game/camera.hpp"
 #include "image/stb_image.hpp"
@@ -29,6 +40,7 @@
 #include "sys/tasking_utility.hpp"
 #include "sys/logging.hpp"
 #include "sys/default_path.hpp"
+#include "sys/sysinfo.hpp"
 
 #include "utest/utest.hpp"
 
@@ -59,27 +71,311 @@ namespace pf
     return tris;
   }
 
-  /*! Task set that computes a frame buffer with ray tracing */
-  template <bool singleRay>
+  /*! The checks below run on random triangles: they do not need a model */
+  static INLINE float frand(void) { return float(rand()) / float(RAND_MAX); }
+  static INLINE vec3f vrand(void) { return vec3f(frand(), frand(), frand()); }
+
+  /*! Small triangles randomly spread in [0,100]^3 */
+  static RTTriangle *RandomTriangles(uint32 triNum) {
+    RTTriangle *tris = PF_NEW_ARRAY(RTTriangle, triNum);
+    srand(1);
+    for (uint32 i = 0; i < triNum; ++i) {
+      const vec3f c = 100.f * vrand();
+      tris[i] = RTTriangle(c, c + 4.f * vrand(), c + 4.f * vrand());
+    }
+    return tris;
+  }
+
+  /*! Packet of random rays in the same direction octant. Origins are spread
+   *  all over the scene: rays quickly diverge and the traversal switches to
+   *  single rays (hybrid traversal)
+   */
+  static void RandomPacket(RayPacket &pckt, Ray rays[RayPacket::rayNum]) {
+    const vec3f sign(frand() < .5f ? -1.f : 1.f,
+                     frand() < .5f ? -1.f : 1.f,
+                     frand() < .5f ? -1.f : 1.f);
+    vec3f minOrg(inf), maxOrg(neg_inf);
+    for (uint32 i = 0; i < RayPacket::rayNum; ++i) {
+      const vec3f dir = sign * (vrand() + vec3f(0.01f));
+      rays[i] = Ray(100.f * vrand(), dir);
+      minOrg = min(minOrg, rays[i].org);
+      maxOrg = max(maxOrg, rays[i].org);
+    }
+    for (uint32 i = 0; i < RayPacket::chunkNum; ++i) {
+      const Ray *r = rays + 4 * i;
+      pckt.org[i] = sse3f(ssef(r[0].org.x, r[1].org.x, r[2].org.x, r[3].org.x),
+                          ssef(r[0].org.y, r[1].org.y, r[2].org.y, r[3].org.y),
+                          ssef(r[0].org.z, r[1].org.z, r[2].org.z, r[3].org.z));
+      pckt.dir[i] = sse3f(ssef(r[0].dir.x, r[1].dir.x, r[2].dir.x, r[3].dir.x),
+                          ssef(r[0].dir.y, r[1].dir.y, r[2].dir.y, r[3].dir.y),
+                          ssef(r[0].dir.z, r[1].dir.z, r[2].dir.z, r[3].dir.z));
+      pckt.rdir[i] = sse3f(rcp(pckt.dir[i].x), rcp(pckt.dir[i].y), rcp(pckt.dir[i].z));
+    }
+    pckt.iaMinOrg = ssef(minOrg.x, minOrg.y, minOrg.z, minOrg.z);
+    pckt.iaMaxOrg = ssef(maxOrg.x, maxOrg.y, maxOrg.z, maxOrg.z);
+    pckt.iasign = ssef(sign.x, sign.y, sign.z, sign.z) < ssef(zero);
+    pckt.properties = 0;
+  }
+
+  /*! Closest hits of divergent packets must be the ones of single rays */
+  static void CheckHybridPackets(const Intersector &intersector, const char *name) {
+    uint32 errorNum = 0, hitNum = 0;
+    srand(7); // Not the seed of the triangles: origins would lie on them
+    for (uint32 p = 0; p < 512; ++p) {
+      RayPacket pckt;
+      PacketHit hit;
+      Ray rays[RayPacket::rayNum];
+      RandomPacket(pckt, rays);
+      intersector.traverse(pckt, hit);
+      for (uint32 i = 0; i < RayPacket::rayNum; ++i) {
+        Hit single;
+        intersector.traverse(rays[i], single);
+        const uint32 chunkID = i / 4, laneID = i % 4;
+        const float t = hit.t[chunkID][laneID];
+        if (hit.id0[chunkID][laneID] != single.id0 ||
+            hit.id1[chunkID][laneID] != single.id1 ||
+            abs(t - single.t) > 1e-4f * max(single.t, 1.f))
+          errorNum++;
+        hitNum += single ? 1 : 0;
+      }
+    }
+    PF_MSG_V(name << ": " << hitNum << " hits, " << errorNum << " packet / single ray mismatches");
+    FATAL_IF(errorNum != 0, "Hybrid packet traversal does not match single rays");
+  }
+
+  /*! Shadow rays are segments: occluders behind the segment end must be
+   *  ignored. Segments end just before or just after the closest hit
+   */
+  static void CheckOcclusion(const Intersector &intersector, const char *name) {
+    uint32 errorNum = 0, occludedNum = 0;
+    srand(7);
+    for (uint32 p = 0; p < 512; ++p) {
+      RayPacket pckt;
+      Ray rays[RayPacket::rayNum];
+      sseb mask[RayPacket::chunkNum];
+      ssef tfar[RayPacket::chunkNum];
+      bool expected[RayPacket::rayNum];
+      RandomPacket(pckt, rays);
+      for (uint32 i = 0; i < RayPacket::rayNum; ++i) {
+        Hit single;
+        intersector.traverse(rays[i], single);
+        const bool beyond = (i & 1) != 0;
+        const uint32 chunkID = i / 4, laneID = i % 4;
+        mask[chunkID][laneID] = (i % 3) != 0 ? -1 : 0;
+        tfar[chunkID][laneID] = single ? (beyond ? 1.01f : 0.99f) * single.t : FLT_MAX;
+        expected[i] = mask[chunkID][laneID] != 0 && single && beyond;
+      }
+      intersector.occluded(pckt, tfar, mask);
+      for (uint32 i = 0; i < RayPacket::rayNum; ++i) {
+        const bool occluded = mask[i / 4][i % 4] != 0;
+        if (occluded != expected[i]) errorNum++;
+        occludedNum += occluded ? 1 : 0;
+      }
+    }
+    PF_MSG_V(name << ": " << occludedNum << " occluded, " << errorNum << " packet / single ray mismatches");
+    FATAL_IF(errorNum != 0, "Packet occlusion does not respect the ray segments");
+  }
+
+  /*! Streams must give the hits of single rays. Origins are all the same
+   *  (pinhole camera) or on a plane (rays leaving a floor): the stream gets
+   *  degenerate origin boxes
+   */
+  static void CheckStream(const Intersector &intersector, bool commonOrigin) {
+    const uint32 rayNum = 16384;
+    RayStream stream(rayNum);
+    HitStream hit(rayNum);
+    Ray *rays = PF_NEW_ARRAY(Ray, rayNum);
+    srand(7);
+    for (uint32 i = 0; i < rayNum; ++i) {
+      const vec3f org = commonOrigin ? vec3f(50.f, 50.f, -10.f)
+                                     : vec3f(100.f * frand(), 50.f, 100.f * frand());
+      const vec3f dir = commonOrigin ? vec3f(frand() - .5f, frand() - .5f, 1.f)
+                                     : vrand() - vec3f(.5f);
+      rays[i] = Ray(org, dir);
+      stream.set(i, org, dir);
+    }
+    intersector.traverse(stream, hit);
+    uint32 errorNum = 0;
+    for (uint32 i = 0; i < rayNum; ++i) {
+      Hit single;
+      intersector.traverse(rays[i], single);
+      if (hit.id0[i] != single.id0 ||
+          abs(hit.t[i] - single.t) > 1e-4f * max(single.t, 1.f))
+        errorNum++;
+    }
+    PF_DELETE_ARRAY(rays);
+    PF_MSG_V("Stream (" << (commonOrigin ? "common origin" : "coplanar origins")
+             << "): " << errorNum << " stream / single ray mismatches");
+    FATAL_IF(errorNum != 0, "Stream traversal does not match single rays");
+  }
+
+  /*! Number of random single rays with different closest hits */
+  static uint32 CompareHits(const Intersector &a, const Intersector &b) {
+    uint32 errorNum = 0;
+    srand(7);
+    for (uint32 i = 0; i < 16384; ++i) {
+      const Ray ray(100.f * vrand(), vrand() - vec3f(.5f));
+      Hit hitA, hitB;
+      a.traverse(ray, hitA);
+      b.traverse(ray, hitB);
+      if (hitA.id0 != hitB.id0 || abs(hitA.t - hitB.t) > 1e-4f * max(hitB.t, 1.f))
+        errorNum++;
+    }
+    return errorNum;
+  }
+
+  /*! All the builders must give the closest hits of the sweep SAH builder,
+   *  with and without the final node relayout
+   */
+  static void CheckBuilders(const RTTriangle *tris, uint32 triNum) {
+    static const char *names[] = {"sweep SAH", "binned SAH", "Morton", "Morton SAH",
+                                  "spatial SAH", "lean SAH"};
+    BVH2BuildOption option = defaultBVH2Options;
+    option.algorithm = PF_BVH2_SWEEP_SAH;
+    Ref<BVH2<RTTriangle>> sweep = PF_NEW(BVH2<RTTriangle>);
+    buildBVH2(tris, triNum, *sweep, option);
+    const BVH2Traverser<RTTriangle> reference(sweep);
+    for (uint32 algorithm = PF_BVH2_SWEEP_SAH; algorithm <= PF_BVH2_LEAN_SAH; ++algorithm)
+      for (uint32 relayout = 0; relayout < 2; ++relayout) {
+        option.algorithm = BVH2BuildAlgorithm(algorithm);
+        option.relayout = relayout != 0;
+        Ref<BVH2<RTTriangle>> bvh = PF_NEW(BVH2<RTTriangle>);
+        buildBVH2(tris, triNum, *bvh, option);
+        const uint32 errorNum = CompareHits(BVH2Traverser<RTTriangle>(bvh), reference);
+        PF_MSG_V("BVH2 " << names[algorithm] << (relayout ? " with" : " without")
+                 << " relayout: " << bvh->nodeNum << " nodes, "
+                 << errorNum << " mismatches");
+        FATAL_IF(errorNum != 0, "BVH2 builders do not give the same hits");
+      }
+  }
+
+  /*! Refitted trees must give the hits of a tree compiled from scratch. The
+   *  triangles are scattered all over the scene: the refitted tree is bad
+   *  enough to be rebuilt
+   */
+  static void CheckRefit(const RTTriangle *tris, uint32 triNum) {
+    Ref<BVH2<RTTriangle>> bvh = PF_NEW(BVH2<RTTriangle>);
+    Ref<BVH4<RTTriangle>> bvh4 = PF_NEW(BVH4<RTTriangle>);
+    Ref<BVH8<RTTriangle>> bvh8 = NULL;
+    buildBVH2(tris, triNum, *bvh);
+    buildBVH4(*bvh, *bvh4);
+    if (hasAVX()) {
+      bvh8 = PF_NEW(BVH8<RTTriangle>);
+      buildBVH8(*bvh, *bvh8);
+    }
+    Ref<DynamicBVH2<RTTriangle>> dynamic = PF_NEW(DynamicBVH2<RTTriangle>, bvh);
+
+    // Move the triangles and refit all the trees
+    RTTriangle *moved = PF_NEW_ARRAY(RTTriangle, triNum);
+    srand(3);
+    for (uint32 i = 0; i < triNum; ++i) {
+      const vec3f shift = 100.f * vrand() - tris[i].v[0];
+      moved[i] = RTTriangle(tris[i].v[0] + shift, tris[i].v[1] + shift, tris[i].v[2] + shift);
+    }
+    FATAL_IF(dynamic->update(moved), "The tree cannot be rebuilt yet");
+    FATAL_IF(dynamic->getCost() <= 1.5f * dynamic->getReferenceCost(),
+             "Scattered triangles must trigger a rebuild");
+    refitBVH4(*bvh4, moved);
+    if (bvh8) refitBVH8(*bvh8, moved);
+    Ref<BVH2<RTTriangle>> fresh = PF_NEW(BVH2<RTTriangle>);
+    buildBVH2(moved, triNum, *fresh);
+    const BVH2Traverser<RTTriangle> reference(fresh);
+    uint32 errorNum = CompareHits(BVH2Traverser<RTTriangle>(dynamic->getBVH()), reference);
+    errorNum += CompareHits(BVH4Traverser<RTTriangle>(bvh4), reference);
+    if (bvh8) errorNum += CompareHits(BVH8Traverser<RTTriangle>(bvh8), reference);
+    PF_MSG_V("Refit: cost from " << dynamic->getReferenceCost() << " to "
+             << dynamic->getCost() << ", " << errorNum << " mismatches");
+    FATAL_IF(errorNum != 0, "Refitted trees do not match a new tree");
+
+    // The next update uses the rebuilt tree
+    TaskingSystemWaitAll();
+    FATAL_IF(!dynamic->update(moved), "The rebuilt tree must replace the refitted one");
+    FATAL_IF(dynamic->getCost() != dynamic->getReferenceCost(), "Wrong reference cost");
+    errorNum = CompareHits(BVH2Traverser<RTTriangle>(dynamic->getBVH()), reference);
+    PF_MSG_V("Rebuild: cost " << dynamic->getCost() << ", " << errorNum << " mismatches");
+    FATAL_IF(errorNum != 0, "Rebuilt tree does not match a new tree");
+    PF_DELETE_ARRAY(moved);
+  }
+
+  /*! Compare the traversals against each other on random scenes */
+  static void RTCheck(void)
+  {
+    const uint32 triNum = 16384;
+    RTTriangle *tris = RandomTriangles(triNum);
+    Ref<BVH2<RTTriangle>> bvh = PF_NEW(BVH2<RTTriangle>);
+    buildBVH2(tris, triNum, *bvh);
+    Ref<Intersector> traverser = PF_NEW(BVH2Traverser<RTTriangle>, bvh);
+    CheckHybridPackets(*traverser, "BVH2 hybrid packets");
+    CheckOcclusion(*traverser, "BVH2 occlusion");
+    Ref<BVH4<RTTriangle>> bvh4 = PF_NEW(BVH4<RTTriangle>);
+    buildBVH4(*bvh, *bvh4);
+    CheckOcclusion(BVH4Traverser<RTTriangle>(bvh4), "BVH4 occlusion");
+    Ref<QBVH4<RTTriangle,uint8>> qbvh4 = PF_NEW((QBVH4<RTTriangle,uint8>));
+    buildQBVH4(*bvh, *qbvh4);
+    CheckOcclusion(QBVH4Traverser<RTTriangle,uint8>(qbvh4), "QBVH4 occlusion");
+    if (hasAVX()) {
+      Ref<BVH8<RTTriangle>> bvh8 = PF_NEW(BVH8<RTTriangle>);
+      buildBVH8(*bvh, *bvh8);
+      CheckOcclusion(BVH8Traverser<RTTriangle>(bvh8), "BVH8 occlusion");
+    }
+    CheckStream(*traverser, true);
+    CheckStream(*traverser, false);
+
+    // 4x4x4 scaled down instances: the top level is deep enough to have
+    // divergent packets too
+    Ref<InstanceIntersector> instances = PF_NEW(InstanceIntersector);
+    const BBox3f box(bvh->node[0].getMin(), bvh->node[0].getMax());
+    for (uint32 i = 0; i < 64; ++i) {
+      const vec3f shift(float(i % 4), float((i / 4) % 4), float(i / 16));
+      mat4x4f model = translate(mat4x4f(one), 25.f * shift);
+      model[0][0] = model[1][1] = model[2][2] = 0.25f;
+      instances->add(traverser, box, model);
+    }
+    instances->compile();
+    CheckHybridPackets(*instances, "Instances hybrid packets");
+    CheckOcclusion(*instances, "Instances occlusion");
+    CheckBuilders(tris, triNum);
+    CheckRefit(tris, triNum);
+    PF_DELETE_ARRAY(tris);
+  }
+
+  /*! What we ray trace */
+  enum RTMode {
+    RT_SINGLE_RAY = 0, //!< Closest hit with single rays
+    RT_PACKET = 1,     //!< Closest hit with ray packets
+    RT_OCCLUDED = 2,   //!< Any hit with ray packets (only visibility)
+    RT_STREAM = 3,     //!< Closest hit with ray streams
+    RT_STATISTICS = 4  //!< BVH2 traversal counters of single rays and packets
+  };
+
+  /*! Task set that computes a frame buffer with ray tracing. Each job
+   *  handles one row of pw x ph packets. With RT_STATISTICS, stats gets the
+   *  counters of the single ray of each pixel (w x h first values) and the
+   *  ones of the packet of each pixel (w x h next values)
+   */
+  template <RTMode mode, uint32 pw = 8, uint32 ph = 8>
   class TaskRayTrace : public TaskSet
   {
   public:
+    typedef RayPacketT<pw,ph> Packet;
+    typedef PacketHitT<pw,ph> Hits;
     INLINE TaskRayTrace(const Intersector &intersector,
                         const RTCamera &cam,
                         const uint32 *c,
                         uint32 *rgba,
-                        uint32 w, uint32 jobNum) :
+                        uint32 w, uint32 jobNum,
+                        BVH2Stats *stats = NULL) :
       TaskSet(jobNum, "TaskRayTrace"),
-      intersector(intersector), cam(cam), c(c), rgba(rgba),
-      w(w), h(jobNum * RayPacket::height) {}
+      intersector(intersector), cam(cam), c(c), rgba(rgba), stats(stats),
+      w(w), h(jobNum * Packet::height) {}
 
     virtual void run(size_t jobID)
     {
-      if (singleRay) {
+      if (mode == RT_SINGLE_RAY) {
         RTCameraRayGen gen;
         cam.createGenerator(gen, w, h);
-        for (uint32 row = 0; row < RayPacket::height; ++row) {
-          const uint32 y = row + jobID * RayPacket::height;
+        for (uint32 row = 0; row < Packet::height; ++row) {
+          const uint32 y = row + jobID * Packet::height;
           for (uint32 x = 0; x < w; ++x) {
             Ray ray;
             Hit hit;
@@ -88,13 +384,13 @@ namespace pf
             rgba[x + y*w] = hit ? c[hit.id0] : 0u;
           }
         }
-      } else {
+      } else if (mode == RT_PACKET) {
         RTCameraPacketGen gen;
         cam.createGenerator(gen, w, h);
-        const uint32 y = jobID * RayPacket::height;
-        for (uint32 x = 0; x < w; x += RayPacket::width) {
-          RayPacket pckt;
-          PacketHit hit;
+        const uint32 y = jobID * Packet::height;
+        for (uint32 x = 0; x < w; x += Packet::width) {
+          Packet pckt;
+          Hits hit;
           gen.generate(pckt, x, y);
           intersector.traverse(pckt, hit);
           const int32 *IDs = (const int32 *) &hit.id0[0][0];
@@ -106,6 +402,74 @@ namespace pf
             }
           }
         }
+      } else if (mode == RT_STREAM) {
+        RTCameraRayGen gen;
+        cam.createGenerator(gen, w, h);
+        RayStream stream(Packet::height * w);
+        HitStream hit(Packet::height * w);
+        for (uint32 row = 0, id = 0; row < Packet::height; ++row) {
+          const uint32 y = row + jobID * Packet::height;
+          for (uint32 x = 0; x < w; ++x, ++id) {
+            Ray ray;
+            gen.generate(ray, x, y);
+            stream.set(id, ray.org, ray.dir);
+          }
+        }
+        intersector.traverse(stream, hit);
+        uint32 *dst = rgba + jobID * Packet::height * w;
+        for (uint32 id = 0; id < stream.rayNum; ++id)
+          dst[id] = hit.id0[id] != -1 ? c[hit.id0[id]] : 0u;
+      } else if (mode == RT_STATISTICS) {
+        RTCameraRayGen rayGen;
+        RTCameraPacketGen packetGen;
+        cam.createGenerator(rayGen, w, h);
+        cam.createGenerator(packetGen, w, h);
+        const uint32 y = jobID * Packet::height;
+        for (uint32 row = 0; row < Packet::height; ++row)
+          for (uint32 x = 0; x < w; ++x) {
+            const uint32 offset = x + (y + row) * w;
+            Ray ray;
+            Hit hit;
+            rayGen.generate(ray, x, y + row);
+            resetBVH2Stats();
+            intersector.traverse(ray, hit);
+            stats[offset] = getBVH2Stats();
+            rgba[offset] = hit ? c[hit.id0] : 0u;
+          }
+        for (uint32 x = 0; x < w; x += Packet::width) {
+          Packet pckt;
+          Hits hit;
+          packetGen.generate(pckt, x, y);
+          resetBVH2Stats();
+          intersector.traverse(pckt, hit);
+          const BVH2Stats packetStats = getBVH2Stats();
+          for (uint32 j = 0; j < pckt.height; ++j)
+            for (uint32 i = 0; i < pckt.width; ++i)
+              stats[w * h + x + i + (y + j) * w] = packetStats;
+        }
+      } else {
+        RTCameraPacketGen gen;
+        cam.createGenerator(gen, w, h);
+        const uint32 y = jobID * Packet::height;
+        for (uint32 x = 0; x < w; x += Packet::width) {
+          Packet pckt;
+          sseb mask[Packet::chunkNum];
+          ssef tfar[Packet::chunkNum];
+          for (uint32 i = 0; i < Packet::chunkNum; ++i) {
+            mask[i] = sseb(True);
+            tfar[i] = ssef(FLT_MAX);
+          }
+          gen.generate(pckt, x, y);
+          intersector.occluded(pckt, tfar, mask);
+          uint32 curr = 0;
+          for (uint32 j = 0; j < pckt.height; ++j) {
+            for (uint32 i = 0; i < pckt.width; ++i, ++curr) {
+              const uint32 offset = x + i + (y + j) * w;
+              const bool occluded = mask[curr / 4][curr % 4] != 0;
+              rgba[offset] = occluded ? 0xffffffffu : 0u;
+            }
+          }
+        }
       }
     }
 
@@ -113,20 +477,66 @@ namespace pf
     const RTCamera &cam;            //!< Parameterize the view
     const uint32 *c;                //!< One color per triangle
     uint32 *rgba;                   //!< Frame buffer
+    BVH2Stats *stats;               //!< Traversal counters (RT_STATISTICS)
     uint32 w, h;                    //!< Frame buffer dimensions
   };
 
+  /*! Blue (cold) to red (hot) color of value in [0, maxValue] */
+  static uint32 heatColor(uint32 value, uint32 maxValue) {
+    const float x = maxValue ? float(value) / float(maxValue) : 0.f;
+    const uint32 r = uint32(255.f * x);
+    const uint32 g = uint32(255.f * (1.f - abs(2.f * x - 1.f)));
+    const uint32 b = uint32(255.f * (1.f - x));
+    return r | (g << 8) | (b << 16) | 0xff000000u;
+  }
+
+  /*! Write the heatmap of one counter (normalized by its maximum value) */
+  static void writeHeatMap(const char *name, const BVH2Stats *stats,
+                           uint32 BVH2Stats::*counter, uint32 w, uint32 h)
+  {
+    uint32 *rgba = PF_NEW_ARRAY(uint32, w * h);
+    uint32 maxValue = 0;
+    for (uint32 i = 0; i < w * h; ++i) maxValue = max(maxValue, stats[i].*counter);
+    for (uint32 i = 0; i < w * h; ++i) rgba[i] = heatColor(stats[i].*counter, maxValue);
+    stbi_write_bmp(name, w, h, 4, rgba);
+    PF_DELETE_ARRAY(rgba);
+  }
+
+  /*! Output the average counters of the given traversals */
+  static void outputStats(const char *name, const BVH2Stats *stats,
+                          uint32 w, uint32 h, uint32 stepX, uint32 stepY)
+  {
+    double nodeNum = 0., leafNum = 0., primNum = 0., iaExitNum = 0.;
+    uint32 maxNodeNum = 0, num = 0;
+    for (uint32 y = 0; y < h; y += stepY)
+      for (uint32 x = 0; x < w; x += stepX, ++num) {
+        const BVH2Stats &s = stats[x + y * w];
+        nodeNum += s.nodeNum;
+        leafNum += s.leafNum;
+        primNum += s.primNum;
+        iaExitNum += s.iaExitNum;
+        maxNodeNum = max(maxNodeNum, s.nodeNum);
+      }
+    PF_MSG_V(name << ": " << nodeNum / num << " nodes, "
+             << leafNum / num << " leaves, "
+             << primNum / num << " primitives, "
+             << iaExitNum / num << " IA exits (average), "
+             << maxNodeNum << " nodes (max)");
+  }
+
   /*! Ray trace the loaded scene */
-  template <bool singleRay>
+  template <RTMode mode, uint32 pw = 8, uint32 ph = 8>
   static void rayTrace(int w, int h, const uint32 *c) {
     FPSCamera fpsCam;
     const RTCamera cam(fpsCam.org, fpsCam.up, fpsCam.view, fpsCam.fov, fpsCam.ratio);
     uint32 *rgba = PF_NEW_ARRAY(uint32, w * h);
+    BVH2Stats *stats = NULL;
+    if (mode == RT_STATISTICS) stats = PF_NEW_ARRAY(BVH2Stats, 2 * w * h);
     std::memset(rgba, 0, sizeof(uint32) * w * h);
     PF_COMPILER_READ_WRITE_BARRIER;
     const double t = getSeconds();
-    Task *rayTask = PF_NEW(TaskRayTrace<singleRay>, *intersector,
-                           cam, c, rgba, w, h/RayPacket::height);
+    Task *rayTask = PF_NEW((TaskRayTrace<mode,pw,ph>), *intersector,
+                           cam, c, rgba, w, h/ph, stats);
     Task *returnToMain = PF_NEW(TaskInterruptMain);
     rayTask->starts(returnToMain);
     rayTask->scheduled();
@@ -134,10 +544,23 @@ namespace pf
     TaskingSystemEnter();
     const double dt = getSeconds() - t;
     PF_MSG_V(dt * 1000. << " msec - " << CAMW * CAMH / dt << " rays/s");
-    if (singleRay)
+    if (mode == RT_SINGLE_RAY)
       stbi_write_bmp("single.bmp", w, h, 4, rgba);
-    else
+    else if (mode == RT_PACKET)
       stbi_write_bmp("packet.bmp", w, h, 4, rgba);
+    else if (mode == RT_STREAM)
+      stbi_write_bmp("stream.bmp", w, h, 4, rgba);
+    else if (mode == RT_STATISTICS) {
+      const BVH2Stats *packetStats = stats + w * h;
+      outputStats("Single rays", stats, w, h, 1, 1);
+      outputStats("Packets", packetStats, w, h, pw, ph);
+      writeHeatMap("ray_nodes.bmp", stats, &BVH2Stats::nodeNum, w, h);
+      writeHeatMap("ray_prims.bmp", stats, &BVH2Stats::primNum, w, h);
+      writeHeatMap("packet_nodes.bmp", packetStats, &BVH2Stats::nodeNum, w, h);
+      writeHeatMap("packet_prims.bmp", packetStats, &BVH2Stats::primNum, w, h);
+      PF_DELETE_ARRAY(stats);
+    } else
+      stbi_write_bmp("occluded.bmp", w, h, 4, rgba);
     PF_DELETE_ARRAY(rgba);
   }
 
@@ -153,10 +576,10 @@ namespace pf
     if (path == defaultPathNum)
       PF_WARNING_V("Obj: " << objName << " not found");
 
-    // Build the BVH
+    // Build the BVH (or map it from the cache if already built)
     RTTriangle *tris = ObjComputeTriangle(obj);
     Ref<BVH2<RTTriangle>> bvh = PF_NEW(BVH2<RTTriangle>);
-    buildBVH2(tris, obj.triNum, *bvh);
+    buildBVH2Cached(tris, obj.triNum, *bvh);
     PF_DELETE_ARRAY(tris);
 
     // Now we have an intersector on the triangle soup
@@ -170,10 +593,87 @@ namespace pf
     }
 
     // Ray trace now
-    PF_MSG_V("Packet ray tracing");
-    for (int i = 0; i < 16; ++i) rayTrace<false>(CAMW, CAMH, c);
-    PF_MSG_V("Single ray tracing");
-    for (int i = 0; i < 16; ++i) rayTrace<true>(CAMW, CAMH, c);
+    PF_MSG_V("BVH2: Packet ray tracing");
+    for (int i = 0; i < 16; ++i) rayTrace<RT_PACKET>(CAMW, CAMH, c);
+    PF_MSG_V("BVH2: 4x4 packet ray tracing");
+    for (int i = 0; i < 16; ++i) rayTrace<RT_PACKET,4,4>(CAMW, CAMH, c);
+    PF_MSG_V("BVH2: 16x16 packet ray tracing");
+    for (int i = 0; i < 16; ++i) rayTrace<RT_PACKET,16,16>(CAMW, CAMH, c);
+    PF_MSG_V("BVH2: Single ray tracing");
+    for (int i = 0; i < 16; ++i) rayTrace<RT_SINGLE_RAY>(CAMW, CAMH, c);
+    PF_MSG_V("BVH2: Packet occlusion");
+    for (int i = 0; i < 16; ++i) rayTrace<RT_OCCLUDED>(CAMW, CAMH, c);
+    PF_MSG_V("BVH2: Stream ray tracing");
+    for (int i = 0; i < 16; ++i) rayTrace<RT_STREAM>(CAMW, CAMH, c);
+    if (PF_BVH2_STATISTICS) {
+      PF_MSG_V("BVH2: Traversal statistics");
+      rayTrace<RT_STATISTICS>(CAMW, CAMH, c);
+    }
+
+    // Same BVH2 with the leaves packed in 4-wide triangles
+    Ref<BVH2<RTTriangle4>> bvhTri4 = PF_NEW(BVH2<RTTriangle4>);
+    buildTriangle4(*bvh, *bvhTri4);
+    intersector = PF_NEW(BVH2Traverser<RTTriangle4>, bvhTri4);
+    PF_MSG_V("BVH2 Triangle4: Packet ray tracing");
+    for (int i = 0; i < 16; ++i) rayTrace<RT_PACKET>(CAMW, CAMH, c);
+    PF_MSG_V("BVH2 Triangle4: Single ray tracing");
+    for (int i = 0; i < 16; ++i) rayTrace<RT_SINGLE_RAY>(CAMW, CAMH, c);
+    PF_MSG_V("BVH2 Triangle4: Packet occlusion");
+    for (int i = 0; i < 16; ++i) rayTrace<RT_OCCLUDED>(CAMW, CAMH, c);
+
+    // Same thing with the collapsed 4-wide BVH
+    Ref<BVH4<RTTriangle>> bvh4 = PF_NEW(BVH4<RTTriangle>);
+    buildBVH4(*bvh, *bvh4);
+    intersector = PF_NEW(BVH4Traverser<RTTriangle>, bvh4);
+    PF_MSG_V("BVH4: Packet ray tracing");
+    for (int i = 0; i < 16; ++i) rayTrace<RT_PACKET>(CAMW, CAMH, c);
+    PF_MSG_V("BVH4: 4x4 packet ray tracing");
+    for (int i = 0; i < 16; ++i) rayTrace<RT_PACKET,4,4>(CAMW, CAMH, c);
+    PF_MSG_V("BVH4: 16x16 packet ray tracing");
+    for (int i = 0; i < 16; ++i) rayTrace<RT_PACKET,16,16>(CAMW, CAMH, c);
+    PF_MSG_V("BVH4: Single ray tracing");
+    for (int i = 0; i < 16; ++i) rayTrace<RT_SINGLE_RAY>(CAMW, CAMH, c);
+    PF_MSG_V("BVH4: Packet occlusion");
+    for (int i = 0; i < 16; ++i) rayTrace<RT_OCCLUDED>(CAMW, CAMH, c);
+    PF_MSG_V("BVH4: Stream ray tracing");
+    for (int i = 0; i < 16; ++i) rayTrace<RT_STREAM>(CAMW, CAMH, c);
+
+    // Same thing with the quantized 4-wide BVH
+    Ref<QBVH4<RTTriangle>> qbvh4 = PF_NEW(QBVH4<RTTriangle>);
+    buildQBVH4(*bvh, *qbvh4);
+    intersector = PF_NEW((QBVH4Traverser<RTTriangle,uint8>), qbvh4);
+    PF_MSG_V("QBVH4: Packet ray tracing");
+    for (int i = 0; i < 16; ++i) rayTrace<RT_PACKET>(CAMW, CAMH, c);
+    PF_MSG_V("QBVH4: Single ray tracing");
+    for (int i = 0; i < 16; ++i) rayTrace<RT_SINGLE_RAY>(CAMW, CAMH, c);
+    PF_MSG_V("QBVH4: Packet occlusion");
+    for (int i = 0; i < 16; ++i) rayTrace<RT_OCCLUDED>(CAMW, CAMH, c);
+
+    // Two-level BVH with one instance of the BVH2
+    Ref<InstanceIntersector> instances = PF_NEW(InstanceIntersector);
+    const BBox3f box(bvh->node[0].getMin(), bvh->node[0].getMax());
+    instances->add(PF_NEW(BVH2Traverser<RTTriangle>, bvh), box, mat4x4f(one));
+    instances->compile();
+    intersector = instances.cast<Intersector>();
+    PF_MSG_V("Instances: Packet ray tracing");
+    for (int i = 0; i < 16; ++i) rayTrace<RT_PACKET>(CAMW, CAMH, c);
+    PF_MSG_V("Instances: Single ray tracing");
+    for (int i = 0; i < 16; ++i) rayTrace<RT_SINGLE_RAY>(CAMW, CAMH, c);
+    PF_MSG_V("Instances: Packet occlusion");
+    for (int i = 0; i < 16; ++i) rayTrace<RT_OCCLUDED>(CAMW, CAMH, c);
+
+    // 8-wide BVH only if the CPU supports AVX
+    if (hasAVX()) {
+      Ref<BVH8<RTTriangle>> bvh8 = PF_NEW(BVH8<RTTriangle>);
+      buildBVH8(*bvh, *bvh8);
+      intersector = PF_NEW(BVH8Traverser<RTTriangle>, bvh8);
+      PF_MSG_V("BVH8: Packet ray tracing");
+      for (int i = 0; i < 16; ++i) rayTrace<RT_PACKET>(CAMW, CAMH, c);
+      PF_MSG_V("BVH8: Single ray tracing");
+      for (int i = 0; i < 16; ++i) rayTrace<RT_SINGLE_RAY>(CAMW, CAMH, c);
+      PF_MSG_V("BVH8: Packet occlusion");
+      for (int i = 0; i < 16; ++i) rayTrace<RT_OCCLUDED>(CAMW, CAMH, c);
+    }
     PF_DELETE_ARRAY(c);
   }
 
@@ -183,6 +683,7 @@ namespace pf
 void utest_rt(void)
 {
   using namespace pf;
+  RTCheck();
   RTStart();
   RTEnd();
 }
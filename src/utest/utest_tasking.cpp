@@ -16,6 +16,8 @@
 
 #include "sys/tasking.hpp"
 #include "sys/tasking_utility.hpp"
+#include "sys/tasking_distributed.hpp"
+#include "sys/tasking_graph.hpp"
 #include "sys/ref.hpp"
 #include "sys/thread.hpp"
 #include "sys/mutex.hpp"
@@ -24,6 +26,9 @@
 
 #include "utest/utest.hpp"
 
+#include <sstream>
+#include <cstring>
+
 #define START_UTEST(TEST_NAME)                          \
 void TEST_NAME(void)                                    \
 {                                                       \
@@ -544,6 +549,243 @@ START_UTEST(TestMultiDependencyRandomStart)
 }
 END_UTEST(TestMultiDependencyRandomStart)
 
+/*! Only holds the counter updated by the tasks that end it */
+class TaskCounter : public Task
+{
+public:
+  TaskCounter(void) : counter(0) {}
+  virtual Task *run(void) { return NULL; }
+  Atomic32 counter;
+};
+
+class TaskMultiEnd : public Task, public MultiDependencyPolicy<TaskMultiEnd>
+{
+public:
+  TaskMultiEnd(TaskCounter *counted) : counted(counted) {}
+  virtual Task *run(void) { counted->counter++; return NULL; }
+private:
+  TaskCounter *counted;
+};
+
+class TaskCheckCounter : public Task
+{
+public:
+  TaskCheckCounter(TaskCounter *counted, int32 expected, Atomic32 &errorNum) :
+    counted(counted), expected(expected), errorNum(errorNum) {}
+  virtual Task *run(void) {
+    if (counted->counter != expected) errorNum++;
+    return NULL;
+  }
+private:
+  Ref<TaskCounter> counted;
+  int32 expected;
+  Atomic32 &errorNum;
+};
+
+START_UTEST(TestMultiDependencyEnds)
+{
+  static const uint32 parentNum = 256;
+  static const uint32 multiTaskToSpawn = 64;
+  Atomic32 errorNum(0);
+  Ref<Task> doneTask = PF_NEW(TaskDone);
+  for (uint32 i = 0; i < parentNum; ++i) {
+    Ref<TaskCounter> parent = PF_NEW(TaskCounter);
+    Ref<Task> check = PF_NEW(TaskCheckCounter, parent.ptr, multiTaskToSpawn, errorNum);
+    parent->starts(check);
+    check->starts(doneTask);
+    for (uint32 j = 0; j < multiTaskToSpawn; ++j) {
+      Ref<TaskMultiEnd> task = PF_NEW(TaskMultiEnd, parent.ptr);
+      task->multiEnds(parent.ptr);
+      task->scheduled();
+    }
+    check->scheduled();
+    parent->scheduled();
+  }
+  doneTask->scheduled();
+  TaskingSystemEnter();
+  FATAL_IF(errorNum != 0, "MultiDependencyEnds failed");
+}
+END_UTEST(TestMultiDependencyEnds)
+
+///////////////////////////////////////////////////////////////////////////////
+// Many tasks contending for the same task mutex
+///////////////////////////////////////////////////////////////////////////////
+class TaskLockedIncrement : public Task
+{
+public:
+  TaskLockedIncrement(TaskMutex &mutex, uint32 &counter) :
+    Task("TaskLockedIncrement"), mutex(mutex), counter(counter) {}
+  virtual Task *run(void) {
+    Lock<TaskMutex> lock(mutex);
+    for (uint32 i = 0; i < incrementNum; ++i) {
+      const uint32 value = counter;
+      __store_release(&counter, value + 1);
+    }
+    return NULL;
+  }
+  static const uint32 incrementNum = 64;
+private:
+  TaskMutex &mutex;
+  uint32 &counter;
+};
+
+START_UTEST(TestTaskMutex)
+{
+  static const uint32 taskNum = 1 << 16;
+  TaskMutex mutex;
+  uint32 counter = 0;
+  double t = getSeconds();
+  Ref<Task> doneTask = PF_NEW(TaskDone);
+  for (uint32 i = 0; i < taskNum; ++i) {
+    Ref<Task> task = PF_NEW(TaskLockedIncrement, mutex, counter);
+    task->starts(doneTask);
+    task->scheduled();
+  }
+  doneTask->scheduled();
+  TaskingSystemEnter();
+  t = getSeconds() - t;
+  std::cout << t * 1000. << " ms" << std::endl;
+  FATAL_IF(counter != taskNum * TaskLockedIncrement::incrementNum,
+           "TestTaskMutex failed");
+}
+END_UTEST(TestTaskMutex)
+
+///////////////////////////////////////////////////////////////////////////////
+// Scratch arena: nested scopes, alignment and chunk overflow
+///////////////////////////////////////////////////////////////////////////////
+class TaskSetScratch : public TaskSet
+{
+public:
+  TaskSetScratch(size_t elemNum, Atomic32 &errorNum) :
+    TaskSet(elemNum, "TaskSetScratch"), errorNum(errorNum) {}
+  virtual void run(size_t elemID) {
+    TaskScratch &scratch = TaskingSystemGetScratch();
+    TaskScratchScope scope(scratch);
+    const size_t elemNum = elemID % 2 ? 1024 : PF_TASK_SCRATCH_CHUNK_SIZE;
+    uint32 *first = scratch.allocateArray<uint32>(elemNum);
+    for (size_t i = 0; i < elemNum; ++i) first[i] = uint32(elemID);
+    const TaskScratch::Marker marker = scratch.getMarker();
+    for (uint32 i = 0; i < 64; ++i) {
+      void *ptr = scratch.allocate(4096 + i, 64);
+      if (size_t(ptr) % 64) errorNum++;
+    }
+    scratch.rewind(marker);
+    for (size_t i = 0; i < elemNum; ++i)
+      if (first[i] != uint32(elemID)) errorNum++;
+  }
+private:
+  Atomic32 &errorNum;
+};
+
+START_UTEST(TestScratch)
+{
+  Atomic32 errorNum(0);
+  double t = getSeconds();
+  Task *done = PF_NEW(TaskDone);
+  Task *taskSet = PF_NEW(TaskSetScratch, 1024, errorNum);
+  taskSet->starts(done);
+  done->scheduled();
+  taskSet->scheduled();
+  TaskingSystemEnter();
+  t = getSeconds() - t;
+  std::cout << t * 1000. << " ms" << std::endl;
+  FATAL_IF(errorNum != 0, "TestScratch failed");
+}
+END_UTEST(TestScratch)
+
+///////////////////////////////////////////////////////////////////////////////
+// Delayed tasks must never start before their deadline
+///////////////////////////////////////////////////////////////////////////////
+class TaskDelayed : public Task
+{
+public:
+  TaskDelayed(double deadline, Atomic32 &errorNum, Atomic32 &runNum) :
+    Task("TaskDelayed"), deadline(deadline), errorNum(errorNum), runNum(runNum) {}
+  virtual Task *run(void) {
+    if (getSeconds() < deadline) errorNum++;
+    runNum++;
+    return NULL;
+  }
+private:
+  double deadline;
+  Atomic32 &errorNum;
+  Atomic32 &runNum;
+};
+
+START_UTEST(TestScheduledAt)
+{
+  static const uint32 taskNum = 1024;
+  static const double maxDelay = 0.2;
+  Atomic32 errorNum(0), runNum(0);
+  Random rand;
+  double t = getSeconds();
+  Ref<Task> doneTask = PF_NEW(TaskDone);
+  for (uint32 i = 0; i < taskNum; ++i) {
+    const double deadline = t + rand.getFloat() * maxDelay;
+    Ref<Task> task = PF_NEW(TaskDelayed, deadline, errorNum, runNum);
+    task->starts(doneTask);
+    task->scheduledAt(deadline);
+  }
+  doneTask->scheduledAt(t + maxDelay);
+  TaskingSystemEnter();
+  t = getSeconds() - t;
+  std::cout << t * 1000. << " ms" << std::endl;
+  FATAL_IF(errorNum != 0, "TestScheduledAt: task started too early");
+  FATAL_IF(runNum != int32(taskNum), "TestScheduledAt: missing tasks");
+}
+END_UTEST(TestScheduledAt)
+
+///////////////////////////////////////////////////////////////////////////////
+// Distributed task set with helper processes (one of them crashes)
+///////////////////////////////////////////////////////////////////////////////
+class TaskDistributedSetSimple : public TaskDistributedSet
+{
+public:
+  TaskDistributedSetSimple(size_t elemNum, uint32 *array, int32 *helperRunNum) :
+    TaskDistributedSet(elemNum, 3, "TaskDistributedSetSimple"),
+    array(array), helperRunNum(helperRunNum), crashID(elemNum / 2) {}
+  virtual void run(size_t elemID) {
+    if (TaskingSystemIsHelper()) {
+      if (elemID == crashID) _Exit(1);
+      atomic_add(helperRunNum, 1);
+    }
+    uint32 value = uint32(elemID);
+    for (uint32 i = 0; i < 256; ++i) value = value * 1664525u + 1013904223u;
+    array[elemID] = value;
+  }
+private:
+  uint32 *array;
+  int32 *helperRunNum;
+  size_t crashID;
+};
+
+START_UTEST(TestDistributedSet)
+{
+  static const size_t elemNum = 1 << 18;
+  uint32 *array = (uint32 *) TaskingSystemSharedAlloc(elemNum * sizeof(uint32));
+  int32 *helperRunNum = (int32 *) TaskingSystemSharedAlloc(sizeof(int32));
+  for (size_t i = 0; i < elemNum; ++i) array[i] = 0;
+  *helperRunNum = 0;
+  double t = getSeconds();
+  Task *done = PF_NEW(TaskDone);
+  Task *distributed = PF_NEW(TaskDistributedSetSimple, elemNum, array, helperRunNum);
+  distributed->starts(done);
+  done->scheduled();
+  distributed->scheduled();
+  TaskingSystemEnter();
+  t = getSeconds() - t;
+  std::cout << t * 1000. << " ms" << std::endl;
+  std::cout << "run by helpers: " << *helperRunNum << std::endl;
+  for (size_t i = 0; i < elemNum; ++i) {
+    uint32 value = uint32(i);
+    for (uint32 j = 0; j < 256; ++j) value = value * 1664525u + 1013904223u;
+    FATAL_IF(array[i] != value, "TestDistributedSet failed");
+  }
+  TaskingSystemSharedFree(helperRunNum);
+  TaskingSystemSharedFree(array);
+}
+END_UTEST(TestDistributedSet)
+
 ///////////////////////////////////////////////////////////////////////////////
 // Test tasking lock and unlock
 ///////////////////////////////////////////////////////////////////////////////
@@ -625,6 +867,86 @@ START_UTEST(TestProfiler)
   PF_DELETE(profiler);
 }
 END_UTEST(TestProfiler)
+
+///////////////////////////////////////////////////////////////////////////////
+// Capture a frame-like graph and find its critical path
+///////////////////////////////////////////////////////////////////////////////
+class TaskSleep : public Task
+{
+public:
+  TaskSleep(const char *name, int ms) : Task(name), ms(ms) {}
+  virtual Task *run(void) { yield(ms); return NULL; }
+private:
+  int ms;
+};
+
+class TaskSetSleep : public TaskSet
+{
+public:
+  TaskSetSleep(const char *name, size_t elemNum, int ms) :
+    TaskSet(elemNum, name), ms(ms) {}
+  virtual void run(size_t elemID) { yield(ms); }
+private:
+  int ms;
+};
+
+START_UTEST(TestTaskGraph)
+{
+  TaskGraphRecorder *recorder = PF_NEW(TaskGraphRecorder);
+  TaskingSystemSetProfiler(recorder);
+  Ref<Task> frame = PF_NEW(TaskSleep, "frame", 0);
+  Ref<Task> hiz = PF_NEW(TaskSleep, "hiz", 40);
+  Ref<Task> cull = PF_NEW(TaskSleep, "cull", 40);
+  Ref<Task> display = PF_NEW(TaskSleep, "display", 10);
+  Ref<Task> audio = PF_NEW(TaskSleep, "audio", 10);
+  Ref<Task> physics = PF_NEW(TaskSleep, "physics", 10);
+  Ref<Task> particles = PF_NEW(TaskSetSleep, "particles", 4, 5);
+  Ref<Task> doneTask = PF_NEW(TaskDone);
+  hiz->starts(cull);
+  cull->starts(display);
+  audio->starts(physics);
+  display->ends(frame);
+  physics->ends(frame);
+  particles->ends(frame);
+  frame->starts(doneTask);
+  display->setAffinity(PF_TASK_MAIN_THREAD);
+  frame->scheduled();
+  display->scheduled();
+  cull->scheduled();
+  physics->scheduled();
+  doneTask->scheduled();
+  hiz->scheduled();
+  audio->scheduled();
+  particles->scheduled();
+  TaskingSystemEnter();
+  TaskingSystemSetProfiler(NULL);
+  recorder->analyze();
+  recorder->outputText(std::cout);
+
+  // hiz -> cull -> display -> frame must be the critical path
+  const char *expected[] = {"hiz", "cull", "display", "frame"};
+  uint32 curr = 0;
+  for (size_t i = 0; i < recorder->criticalPath.size(); ++i) {
+    const TaskGraphRecorder::Node &node = recorder->nodes[recorder->criticalPath[i]];
+    if (curr < 4 && node.name && strcmp(node.name, expected[curr]) == 0) curr++;
+    FATAL_IF (node.getSlack() > 1e-6, "TestTaskGraph failed: slack on the path");
+  }
+  FATAL_IF (curr != 4, "TestTaskGraph failed: wrong critical path");
+  for (size_t i = 0; i < recorder->nodes.size(); ++i) {
+    const TaskGraphRecorder::Node &node = recorder->nodes[i];
+    if (node.name == NULL || strcmp(node.name, "audio")) continue;
+    FATAL_IF (node.critical || node.getSlack() < 0.03, "TestTaskGraph failed: audio slack");
+  }
+  FATAL_IF (recorder->parallelism <= 1., "TestTaskGraph failed: parallelism");
+  std::stringstream dot, json;
+  recorder->outputDOT(dot);
+  recorder->outputJSON(json);
+  FATAL_IF (dot.str().find("color=red") == std::string::npos ||
+            json.str().find("\"criticalPath\":[") == std::string::npos,
+            "TestTaskGraph failed: DOT / JSON output");
+  PF_DELETE(recorder);
+}
+END_UTEST(TestTaskGraph)
 #endif /* PF_TASK_PROFILER */
 
 /*! Run all tasking tests */
@@ -643,8 +965,14 @@ void utest_tasking(void)
   TestMultiDependency();
   TestMultiDependencyTwoStage();
   TestMultiDependencyRandomStart();
+  TestMultiDependencyEnds();
+  TestTaskMutex();
+  TestScratch();
+  TestScheduledAt();
+  TestDistributedSet();
   TestLockUnlock();
   TestProfiler();
+  TestTaskGraph();
 }
 
 UTEST_REGISTER(utest_tasking);